@@ -0,0 +1,764 @@
+/*
+ * pmc-metric.c
+ *
+ ******************************************************************************
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ *  Compute high-level metrics (e.g., IPC) from the output of pmctrack.
+ *  Both the text output and binary streams of samples (pmctrack -w) are
+ *  accepted. Samples are processed in columnar batches, and metric
+ *  expressions are compiled once and evaluated a whole batch at a time.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <err.h>
+#include <pmctrack_internal.h>
+
+#define BATCH_SIZE 1024		/* Max number of rows processed at once */
+#define MAX_COLUMNS 32		/* Max number of columns in the input */
+#define MAX_METRICS 16		/* Max number of metrics per experiment */
+#define MAX_EXPIDS MAX_COUNTER_CONFIGS
+#define LINE_SIZE 1024
+#define NAME_SIZE 32
+
+/* Metric specified by the user as <name>=<expr>[;expid] */
+typedef struct {
+	char* name;
+	char* text;			/* Expression as specified by the user */
+	pmct_metric_prog_t* prog;	/* Compiled expression */
+} metric_t;
+
+/* Metrics associated with an experiment (expid) */
+typedef struct {
+	metric_t metrics[MAX_METRICS];
+	int nr_metrics;
+	double* results[MAX_METRICS];	/* Values of the metrics for the current batch */
+	double sums[MAX_COLUMNS];	/* Aggregate count mode (-A) */
+	unsigned long nr_samples;
+} metric_set_t;
+
+/* Kind of data columns in binary streams */
+typedef enum {
+	COL_PMC,
+	COL_VIRT,
+	COL_ETIME
+} column_kind_t;
+
+/*
+ * Input table. Columns that go after the "event" column hold
+ * numeric data, and the preceding ones are just passed through.
+ */
+typedef struct {
+	int binary;
+	char meta_names[MAX_COLUMNS][NAME_SIZE];
+	int nr_meta;
+	char data_names[MAX_COLUMNS][NAME_SIZE];
+	int nr_data;
+	int expid_col;			/* Index of the expid column (-1 if none) */
+	/* Current batch */
+	unsigned int n;
+	double* data[MAX_COLUMNS];	/* BATCH_SIZE values per data column */
+	int expid[BATCH_SIZE];
+	/* Text input: copy of the lines and their tokens */
+	char lines[BATCH_SIZE][LINE_SIZE];
+	char* tokens[BATCH_SIZE][MAX_COLUMNS];
+	/* Binary input */
+	pmct_stream_header_t header;
+	column_kind_t kind[MAX_COLUMNS];
+	int index[MAX_COLUMNS];		/* PMC or virtual counter number */
+	pmc_sample_t samples[BATCH_SIZE];
+	unsigned long nr_samples_read;
+} table_t;
+
+static table_t table;
+static metric_set_t metric_sets[MAX_EXPIDS];
+
+/* Command-line options */
+static int bypass=0;
+static int verbose=0;
+static int accum_mode=0;
+static int csv_mode=0;
+
+/* Width of the pass-through columns (as printed by pmctrack) */
+static int meta_width(const char* name)
+{
+	if (!strcmp(name,"nsample"))
+		return 7;
+	else if (!strcmp(name,"pid") || !strcmp(name,"cpu") || !strcmp(name,"target"))
+		return 6;
+	else if (!strcmp(name,"coretype"))
+		return 8;
+	else if (!strcmp(name,"expid"))
+		return 5;
+	return 10;
+}
+
+/* Register a metric specified as <name>=<expr>[;expid] */
+static int add_metric(const char* spec)
+{
+	char* copy=strdup(spec);
+	char* expr;
+	char* expid_str;
+	int expid=0;
+	metric_set_t* set;
+	metric_t* metric;
+
+	if (!copy || (expr=strchr(copy,'='))==NULL || expr==copy) {
+		warnx("Wrong format for metric: %s",spec);
+		free(copy);
+		return 1;
+	}
+
+	*expr++='\0';
+
+	if ((expid_str=strchr(expr,';'))) {
+		*expid_str++='\0';
+		expid=atoi(expid_str);
+	}
+
+	if (expid<0 || expid>=MAX_EXPIDS) {
+		warnx("Wrong experiment ID for metric %s: %d",copy,expid);
+		free(copy);
+		return 1;
+	}
+
+	set=&metric_sets[expid];
+
+	if (set->nr_metrics==MAX_METRICS) {
+		warnx("Too many metrics for experiment %d",expid);
+		free(copy);
+		return 1;
+	}
+
+	metric=&set->metrics[set->nr_metrics++];
+	metric->name=copy;
+	metric->text=expr;
+	metric->prog=NULL;
+	return 0;
+}
+
+/* Read metric specifications from a file (one per line, '#' for comments) */
+static int add_metrics_from_file(const char* path)
+{
+	char line[LINE_SIZE];
+	FILE* f=fopen(path,"r");
+	char* end;
+
+	if (!f) {
+		warn("Can't open %s",path);
+		return 1;
+	}
+
+	while (fgets(line,LINE_SIZE,f)) {
+		/* Remove trailing white spaces */
+		end=line+strlen(line);
+		while (end>line && (end[-1]=='\n' || end[-1]==' ' || end[-1]=='\t' || end[-1]=='\r'))
+			*--end='\0';
+
+		if (line[0]=='#' || line[0]=='\0')
+			continue;
+
+		if (add_metric(line)) {
+			fclose(f);
+			return 1;
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/*
+ * Compile the metrics once the names of the input columns are known.
+ * A metric may refer to the metrics defined before it for the same experiment.
+ */
+static int compile_metrics(void)
+{
+	const char* vars[MAX_COLUMNS+MAX_METRICS];
+	metric_set_t* set;
+	int i,j;
+
+	for (i=0; i<table.nr_data; i++)
+		vars[i]=table.data_names[i];
+
+	for (i=0; i<MAX_EXPIDS; i++) {
+		set=&metric_sets[i];
+
+		for (j=0; j<set->nr_metrics; j++) {
+			if (!(set->metrics[j].prog=pmct_metric_compile(set->metrics[j].text,vars,table.nr_data+j)))
+				return 1;
+			vars[table.nr_data+j]=set->metrics[j].name;
+
+			if (!(set->results[j]=malloc(sizeof(double)*BATCH_SIZE)))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/* Count the number of tokens in a line (without modifying it) */
+static int count_tokens(const char* line)
+{
+	int count=0;
+
+	while (*line) {
+		while (*line==' ' || *line=='\t' || *line=='\n')
+			line++;
+		if (!*line)
+			break;
+		count++;
+		while (*line && *line!=' ' && *line!='\t' && *line!='\n')
+			line++;
+	}
+	return count;
+}
+
+/* Split a line into tokens (at most max_tokens) */
+static int tokenize(char* line, char** tokens, int max_tokens)
+{
+	char* saveptr;
+	char* token;
+	int count=0;
+
+	for (token=strtok_r(line," \t\n",&saveptr); token && count<max_tokens; token=strtok_r(NULL," \t\n",&saveptr))
+		tokens[count++]=token;
+
+	return count;
+}
+
+/*
+ * Skip the lines that precede the header of the table (they are echoed in verbose mode)
+ * and retrieve the column names from the header.
+ */
+static int read_text_header(FILE* fin, FILE* fout)
+{
+	char line[LINE_SIZE];
+	char* tokens[MAX_COLUMNS];
+	int nr_tokens,i;
+	int event_col=-1;
+
+	while (fgets(line,LINE_SIZE,fin)) {
+		nr_tokens=count_tokens(line);
+
+		if (nr_tokens>0 && nr_tokens<=MAX_COLUMNS) {
+			char copy[LINE_SIZE];
+
+			strcpy(copy,line);
+			tokenize(copy,tokens,MAX_COLUMNS);
+
+			if (!strcmp(tokens[0],"nsample") ||
+			    (nr_tokens>1 && !strcmp(tokens[0],"target") && !strcmp(tokens[1],"nsample"))) {
+
+				for (i=0; i<nr_tokens && event_col==-1; i++)
+					if (!strcmp(tokens[i],"event"))
+						event_col=i;
+
+				if (event_col==-1) {
+					warnx("Can't find the event column in pmctrack header");
+					return 1;
+				}
+
+				table.expid_col=-1;
+				table.nr_meta=0;
+				table.nr_data=0;
+
+				for (i=0; i<nr_tokens; i++) {
+					if (i<=event_col) {
+						if (!strcmp(tokens[i],"expid"))
+							table.expid_col=i;
+						strncpy(table.meta_names[table.nr_meta++],tokens[i],NAME_SIZE-1);
+					} else
+						strncpy(table.data_names[table.nr_data++],tokens[i],NAME_SIZE-1);
+				}
+				return 0;
+			}
+		}
+
+		if (verbose)
+			fputs(line,fout);
+	}
+
+	warnx("Can't find pmctrack header");
+	return 1;
+}
+
+/* Build the column names from the header of a binary stream */
+static int read_binary_header(FILE* fin)
+{
+	pmct_stream_header_t* header=&table.header;
+	int i;
+
+	if (pmct_read_stream_header(fin,header))
+		return 1;
+
+	table.nr_meta=0;
+	table.nr_data=0;
+	table.expid_col=-1;
+
+	if (header->flags & PMCT_STREAM_MULTI_TARGET)
+		strcpy(table.meta_names[table.nr_meta++],"target");
+	strcpy(table.meta_names[table.nr_meta++],"nsample");
+	strcpy(table.meta_names[table.nr_meta++],(header->flags & PMCT_STREAM_SYSWIDE)?"cpu":"pid");
+	if ((header->flags & PMCT_STREAM_EXTENDED) || header->nr_experiments>=2) {
+		strcpy(table.meta_names[table.nr_meta++],"coretype");
+		table.expid_col=table.nr_meta;
+		strcpy(table.meta_names[table.nr_meta++],"expid");
+	}
+	strcpy(table.meta_names[table.nr_meta++],"event");
+
+	for (i=0; i<MAX_PERFORMANCE_COUNTERS; i++) {
+		if (header->pmcmask & (1<<i)) {
+			table.kind[table.nr_data]=COL_PMC;
+			table.index[table.nr_data]=i;
+			sprintf(table.data_names[table.nr_data++],"pmc%d",i);
+		}
+	}
+
+	table.kind[table.nr_data]=COL_ETIME;
+	strcpy(table.data_names[table.nr_data++],"etime_us");
+
+	for (i=0; i<MAX_VIRTUAL_COUNTERS; i++) {
+		if (header->virtual_mask & (1<<i)) {
+			table.kind[table.nr_data]=COL_VIRT;
+			table.index[table.nr_data]=i;
+			sprintf(table.data_names[table.nr_data++],"virt%d",i);
+		}
+	}
+	return 0;
+}
+
+/* Load the next batch of rows from the text output of pmctrack */
+static void read_text_batch(FILE* fin, FILE* fout)
+{
+	int nr_columns=table.nr_meta+table.nr_data;
+	char** tokens;
+	char* line;
+	char* tok;
+	int j;
+
+	table.n=0;
+
+	while (table.n<BATCH_SIZE && fgets(line=table.lines[table.n],LINE_SIZE,fin)) {
+		/* Try to skip rubbish lines */
+		if (count_tokens(line)<nr_columns) {
+			if (verbose)
+				fputs(line,fout);
+			continue;
+		}
+
+		tokens=table.tokens[table.n];
+		tokenize(line,tokens,nr_columns);
+
+		for (j=0; j<table.nr_data; j++) {
+			tok=tokens[table.nr_meta+j];
+			/* Counters not included in the sample */
+			table.data[j][table.n]=(tok[0]=='-' && tok[1]=='\0')?0.0:strtod(tok,NULL);
+		}
+
+		table.expid[table.n]=(table.expid_col>=0)?atoi(tokens[table.expid_col]):0;
+		table.n++;
+	}
+}
+
+/* Returns a non-zero value if the data column has a value in the sample */
+static inline int sample_has_value(pmc_sample_t* sample, int col)
+{
+	switch (table.kind[col]) {
+	case COL_PMC:
+		return sample->pmc_mask & (1<<table.index[col]);
+	case COL_VIRT:
+		return sample->virt_mask & (1<<table.index[col]);
+	default:
+		return 1;
+	}
+}
+
+/* Load the next batch of samples from a binary stream and lay them out in columns */
+static void read_binary_batch(FILE* fin)
+{
+	pmc_sample_t* sample;
+	double* column;
+	unsigned int i;
+	unsigned int below;
+	int j,idx;
+
+	table.n=pmct_read_stream_samples(fin,&table.header,table.samples,BATCH_SIZE);
+
+	for (j=0; j<table.nr_data; j++) {
+		column=table.data[j];
+		idx=table.index[j];
+		below=(1U<<idx)-1;
+
+		switch (table.kind[j]) {
+		case COL_PMC:
+			/* Counts are stored in increasing PMC order */
+			for (i=0; i<table.n; i++) {
+				sample=&table.samples[i];
+				column[i]=(sample->pmc_mask & (1<<idx))?
+				          sample->pmc_counts[__builtin_popcount(sample->pmc_mask & below)]:0.0;
+			}
+			break;
+		case COL_VIRT:
+			for (i=0; i<table.n; i++) {
+				sample=&table.samples[i];
+				column[i]=(sample->virt_mask & (1<<idx))?
+				          sample->virtual_counts[__builtin_popcount(sample->virt_mask & below)]:0.0;
+			}
+			break;
+		default:
+			for (i=0; i<table.n; i++)
+				column[i]=table.samples[i].elapsed_time/1000;
+			break;
+		}
+	}
+
+	for (i=0; i<table.n; i++)
+		table.expid[i]=table.samples[i].exp_idx;
+}
+
+/* Get the value of a pass-through column for a row of the current batch */
+static const char* get_meta_value(unsigned int row, int col, char* buf)
+{
+	pmc_sample_t* sample;
+	const char* name;
+
+	if (!table.binary)
+		return table.tokens[row][col];
+
+	sample=&table.samples[row];
+	name=table.meta_names[col];
+
+	if (!strcmp(name,"target"))
+		sprintf(buf,"%d",sample->target_id);
+	else if (!strcmp(name,"nsample"))
+		sprintf(buf,"%lu",table.nr_samples_read+row+1);
+	else if (!strcmp(name,"pid") || !strcmp(name,"cpu"))
+		sprintf(buf,"%d",sample->pid);
+	else if (!strcmp(name,"coretype"))
+		sprintf(buf,"%d",sample->coretype);
+	else if (!strcmp(name,"expid"))
+		sprintf(buf,"%d",sample->exp_idx);
+	else
+		return pmct_sample_type_str(sample->type);
+
+	return buf;
+}
+
+/* Get the value of a data column for a row of the current batch (bypass mode) */
+static const char* get_data_value(unsigned int row, int col, char* buf)
+{
+	if (!table.binary)
+		return table.tokens[row][table.nr_meta+col];
+
+	if (!sample_has_value(&table.samples[row],col))
+		return "-";
+
+	sprintf(buf,"%.0f",table.data[col][row]);
+	return buf;
+}
+
+/* Print the list of metrics and the header of the output table */
+static void print_header(FILE* fout)
+{
+	char name[NAME_SIZE];
+	int i,j,max_metrics=0;
+
+	if (verbose) {
+		fprintf(fout,"[High-level metrics]\n");
+		for (i=0; i<MAX_EXPIDS; i++)
+			for (j=0; j<metric_sets[i].nr_metrics; j++)
+				fprintf(fout,"%s(%d)=%s\n",metric_sets[i].metrics[j].name,i,metric_sets[i].metrics[j].text);
+	}
+
+	for (i=0; i<table.nr_meta; i++) {
+		if (csv_mode)
+			fprintf(fout,"%s%s",i?",":"",table.meta_names[i]);
+		else
+			fprintf(fout,"%s%*s",i?" ":"",meta_width(table.meta_names[i]),table.meta_names[i]);
+	}
+
+	if (bypass)
+		for (i=0; i<table.nr_data; i++)
+			fprintf(fout,csv_mode?",%s":" %12s",table.data_names[i]);
+
+	if (table.expid_col>=0) {
+		/* The metrics may be different for each experiment */
+		for (i=0; i<MAX_EXPIDS; i++)
+			if (metric_sets[i].nr_metrics>max_metrics)
+				max_metrics=metric_sets[i].nr_metrics;
+
+		for (i=0; i<max_metrics; i++) {
+			sprintf(name,"metric%d",i);
+			fprintf(fout,csv_mode?",%s":" %12s",name);
+		}
+	} else {
+		for (i=0; i<metric_sets[0].nr_metrics; i++)
+			fprintf(fout,csv_mode?",%s":" %12s",metric_sets[0].metrics[i].name);
+	}
+
+	fprintf(fout,"\n");
+}
+
+/* Compute the metrics for the current batch, a whole column at a time */
+static int evaluate_batch(void)
+{
+	double* columns[MAX_COLUMNS+MAX_METRICS];
+	metric_set_t* set;
+	int i,j;
+
+	if (table.n==0)
+		return 0;
+
+	for (i=0; i<table.nr_data; i++)
+		columns[i]=table.data[i];
+
+	for (i=0; i<MAX_EXPIDS; i++) {
+		set=&metric_sets[i];
+
+		for (j=0; j<set->nr_metrics; j++) {
+			if (pmct_metric_eval(set->metrics[j].prog,columns,set->results[j],table.n))
+				return 1;
+			/* Metrics defined next may refer to this one */
+			columns[table.nr_data+j]=set->results[j];
+		}
+	}
+	return 0;
+}
+
+/* Accumulate the data columns of the current batch per experiment (-A option) */
+static void accumulate_batch(void)
+{
+	metric_set_t* set;
+	unsigned int i;
+	int j;
+
+	for (i=0; i<table.n; i++) {
+		if (table.expid[i]<0 || table.expid[i]>=MAX_EXPIDS)
+			continue;
+
+		set=&metric_sets[table.expid[i]];
+		set->nr_samples++;
+
+		for (j=0; j<table.nr_data; j++)
+			set->sums[j]+=table.data[j][i];
+	}
+}
+
+/* Print the rows of the current batch along with the metrics */
+static void print_batch(FILE* fout)
+{
+	char buf[64];
+	metric_set_t* set;
+	unsigned int i;
+	int j;
+
+	for (i=0; i<table.n; i++) {
+		for (j=0; j<table.nr_meta; j++) {
+			if (csv_mode)
+				fprintf(fout,"%s%s",j?",":"",get_meta_value(i,j,buf));
+			else
+				fprintf(fout,"%*s ",meta_width(table.meta_names[j]),get_meta_value(i,j,buf));
+		}
+
+		if (bypass)
+			for (j=0; j<table.nr_data; j++)
+				fprintf(fout,csv_mode?",%s":"%12s ",get_data_value(i,j,buf));
+
+		if (table.expid[i]>=0 && table.expid[i]<MAX_EXPIDS) {
+			set=&metric_sets[table.expid[i]];
+			for (j=0; j<set->nr_metrics; j++)
+				fprintf(fout,csv_mode?",%f":"%12f ",set->results[j][i]);
+		}
+
+		fprintf(fout,"\n");
+	}
+}
+
+/*
+ * Print to stderr the metrics computed from the aggregate counts (-A option).
+ * Metrics that depend on a single variable are averaged over the samples.
+ */
+static void print_accum_metrics(void)
+{
+	double* columns[MAX_COLUMNS+MAX_METRICS];
+	double values[MAX_EXPIDS][MAX_METRICS];
+	char mname[NAME_SIZE+16];
+	metric_set_t* set;
+	int i,j,first=1;
+
+	/* Header */
+	for (i=0; i<MAX_EXPIDS; i++) {
+		set=&metric_sets[i];
+
+		for (j=0; j<table.nr_data; j++)
+			columns[j]=&set->sums[j];
+
+		for (j=0; j<set->nr_metrics; j++) {
+			pmct_metric_eval(set->metrics[j].prog,columns,&values[i][j],1);
+			if (pmct_metric_nr_refs(set->metrics[j].prog)==1 && set->nr_samples)
+				values[i][j]/=set->nr_samples;
+			/* Metrics defined next may refer to this one */
+			columns[table.nr_data+j]=&values[i][j];
+
+			snprintf(mname,sizeof(mname),"%s(%d)",set->metrics[j].name,i);
+			if (csv_mode)
+				fprintf(stderr,"%s%s",first?"":",",mname);
+			else
+				fprintf(stderr,"%-15s ",mname);
+			first=0;
+		}
+	}
+
+	fprintf(stderr,"\n");
+
+	/* Values */
+	for (i=0,first=1; i<MAX_EXPIDS; i++) {
+		for (j=0; j<metric_sets[i].nr_metrics; j++) {
+			if (csv_mode)
+				fprintf(stderr,"%s%f",first?"":",",values[i][j]);
+			else
+				fprintf(stderr,"%-15f ",values[i][j]);
+			first=0;
+		}
+	}
+
+	fprintf(stderr,"\n");
+}
+
+/* Prints to stdout the arguments accepted by the command */
+static void usage(int verbose)
+{
+	printf("Usage: pmc-metric [ -m <metric> | -M <metric-file> | -o <outfile> | -i <infile> | -b | -v | -A | -c ]\n");
+
+	if(verbose) {
+		printf ("\n\t-m\t<metric>\n\t\tCompute a metric (<name>=<expr>[;expid]) such as ipc=pmc0/pmc1. Expressions may use\n\t\tconstants, column names (e.g., pmc0, virt1 or etime_us), previously defined metrics and the +,-,*,/ operators");
+		printf ("\n\t-M\t<metric-file>\n\t\tRead metrics from a file (one per line)");
+		printf ("\n\t-i\t<infile>\n\t\tRead the text output of pmctrack or a binary stream (pmctrack -w) from a file (default = stdin)");
+		printf ("\n\t-o\t<outfile>\n\t\tSet output file for the results (default = stdout)");
+		printf ("\n\t-b\n\t\tShow the raw counts along with the metrics");
+		printf ("\n\t-v\n\t\tVerbose mode: echo the lines that are not samples and list the metrics");
+		printf ("\n\t-A\n\t\tPrint metrics computed from aggregate counts to stderr");
+		printf ("\n\t-c\n\t\tGenerate output in CSV format\n");
+	}
+}
+
+/* MAIN */
+int main(int argc, char* argv[])
+{
+	char optc;
+	FILE* fin=stdin;
+	FILE* fout=stdout;
+	int i,c;
+
+	while ((optc = getopt(argc, argv, "i:hm:M:bo:vAc")) != (char)-1) {
+		switch (optc) {
+		case 'h':
+			usage(1);
+			exit(0);
+		case 'm':
+			if (add_metric(optarg))
+				exit(1);
+			break;
+		case 'M':
+			if (add_metrics_from_file(optarg))
+				exit(1);
+			break;
+		case 'o':
+			if (!(fout=fopen(optarg,"w")))
+				err(1,"Can't open %s",optarg);
+			break;
+		case 'i':
+			if (!(fin=fopen(optarg,"r")))
+				err(1,"Can't open %s",optarg);
+			break;
+		case 'b':
+			bypass=1;
+			break;
+		case 'v':
+			verbose=1;
+			break;
+		case 'A':
+			accum_mode=1;
+			break;
+		case 'c':
+			csv_mode=1;
+			break;
+		default:
+			usage(0);
+			exit(1);
+		}
+	}
+
+	for (i=0; i<MAX_EXPIDS && metric_sets[i].nr_metrics==0; i++) {}
+
+	if (i==MAX_EXPIDS) {
+		warnx("A set of metrics should be specified by using the -m or -M options");
+		exit(1);
+	}
+
+	/* Binary streams start with a non-printable character */
+	c=getc(fin);
+	table.binary=(c==(unsigned char)PMCT_STREAM_MAGIC[0]);
+	if (c!=EOF)
+		ungetc(c,fin);
+
+	if (table.binary?read_binary_header(fin):read_text_header(fin,fout))
+		exit(1);
+
+	for (i=0; i<table.nr_data; i++)
+		if (!(table.data[i]=malloc(sizeof(double)*BATCH_SIZE)))
+			err(1,"Can't allocate memory");
+
+	if (compile_metrics())
+		exit(1);
+
+	print_header(fout);
+
+	do {
+		if (table.binary)
+			read_binary_batch(fin);
+		else
+			read_text_batch(fin,fout);
+
+		if (evaluate_batch())
+			errx(1,"Can't allocate memory");
+
+		print_batch(fout);
+
+		if (accum_mode)
+			accumulate_batch();
+
+		table.nr_samples_read+=table.n;
+	} while (table.n>0);
+
+	if (accum_mode)
+		print_accum_metrics();
+
+	if (fin!=stdin)
+		fclose(fin);
+	if (fout!=stdout)
+		fclose(fout);
+
+	exit(0);
+}
@@ -52,15 +52,16 @@
 #include <sys/time.h> /* For setitimer */
 #include <pmctrack_internal.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <ctype.h>
+#include <poll.h>
+#include <wordexp.h>
+#include <math.h>
 
 #ifndef  _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
 
-#ifndef NO_CPU_BINDING
-#define NO_CPU_BINDING 0xffffffff
-#endif
-
 /* Various flag values for the "flags" field in struct options */
 #define CMD_FLAG_ACUM_SAMPLES  (1<<0)
 #define CMD_FLAG_EXTENDED_OUTPUT (1<<1)
@@ -72,6 +73,10 @@
 #define CMD_FLAG_SYSTEM_WIDE_MODE	(1<<7)
 #define CMD_FLAG_SHOW_TIME_SECS	(1<<8)
 #define CMD_FLAG_SHOW_ELAPSED_TIME	(1<<9)
+#define CMD_FLAG_SHOW_TIMESTAMP	(1<<10)
+
+/* Max number of jobs that may run concurrently in batch mode */
+#define MAX_BATCH_LANES 64
 
 /* Monitoring modes supported */
 typedef enum {
@@ -84,17 +89,26 @@ typedef enum {
  * Structure to store information about command-line options
  * specified by the user
  */
+/* Max number of processes that can be attached to simultaneously */
+#define MAX_TARGETS 64
+
 struct options {
 	/* Global switches */
 	int timeout_secs;
 	int msecs;
 	int max_samples;
 	int kernel_buffer_size;
-	unsigned long cpumask;
+	pmct_cpuset_t* cpuset;	/* NULL if no binding was requested */
+	pmct_cpuset_t* syswide_cpuset;	/* CPUs monitored in system-wide mode (NULL means all) */
+	char* syswide_aggr;	/* Aggregation level for system-wide mode (NULL means per-CPU samples) */
+	char* cgroups[PMC_MAX_CGROUPS];	/* Cgroup-scoped mode: cgroup v2 paths */
+	int nr_cgroups;
 	int optind;
 	char** argv;
 	unsigned long flags;
-	pid_t target_pid;
+	pid_t target_pid;	/* First process to attach to (-1 if none) */
+	pid_t target_pids[MAX_TARGETS];	/* Processes to attach to (the index is the target id) */
+	int nr_targets;
 	/* Information on PMCs  */
 	char* user_cfg_str[MAX_COUNTER_CONFIGS];
 	char* strcfg[MAX_RAW_COUNTER_CONFIGS_SAFE];
@@ -106,6 +120,24 @@ struct options {
 	char* virtcfg;
 	unsigned int  nr_virtual_counters;
 	unsigned int  virtual_mask;
+	/* Batch mode */
+	char* batch_file;
+	pmct_cpuset_t* batch_cpusets[MAX_BATCH_LANES];
+	int nr_batch_lanes;
+	/* Multi-run mode */
+	int sweep_runs;
+	/* Flight-recorder mode (time window in seconds, 0 if disabled) */
+	int flight_secs;
+	/* Kernel-side sample filter (NULL if none) */
+	char* sample_filter;
+	/* Alternate PMC configuration to switch to upon SIGUSR2 (-X switch) */
+	char* alt_user_cfg_str[MAX_COUNTER_CONFIGS];
+	char* alt_strcfg[MAX_RAW_COUNTER_CONFIGS_SAFE];
+	int alt_nr_configs;
+	unsigned int nr_experiments;	/* Number of experiments in the current configuration */
+	unsigned int alt_nr_experiments;
+	counter_mapping_t alt_event_mapping[MAX_PERFORMANCE_COUNTERS];
+	unsigned int alt_pmcmask;
 };
 
 
@@ -118,9 +150,12 @@ int stop_profiling, file_flag;
 volatile int child_finished=0;
 int child_status=0;
 int profile_started=0;
+volatile int flight_dump_requested=0;
+volatile int reconfig_requested=0;
 unsigned int ebs_on=0;
 int extended_output=0;
 FILE *fo;
+FILE *fbin=NULL;	/* Binary stream of samples (-w option) */
 struct rusage child_rusage;
 struct timeval start_time, end_time;
 
@@ -129,6 +164,8 @@ sem_t* sem_config_ready;
 #endif
 
 #define MAX_THREADS_APP 256
+/* Flight-recorder dumps are retrieved in chunks of this many samples */
+#define FLIGHT_DUMP_CHUNK_SAMPLES 1024
 
 /* To implement cummulative mode */
 struct pid_ctrl {
@@ -144,7 +181,32 @@ struct pid_ctrl {
 void sigalarm_handler(int signo) {};
 void sigchld_handler(int signo);
 void sigint_handler(int signo);
+void sigusr1_handler(int signo);
+void sigusr2_handler(int signo);
+static int switch_pmc_configuration(struct options* opts);
 static void usage(const char* program_name,int status);
+void free_options (struct options* opts);
+
+/*
+ * Write the header of the binary stream of samples (-w option),
+ * which replaces the header of the table of samples
+ */
+static void write_stream_header(unsigned int nr_experiments, unsigned int pmcmask,
+                                unsigned int virtual_mask, monitoring_mode_t mode,
+                                int multi_target)
+{
+	unsigned int flags=0;
+
+	if (mode==PMCTRACK_MODE_SYSWIDE)
+		flags|=PMCT_STREAM_SYSWIDE;
+	if (multi_target)
+		flags|=PMCT_STREAM_MULTI_TARGET;
+	if (extended_output)
+		flags|=PMCT_STREAM_EXTENDED;
+
+	if (pmct_write_stream_header(fbin,nr_experiments,pmcmask,virtual_mask,flags))
+		warnx("Can't write the header of the binary stream");
+}
 
 /* Data type predeclaration */
 struct pid_set;
@@ -153,7 +215,7 @@ typedef struct pid_set pid_set_t;
 static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned int pmcmask,
                                unsigned int virtual_mask,struct pid_ctrl* pid_ctrl_vector,
                                pmc_sample_t** acum_samples, monitoring_mode_t mode,
-                               pid_set_t* set);
+                               pid_set_t** sets);
 #ifndef USE_VFORK
 static void init_posix_semaphore(sem_t** sem, int value)
 {
@@ -173,42 +235,36 @@ static void init_posix_semaphore(sem_t** sem, int value)
 }
 #endif
 
-/* Included due to an issue with header files in some Linux distributions */
-extern int sched_setaffinity(pid_t pid, unsigned int len, unsigned long *mask);
-
-
-/* Turn a string (hex format) into a 64-bit CPU mask */
-static unsigned long str_to_cpumask(const char* str)
+/* Turn a string (CPU number, CPU list or hex mask) into a CPU set. Exit on error */
+static pmct_cpuset_t* str_to_cpuset(const char* str)
 {
-	unsigned long val=0;
-	if (strncmp(str,"0x",2)==0) {
-		/* Remove the 0x preffix and convert to the mask directly */
-		return strtol(str+2,NULL,16);
-	} else {
-		/* Assume just a CPU number in decimal format */
-		val=strtol(str,NULL,10);
-		return 0x1<<val;
-	}
-}
+	pmct_cpuset_t* cpus=pmct_parse_cpuset(str);
 
-/* Wrapper for sched_setaffinity */
-static inline void bind_process_cpumask(int pid, unsigned long cpumask)
-{
-	if ((cpumask!=NO_CPU_BINDING) && sched_setaffinity(pid, sizeof(unsigned long),&cpumask)!=0) {
-		warnx("Error when binding process to cpumask 0x%lu",cpumask);
+	if (!cpus)
 		exit(1);
-	}
+	return cpus;
 }
 
-static int try_to_bind_process_cpumask(int pid, unsigned long cpumask)
+/* Wrapper for sched_setaffinity (NULL cpuset means no binding) */
+static int try_to_bind_process_cpuset(int pid, pmct_cpuset_t* cpus)
 {
-	if ((cpumask!=NO_CPU_BINDING) && sched_setaffinity(pid, sizeof(unsigned long),&cpumask)!=0) {
-		warnx("Cannot bind process to cpumask 0x%lu",cpumask);
+	char buf[256];
+
+	if (cpus && pmct_bind_process_cpuset(pid,cpus)!=0) {
+		if (pmct_cpuset_to_str(cpus,buf,sizeof(buf))<0)
+			strcpy(buf,"...");
+		warnx("Cannot bind process %d to CPUs %s",pid,buf);
 		return 1;
 	}
 	return 0;
 }
 
+static inline void bind_process_cpuset(int pid, pmct_cpuset_t* cpus)
+{
+	if (try_to_bind_process_cpuset(pid,cpus))
+		exit(1);
+}
+
 
 /*
  * When using vfork(), it is strongly advisable to use _exit() rather than exit()
@@ -269,6 +325,35 @@ static void print_counter_mappings(FILE* fout,
 
 }
 
+/*
+ * Show the cgroup each sample refers to in the cgroup-scoped mode
+ * (the "cpu" column stores the index of the cgroup)
+ */
+static void print_cgroup_mappings(FILE* fout, struct options* opts)
+{
+	int i;
+
+	if (!opts->nr_cgroups || (opts->flags & CMD_FLAG_LEGACY_OUTPUT))
+		return;
+
+	fprintf(fout,"[Cgroup mappings]\n");
+	for (i=0; i<opts->nr_cgroups; i++)
+		fprintf(fout,"cgroup%d=%s\n",i,opts->cgroups[i]);
+}
+
+/* Print the PID associated with each target id when attaching to several processes */
+static void print_target_mappings(FILE* fout, struct options* opts)
+{
+	int i;
+
+	if (opts->nr_targets<2 || (opts->flags & CMD_FLAG_LEGACY_OUTPUT))
+		return;
+
+	fprintf(fout,"[Target mappings]\n");
+	for (i=0; i<opts->nr_targets; i++)
+		fprintf(fout,"target%d=%d\n",i,opts->target_pids[i]);
+}
+
 
 /*
  *  Returns non-zero if the child process has been running longer
@@ -437,6 +522,26 @@ static int restore_signal_handlers(void)
 
 
 /* Config & Monitoring function for per-thread monitoring mode */
+/*
+ * Tell the kernel module the whole session configuration
+ * (kernel buffer size, event sets, sampling period and virtual counters)
+ * in a single call. cfg_flags may hold extra PMC_CFG_* flags.
+ */
+static int config_session(struct options* opts, unsigned int cfg_flags)
+{
+	pmc_session_config_t cfg;
+
+	/* Check whether the kernel controls the counters or not */
+	if (opts->flags & CMD_FLAG_KERNEL_DRIVES_PMCS)
+		cfg_flags|=PMC_CFG_KERNEL_CONTROL;
+
+	if (pmct_build_session_config(&cfg,(const char**)opts->strcfg,opts->virtcfg,opts->msecs,
+	                              opts->kernel_buffer_size!=-1?opts->kernel_buffer_size:0,cfg_flags))
+		return -1;
+
+	return pmct_config_session(-1,&cfg);
+}
+
 static void monitoring_counters(struct options* opts,int optind,char** argv)
 {
 	unsigned int nr_virtual_counters=0,virtual_mask=0;
@@ -503,27 +608,10 @@ static void monitoring_counters(struct options* opts,int optind,char** argv)
 			exit(1);
 
 		/* Bind first */
-		bind_process_cpumask(getpid(),opts->cpumask);
-
-		/* Set up kernel buffer size */
-		if (opts->kernel_buffer_size!=-1 && pmct_set_kernel_buffer_size(opts->kernel_buffer_size))
-			pmctrack_exit(1);
-
-		/* Configure counters if there is something to configure */
-		if (opts->strcfg[0] && pmct_config_counters((const char**)opts->strcfg,0))
-			pmctrack_exit(1);
+		bind_process_cpuset(getpid(),opts->cpuset);
 
-		/* Set up sampling period
-			(check whether the kernel control the counters or not)
-		*/
-		if (pmct_config_timeout(opts->msecs,(!(opts->strcfg)[0] && npmcs!=0)))
-			pmctrack_exit(1);
-
-		if (opts->virtcfg && pmct_config_virtual_counters(opts->virtcfg,0))
-			pmctrack_exit(1);
-
-		/* Enable profiling !! */
-		if (pmct_start_counting())
+		/* Configure the session and enable profiling !! */
+		if (config_session(opts,PMC_CFG_START))
 			pmctrack_exit(1);
 
 #ifndef USE_VFORK
@@ -541,7 +629,7 @@ static void monitoring_counters(struct options* opts,int optind,char** argv)
 			exit(1);
 		}
 
-		if (pmct_attach_process(pid,0) < 0)
+		if (pmct_attach_process(pid,0,0) < 0)
 			errx(1,"Can't attach to child process\n");
 
 
@@ -555,6 +643,7 @@ static void monitoring_counters(struct options* opts,int optind,char** argv)
 }
 
 
+/* Minimum number of per-CPU slots for cumulative counts in system-wide mode */
 #define MAX_CPUS 256
 
 /* Config & Monitoring function for system-wide mode */
@@ -567,6 +656,8 @@ void monitoring_counters_syswide(struct options* opts,int optind,char** argv)
 	pmc_sample_t** acum_samples=NULL;
 	struct pid_ctrl* pid_ctrl_vector=NULL;
 	unsigned int nr_experiments;
+	long nr_cpus=sysconf(_SC_NPROCESSORS_CONF);
+	int i;
 
 	child_status = 0;
 	nr_virtual_counters=opts->nr_virtual_counters;
@@ -588,35 +679,30 @@ void monitoring_counters_syswide(struct options* opts,int optind,char** argv)
 	}
 
 	if (opts->flags & CMD_FLAG_ACUM_SAMPLES) {
-		acum_samples=malloc(sizeof(pmc_sample_t*)*MAX_CPUS);
-		pid_ctrl_vector=malloc(sizeof(struct pid_ctrl)*MAX_CPUS); /* As much as 256 CPUs */
+		if (nr_cpus<MAX_CPUS)
+			nr_cpus=MAX_CPUS;
+		acum_samples=malloc(sizeof(pmc_sample_t*)*nr_cpus);
+		pid_ctrl_vector=malloc(sizeof(struct pid_ctrl)*nr_cpus);
 		if (!acum_samples || ! pid_ctrl_vector) {
 			fprintf(stderr, "%s\n", "Couldn't reserve memory for cummulative counters");
 			exit(1);
 		}
-		memset(acum_samples,0,sizeof(pmc_sample_t*)*MAX_CPUS);/* Set NULL POINTERS*/
+		memset(acum_samples,0,sizeof(pmc_sample_t*)*nr_cpus);/* Set NULL POINTERS*/
 	}
 
 	/* In system-wide mode, the monitor program "owns" the counter configuration
 		- So counter configuration must be done right here... before fork
 	 */
 
-	/* Set up kernel buffer size */
-	if (opts->kernel_buffer_size!=-1 && pmct_set_kernel_buffer_size(opts->kernel_buffer_size))
+	if (config_session(opts,PMC_CFG_SYSWIDE))
 		pmctrack_exit(1);
 
-	/* Configure counters if there is something to configure */
-	if (opts->strcfg[0] && pmct_config_counters((const char**)opts->strcfg,PMCT_CONFIG_SYSWIDE))
+	if (opts->syswide_aggr && pmct_config_syswide_aggregation(opts->syswide_aggr))
 		pmctrack_exit(1);
 
-	/* Set up sampling period
-		(check whether the kernel control the counters or not)
-	*/
-	if (pmct_config_timeout(opts->msecs,(!(opts->strcfg)[0] && npmcs!=0)))
-		pmctrack_exit(1);
-
-	if (opts->virtcfg && pmct_config_virtual_counters(opts->virtcfg,PMCT_CONFIG_SYSWIDE))
-		pmctrack_exit(1);
+	for (i=0; i<opts->nr_cgroups; i++)
+		if (pmct_config_syswide_cgroup(opts->cgroups[i]))
+			pmctrack_exit(1);
 
 #ifndef USE_VFORK
 	/* init semaphore to signal the parent that the child proccess has successfuly configured the counters */
@@ -628,7 +714,17 @@ void monitoring_counters_syswide(struct options* opts,int optind,char** argv)
 	stop_profiling = 0;
 
 	/* Enable profiling !! */
-	if (pmct_syswide_start_counting())
+	if (opts->syswide_cpuset) {
+		char cpulist[MAX_CONFIG_STRING_SIZE];
+
+		if (pmct_cpuset_to_str(opts->syswide_cpuset,cpulist,sizeof(cpulist))<0) {
+			warnx("CPU list for system-wide mode is too long");
+			pmctrack_exit(1);
+		}
+
+		if (pmct_syswide_start_counting(cpulist))
+			pmctrack_exit(1);
+	} else if (pmct_syswide_start_counting(NULL))
 		pmctrack_exit(1);
 
 	/* Keep track of start time */
@@ -647,7 +743,7 @@ void monitoring_counters_syswide(struct options* opts,int optind,char** argv)
 			exit(1);		
 
 		/* Bind first */
-		bind_process_cpumask(getpid(),opts->cpumask);
+		bind_process_cpuset(getpid(),opts->cpuset);
 
 #ifndef USE_VFORK
 		/* Notify the parent that the configuration is done */
@@ -678,6 +774,7 @@ typedef struct {
 struct pid_set {
 	pid_status_t* pid_status; 	/* Array of pid status */
 	unsigned int nr_pids;		/* # of items in pid_status array */
+	unsigned char group_attached;	/* All threads attached with a single request */
 };
 
 /* Initialize empty set */
@@ -689,6 +786,7 @@ static pid_set_t* alloc_pid_set(void)
 		return NULL;
 	set->pid_status=NULL; /* Lazy initialization */
 	set->nr_pids=0;
+	set->group_attached=0;
 
 	return set;
 }
@@ -765,18 +863,34 @@ return_free_pidlist:
 /*
  * Returns the number of pids that could not be attached
  * The PID of the master thread must be attached for this to succeed
+ * Samples of the attached threads are tagged with target_id
  */
-static int attach_pid_set(pid_set_t* set,int pid, unsigned long cpumask)
+static int attach_pid_set(pid_set_t* set,int pid, int target_id, pmct_cpuset_t* cpus)
 {
 	int i=0;
 	int nr_attached=0;
 
-	if (pmct_attach_process(pid,1) < 0) {
+	/*
+	 * Attach the whole thread group in one go, so that threads
+	 * created during the operation are not missed. Fall back
+	 * to attaching thread by thread if that is not supported.
+	 */
+	if (pmct_attach_thread_group(pid,target_id)==0) {
+		set->group_attached=1;
+
+		for (i = 0; i < set->nr_pids; i++) {
+			set->pid_status[i].attached=1;
+			try_to_bind_process_cpuset(set->pid_status[i].pid,cpus);
+		}
+		return set->nr_pids;
+	}
+
+	if (pmct_attach_process(pid,1,target_id) < 0) {
 		warnx("Can't attach to process with PID %d\n",pid);
 		return -1;
 	}
 
-	try_to_bind_process_cpumask(pid,cpumask);
+	try_to_bind_process_cpuset(pid,cpus);
 
 	nr_attached=1;
 
@@ -789,12 +903,12 @@ static int attach_pid_set(pid_set_t* set,int pid, unsigned long cpumask)
 			continue;
 		}
 
-		if (pmct_attach_process(cur_pid,1) < 0) {
+		if (pmct_attach_process(cur_pid,1,target_id) < 0) {
 			warnx("Can't attach to process with PID %d\n",cur_pid);
 		} else {
 			set->pid_status[i].attached=1;
 			nr_attached++;
-			try_to_bind_process_cpumask(cur_pid,cpumask);
+			try_to_bind_process_cpuset(cur_pid,cpus);
 		}
 	}
 
@@ -806,6 +920,15 @@ static void detach_pid_set(pid_set_t* set,int pid)
 	int i=0;
 	int ret=0;
 
+	if (set->group_attached) {
+		if (pmct_detach_thread_group(pid)==0)
+			printf("PID=%d and its threads detached successfuly\n",pid);
+		for (i = 0; i < set->nr_pids; i++)
+			set->pid_status[i].attached=0;
+		set->group_attached=0;
+		return;
+	}
+
 	for (i = 0; i < set->nr_pids; i++) {
 		if (set->pid_status[i].attached) {
 			ret=pmct_detach_process(set->pid_status[i].pid);
@@ -816,6 +939,25 @@ static void detach_pid_set(pid_set_t* set,int pid)
 	}
 }
 
+/* Detach all the processes the monitor is attached to */
+static void detach_targets(pid_set_t** sets, struct options* opts)
+{
+	int i;
+
+	for (i=0; i<opts->nr_targets; i++)
+		if (sets[i])
+			detach_pid_set(sets[i],opts->target_pids[i]);
+}
+
+/* Free up the PID sets associated with the various targets */
+static void destroy_targets(pid_set_t** sets, int nr_targets)
+{
+	int i;
+
+	for (i=0; i<nr_targets; i++)
+		destroy_pid_set(sets[i]);
+}
+
 /* Config & Monitoring function for per-thread monitoring mode (attach variant) */
 static void monitoring_counters_attach(struct options* opts,int optind,char** argv)
 {
@@ -826,8 +968,9 @@ static void monitoring_counters_attach(struct options* opts,int optind,char** ar
 	pmc_sample_t** acum_samples=NULL;
 	struct pid_ctrl* pid_ctrl_vector=NULL;
 	unsigned int nr_experiments;
-	pid_set_t* set=alloc_pid_set();
+	pid_set_t* sets[MAX_TARGETS];
 	int exit_val=0;
+	int i;
 
 	child_status = 0;
 	nr_virtual_counters=opts->nr_virtual_counters;
@@ -836,13 +979,16 @@ static void monitoring_counters_attach(struct options* opts,int optind,char** ar
 	if (install_signal_handlers(0))
 		exit(1);
 
-	if (!set)
-		errx(1,"Cannot allocate memory for pid set\n");
+	for (i=0; i<opts->nr_targets; i++)
+		if ((sets[i]=alloc_pid_set())==NULL)
+			errx(1,"Cannot allocate memory for pid set\n");
 
-	if (populate_pid_set(set,opts->target_pid)) {
-		warnx("PID %d not found",opts->target_pid);
-		exit_val=1;
-		goto free_up_pid_set;
+	for (i=0; i<opts->nr_targets; i++) {
+		if (populate_pid_set(sets[i],opts->target_pids[i])) {
+			warnx("PID %d not found",opts->target_pids[i]);
+			exit_val=1;
+			goto free_up_pid_set;
+		}
 	}
 
 	/* Gather info to build header */
@@ -876,27 +1022,7 @@ static void monitoring_counters_attach(struct options* opts,int optind,char** ar
 	child_finished=0;
 	stop_profiling = 0;
 
-	/* Set up kernel buffer size */
-	if (opts->kernel_buffer_size!=-1 && pmct_set_kernel_buffer_size(opts->kernel_buffer_size)) {
-		exit_val=1;
-		goto free_up_pid_set;
-	}
-
-	/* Configure counters if there is something to configure */
-	if (opts->strcfg[0] && pmct_config_counters((const char**)opts->strcfg,0)) {
-		exit_val=1;
-		goto free_up_pid_set;
-	}
-
-	/* Set up sampling period
-		(check whether the kernel control the counters or not)
-	*/
-	if (pmct_config_timeout(opts->msecs,(!(opts->strcfg)[0] && npmcs!=0))) {
-		exit_val=1;
-		goto free_up_pid_set;
-	}
-
-	if (opts->virtcfg && pmct_config_virtual_counters(opts->virtcfg,0)) {
+	if (config_session(opts,0)) {
 		exit_val=1;
 		goto free_up_pid_set;
 	}
@@ -904,24 +1030,27 @@ static void monitoring_counters_attach(struct options* opts,int optind,char** ar
 	/* Keep track of start time */
 	gettimeofday(&start_time, NULL);
 
-	if (attach_pid_set(set,opts->target_pid,opts->cpumask)<0) {
-		exit_val=1;
-		goto free_up_pid_set;
+	/* The index of each process in the list of targets is used as the target id */
+	for (i=0; i<opts->nr_targets; i++) {
+		if (attach_pid_set(sets[i],opts->target_pids[i],i,opts->cpuset)<0) {
+			detach_targets(sets,opts);
+			exit_val=1;
+			goto free_up_pid_set;
+		}
 	}
 
 	process_pmc_counts(opts,nr_experiments,pmcmask,virtual_mask,
-	                   pid_ctrl_vector,acum_samples,PMCTRACK_MODE_ATTACH,set);
+	                   pid_ctrl_vector,acum_samples,PMCTRACK_MODE_ATTACH,sets);
 	return;
 
 free_up_pid_set:
-	if (set)
-		destroy_pid_set(set);
+	destroy_targets(sets,opts->nr_targets);
 	exit(exit_val);
 }
 
 static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned int pmcmask,
                                unsigned int virtual_mask,struct pid_ctrl* pid_ctrl_vector,
-                               pmc_sample_t** acum_samples, monitoring_mode_t mode, pid_set_t* set)
+                               pmc_sample_t** acum_samples, monitoring_mode_t mode, pid_set_t** sets)
 {
 	int i=0,cont=1;
 	int fd=-1;
@@ -929,18 +1058,71 @@ static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned
 	int nr_pids=0;
 	int nr_samples;
 	unsigned int max_buffer_samples;
+	unsigned int sample_size;
+	unsigned long dump_samples=0;
 	int detached=1;
-	unsigned int show_elapsed_time=(opts->flags & CMD_FLAG_SHOW_ELAPSED_TIME);
+	unsigned int time_columns=0;
+	/* Samples are tagged with the target id when attaching to several processes */
+	int multi_target=(mode==PMCTRACK_MODE_ATTACH && opts->nr_targets>1);
 
 	if (mode==PMCTRACK_MODE_ATTACH)
 		detached=0;
 
+	if (opts->flags & CMD_FLAG_SHOW_ELAPSED_TIME)
+		time_columns|=PMCT_SHOW_ETIME;
+	if (opts->flags & CMD_FLAG_SHOW_TIMESTAMP)
+		time_columns|=PMCT_SHOW_TIMESTAMP;
+
 	profile_started=1;
 
 	if ( (fd = pmct_open_monitor_entry())<0 )
 		goto error_path;
 
-	if (opts->kernel_buffer_size<4096) {
+	if (opts->sample_filter && pmct_config_sample_filter(opts->sample_filter))
+		goto error_path;
+
+	if (opts->alt_nr_configs) {
+		struct sigaction sact;
+
+		/* Make room for the counters of both configurations in the output */
+		pmcmask|=opts->alt_pmcmask;
+		if (opts->alt_nr_experiments>nr_experiments)
+			nr_experiments=opts->alt_nr_experiments;
+
+		sact.sa_handler = sigusr2_handler;
+		sact.sa_flags = 0;
+		sigemptyset(&sact.sa_mask);
+		if(sigaction(SIGUSR2, &sact, NULL) < 0) {
+			perror("Can't assign signal handler for SIGUSR2");
+			goto error_path;
+		}
+		fprintf(stderr,"Send SIGUSR2 to process %d to switch to the alternate PMC configuration\n",getpid());
+	}
+
+	if (opts->flight_secs) {
+		struct sigaction sact;
+		/* Make room for a few samples per second and CPU unless -k was specified */
+		unsigned int flight_buffer_size=opts->kernel_buffer_size!=-1?opts->kernel_buffer_size:
+		                                sizeof(pmc_sample_t)*sysconf(_SC_NPROCESSORS_CONF)*opts->flight_secs*10;
+
+		if (pmct_config_flight_recorder(opts->flight_secs*1000,flight_buffer_size))
+			goto error_path;
+
+		/* Dumps are retrieved in bounded chunks (one read each) */
+		max_buffer_samples=FLIGHT_DUMP_CHUNK_SAMPLES;
+		if ((samples=malloc(max_buffer_samples*sizeof(pmc_sample_t)))==NULL)
+			goto error_path;
+
+		sact.sa_handler = sigusr1_handler;
+		sact.sa_flags = 0;
+		sigemptyset(&sact.sa_mask);
+		if(sigaction(SIGUSR1, &sact, NULL) < 0) {
+			perror("Can't assign signal handler for SIGUSR1");
+			goto error_path;
+		}
+		fprintf(stderr,"Flight-recorder mode enabled. Send SIGUSR1 to process %d to dump the samples of the last %d seconds\n",
+		        getpid(),opts->flight_secs);
+	} else if (opts->kernel_buffer_size<4096) {
 		/* Request shared memory region */
 		if ((samples=pmct_request_shared_memory_region(fd,&max_buffer_samples))==NULL)
 			goto error_path;
@@ -950,28 +1132,72 @@ static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned
 		if ((samples=malloc(max_buffer_samples*sizeof(pmc_sample_t)))==NULL)
 			goto error_path;
 	}
+
+	/* The session is already configured at this point */
+	if (pmct_kernel_sample_size(fd,&sample_size))
+		goto error_path;
+
 	/* Print header if necessary */
 	if (!(opts->flags & CMD_FLAG_ACUM_SAMPLES)) {
+		print_cgroup_mappings(fo,opts);
+		print_target_mappings(fo,opts);
 		print_counter_mappings(fo,opts,nr_experiments);
-		pmct_print_header(fo,nr_experiments,pmcmask,virtual_mask,extended_output, mode==PMCTRACK_MODE_SYSWIDE, show_elapsed_time);
+		if (fbin)
+			write_stream_header(nr_experiments,pmcmask,virtual_mask,mode,multi_target);
+		else {
+			if (multi_target)
+				fprintf(fo,"%6s ","target");
+			pmct_print_header(fo,nr_experiments,pmcmask,virtual_mask,extended_output, mode==PMCTRACK_MODE_SYSWIDE, time_columns);
+		}
 	}
 	/* Print child counters */
 	while(!stop_profiling) {
 		/*
 		 * Do this while !child_finished
 		 * Note that in the ATTACH mode, child_finished is always false
+		 * (In flight-recorder mode, the read operation blocks until a dump is triggered)
 		 */
-		if (!child_finished) {
+		if (!child_finished && !opts->flight_secs) {
 			alarm_ms(opts->msecs);
 			pause();
 		}
 
 		/* Check if Ctrl+C was pressed */
 		if(!stop_profiling) {
-			nr_samples=pmct_read_samples(fd,samples,max_buffer_samples);
+			/* SIGUSR1 received: trigger a dump of the flight recorder */
+			if (flight_dump_requested) {
+				flight_dump_requested=0;
+				if (pmct_flight_recorder_dump())
+					goto error_path;
+			}
+
+			/* SIGUSR2 received: switch to the alternate PMC configuration */
+			if (reconfig_requested) {
+				reconfig_requested=0;
+				if (switch_pmc_configuration(opts))
+					warnx("Could not switch to the alternate PMC configuration");
+			}
+
+			nr_samples=pmct_read_samples(fd,samples,max_buffer_samples,sample_size);
 
-			if (nr_samples < 0)
+			if (nr_samples < 0) {
+				if (errno==EINTR && opts->flight_secs) {
+					/* Either a dump was requested or the child finished */
+					if (child_finished)
+						break;
+					continue;
+				}
+				/* The kernel marks the end of every dump this way */
+				if (errno==EAGAIN && opts->flight_secs) {
+					fprintf(stderr,"Flight recorder dump: %lu samples\n",dump_samples);
+					dump_samples=0;
+					continue;
+				}
 				goto error_path;
+			}
+
+			if (opts->flight_secs)
+				dump_samples+=nr_samples;
 
 			/*
 			 *  If we did not read anything and child already finished,
@@ -991,15 +1217,20 @@ static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned
 				if (opts->flags & CMD_FLAG_ACUM_SAMPLES) {
 					int j=0;
 					unsigned char copy_metadata=0;
+					/* Accumulate per target when attaching to several processes */
+					pid_t key=cur->pid;
+
+					if (multi_target && cur->target_id>=0 && cur->target_id<opts->nr_targets)
+						key=opts->target_pids[cur->target_id];
 
 					/* Search PID in set */
-					while (j<nr_pids && pid_ctrl_vector[j].pid!=cur->pid)
+					while (j<nr_pids && pid_ctrl_vector[j].pid!=key)
 						j++;
 
 					/* PID not found */
 					if (j==nr_pids) {
 						/* Add new item to set */
-						pid_ctrl_vector[j].pid=cur->pid;
+						pid_ctrl_vector[j].pid=key;
 						pid_ctrl_vector[j].exp_mask=0;
 						nr_pids++;
 						acum_samples[j]=malloc(sizeof(pmc_sample_t)*nr_experiments);
@@ -1019,8 +1250,16 @@ static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned
 						pid_ctrl_vector[j].nr_samples_accum[cur->exp_idx]++;
 
 					pmct_accumulate_sample (nr_experiments,pmcmask,virtual_mask,copy_metadata,cur,&acum_samples[j][cur->exp_idx]);
+					acum_samples[j][cur->exp_idx].pid=key;
+				} else if (fbin) {
+					if (pmct_write_stream_samples(fbin,virtual_mask,cur,1)) {
+						warnx("Can't write samples to the binary stream");
+						goto error_path;
+					}
 				} else {
-					pmct_print_sample (fo,nr_experiments, pmcmask, virtual_mask, extended_output, show_elapsed_time, cont, cur);
+					if (multi_target)
+						fprintf(fo,"%6d ",cur->target_id);
+					pmct_print_sample (fo,nr_experiments, pmcmask, virtual_mask, extended_output, time_columns, cont, cur);
 				}
 
 				cont++;
@@ -1029,9 +1268,12 @@ static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned
 				if (mode==PMCTRACK_MODE_ATTACH) {
 					if ((opts->max_samples!=-1 && cont>opts->max_samples)
 					    || (opts->timeout_secs!=-1 && check_timeout(opts->timeout_secs))) {
-						detach_pid_set(set,opts->target_pid);
+						detach_targets(sets,opts);
 						detached=1;
-						fprintf(stderr, "Maximum samples/timeout reached. Detaching process %d\n",opts->target_pid);
+						if (multi_target)
+							fprintf(stderr, "Maximum samples/timeout reached. Detaching processes\n");
+						else
+							fprintf(stderr, "Maximum samples/timeout reached. Detaching process %d\n",opts->target_pid);
 					}
 				} else {
 					if ((opts->max_samples!=-1 && !child_finished && cont>opts->max_samples)
@@ -1047,23 +1289,38 @@ static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned
 	/* Generate output from accumulated values */
 	if (opts->flags & CMD_FLAG_ACUM_SAMPLES) {
 
+		print_cgroup_mappings(fo,opts);
+		print_target_mappings(fo,opts);
 		print_counter_mappings(fo,opts,nr_experiments);
-		pmct_print_header(fo,nr_experiments,pmcmask,virtual_mask,extended_output, mode==PMCTRACK_MODE_SYSWIDE, show_elapsed_time);
+		if (fbin)
+			write_stream_header(nr_experiments,pmcmask,virtual_mask,mode,multi_target);
+		else {
+			if (multi_target)
+				fprintf(fo,"%6s ","target");
+			pmct_print_header(fo,nr_experiments,pmcmask,virtual_mask,extended_output, mode==PMCTRACK_MODE_SYSWIDE, time_columns);
+		}
 
-		/* Generate samples for the various threads */
+		/* Generate samples for the various threads (or targets) */
 		for (i=0; i<nr_pids; i++) {
 			int j=0;
 			for (j=0; j<nr_experiments; j++) {
-				if ( pid_ctrl_vector[i].exp_mask & (1<<j))
-					pmct_print_sample (fo,nr_experiments, pmcmask, virtual_mask,
-					                   extended_output, show_elapsed_time, pid_ctrl_vector[i].nr_samples_accum[j], &acum_samples[i][j]);
+				if (!(pid_ctrl_vector[i].exp_mask & (1<<j)))
+					continue;
+				if (fbin) {
+					pmct_write_stream_samples(fbin,virtual_mask,&acum_samples[i][j],1);
+					continue;
+				}
+				if (multi_target)
+					fprintf(fo,"%6d ",acum_samples[i][j].target_id);
+				pmct_print_sample (fo,nr_experiments, pmcmask, virtual_mask,
+				                   extended_output, time_columns, pid_ctrl_vector[i].nr_samples_accum[j], &acum_samples[i][j]);
 			}
 		}
 	}
 
 error_path:
 	if (!detached)
-		detach_pid_set(set,opts->target_pid);
+		detach_targets(sets,opts);
 
 	if (mode!=PMCTRACK_MODE_ATTACH && !child_finished) {
 		wait4(pid,&child_status,0,&child_rusage);
@@ -1073,137 +1330,1386 @@ error_path:
 		print_process_statistics(fo,opts,&child_rusage,&start_time,&end_time);
 	if (fd>0)
 		close(fd);
-	if (set)
-		destroy_pid_set(set);
+	if (sets)
+		destroy_targets(sets,opts->nr_targets);
+	if (fbin)
+		fflush(fbin);
 	exit(child_status);
 }
 
-void sigchld_handler(int signo)
+/*
+ * Batch mode (-F option): run a list of commands (each one with its own event sets)
+ * from a single pmctrack process. Event configurations are resolved only once
+ * and the same monitor descriptor is reused for all the jobs. Jobs may also run
+ * concurrently on disjoint CPU masks (-j option), each CPU mask being handled
+ * by a separate worker (lane) that runs jobs one after the other.
+ */
+/* PMC configuration shared by the jobs of a batch */
+typedef struct batch_cfg {
+	char* spec;                  /* Event sets as specified in the batch file (NULL for -c options) */
+	struct options opts;         /* Copy of global options with the resolved configuration */
+	unsigned int nr_experiments;
+	unsigned int pmcmask;
+	unsigned int npmcs;
+	unsigned int ebs;
+} batch_cfg_t;
+
+/* Command to run in batch mode */
+typedef struct batch_job {
+	char* cmdline;               /* Command line (as found in the batch file) */
+	char** argv;                 /* Command-line arguments (NULL to split cmdline) */
+	batch_cfg_t* cfg;            /* PMC configuration for the job */
+} batch_job_t;
+
+/* Aggregate counts for a job (sent from the lanes to the main process) */
+typedef struct batch_result {
+	int job;                     /* Job index */
+	pid_t pid;                   /* PID of the process that ran the job */
+	int status;                  /* Exit status */
+	unsigned long exp_mask;      /* Experiments with at least one sample */
+	unsigned int nr_samples[MAX_COUNTER_CONFIGS];
+	pmc_sample_t acum[MAX_COUNTER_CONFIGS];
+	struct rusage rusage;
+	struct timeval start;
+	struct timeval end;
+} batch_result_t;
+
+/* Function invoked by the main process when a job completes */
+typedef void (*batch_result_handler_t)(struct options* opts, batch_job_t* jobs,
+                                       batch_result_t* res, void* data);
+
+/* SIGINT/SIGTERM handler in batch mode (pid may not refer to a valid child) */
+static void batch_sigint_handler(int signo)
 {
-	/* Error since profile was not started when the child process finished */
-	if (!profile_started)
-		exit(1);
+	stop_profiling=1;
+	if (pid>0)
+		kill(pid,SIGTERM);
+}
 
-	if (wait4(pid,&child_status,WNOHANG,&child_rusage)>0) {
-		gettimeofday(&end_time, NULL);
-		child_finished=1;
+/* Install signal handlers for the batch mode */
+static int install_batch_signal_handlers(int install_sigchild)
+{
+	struct sigaction sact;
+	int signals[]= {SIGINT,SIGTERM,SIGPIPE};
+	int i;
+
+	if (install_signal_handlers(install_sigchild))
+		return 1;
+
+	for (i=0; i<3; i++) {
+		sact.sa_handler = batch_sigint_handler;
+		sact.sa_flags = 0;
+		sigemptyset(&sact.sa_mask);
+		sigaddset(&sact.sa_mask, signals[i]);
+		if(sigaction(signals[i], &sact, NULL) < 0) {
+			perror("Can't assign signal handler");
+			return 1;
+		}
 	}
+	return 0;
 }
 
-void sigint_handler(int signo)
+/* read()/write() wrappers that deal with partial transfers and EINTR */
+static int read_full(int fd, void* buf, size_t len)
 {
-	if (kill(pid,SIGTERM))
-		fprintf(stderr,"Could not send signal %d to PID %d\n",signo,pid);
+	char* dst=buf;
+	ssize_t ret;
+
+	while (len>0) {
+		if ((ret=read(fd,dst,len))<0) {
+			if (errno==EINTR && !stop_profiling)
+				continue;
+			return -1;
+		} else if (ret==0)
+			return 1; /* EOF */
+		dst+=ret;
+		len-=ret;
+	}
+	return 0;
+}
 
-	/* Finish immediately */
-	stop_profiling=1;
-	fprintf(stderr,"Received signal %d\n", signo);
-	if (signo==SIGPIPE) {
-		sigchld_handler(signo);
-		exit(1);
+static int write_full(int fd, const void* buf, size_t len)
+{
+	const char* src=buf;
+	ssize_t ret;
+
+	while (len>0) {
+		if ((ret=write(fd,src,len))<0) {
+			if (errno==EINTR)
+				continue;
+			return -1;
+		}
+		src+=ret;
+		len-=ret;
 	}
+	return 0;
 }
 
+/* Make the monitor descriptor point to the samples buffer of a given process */
+static int monitor_process_fd(int fd, pid_t target)
+{
+	char str[30];
+	int len=sprintf(str,"pid_monitor %d",target);
 
-/* Give a default value for the various fields ... */
-void init_options( struct options* opts)
+	return write(fd,str,len+1)<0?-1:0;
+}
+
+/*
+ * Resolve a set of event configurations separated by semicolons
+ * (or the ones provided with -c if spec is NULL)
+ */
+static int resolve_batch_cfg(struct options* opts, const char* spec, batch_cfg_t* cfg)
 {
-	unsigned int i;
+	char* user_cfg_str[MAX_COUNTER_CONFIGS+1];
+	char* cpspec=NULL;
+	char* cur;
+	char* item;
+	unsigned int nr_experiments;
+	int i=0,ret=0;
 
-	opts->msecs = 1000;
-	opts->virtcfg = NULL;
-	opts->nr_virtual_counters=opts->virtual_mask=0;
+	memcpy(&cfg->opts,opts,sizeof(struct options));
+	cfg->spec=NULL;
 
-	for (i = 0; i<MAX_RAW_COUNTER_CONFIGS_SAFE; ++i)
-		opts->strcfg[i] = NULL;
+	if (spec) {
+		cfg->spec=strdup(spec);
+		cpspec=cur=strdup(spec);
 
-	for (i = 0; i<MAX_COUNTER_CONFIGS; ++i)
-		opts->user_cfg_str[i]=NULL;
+		if (!cfg->spec || !cpspec) {
+			warnx("Can't allocate memory for the batch configuration");
+			free(cfg->spec);
+			free(cpspec);
+			return 1;
+		}
 
-	opts->cpumask = NO_CPU_BINDING;
-	opts->max_samples = -1;
-	opts->flags=0;
-	opts->target_pid=-1;
-	opts->kernel_buffer_size = -1;
-	opts->user_nr_configs=0;
-	opts->pmu_id=0;
-	memset(opts->event_mapping,0,sizeof(counter_mapping_t)*MAX_PERFORMANCE_COUNTERS);
-	opts->global_pmcmask=0;
-	opts->timeout_secs=-1; /* Disabled for now */
-}
+		while ((item=strsep(&cur,";"))!=NULL) {
+			if (*item=='\0')
+				continue;
+			if (i==MAX_COUNTER_CONFIGS) {
+				warnx("Too many event sets in %s",spec);
+				ret=1;
+				goto out;
+			}
+			user_cfg_str[i++]=item;
+		}
+		user_cfg_str[i]=NULL;
 
+		for (i=0; i<MAX_RAW_COUNTER_CONFIGS_SAFE; i++)
+			cfg->opts.strcfg[i]=NULL;
 
-/* Insert the argument for an instance of the "-c" switch in a vector */
-int add_cfg_string_to_options(char* usercfg, struct options* opts)
-{
-	char* cpstring;
+		memset(cfg->opts.event_mapping,0,sizeof(counter_mapping_t)*MAX_PERFORMANCE_COUNTERS);
 
-	if (opts->user_nr_configs>=MAX_COUNTER_CONFIGS) {
-		warnx("Sorry! cannot accept more PMC configuration strings");
-		return 1;
+		if ((ret=pmct_parse_pmc_configuration((const char**)user_cfg_str,
+		                                      (opts->flags & CMD_FLAG_RAW_PMC_FORMAT),
+		                                      opts->pmu_id,
+		                                      cfg->opts.strcfg,
+		                                      &nr_experiments,
+		                                      &cfg->opts.global_pmcmask,
+		                                      cfg->opts.event_mapping)))
+			goto out;
 	}
 
-	/* Copy string as is */
-	cpstring=malloc(strlen(usercfg)+1);
-	/* Copy config */
-	strcpy(cpstring,usercfg);
-	opts->user_cfg_str[opts->user_nr_configs]=cpstring;
-	opts->user_nr_configs++;
+	if ((ret=pmct_check_counter_config((const char**)cfg->opts.strcfg,&cfg->npmcs,&cfg->pmcmask,
+	                                   &cfg->ebs,&cfg->nr_experiments)))
+		goto out;
 
-	return 0;
+	if (!cfg->opts.strcfg[0] && cfg->npmcs!=0)
+		cfg->opts.flags |= CMD_FLAG_KERNEL_DRIVES_PMCS;
+
+	if (cfg->opts.nr_virtual_counters==0 && cfg->npmcs==0) {
+		warnx("Please specify events to monitor!");
+		ret=1;
+	}
+out:
+	free(cpspec);
+	return ret;
 }
 
-/* Wrapper for pmct_parse_pmc_configuration() */
-int parse_pmc_configuration(struct options* opts)
+/* Free up the raw configuration strings of a batch configuration */
+static void free_batch_cfg(batch_cfg_t* cfg)
 {
-	unsigned int nr_experiments;
-	return pmct_parse_pmc_configuration((const char**)opts->user_cfg_str,
-	                                    (opts->flags & CMD_FLAG_RAW_PMC_FORMAT),
-	                                    opts->pmu_id,
-	                                    opts->strcfg,
-	                                    &nr_experiments,
-	                                    &opts->global_pmcmask,
-	                                    opts->event_mapping);
-}
+	int i;
 
+	if (!cfg->spec)
+		return; /* Strings belong to the global options */
 
-/* Wrapper for pmct_parse_vcounter_config() */
-int set_vcount_string_in_options (char* user_vcount_string, struct options* opts)
+	for (i=0; cfg->opts.strcfg[i]; i++)
+		free(cfg->opts.strcfg[i]);
+	free(cfg->spec);
+}
+
+/* Find the configuration for a set of events or resolve it if it was not found */
+static batch_cfg_t* get_batch_cfg(struct options* opts, const char* spec,
+                                  batch_cfg_t** cfgs, int* nr_cfgs)
 {
+	int i;
+	batch_cfg_t* cfg;
 
-	int mnemonics_used=0;
+	for (i=0; i<*nr_cfgs; i++) {
+		cfg=cfgs[i];
+		if ((!spec && !cfg->spec) || (spec && cfg->spec && strcmp(spec,cfg->spec)==0))
+			return cfg;
+	}
 
-	if ( pmct_parse_vcounter_config(user_vcount_string,
-	                                &opts->virtual_mask,
-	                                &opts->nr_virtual_counters,
-	                                &mnemonics_used,
-	                                &opts->virtcfg))
-		return 1;
+	if ((cfg=malloc(sizeof(batch_cfg_t)))==NULL)
+		return NULL;
 
-	if (mnemonics_used)
-		opts->flags |= CMD_FLAG_VIRT_COUNTER_MNEMONICS;
+	if (resolve_batch_cfg(opts,spec,cfg)) {
+		free(cfg);
+		return NULL;
+	}
 
-	return 0;
+	cfgs[(*nr_cfgs)++]=cfg;
+	return cfg;
 }
 
-/* Free up allocated memory for the various fields of struct options */
-void free_options (struct options* opts)
+/* Remove leading and trailing whitespace */
+static char* trim_string(char* str)
 {
-	unsigned int i = 0;
-	/* Free cfg string buffer */
-	while (opts->strcfg[i]) {
-		free(opts->strcfg[i]);
-		++i;
-	}
+	char* end;
 
-	i=0;
-	while (opts->user_cfg_str[i]) {
-		free(opts->user_cfg_str[i]);
-		++i;
+	while (*str==' ' || *str=='\t')
+		str++;
+
+	end=str+strlen(str);
+	while (end>str && (end[-1]==' ' || end[-1]=='\t' || end[-1]=='\n' || end[-1]=='\r'))
+		end--;
+	*end='\0';
+	return str;
+}
+
+/*
+ * Parse a batch file. Each line describes a job with the following format:
+ *
+ *		[<event-set>[;<event-set>]... |] <command> [args]
+ *
+ * where the event sets use the same syntax as the -c option. If no event set
+ * is specified, the job uses the configuration provided with the -c and -V options.
+ * Empty lines and lines starting with '#' are ignored.
+ */
+static int parse_batch_file(struct options* opts,
+                            batch_job_t** jobs_p, int* nr_jobs_p,
+                            batch_cfg_t*** cfgs_p, int* nr_cfgs_p)
+{
+	FILE* fin;
+	char* line=NULL;
+	size_t line_size=0;
+	int lineno=0;
+	char* cmd;
+	char* spec;
+	char* sep;
+	batch_job_t* jobs=NULL;
+	batch_cfg_t** cfgs=NULL;
+	int nr_jobs=0,max_jobs=0;
+	int nr_cfgs=0,max_cfgs=0;
+	int ret=0;
+
+	if (strcmp(opts->batch_file,"-")==0)
+		fin=stdin;
+	else if ((fin=fopen(opts->batch_file,"r"))==NULL) {
+		warnx("Can't open batch file %s",opts->batch_file);
+		return 1;
+	}
+
+	while (getline(&line,&line_size,fin)!=-1) {
+		lineno++;
+		cmd=trim_string(line);
+
+		if (*cmd=='\0' || *cmd=='#')
+			continue;
+
+		spec=NULL;
+		if ((sep=strchr(cmd,'|'))!=NULL) {
+			*sep='\0';
+			spec=trim_string(cmd);
+			cmd=trim_string(sep+1);
+			if (*spec=='\0')
+				spec=NULL;
+		}
+
+		if (*cmd=='\0') {
+			warnx("%s:%d: command not specified",opts->batch_file,lineno);
+			ret=1;
+			break;
+		}
+
+		/* Grow vectors if necessary */
+		if (nr_jobs==max_jobs) {
+			batch_job_t* tmp;
+			max_jobs=max_jobs?2*max_jobs:64;
+			if ((tmp=realloc(jobs,max_jobs*sizeof(batch_job_t)))==NULL) {
+				warnx("Can't allocate memory for the batch jobs");
+				ret=1;
+				break;
+			}
+			jobs=tmp;
+		}
+
+		if (nr_cfgs==max_cfgs) {
+			batch_cfg_t** tmp;
+			max_cfgs=max_cfgs?2*max_cfgs:8;
+			if ((tmp=realloc(cfgs,max_cfgs*sizeof(batch_cfg_t*)))==NULL) {
+				warnx("Can't allocate memory for the batch configurations");
+				ret=1;
+				break;
+			}
+			cfgs=tmp;
+		}
+
+		if ((jobs[nr_jobs].cfg=get_batch_cfg(opts,spec,cfgs,&nr_cfgs))==NULL) {
+			warnx("%s:%d: wrong event configuration",opts->batch_file,lineno);
+			ret=1;
+			break;
+		}
+
+		jobs[nr_jobs].argv=NULL;
+		if ((jobs[nr_jobs].cmdline=strdup(cmd))==NULL) {
+			warnx("Can't allocate memory for the batch jobs");
+			ret=1;
+			break;
+		}
+		nr_jobs++;
+	}
+
+	free(line);
+	if (fin!=stdin)
+		fclose(fin);
+
+	if (!ret && nr_jobs==0) {
+		warnx("No jobs found in %s",opts->batch_file);
+		ret=1;
+	}
+
+	(*jobs_p)=jobs;
+	(*nr_jobs_p)=nr_jobs;
+	(*cfgs_p)=cfgs;
+	(*nr_cfgs_p)=nr_cfgs;
+	return ret;
+}
+
+/*
+ * Run a job in the current process, which acts as the monitor.
+ * fd is the (already open) monitor descriptor, and samples is the buffer
+ * where samples are retrieved.
+ */
+static int run_batch_job(struct options* opts, batch_job_t* jobs, int job_idx,
+                         int fd, pmc_sample_t* samples, unsigned int max_buffer_samples,
+                         pmct_cpuset_t* cpus, batch_result_t* res)
+{
+	batch_job_t* job=&jobs[job_idx];
+	batch_cfg_t* cfg=job->cfg;
+	unsigned int nr_experiments=cfg->nr_experiments;
+	wordexp_t job_words;
+	char** job_argv=job->argv;
+	int sync_pipe[2];
+	char sync_val=1;
+	unsigned int sample_size;
+	int i,ret,nr_samples,cont=1;
+
+	memset(res,0,sizeof(batch_result_t));
+	res->job=job_idx;
+	res->status=-1;
+
+	/* Split the command line if necessary */
+	if (!job_argv) {
+		if (wordexp(job->cmdline,&job_words,WRDE_NOCMD)!=0 || job_words.we_wordc==0) {
+			warnx("Can't parse command: %s",job->cmdline);
+			return -1;
+		}
+		job_argv=job_words.we_wordv;
+	}
+
+	/* The child closes the pipe (exec) or writes on it (failure) when it's done */
+	if (pipe(sync_pipe)<0) {
+		warnx("Can't create pipe");
+		if (!job->argv)
+			wordfree(&job_words);
+		return -1;
+	}
+	fcntl(sync_pipe[1],F_SETFD,FD_CLOEXEC);
+
+	child_finished=0;
+	child_status=0;
+	profile_started=1;
+
+	/* Keep track of start time */
+	gettimeofday(&start_time, NULL);
+	res->start=start_time;
+
+	pid = fork();
+
+	if(pid == -1) {
+		warnx("Error forking process.");
+		close(sync_pipe[0]);
+		close(sync_pipe[1]);
+		if (!job->argv)
+			wordfree(&job_words);
+		return -1;
+	} else if(pid == 0) {
+		// CHILD CODE:
+		close(sync_pipe[0]);
+
+		if (restore_signal_handlers() || try_to_bind_process_cpuset(getpid(),cpus)
+		    || config_session(&cfg->opts,PMC_CFG_START)) {
+			write(sync_pipe[1],&sync_val,1);
+			_exit(1);
+		}
+
+		execvp(job_argv[0],job_argv);
+		warnx("Error when trying to execute program %s\n",job_argv[0]);
+		write(sync_pipe[1],&sync_val,1);
+		_exit(1);
+	}
+
+	// PARENT CODE:
+	res->pid=pid;
+	if (!job->argv)
+		wordfree(&job_words);
+	close(sync_pipe[1]);
+
+	/* Wait for the child process to configure the counters */
+	ret=read_full(sync_pipe[0],&sync_val,1);
+	close(sync_pipe[0]);
+
+	if (ret!=1 || monitor_process_fd(fd,pid) || pmct_kernel_sample_size(fd,&sample_size)) {
+		warnx("Job %d failed: %s",job_idx+1,job->cmdline);
+		if (!child_finished)
+			wait4(pid,&child_status,0,&child_rusage);
+		goto out;
+	}
+
+	while(!stop_profiling) {
+		if (!child_finished) {
+			alarm_ms(opts->msecs);
+			pause();
+		}
+
+		/* Just in case the signal arrived before the pid was known */
+		if (!child_finished && wait4(pid,&child_status,WNOHANG,&child_rusage)>0) {
+			gettimeofday(&end_time, NULL);
+			child_finished=1;
+		}
+
+		if (stop_profiling)
+			break;
+
+		if ((nr_samples=pmct_read_samples(fd,samples,max_buffer_samples,sample_size))<0) {
+			if (errno==EINTR)
+				continue;
+			break;
+		}
+
+		if (nr_samples==0 && child_finished)
+			break;
+
+		for (i=0; i<nr_samples; i++) {
+			pmc_sample_t* cur=&samples[i];
+			unsigned char copy_metadata=0;
+
+			if (cur->exp_idx<0 || cur->exp_idx>=MAX_COUNTER_CONFIGS)
+				continue;
+
+			if (!(res->exp_mask & (1<<cur->exp_idx))) {
+				copy_metadata=1;
+				res->exp_mask|=1<<cur->exp_idx;
+			}
+			res->nr_samples[cur->exp_idx]++;
+
+			pmct_accumulate_sample (nr_experiments,cfg->pmcmask,opts->virtual_mask,copy_metadata,
+			                        cur,&res->acum[cur->exp_idx]);
+
+			/* Elapsed time is not accumulated by libpmctrack */
+			res->acum[cur->exp_idx].elapsed_time+=cur->elapsed_time;
+
+			cont++;
+		}
+
+		/* Control for -n /-N options */
+		if ((opts->max_samples!=-1 && !child_finished && cont>opts->max_samples)
+		    || (opts->timeout_secs!=-1 && !child_finished && check_timeout(opts->timeout_secs))) {
+			kill(pid,SIGTERM);
+			fprintf(stderr, "Maximum samples/timeout reached. Killing job %d (PID %d)\n",job_idx+1,pid);
+		}
+	}
+
+	if (!child_finished) {
+		if (stop_profiling)
+			kill(pid,SIGTERM);
+		wait4(pid,&child_status,0,&child_rusage);
+		gettimeofday(&end_time, NULL);
+	}
+out:
+	pid=0;
+	res->status=WIFEXITED(child_status)?WEXITSTATUS(child_status):-1;
+	res->rusage=child_rusage;
+	res->end=end_time;
+	return 0;
+}
+
+/*
+ * Open the monitor descriptor and set up the buffer to retrieve samples
+ * (shared by all the jobs run by the calling process)
+ */
+static int open_batch_monitor(struct options* opts, pmc_sample_t** samples, unsigned int* max_buffer_samples)
+{
+	int fd;
+
+	if ( (fd = pmct_open_monitor_entry())<0 )
+		return -1;
+
+	if (opts->kernel_buffer_size<4096) {
+		/* Request shared memory region */
+		if (((*samples)=pmct_request_shared_memory_region(fd,max_buffer_samples))==NULL) {
+			close(fd);
+			return -1;
+		}
+	} else {
+		/* Reserve a big buffer from the heap directly */
+		(*max_buffer_samples)=opts->kernel_buffer_size/sizeof(pmc_sample_t);
+		if (((*samples)=malloc((*max_buffer_samples)*sizeof(pmc_sample_t)))==NULL) {
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/*
+ * Code executed by a lane in the concurrent batch mode: run the jobs
+ * requested by the main process (job indexes through cmd_fd) and send
+ * back the results (through res_fd).
+ */
+static void batch_lane(struct options* opts, batch_job_t* jobs, pmct_cpuset_t* cpus,
+                       int cmd_fd, int res_fd)
+{
+	int fd;
+	pmc_sample_t* samples=NULL;
+	unsigned int max_buffer_samples;
+	batch_result_t res;
+	int job_idx;
+
+	if (install_batch_signal_handlers(1))
+		_exit(1);
+
+	if ((fd=open_batch_monitor(opts,&samples,&max_buffer_samples))<0)
+		_exit(1);
+
+	while (!stop_profiling && read_full(cmd_fd,&job_idx,sizeof(int))==0 && job_idx>=0) {
+		run_batch_job(opts,jobs,job_idx,fd,samples,max_buffer_samples,cpus,&res);
+		if (write_full(res_fd,&res,sizeof(batch_result_t)))
+			break;
+	}
+
+	close(fd);
+	_exit(0);
+}
+
+/*
+ * Run all the jobs in a batch, and invoke the handler function
+ * for each job completed. If several CPU sets were specified (-j option)
+ * jobs are distributed dynamically among lanes.
+ */
+static int run_batch(struct options* opts, batch_job_t* jobs, int nr_jobs,
+                     batch_result_handler_t handler, void* data)
+{
+	int nr_lanes=opts->nr_batch_lanes;
+	int cmd_fds[MAX_BATCH_LANES];
+	int res_fds[MAX_BATCH_LANES];
+	pid_t lane_pids[MAX_BATCH_LANES];
+	int lane_jobs[MAX_BATCH_LANES];	/* Job run by each lane */
+	struct pollfd pfds[MAX_BATCH_LANES];
+	int active_lanes=0;
+	int next_job=0;
+	int i,j,fd,exit_val=0;
+	int stop_job=-1;
+	pmc_sample_t* samples=NULL;
+	unsigned int max_buffer_samples;
+	batch_result_t res;
+
+	/* Sequential mode: this process runs all the jobs */
+	if (nr_lanes<=1) {
+		pmct_cpuset_t* cpus=nr_lanes?opts->batch_cpusets[0]:opts->cpuset;
+
+		if (install_batch_signal_handlers(1))
+			return 1;
+
+		if ((fd=open_batch_monitor(opts,&samples,&max_buffer_samples))<0)
+			return 1;
+
+		for (i=0; i<nr_jobs && !stop_profiling; i++) {
+			if (run_batch_job(opts,jobs,i,fd,samples,max_buffer_samples,cpus,&res))
+				exit_val=1;
+			handler(opts,jobs,&res,data);
+		}
+		close(fd);
+		return exit_val;
+	}
+
+	if (install_batch_signal_handlers(0))
+		return 1;
+
+	/* Create lanes */
+	for (i=0; i<nr_lanes; i++) {
+		int cmd_pipe[2],res_pipe[2];
+
+		if (pipe(cmd_pipe)<0 || pipe(res_pipe)<0) {
+			warnx("Can't create pipe");
+			exit_val=1;
+			break;
+		}
+
+		if ((lane_pids[i]=fork())==-1) {
+			warnx("Error forking process.");
+			exit_val=1;
+			break;
+		} else if (lane_pids[i]==0) {
+			close(cmd_pipe[1]);
+			close(res_pipe[0]);
+			for (j=0; j<i; j++) {
+				close(cmd_fds[j]);
+				close(res_fds[j]);
+			}
+			batch_lane(opts,jobs,opts->batch_cpusets[i],cmd_pipe[0],res_pipe[1]);
+		}
+
+		close(cmd_pipe[0]);
+		close(res_pipe[1]);
+		cmd_fds[i]=cmd_pipe[1];
+		res_fds[i]=res_pipe[0];
+		pfds[i].fd=res_fds[i];
+		pfds[i].events=POLLIN;
+		active_lanes++;
+
+		/* Hand out the first job */
+		if (next_job<nr_jobs && write_full(cmd_fds[i],&next_job,sizeof(int))==0)
+			lane_jobs[i]=next_job++;
+		else {
+			write_full(cmd_fds[i],&stop_job,sizeof(int));
+			pfds[i].fd=-1;
+			active_lanes--;
+		}
+	}
+	nr_lanes=i;
+
+	while (active_lanes>0) {
+		if (poll(pfds,nr_lanes,-1)<0) {
+			if (errno==EINTR)
+				continue;
+			break;
+		}
+
+		for (i=0; i<nr_lanes; i++) {
+			if (pfds[i].fd<0 || !pfds[i].revents)
+				continue;
+
+			if (read_full(res_fds[i],&res,sizeof(batch_result_t))) {
+				/* The lane is gone: report its job as failed */
+				warnx("Job %d failed: %s",lane_jobs[i]+1,jobs[lane_jobs[i]].cmdline);
+				memset(&res,0,sizeof(batch_result_t));
+				res.job=lane_jobs[i];
+				res.status=-1;
+				handler(opts,jobs,&res,data);
+				exit_val=1;
+				pfds[i].fd=-1;
+				active_lanes--;
+				continue;
+			}
+
+			handler(opts,jobs,&res,data);
+
+			if (next_job<nr_jobs && !stop_profiling
+			    && write_full(cmd_fds[i],&next_job,sizeof(int))==0) {
+				lane_jobs[i]=next_job++;
+			} else {
+				write_full(cmd_fds[i],&stop_job,sizeof(int));
+				pfds[i].fd=-1;
+				active_lanes--;
+			}
+		}
+	}
+
+	for (i=0; i<nr_lanes; i++) {
+		close(cmd_fds[i]);
+		close(res_fds[i]);
+		waitpid(lane_pids[i],NULL,0);
+	}
+
+	if (next_job<nr_jobs)
+		exit_val=1;
+	return exit_val;
+}
+
+/* Completed jobs waiting to be printed (to preserve the order of the batch file) */
+struct batch_output {
+	batch_result_t** pending;
+	int next;
+	int nr_jobs;
+};
+
+/* Placeholder for the results that could not be stored */
+static batch_result_t batch_result_lost;
+
+/* Print the aggregate counts for a job (same format as -A) */
+static void print_batch_result(struct options* opts, batch_job_t* jobs, batch_result_t* res)
+{
+	batch_job_t* job=&jobs[res->job];
+	batch_cfg_t* cfg=job->cfg;
+	unsigned int time_columns=(opts->flags & CMD_FLAG_SHOW_ELAPSED_TIME)?PMCT_SHOW_ETIME:0;
+	int j;
+
+	fprintf(fo,"[Job %d] %s (exit status: %d)\n",res->job+1,job->cmdline,res->status);
+	print_counter_mappings(fo,&cfg->opts,cfg->nr_experiments);
+	pmct_print_header(fo,cfg->nr_experiments,cfg->pmcmask,opts->virtual_mask,extended_output,0,time_columns);
+
+	for (j=0; j<cfg->nr_experiments && j<MAX_COUNTER_CONFIGS; j++) {
+		if (res->exp_mask & (1<<j))
+			pmct_print_sample (fo,cfg->nr_experiments, cfg->pmcmask, opts->virtual_mask,
+			                   extended_output, time_columns, res->nr_samples[j], &res->acum[j]);
+	}
+
+	if (opts->flags & CMD_FLAG_SHOW_CHILD_TIMES)
+		print_process_statistics(fo,opts,&res->rusage,&res->start,&res->end);
+}
+
+/* Print the results of the next job in the batch-file order, flagging the missing ones */
+static void print_next_batch_result(struct options* opts, batch_job_t* jobs, struct batch_output* out)
+{
+	batch_result_t* cur=out->pending[out->next];
+
+	if (cur==NULL)
+		fprintf(fo,"[Job %d] %s (not run)\n",out->next+1,jobs[out->next].cmdline);
+	else if (cur==&batch_result_lost)
+		fprintf(fo,"[Job %d] %s (results lost)\n",out->next+1,jobs[out->next].cmdline);
+	else {
+		print_batch_result(opts,jobs,cur);
+		free(cur);
+	}
+
+	out->pending[out->next++]=NULL;
+}
+
+/* Result handler for the batch mode: print results in the batch-file order */
+static void batch_output_handler(struct options* opts, batch_job_t* jobs,
+                                 batch_result_t* res, void* data)
+{
+	struct batch_output* out=data;
+	batch_result_t* cur;
+
+	if (res->job!=out->next) {
+		/* Keep the slot taken, so that later results are not held back forever */
+		if ((cur=malloc(sizeof(batch_result_t)))==NULL) {
+			warnx("Can't allocate memory for the results of job %d",res->job+1);
+			out->pending[res->job]=&batch_result_lost;
+			return;
+		}
+		memcpy(cur,res,sizeof(batch_result_t));
+		out->pending[res->job]=cur;
+		return;
+	}
+
+	print_batch_result(opts,jobs,res);
+	out->next++;
+
+	/* Flush pending results */
+	while (out->pending[out->next]!=NULL)
+		print_next_batch_result(opts,jobs,out);
+}
+
+/* Config & Monitoring function for batch mode */
+static void monitoring_counters_batch(struct options* opts)
+{
+	batch_job_t* jobs=NULL;
+	batch_cfg_t** cfgs=NULL;
+	int nr_jobs=0,nr_cfgs=0;
+	struct batch_output out;
+	int i,last,exit_val=1;
+
+	if (parse_batch_file(opts,&jobs,&nr_jobs,&cfgs,&nr_cfgs))
+		goto free_up_batch;
+
+	out.next=0;
+	out.nr_jobs=nr_jobs;
+	/* One extra item acts as a sentinel */
+	if ((out.pending=calloc(nr_jobs+1,sizeof(batch_result_t*)))==NULL) {
+		warnx("Can't allocate memory for the batch results");
+		goto free_up_batch;
+	}
+
+	stop_profiling=0;
+	exit_val=run_batch(opts,jobs,nr_jobs,batch_output_handler,&out);
+
+	/* Print the results held back by missing ones (jobs not run at the end are left out) */
+	for (last=out.nr_jobs-1; last>=out.next && out.pending[last]==NULL; last--) {}
+
+	while (out.next<=last) {
+		if (out.pending[out.next]==NULL || out.pending[out.next]==&batch_result_lost)
+			exit_val=1;
+		print_next_batch_result(opts,jobs,&out);
+	}
+	free(out.pending);
+
+free_up_batch:
+	for (i=0; i<nr_jobs; i++)
+		free(jobs[i].cmdline);
+	free(jobs);
+	for (i=0; i<nr_cfgs; i++) {
+		free_batch_cfg(cfgs[i]);
+		free(cfgs[i]);
+	}
+	free(cfgs);
+	if (fo!=stdout)
+		fclose(fo);
+	free_options(opts);
+	exit(exit_val);
+}
+
+/* Statistics for the multi-run mode (-m option) */
+#define SWEEP_MAX_COUNTERS (MAX_PERFORMANCE_COUNTERS+MAX_VIRTUAL_COUNTERS)
+
+struct sweep_stats {
+	unsigned int nr_experiments;
+	unsigned int nr_runs[MAX_COUNTER_CONFIGS];      /* Runs with samples for each event set */
+	unsigned int failed_runs;                       /* Runs without samples */
+	unsigned int pmcmask[MAX_COUNTER_CONFIGS];      /* PMCs observed for each event set */
+	unsigned int virtual_mask[MAX_COUNTER_CONFIGS]; /* Virtual counters observed for each event set */
+	double mean[MAX_COUNTER_CONFIGS][SWEEP_MAX_COUNTERS];
+	double m2[MAX_COUNTER_CONFIGS][SWEEP_MAX_COUNTERS]; /* Sum of squared deviations */
+};
+
+/* Incremental computation of mean and variance (Welford's algorithm) */
+static inline void update_sweep_stats(struct sweep_stats* st, int exp, int counter,
+                                      uint64_t value)
+{
+	double delta=(double)value-st->mean[exp][counter];
+
+	st->mean[exp][counter]+=delta/st->nr_runs[exp];
+	st->m2[exp][counter]+=delta*((double)value-st->mean[exp][counter]);
+}
+
+/* Result handler for the multi-run mode: update statistics with the counts of the run */
+static void sweep_result_handler(struct options* opts, batch_job_t* jobs,
+                                 batch_result_t* res, void* data)
+{
+	struct sweep_stats* st=data;
+	int exp=res->job % st->nr_experiments; /* Job order: run-major */
+	pmc_sample_t* sample=&res->acum[0];
+	int j,cnt;
+
+	if (!(res->exp_mask & 0x1)) {
+		warnx("No samples gathered for event set %d (run %d)",exp,res->job/st->nr_experiments+1);
+		st->failed_runs++;
+		return;
+	}
+
+	st->nr_runs[exp]++;
+
+	for (j=0,cnt=0; j<MAX_PERFORMANCE_COUNTERS; j++) {
+		if (sample->pmc_mask & (0x1<<j)) {
+			update_sweep_stats(st,exp,j,sample->pmc_counts[cnt++]);
+			st->pmcmask[exp]|=(0x1<<j);
+		}
+	}
+
+	for (j=0,cnt=0; j<MAX_VIRTUAL_COUNTERS; j++) {
+		if (sample->virt_mask & (0x1<<j)) {
+			update_sweep_stats(st,exp,MAX_PERFORMANCE_COUNTERS+j,sample->virtual_counts[cnt++]);
+			st->virtual_mask[exp]|=(0x1<<j);
+		}
+	}
+}
+
+/* Print a row of the merged report for the multi-run mode */
+static void print_sweep_row(FILE* fout, struct sweep_stats* st, int exp,
+                            int counter, const char* name, int idx)
+{
+	unsigned int n=st->nr_runs[exp];
+	double mean=st->mean[exp][counter];
+	double stddev=(n>1)?sqrt(st->m2[exp][counter]/(n-1)):0.0;
+
+	fprintf(fout,"%5d %5u %8s%-2d %18.1f %16.1f %8.3f\n",exp,n,name,idx,
+	        mean,stddev,(mean!=0.0)?100.0*stddev/mean:0.0);
+}
+
+/* Print the merged report for the multi-run mode */
+static void print_sweep_report(FILE* fout, struct options* opts, struct sweep_stats* st)
+{
+	int i,j;
+
+	print_counter_mappings(fout,opts,st->nr_experiments);
+	fprintf(fout,"%5s %5s %10s %18s %16s %8s\n","expid","runs","counter","mean","stddev","rsd(%)");
+
+	for (i=0; i<st->nr_experiments; i++) {
+		for (j=0; j<MAX_PERFORMANCE_COUNTERS; j++)
+			if (st->pmcmask[i] & (0x1<<j))
+				print_sweep_row(fout,st,i,j,"pmc",j);
+
+		for (j=0; j<MAX_VIRTUAL_COUNTERS; j++)
+			if (st->virtual_mask[i] & (0x1<<j))
+				print_sweep_row(fout,st,i,MAX_PERFORMANCE_COUNTERS+j,"virt",j);
+	}
+
+	if (st->failed_runs)
+		fprintf(fout,"[Runs without samples]\n%u\n",st->failed_runs);
+}
+
+/*
+ * Config & Monitoring function for the multi-run mode. Rather than multiplexing
+ * the various event sets, the command is run once per event set (as many times
+ * as requested via -m), and a report with the mean count for each event
+ * and its variability across runs is generated.
+ */
+static void monitoring_counters_sweep(struct options* opts,int optind,char** argv)
+{
+	batch_cfg_t cfgs[MAX_COUNTER_CONFIGS];
+	batch_job_t* jobs=NULL;
+	struct sweep_stats* stats=NULL;
+	unsigned int nr_experiments=0;
+	int i,j,r,nr_jobs,exit_val=1;
+
+	while (nr_experiments<MAX_COUNTER_CONFIGS && opts->strcfg[nr_experiments])
+		nr_experiments++;
+
+	if (nr_experiments==0) {
+		warnx("The multi-run mode (-m) requires at least one event set (-c)");
+		goto free_up_sweep;
+	}
+
+	/* One configuration per event set (owned by the global options) */
+	for (i=0; i<nr_experiments; i++) {
+		batch_cfg_t* cfg=&cfgs[i];
+
+		memcpy(&cfg->opts,opts,sizeof(struct options));
+		cfg->spec=NULL;
+		for (j=0; j<MAX_RAW_COUNTER_CONFIGS_SAFE; j++)
+			cfg->opts.strcfg[j]=NULL;
+		cfg->opts.strcfg[0]=opts->strcfg[i];
+
+		if (pmct_check_counter_config((const char**)cfg->opts.strcfg,&cfg->npmcs,&cfg->pmcmask,
+		                              &cfg->ebs,&cfg->nr_experiments))
+			goto free_up_sweep;
+	}
+
+	nr_jobs=nr_experiments*opts->sweep_runs;
+
+	if ((jobs=malloc(nr_jobs*sizeof(batch_job_t)))==NULL ||
+	    (stats=malloc(sizeof(struct sweep_stats)))==NULL) {
+		warnx("Can't allocate memory for the multi-run mode");
+		goto free_up_sweep;
+	}
+
+	/* Interleave event sets to spread out any drift across runs */
+	for (r=0; r<opts->sweep_runs; r++) {
+		for (i=0; i<nr_experiments; i++) {
+			batch_job_t* job=&jobs[r*nr_experiments+i];
+			job->cmdline=argv[optind];
+			job->argv=&argv[optind];
+			job->cfg=&cfgs[i];
+		}
 	}
 
+	memset(stats,0,sizeof(struct sweep_stats));
+	stats->nr_experiments=nr_experiments;
+
+	stop_profiling=0;
+	exit_val=run_batch(opts,jobs,nr_jobs,sweep_result_handler,stats);
+
+	print_sweep_report(fo,opts,stats);
+
+free_up_sweep:
+	free(jobs);
+	free(stats);
+	if (fo!=stdout)
+		fclose(fo);
+	free_options(opts);
+	exit(exit_val);
+}
+
+void sigchld_handler(int signo)
+{
+	/* Error since profile was not started when the child process finished */
+	if (!profile_started)
+		exit(1);
+
+	if (wait4(pid,&child_status,WNOHANG,&child_rusage)>0) {
+		gettimeofday(&end_time, NULL);
+		child_finished=1;
+	}
+}
+
+/* Request a dump of the flight recorder (the dump is triggered from the main loop) */
+void sigusr1_handler(int signo)
+{
+	flight_dump_requested=1;
+}
+
+/* Request a switch to the alternate PMC configuration (the switch is done from the main loop) */
+void sigusr2_handler(int signo)
+{
+	reconfig_requested=1;
+}
+
+void sigint_handler(int signo)
+{
+	if (kill(pid,SIGTERM))
+		fprintf(stderr,"Could not send signal %d to PID %d\n",signo,pid);
+
+	/* Finish immediately */
+	stop_profiling=1;
+	fprintf(stderr,"Received signal %d\n", signo);
+	if (signo==SIGPIPE) {
+		sigchld_handler(signo);
+		exit(1);
+	}
+}
+
+
+/* Give a default value for the various fields ... */
+void init_options( struct options* opts)
+{
+	unsigned int i;
+
+	opts->msecs = 1000;
+	opts->virtcfg = NULL;
+	opts->nr_virtual_counters=opts->virtual_mask=0;
+
+	for (i = 0; i<MAX_RAW_COUNTER_CONFIGS_SAFE; ++i)
+		opts->strcfg[i] = NULL;
+
+	for (i = 0; i<MAX_COUNTER_CONFIGS; ++i)
+		opts->user_cfg_str[i]=opts->alt_user_cfg_str[i]=NULL;
+
+	for (i = 0; i<MAX_RAW_COUNTER_CONFIGS_SAFE; ++i)
+		opts->alt_strcfg[i] = NULL;
+
+	opts->alt_nr_configs=0;
+	opts->nr_experiments=opts->alt_nr_experiments=0;
+	opts->alt_pmcmask=0;
+	memset(opts->alt_event_mapping,0,sizeof(counter_mapping_t)*MAX_PERFORMANCE_COUNTERS);
+
+	opts->cpuset = NULL;
+	opts->syswide_cpuset = NULL;
+	opts->syswide_aggr = NULL;
+	opts->nr_cgroups = 0;
+	opts->max_samples = -1;
+	opts->flags=0;
+	opts->target_pid=-1;
+	opts->nr_targets=0;
+	opts->kernel_buffer_size = -1;
+	opts->user_nr_configs=0;
+	opts->pmu_id=0;
+	memset(opts->event_mapping,0,sizeof(counter_mapping_t)*MAX_PERFORMANCE_COUNTERS);
+	opts->global_pmcmask=0;
+	opts->timeout_secs=-1; /* Disabled for now */
+	opts->batch_file=NULL;
+	opts->nr_batch_lanes=0;
+	opts->sweep_runs=0;
+	opts->flight_secs=0;
+	opts->sample_filter=NULL;
+}
+
+
+/* Insert the argument for an instance of the "-c" switch in a vector */
+int add_cfg_string_to_options(char* usercfg, struct options* opts)
+{
+	char* cpstring;
+
+	if (opts->user_nr_configs>=MAX_COUNTER_CONFIGS) {
+		warnx("Sorry! cannot accept more PMC configuration strings");
+		return 1;
+	}
+
+	/* Copy string as is */
+	cpstring=malloc(strlen(usercfg)+1);
+	/* Copy config */
+	strcpy(cpstring,usercfg);
+	opts->user_cfg_str[opts->user_nr_configs]=cpstring;
+	opts->user_nr_configs++;
+
+	return 0;
+}
+
+/* Add a string to the alternate PMC configuration (-X switch) */
+int add_alt_cfg_string_to_options(char* usercfg, struct options* opts)
+{
+	if (opts->alt_nr_configs>=MAX_COUNTER_CONFIGS) {
+		warnx("Sorry! cannot accept more alternate PMC configuration strings");
+		return 1;
+	}
+
+	if ((opts->alt_user_cfg_str[opts->alt_nr_configs]=strdup(usercfg))==NULL) {
+		warnx("Can't allocate memory for the alternate PMC configuration");
+		return 1;
+	}
+
+	opts->alt_nr_configs++;
+	return 0;
+}
+
+/* Register the CPU set for a new lane in batch mode (-j switch) */
+int add_batch_lane(char* str, struct options* opts)
+{
+	pmct_cpuset_t* cpus;
+	int i;
+
+	if (opts->nr_batch_lanes>=MAX_BATCH_LANES) {
+		warnx("Sorry! cannot accept more CPU sets for batch mode");
+		return 1;
+	}
+
+	if ((cpus=pmct_parse_cpuset(str))==NULL)
+		return 1;
+
+	for (i=0; i<opts->nr_batch_lanes; i++) {
+		if (pmct_cpuset_intersects(opts->batch_cpusets[i],cpus)) {
+			warnx("CPU sets for batch mode must be disjoint");
+			pmct_free_cpuset(cpus);
+			return 1;
+		}
+	}
+
+	opts->batch_cpusets[opts->nr_batch_lanes++]=cpus;
+	return 0;
+}
+
+/* Wrapper for pmct_parse_pmc_configuration() */
+int parse_pmc_configuration(struct options* opts)
+{
+	unsigned int nr_experiments;
+	unsigned int npmcs,pmcmask,ebs,alt_ebs;
+	int ret;
+
+	ret=pmct_parse_pmc_configuration((const char**)opts->user_cfg_str,
+	                                 (opts->flags & CMD_FLAG_RAW_PMC_FORMAT),
+	                                 opts->pmu_id,
+	                                 opts->strcfg,
+	                                 &opts->nr_experiments,
+	                                 &opts->global_pmcmask,
+	                                 opts->event_mapping);
+
+	if (ret || !opts->alt_nr_configs)
+		return ret;
+
+	/* Alternate configuration (-X switch) */
+	if ((ret=pmct_parse_pmc_configuration((const char**)opts->alt_user_cfg_str,
+	                                      (opts->flags & CMD_FLAG_RAW_PMC_FORMAT),
+	                                      opts->pmu_id,
+	                                      opts->alt_strcfg,
+	                                      &opts->alt_nr_experiments,
+	                                      &opts->alt_pmcmask,
+	                                      opts->alt_event_mapping)))
+		return ret;
+
+	if (pmct_check_counter_config((const char**)opts->strcfg,&npmcs,&pmcmask,&ebs,&nr_experiments) ||
+	    pmct_check_counter_config((const char**)opts->alt_strcfg,&npmcs,&pmcmask,&alt_ebs,&nr_experiments))
+		return 1;
+
+	/* The kernel cannot switch from TBS to EBS (or vice versa) in the middle of a session */
+	if (ebs!=alt_ebs) {
+		warnx("The alternate PMC configuration (-X) must use the same sampling mode (EBS or TBS) as the -c one");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Switch to the alternate PMC configuration (-X switch) without
+ * stopping the session. The alternate configuration becomes the
+ * current one, so that subsequent switches toggle between both.
+ */
+static int switch_pmc_configuration(struct options* opts)
+{
+	char* strcfg[MAX_RAW_COUNTER_CONFIGS_SAFE];
+	counter_mapping_t event_mapping[MAX_PERFORMANCE_COUNTERS];
+	unsigned int pmcmask,nr_experiments;
+
+	if (pmct_reconfig_counters((const char**)opts->alt_strcfg))
+		return 1;
+
+	memcpy(strcfg,opts->strcfg,sizeof(strcfg));
+	memcpy(opts->strcfg,opts->alt_strcfg,sizeof(strcfg));
+	memcpy(opts->alt_strcfg,strcfg,sizeof(strcfg));
+
+	memcpy(event_mapping,opts->event_mapping,sizeof(event_mapping));
+	memcpy(opts->event_mapping,opts->alt_event_mapping,sizeof(event_mapping));
+	memcpy(opts->alt_event_mapping,event_mapping,sizeof(event_mapping));
+
+	pmcmask=opts->global_pmcmask;
+	opts->global_pmcmask=opts->alt_pmcmask;
+	opts->alt_pmcmask=pmcmask;
+
+	nr_experiments=opts->alt_nr_experiments;
+	opts->alt_nr_experiments=opts->nr_experiments;
+	opts->nr_experiments=nr_experiments;
+
+	fprintf(stderr,"Switched to a new PMC configuration (samples gathered with it carry a new config epoch)\n");
+
+	if (!(opts->flags & (CMD_FLAG_LEGACY_OUTPUT|CMD_FLAG_RAW_PMC_FORMAT))) {
+		fprintf(stderr,"[Event-to-counter mappings]\n");
+		pmct_print_counter_mappings(stderr,opts->event_mapping,opts->global_pmcmask,opts->nr_experiments);
+	}
+
+	return 0;
+}
+
+
+/* Wrapper for pmct_parse_vcounter_config() */
+int set_vcount_string_in_options (char* user_vcount_string, struct options* opts)
+{
+
+	int mnemonics_used=0;
+
+	if ( pmct_parse_vcounter_config(user_vcount_string,
+	                                &opts->virtual_mask,
+	                                &opts->nr_virtual_counters,
+	                                &mnemonics_used,
+	                                &opts->virtcfg))
+		return 1;
+
+	if (mnemonics_used)
+		opts->flags |= CMD_FLAG_VIRT_COUNTER_MNEMONICS;
+
+	return 0;
+}
+
+/* Free up allocated memory for the various fields of struct options */
+void free_options (struct options* opts)
+{
+	unsigned int i = 0;
+	/* Free cfg string buffer */
+	while (opts->strcfg[i]) {
+		free(opts->strcfg[i]);
+		++i;
+	}
+
+	i=0;
+	while (opts->user_cfg_str[i]) {
+		free(opts->user_cfg_str[i]);
+		++i;
+	}
+
+	for (i=0; opts->alt_strcfg[i]; i++)
+		free(opts->alt_strcfg[i]);
+
+	for (i=0; opts->alt_user_cfg_str[i]; i++)
+		free(opts->alt_user_cfg_str[i]);
+
 	if (opts->virtcfg)
 		free(opts->virtcfg);
+
+	pmct_free_cpuset(opts->cpuset);
+	pmct_free_cpuset(opts->syswide_cpuset);
+	for (i=0; i<opts->nr_batch_lanes; i++)
+		pmct_free_cpuset(opts->batch_cpusets[i]);
+}
+
+/* Add a process to the list of targets (duplicates are ignored) */
+static int add_target(struct options* opts, pid_t pid)
+{
+	int i;
+
+	for (i=0; i<opts->nr_targets; i++)
+		if (opts->target_pids[i]==pid)
+			return 0;
+
+	if (opts->nr_targets>=MAX_TARGETS) {
+		warnx("Sorry! cannot attach to more than %d processes",MAX_TARGETS);
+		return 1;
+	}
+
+	opts->target_pids[opts->nr_targets++]=pid;
+	return 0;
+}
+
+/*
+ * Add the processes whose command name (/proc/<pid>/comm) matches
+ * a shell wildcard pattern to the list of targets.
+ * Returns the number of matching processes, or -1 on error.
+ */
+static int add_targets_by_comm(struct options* opts, const char* pattern)
+{
+	DIR* dir;
+	struct dirent* entry;
+	char path[64];
+	char comm[64];
+	FILE* fcomm;
+	pid_t cur;
+	int nr_matches=0;
+
+	if ((dir=opendir("/proc"))==NULL) {
+		warnx("Can't open /proc");
+		return -1;
+	}
+
+	while ((entry=readdir(dir))!=NULL) {
+		if (!isdigit(entry->d_name[0]))
+			continue;
+
+		cur=atoi(entry->d_name);
+
+		/* Do not attach to ourselves */
+		if (cur==getpid())
+			continue;
+
+		sprintf(path,"/proc/%d/comm",cur);
+
+		/* The process may have exited in the meantime */
+		if ((fcomm=fopen(path,"r"))==NULL)
+			continue;
+
+		if (fgets(comm,sizeof(comm),fcomm)) {
+			comm[strcspn(comm,"\n")]='\0';
+
+			if (fnmatch(pattern,comm,0)==0) {
+				if (add_target(opts,cur)) {
+					fclose(fcomm);
+					closedir(dir);
+					return -1;
+				}
+				printf("Process %d (%s) matches %s\n",cur,comm,pattern);
+				nr_matches++;
+			}
+		}
+		fclose(fcomm);
+	}
+
+	closedir(dir);
+	return nr_matches;
+}
+
+/*
+ * Parse the argument of the -p option: a comma-separated list
+ * of PIDs and/or patterns on the command name (e.g., 1234,java,nginx*).
+ * The index of each process in the list is used as its target id.
+ * The function returns a non-zero value on error.
+ */
+static int parse_target_list(struct options* opts, const char* str)
+{
+	char* copy=strdup(str);
+	char* item;
+	char* saveptr=NULL;
+	int retval=0;
+	int nr_matches;
+
+	if (!copy)
+		return 1;
+
+	for (item=strtok_r(copy,",",&saveptr); item && !retval; item=strtok_r(NULL,",",&saveptr)) {
+		if (item[strspn(item,"0123456789")]=='\0') {
+			retval=add_target(opts,atoi(item));
+		} else if ((nr_matches=add_targets_by_comm(opts,item))<=0) {
+			if (nr_matches==0)
+				warnx("No process matches %s",item);
+			retval=1;
+		}
+	}
+
+	if (!retval && opts->nr_targets==0) {
+		warnx("No process to attach to");
+		retval=1;
+	}
+
+	free(copy);
+	return retval;
 }
 
 int check_options(struct options* opts,char *argv[],int optind)
@@ -1211,7 +2717,10 @@ int check_options(struct options* opts,char *argv[],int optind)
 	if (opts->target_pid!=-1 && argv[optind]) {
 		warnx("Attach mode enabled but command specified in the command line\n");
 		return 1;
-	} else if (opts->target_pid==-1 && !argv[optind]) {
+	} else if (opts->batch_file && argv[optind]) {
+		warnx("Batch mode enabled but command specified in the command line\n");
+		return 1;
+	} else if (opts->target_pid==-1 && !opts->batch_file && !argv[optind]) {
 		warnx("Command to launch not provided\n");
 		return 2;
 	} else if ( (opts->flags & CMD_FLAG_SYSTEM_WIDE_MODE) && opts->target_pid!=-1 ) {
@@ -1220,6 +2729,36 @@ int check_options(struct options* opts,char *argv[],int optind)
 	} else if ( (opts->flags & CMD_FLAG_SHOW_CHILD_TIMES) && opts->target_pid!=-1 ) {
 		warnx("Attach mode (-p) not compatible with -t option\n");
 		return 4;
+	} else if ( opts->batch_file && (opts->target_pid!=-1 || (opts->flags & CMD_FLAG_SYSTEM_WIDE_MODE)) ) {
+		warnx("Batch mode (-F) not compatible with -p or -S options\n");
+		return 5;
+	} else if ( opts->nr_batch_lanes && !opts->batch_file && !opts->sweep_runs ) {
+		warnx("The -j option can only be used in batch (-F) or multi-run (-m) modes\n");
+		return 6;
+	} else if ( opts->sweep_runs && (opts->batch_file || opts->target_pid!=-1 || (opts->flags & CMD_FLAG_SYSTEM_WIDE_MODE)) ) {
+		warnx("Multi-run mode (-m) not compatible with -F, -p or -S options\n");
+		return 7;
+	} else if ( opts->syswide_aggr && !(opts->flags & CMD_FLAG_SYSTEM_WIDE_MODE) ) {
+		warnx("The -a option can only be used in system-wide mode (-S)\n");
+		return 8;
+	} else if ( opts->nr_cgroups && (opts->syswide_aggr || opts->virtcfg) ) {
+		warnx("Cgroup-scoped mode (-G) not compatible with -a or -V options\n");
+		return 9;
+	} else if ( opts->flight_secs && (opts->batch_file || opts->sweep_runs) ) {
+		warnx("Flight-recorder mode (-R) not compatible with -F or -m options\n");
+		return 10;
+	} else if ( opts->sample_filter && (opts->batch_file || opts->sweep_runs) ) {
+		warnx("Sample filters (-f) not compatible with -F or -m options\n");
+		return 11;
+	} else if ( fbin && (opts->batch_file || opts->sweep_runs) ) {
+		warnx("Binary output (-w) not compatible with -F or -m options\n");
+		return 12;
+	} else if ( opts->alt_nr_configs && (opts->batch_file || opts->sweep_runs || (opts->flags & CMD_FLAG_ACUM_SAMPLES)) ) {
+		warnx("Alternate PMC configurations (-X) not compatible with -F, -m or -A options\n");
+		return 13;
+	} else if ( opts->alt_nr_configs && !opts->user_nr_configs ) {
+		warnx("The -X option requires a PMC configuration (-c)\n");
+		return 14;
 	}
 	return 0;
 }
@@ -1234,21 +2773,32 @@ static void usage(const char* program_name,int status)
 		printf ("\n\t-c\t<config-string>\n\t\tset up a performance monitoring experiment using either raw or mnemonic-based PMC string");
 		printf ("\n\t-o\t<output>\n\t\toutput: set output file for the results. (default = stdout.)");
 		printf ("\n\t-T\t<Time>\n\t\tTime: elapsed time in seconds between two consecutive counter samplings. (default = 1 sec.)");
-		printf ("\n\t-b\t<cpu or mask>\n\t\tbind launched program to the specified cpu o cpumask.");
+		printf ("\n\t-b\t<cpus>\n\t\tbind launched program to the specified cpu, cpu list (e.g. 0-15,64-79) or hex cpumask.");
 		printf ("\n\t-n\t<max-samples>\n\t\tRun command until a given number of samples are collected");
 		printf ("\n\t-N\t<secs>\n\t\tRun command for secs seconds only");
 		printf ("\n\t-e\n\t\tEnable extended output");
 		printf ("\n\t-E\n\t\tShow additional column with elapsed time between samples");	
+		printf ("\n\t-M\n\t\tShow additional column with the absolute timestamp of samples (CLOCK_MONOTONIC, in ns)");
 		printf ("\n\t-A\n\t\tEnable aggregate count mode");
 		printf ("\n\t-k\t<kernel_buffer_size>\n\t\tSpecify the size of the kernel buffer used for the PMC samples");
-		printf ("\n\t-b\t<cpu or mask>\n\t\tbind monitor program to the specified cpu o cpumask.");
+		printf ("\n\t-B\t<cpus>\n\t\tbind monitor program to the specified cpu, cpu list or hex cpumask.");
 		printf ("\n\t-S\n\t\tEnable system-wide monitoring mode (per-CPU)");
+		printf ("\n\t-C\t<cpus>\n\t\tSystem-wide mode restricted to the specified cpu list or hex cpumask (implies -S)");
+		printf ("\n\t-G\t<cgroup>\n\t\tCgroup-scoped mode: count events of the tasks in a cgroup v2 path, aggregated per cgroup (can be used several times, implies -S)");
+		printf ("\n\t-a\t<level>\n\t\tSystem-wide mode: aggregate per-CPU counts in the kernel (level: cpu, core, llc, socket or node)");
 		printf ("\n\t-r\t\n\t\tAccept pmc configuration strings in the RAW format");
 		printf ("\n\t-P\t<pmu>\n\t\tSpecify the PMU id to use for the event configuration");
 		printf ("\n\t-L\n\t\tLegacy-mode: do not show counter-to-event mapping");
 		printf ("\n\t-t\n\t\tShow real, user and sys time of child process");
 		printf ("\n\t-st\n\t\tDisplay real time in seconds (when -t option is enabled)");		
-		printf ("\n\t-p\t<pid>\n\t\tAttach to existing process with given pid");
+		printf ("\n\t-p\t<pids>\n\t\tAttach to existing processes (comma-separated list of PIDs and/or command-name patterns, such as 1234,nginx*)");
+		printf ("\n\t-F\t<file>\n\t\tBatch mode: run the jobs listed in file (one '[event-sets |] command' per line)");
+		printf ("\n\t-j\t<cpus>\n\t\tBatch/multi-run modes: run jobs concurrently on the specified cpu, cpu list or hex cpumask (can be used several times)");
+		printf ("\n\t-m\t<runs>\n\t\tMulti-run mode: run the program <runs> times per event set instead of multiplexing event sets");
+		printf ("\n\t-f\t<filter>\n\t\tEmit only the samples that pass a filter evaluated in the kernel (e.g., \"pmc2/pmc0*1000>5 cpus=0-3\")");
+		printf ("\n\t-w\t<file>\n\t\tWrite the samples to a binary stream rather than as text (\"-\" stands for stdout), to be processed with pmc-metric");
+		printf ("\n\t-R\t<secs>\n\t\tFlight-recorder mode: keep the samples of the last <secs> seconds in the kernel and print them only when pmctrack receives SIGUSR1 (or upon \"flight_dump\" writes to /proc/pmc/enable)");
+		printf ("\n\t-X\t<config>\n\t\tAlternate PMC configuration (can be used several times): pmctrack switches between the -c and -X event sets without stopping the session every time it receives SIGUSR2");
 		printf ("\nPROG + ARGS:\n\t\tCommand line for the program to be monitored.\n");
 		break;
 	case -2:
@@ -1278,7 +2828,7 @@ int main(int argc, char *argv[])
 		usage(argv[0],0);
 
 	/* Process command-line options ... */
-	while ((optc = getopt(argc, argv, "+hc:T:o:b:n:V:B:eAk:SrP:LtN:p:sE")) != (char)-1) {
+	while ((optc = getopt(argc, argv, "+hc:T:o:b:n:V:B:eAk:SC:a:G:rP:LtN:p:sEF:j:m:R:f:w:X:M")) != (char)-1) {
 		switch (optc) {
 		case 'o':
 			if((fo = fopen(optarg, "w")) == NULL)
@@ -1299,11 +2849,16 @@ int main(int argc, char *argv[])
 			opts.msecs = (int)1000.0*atof(optarg);
 			break;
 		case 'b':
-			opts.cpumask=str_to_cpumask(optarg);
+			pmct_free_cpuset(opts.cpuset);
+			opts.cpuset=str_to_cpuset(optarg);
 			break;
 		case 'B':
-			bind_process_cpumask(getpid(),str_to_cpumask(optarg));
+		{
+			pmct_cpuset_t* cpus=str_to_cpuset(optarg);
+			bind_process_cpuset(getpid(),cpus);
+			pmct_free_cpuset(cpus);
 			break;
+		}
 		case 'n':
 			opts.max_samples=atoi(optarg);
 			break;
@@ -1320,6 +2875,22 @@ int main(int argc, char *argv[])
 		case 'S':
 			opts.flags|=CMD_FLAG_SYSTEM_WIDE_MODE;
 			break;
+		case 'C':
+			pmct_free_cpuset(opts.syswide_cpuset);
+			opts.syswide_cpuset=str_to_cpuset(optarg);
+			opts.flags|=CMD_FLAG_SYSTEM_WIDE_MODE;
+			break;
+		case 'a':
+			opts.syswide_aggr=optarg;
+			break;
+		case 'G':
+			if (opts.nr_cgroups>=PMC_MAX_CGROUPS) {
+				warnx("Sorry! cannot monitor more than %d cgroups",PMC_MAX_CGROUPS);
+				exit(1);
+			}
+			opts.cgroups[opts.nr_cgroups++]=optarg;
+			opts.flags|=CMD_FLAG_SYSTEM_WIDE_MODE;
+			break;
 		case 'r':
 			opts.flags|=CMD_FLAG_RAW_PMC_FORMAT;
 			break;
@@ -1336,7 +2907,9 @@ int main(int argc, char *argv[])
 			opts.timeout_secs=atoi(optarg);
 			break;
 		case 'p':
-			opts.target_pid=atoi(optarg);
+			if (parse_target_list(&opts,optarg))
+				exit(1);
+			opts.target_pid=opts.target_pids[0];
 			break;
 		case 's':
 			opts.flags|=CMD_FLAG_SHOW_TIME_SECS;
@@ -1344,6 +2917,41 @@ int main(int argc, char *argv[])
 		case 'E':
 			opts.flags|=CMD_FLAG_SHOW_ELAPSED_TIME;
 			break;			
+		case 'M':
+			opts.flags|=CMD_FLAG_SHOW_TIMESTAMP;
+			break;
+		case 'F':
+			opts.batch_file=optarg;
+			break;
+		case 'j':
+			if (add_batch_lane(optarg,&opts))
+				exit(1);
+			break;
+		case 'm':
+			if ((opts.sweep_runs=atoi(optarg))<=0) {
+				warnx("The number of runs must be greater than zero");
+				exit(1);
+			}
+			break;
+		case 'f':
+			opts.sample_filter=optarg;
+			break;
+		case 'w':
+			if (strcmp(optarg,"-")==0)
+				fbin=stdout;
+			else if ((fbin=fopen(optarg,"w"))==NULL)
+				err(1,"Can't open %s",optarg);
+			break;
+		case 'X':
+			if (add_alt_cfg_string_to_options(optarg,&opts))
+				exit(1);
+			break;
+		case 'R':
+			if ((opts.flight_secs=atoi(optarg))<=0) {
+				warnx("The time window of the flight recorder must be greater than zero");
+				exit(1);
+			}
+			break;
 		default:
 			fprintf(stderr, "Wrong option: %c\n", optc);
 			exit(1);
@@ -1361,18 +2969,27 @@ int main(int argc, char *argv[])
 		exit(1);
 
 
+	/* The text output cannot go along with the binary stream */
+	if (fbin==stdout && fo==stdout)
+		fo=stderr;
+
 	/* Get rid of stdio buffer */
 	setbuf(fo,NULL);
 
 	/* Invoke main monitoring function for the selected mode */
-	if (opts.flags & CMD_FLAG_SYSTEM_WIDE_MODE)
+	if (opts.batch_file)
+		monitoring_counters_batch(&opts);
+	else if (opts.sweep_runs)
+		monitoring_counters_sweep(&opts,optind,argv);
+	else if (opts.flags & CMD_FLAG_SYSTEM_WIDE_MODE)
 		monitoring_counters_syswide(&opts,optind,argv);
 	else if (opts.target_pid!=-1)
 		monitoring_counters_attach(&opts,optind,argv);
 	else
 		monitoring_counters(&opts,optind,argv);
 
-	if(fo != stdout) fclose(fo);
+	if(fo != stdout && fo != stderr) fclose(fo);
+	if(fbin && fbin != stdout) fclose(fbin);
 
 	free_options(&opts);
 
@@ -132,6 +132,18 @@ int pmctrack_stop_counters(pmctrack_desc_t* desc);
  */
 int pmctrack_start_counters_syswide(pmctrack_desc_t* desc);
 
+/*
+ * Start a monitoring session in system-wide mode on a subset of CPUs only.
+ * The remaining CPUs in the system are neither configured nor sampled.
+ *
+ * ==Parameters==
+ * desc: PMCTrack descriptor
+ * cpus: CPU list (e.g., "0-7,16") or CPU mask in hex format (e.g., "0xff")
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmctrack_start_counters_syswide_cpus(pmctrack_desc_t* desc, const char* cpus);
+
 /*
  * Stops a monitoring session in system-wide mode. This function also
  * retrieves PMC and virtual counter samples collected by the kernel.
@@ -162,6 +174,56 @@ void pmctrack_print_counts(pmctrack_desc_t* desc, FILE* outfile, int extended_ou
  */
 pmc_sample_t* pmctrack_get_samples(pmctrack_desc_t* desc,int* nr_samples);
 
+/*
+ * Retrieve the samples collected so far in an ongoing monitoring session
+ * (per-thread or system-wide) without stopping it. Samples are
+ * copied by the kernel straight into the "samples" array, which must be
+ * allocated by the program and have room for max_samples samples. The
+ * function blocks until some samples are available, and then retrieves
+ * them in bounded chunks until the array is full or no more samples
+ * are pending.
+ *
+ * The function returns the number of samples retrieved (zero if the session
+ * is over), and -1 upon failure.
+ */
+int pmctrack_read_samples(pmctrack_desc_t* desc, pmc_sample_t* samples, unsigned int max_samples);
+
+/*
+ * Merge several streams of samples into a single stream
+ * where samples appear in increasing timestamp order. Each stream
+ * (e.g., samples gathered for a thread or a CPU) must be sorted
+ * by timestamp already. The "timestamp" field of a sample
+ * holds absolute CLOCK_MONOTONIC time, so the resulting stream
+ * can be correlated with clock_gettime(CLOCK_MONOTONIC) readings
+ * taken by the application.
+ *
+ * ==Parameters==
+ * streams: Array of sample streams
+ * nr_samples: Number of samples in each stream
+ * nr_streams: Number of elements in the "streams" array
+ * dst: Array used to store the merged stream
+ * max_samples: Maximum capacity of the "dst" array
+ *
+ * The function returns the number of samples stored in "dst", and
+ * a negative value upon failure.
+ */
+int pmctrack_merge_samples(pmc_sample_t* streams[],
+                           unsigned int nr_samples[],
+                           unsigned int nr_streams,
+                           pmc_sample_t* dst,
+                           unsigned int max_samples);
+
+/*
+ * Retrieve the number of event sets (nr_experiments), the bitmask of
+ * performance counters used (pmcmask) and the virtual-counter mask (virtual_mask)
+ * of the current counter configuration. This makes it possible to interpret the
+ * samples regardless of the format used to configure the counters.
+ */
+void pmctrack_get_counter_config(pmctrack_desc_t* desc,
+                                 unsigned int* nr_experiments,
+                                 unsigned int* pmcmask,
+                                 unsigned int* virtual_mask);
+
 /*
  * Retrieve the event-to-PMC mapping information. The function should be used
  * only if pmctrack_config_counters_mnemonic() was used to configure performance
@@ -38,6 +38,12 @@
 #define MAX_CONFIG_STRING_SIZE 150
 #define MAX_RAW_COUNTER_CONFIGS_SAFE (2*MAX_COUNTER_CONFIGS)
 
+/*
+ * Max number of samples retrieved with a single read() on the monitor entry
+ * (keeps each request below the kernel's per-read limit)
+ */
+#define PMCT_READ_CHUNK_SAMPLES 512
+
 /* Various flag values for the "flags" field in struct pmctrack_desc */
 #define PMCT_FLAG_SHARED_REGION 0x1
 #define PMCT_FLAG_SYSWIDE 0x2
@@ -50,6 +56,10 @@
 #define PMCT_CONFIG_SYSWIDE 0x1
 #define PMCT_CONFIG_SELF 0x2
 
+/* Optional time columns for pmct_print_header() and pmct_print_sample() */
+#define PMCT_SHOW_ETIME 0x1
+#define PMCT_SHOW_TIMESTAMP 0x2
+
 /*
  * Structure to manage a performance
  * monitoring session with PMCTrack's kernel driver
@@ -66,6 +76,7 @@ struct pmctrack_desc {
 	unsigned int ebs_on;               /* Indicates if the Event-Based Sampling mode is enabled */
 	unsigned int nr_samples;           /* Number of items temporarily stored in the "samples" array */
 	unsigned int max_nr_samples;       /* Max capacity (# of samples) of the "samples" array */
+	unsigned int kern_sample_size;     /* Size of the samples delivered by the kernel (in bytes) */
 	counter_mapping_t event_mapping[MAX_PERFORMANCE_COUNTERS]; /* Structure storing the event-to-PMC mapping */
 	unsigned int global_pmcmask;       /* Overall PMC mask used (when using event mnemonics only) */
 	unsigned long flags;               /* Bitmask field (libpmctrack-specific flags) */
@@ -109,6 +120,60 @@ int pmct_check_vcounter_config(const char* virtcfg,unsigned int* nr_virtual_coun
  */
 int pmct_config_counters(const char* strcfg[], unsigned long flags);
 
+/*
+ * Replace the PMC events monitored by all the threads (or CPUs in system-wide mode)
+ * associated with the current monitor process, without stopping the session.
+ * Each thread or CPU switches to the new event sets at its next sample boundary.
+ * Samples gathered with the new configuration have a greater value in the
+ * config_epoch field.
+ *
+ * ==Parameters==
+ * strcfg: NULL-terminated array of string with counter configurations in the raw format
+ *      (e.g., {"pmc0,pmc1","pmc2=0xc0,pmc3=0x2e","NULL"})
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_reconfig_counters(const char* strcfg[]);
+
+/*
+ * Fill in a binary session configuration (cfg) to be applied
+ * with pmct_config_session().
+ *
+ * ==Parameters==
+ * strcfg: NULL-terminated array of string with counter configurations in the raw format
+ * virtcfg: virtual counter configuration string in the raw format (NULL if none)
+ * msecs: sampling period in ms (0 to keep the kernel default)
+ * kernel_buffer_size: size of the kernel buffer in bytes (0 to keep the kernel default)
+ * cfg_flags: PMC_CFG_* flags (syswide mode, self-monitoring, start counting, ...)
+ *
+ * All CPUs are monitored when system-wide monitoring is started with PMC_CFG_START,
+ * unless a CPU list (e.g., "0-7,16") is copied into cfg->cpu_list afterwards.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_build_session_config(pmc_session_config_t* cfg,
+                              const char* strcfg[],
+                              const char* virtcfg,
+                              unsigned int msecs,
+                              unsigned int kernel_buffer_size,
+                              unsigned int cfg_flags);
+
+/*
+ * Apply a session configuration built with pmct_build_session_config()
+ * in a single call to PMCTrack's kernel module. This replaces the sequence
+ * pmct_set_kernel_buffer_size(), pmct_config_counters(), pmct_config_timeout(),
+ * pmct_config_virtual_counters() and pmct_start_counting(). Upon return,
+ * cfg also holds the counter usage of the active monitoring module.
+ * The legacy text interface is used if the kernel module does not support it.
+ *
+ * ==Parameters==
+ * fd: descriptor of /proc/pmc/monitor (-1 to open the file temporarily)
+ * cfg: session configuration
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_config_session(int fd, pmc_session_config_t* cfg);
+
 /*
  * Tell PMCTrack's kernel module which virtual counters must be monitored.
  *
@@ -130,6 +195,79 @@ int pmct_config_virtual_counters(const char* virtcfg, unsigned long flags);
  */
 int pmct_config_timeout(int msecs, int kernel_control);
 
+/*
+ * Set the level at which the kernel aggregates per-CPU samples in
+ * system-wide mode: "cpu" (no aggregation), "core", "llc", "socket" or "node".
+ * Aggregated samples store the domain id in the "pid" field.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_config_syswide_aggregation(const char* level);
+
+/*
+ * Enable the flight-recorder mode: the kernel keeps only the samples
+ * gathered in the last window_ms milliseconds in an overwrite ring, and
+ * delivers nothing to the monitor process until a dump is triggered,
+ * either with pmct_flight_recorder_dump() or by writing "flight_dump"
+ * to /proc/pmc/enable (which triggers a dump for all monitors).
+ * If size_bytes>0, the capacity of the ring buffer is set to that value.
+ * The counters must be configured before invoking this function.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_config_flight_recorder(unsigned int window_ms, unsigned int size_bytes);
+
+/*
+ * Install a filter that the kernel evaluates on the samples before pushing them
+ * into the buffer of the monitor process, so that only interesting samples
+ * reach user space. The filter consists of space-separated conditions
+ * that must hold for a sample to be emitted:
+ *  - "cpus=<cpulist>": only samples gathered on these CPUs
+ *  - "<expr>><value>" or "<expr><<value>": <expr> can be an event (pmcN or virtN)
+ *    or a relation between two events, such as pmc2/pmc0*1000 (rate with a scale factor),
+ *    pmc0*pmc1, pmc0+pmc1 or pmc0-pmc1. Values are integers.
+ * For instance "pmc2/pmc0*1000>5" emits samples with more than 5 events counted by
+ * pmc2 per thousand events counted by pmc0. "none" removes the filter.
+ * The counters must be configured before invoking this function.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_config_sample_filter(const char* spec);
+
+/*
+ * Define a metric that PMCTrack's kernel module computes for every sample
+ * and exports as a virtual counter, which can be then selected by name
+ * like any other virtual counter. The specification has the "<name>=<expr>"
+ * format, where <expr> is a PMC (pmcN), a virtual counter (virtN) or a relation
+ * between two of them, as in pmct_config_sample_filter(). For instance,
+ * "ipc=pmc0/pmc1*1000" defines the IPC metric (x1000) for the default counter
+ * configuration on Intel processors. "<name>=none" removes the metric and
+ * "clear" removes all of them. Definitions are system-wide and persist
+ * until removed.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_define_metric(const char* spec);
+
+/*
+ * Trigger a dump of the samples kept in the kernel in flight-recorder mode.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_flight_recorder_dump(void);
+
+/*
+ * Add a cgroup to the set of cgroups to monitor in system-wide mode
+ * (cgroup-scoped mode). The path is relative to the root of the
+ * cgroup v2 hierarchy (e.g., "/system.slice/foo.service"), and "none"
+ * clears the set. Counts are aggregated per cgroup in the kernel, and
+ * samples store the index of the cgroup (in the order it was added)
+ * in the "pid" field.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_config_syswide_cgroup(const char* path);
+
 /*
  * Tell PMCTrack's kernel module to start a monitoring session in per-thread mode
  *
@@ -149,15 +287,16 @@ int pmct_start_counting( void );
  *                  events sets are monitored in the various cores of
  *                  an asymmetric multicore system
  * syswide: Use a non-zero value if the system-wide mode is enabled.
- * show_elapsed_time: Use a non-zero value to print additional column with the elapsed time
- * 					  relative to the previous sample
+ * time_columns: Bitmask of extra columns to print: PMCT_SHOW_ETIME (elapsed time
+ *               relative to the previous sample) and/or PMCT_SHOW_TIMESTAMP
+ *               (absolute CLOCK_MONOTONIC timestamp of the sample)
  */
 void pmct_print_header (FILE* fo, unsigned int nr_experiments,
                         unsigned int pmcmask,
                         unsigned int virtual_mask,
                         int extended_output,
                         int syswide,
-                        int show_elapsed_time);
+                        int time_columns);
 
 /*
  * Print a sample row in the "normalized" format for a table of
@@ -170,8 +309,8 @@ void pmct_print_header (FILE* fo, unsigned int nr_experiments,
  * extended_output: Use a non-zero value if nr_experiments>1 or different
  *                  events sets are monitored in the various cores of
  *                  an asymmetric multicore system
- * show_elapsed_time: Use a non-zero value to print additional column with the elapsed time
- * 					  relative to the previous sample 
+ * time_columns: Bitmask of extra columns to print (PMCT_SHOW_ETIME
+ *               and/or PMCT_SHOW_TIMESTAMP)
  * nsample: Number of sample to be included in the row
  * sample: Actual sample with PMC and virtual-counter data
  *
@@ -180,7 +319,7 @@ void pmct_print_sample (FILE* fo, unsigned int nr_experiments,
                         unsigned int pmcmask,
                         unsigned int virtual_mask,
                         unsigned int extended_output,
-                        unsigned int show_elapsed_time,
+                        unsigned int time_columns,
                         int nsample,
                         pmc_sample_t* sample);
 
@@ -206,6 +345,100 @@ void pmct_accumulate_sample (unsigned int nr_experiments,
                              pmc_sample_t* sample,
                              pmc_sample_t* accum);
 
+/*
+ * Binary streams of samples: a pmct_stream_header_t structure followed
+ * by raw pmc_sample_t structures, truncated after the last virtual count
+ * in use. Streams are much cheaper to produce and
+ * consume than the text output (e.g., with the pmc-metric command).
+ */
+#define PMCT_STREAM_MAGIC "\x89PMCTRK\n"
+#define PMCT_STREAM_VERSION 1
+#define PMCT_STREAM_SYSWIDE 0x1		/* The pid field of samples holds a CPU number */
+#define PMCT_STREAM_MULTI_TARGET 0x2	/* The target_id field of samples is meaningful */
+#define PMCT_STREAM_EXTENDED 0x4	/* Extended output was requested (coretype and expid) */
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t sample_size;		/* Size of every sample in the stream (see pmc_sample_size()) */
+	uint32_t nr_experiments;
+	uint32_t pmcmask;
+	uint32_t virtual_mask;
+	uint32_t flags;
+} pmct_stream_header_t;
+
+/*
+ * Write the header of a binary stream of samples. Samples are written
+ * next with pmct_write_stream_samples().
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_write_stream_header(FILE* fo, unsigned int nr_experiments,
+                             unsigned int pmcmask,
+                             unsigned int virtual_mask,
+                             unsigned int flags);
+
+/*
+ * Append samples to a binary stream. Only the virtual counts of the
+ * counters in virtual_mask (the one passed to pmct_write_stream_header()) are written.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_write_stream_samples(FILE* fo, unsigned int virtual_mask, pmc_sample_t* samples, unsigned int nr_samples);
+
+/*
+ * Read and validate the header of a binary stream of samples.
+ *
+ * The function returns 0 on success, and a non-zero value if the
+ * stream is not valid or was generated on an incompatible system.
+ */
+int pmct_read_stream_header(FILE* fi, pmct_stream_header_t* header);
+
+/*
+ * Read up to max_samples samples from a binary stream whose header
+ * was read with pmct_read_stream_header().
+ *
+ * The function returns the number of samples read (0 at the end of the stream).
+ */
+int pmct_read_stream_samples(FILE* fi, pmct_stream_header_t* header, pmc_sample_t* samples, unsigned int max_samples);
+
+/* Name of a sample type (as shown in the "event" column of the output) */
+const char* pmct_sample_type_str(int type);
+
+/* Compiled metric expression (see metric.c) */
+typedef struct pmct_metric_prog pmct_metric_prog_t;
+
+/*
+ * Compile a metric expression made up of numeric constants, variables,
+ * parentheses and the +, -, * and / operators (e.g., "pmc0/pmc1" or
+ * "(pmc2+pmc3)*1000/pmc0"). Variable names are resolved into indexes
+ * of the "vars" array: the index of a variable is the position of its
+ * column when evaluating the expression with pmct_metric_eval().
+ *
+ * The function returns NULL if the expression is not valid.
+ */
+pmct_metric_prog_t* pmct_metric_compile(const char* expr, const char* const* vars, int nr_vars);
+
+/* Free up a compiled metric expression */
+void pmct_metric_free(pmct_metric_prog_t* prog);
+
+/* Number of different variables referenced in a compiled metric expression */
+unsigned int pmct_metric_nr_refs(pmct_metric_prog_t* prog);
+
+/*
+ * Evaluate a compiled metric expression for a batch of n rows.
+ *
+ * ==Parameters==
+ * prog: Compiled expression
+ * columns: Array with one column of n values per variable
+ * out: Array where the n results are stored
+ * n: Number of rows in the batch
+ *
+ * Divisions by zero yield zero. The function returns 0 on success,
+ * and a non-zero value upon failure.
+ */
+int pmct_metric_eval(pmct_metric_prog_t* prog, double* const* columns, double* out, unsigned int n);
+
 /*
  * Become the monitor process of another process with PID=pid.
  * Upon invocation to this function the monitor process will
@@ -213,18 +446,38 @@ void pmct_accumulate_sample (unsigned int nr_experiments,
  * using a special file exported by PMCTrack's kernel module
  *
  * If config_pmcs !=0, the attached process will inherit PMC and
- * virtual counter configuration from the parent process
+ * virtual counter configuration from the parent process, and its
+ * samples will be tagged with target_id (ignored otherwise).
  *
  * The function returns 0 on success, and a non-zero value upon failure.
  *
  */
-int pmct_attach_process (pid_t pid, int config_pmcs);
+int pmct_attach_process (pid_t pid, int config_pmcs, int target_id);
 
 /*
  * Detach process from monitor
  */
 int pmct_detach_process (pid_t pid);
 
+/*
+ * Attach all the threads of the process with PID=pid to the monitor
+ * process with a single request to the kernel. Threads created by the
+ * process while the operation is in progress are attached as well, and
+ * threads created afterwards inherit monitoring from their creator.
+ * Samples collected for these threads are tagged with target_id (see
+ * the target_id field in pmc_sample_t), which makes it possible to track
+ * several processes with the same monitor process.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure
+ * (e.g., if the kernel module does not support this operation).
+ */
+int pmct_attach_thread_group (pid_t pid, int target_id);
+
+/*
+ * Detach all the threads of the process with PID=pid from the monitor
+ */
+int pmct_detach_thread_group (pid_t pid);
+
 
 /*
  * Obtain a file descriptor of the special file exported by
@@ -236,6 +489,16 @@ int pmct_detach_process (pid_t pid);
  */
 int pmct_open_monitor_entry(void);
 
+/*
+ * Retrieve the size of the samples that the kernel delivers through fd
+ * (the kernel may store only the virtual counts in use for every sample).
+ * The size is fixed once the session has been configured, so it should
+ * be queried only once per session.
+ *
+ * The function returns 0 on success, and -1 upon failure.
+ */
+int pmct_kernel_sample_size(int fd, unsigned int* sample_size);
+
 /*
  * Retrieve performance samples from the special file exported by
  * PMCTrack's kernel module
@@ -244,11 +507,13 @@ int pmct_open_monitor_entry(void);
  * fd: File descriptor obtained with pmct_open_monitor_entry()
  * samples: Array used to store the retrieved samples
  * max_samples: Maximum capacity of the "samples" array
+ * sample_size: Size of the samples delivered by the kernel, as
+ *              returned by pmct_kernel_sample_size()
  *
- * The function returns 0 on success, and a non-zero value upon failure.
+ * The function returns the number of samples retrieved, and -1 upon failure.
  *
  */
-int pmct_read_samples (int fd, pmc_sample_t* samples, int max_samples);
+int pmct_read_samples (int fd, pmc_sample_t* samples, int max_samples, unsigned int sample_size);
 
 /*
  * Request a memory region shared between kernel and user space to
@@ -274,9 +539,12 @@ int pmct_set_kernel_buffer_size(unsigned int nr_bytes);
 /*
  * Tell PMCTrack's kernel module to start a monitoring session in system-wide mode
  *
+ * ==Parameters==
+ * cpulist: CPU list or hex mask with the CPUs to monitor (NULL means all CPUs)
+ *
  * The function returns 0 on success, and a non-zero value upon failure.
  */
-int pmct_syswide_start_counting( void );
+int pmct_syswide_start_counting(const char* cpulist);
 
 /* PMCTrack PMU_INFO structures plus event mnemonic translation engine */
 
@@ -447,6 +715,12 @@ int pmct_get_nr_virtual_counters_supported(void);
  */
 virtual_counter_info_t* pmct_get_virtual_counter_info(void);
 
+/*
+ * Read the list of virtual counters again from the kernel
+ * (e.g., after defining a metric with pmct_define_metric())
+ */
+void pmct_reload_virtual_counter_info(void);
+
 /*
  * Print a listing of the virtual counters supported by
  * the current active monitoring module
@@ -481,4 +755,54 @@ int pmct_parse_vcounter_config(const char* virtcfg,
                                unsigned int* nr_virtual_counters,
                                int* mnemonics_used,
                                char** raw_virtcfg);
+
+/* Dynamically-sized set of CPUs (see cpuset.c) */
+typedef struct pmct_cpuset pmct_cpuset_t;
+
+/*
+ * Allocate an empty CPU set that can hold at least nr_cpus CPUs
+ * (or all the CPUs configured in the system, whatever is greater).
+ *
+ * The function returns NULL upon failure.
+ */
+pmct_cpuset_t* pmct_alloc_cpuset(unsigned int nr_cpus);
+
+/* Free up a CPU set */
+void pmct_free_cpuset(pmct_cpuset_t* cpus);
+
+/*
+ * Build a CPU set from a string that contains either a CPU mask in hex
+ * format of arbitrary length (e.g., 0xff00) or a list of comma-separated
+ * CPU numbers and ranges (e.g., 0-15,64-79).
+ *
+ * The function returns NULL if the string has a wrong format.
+ */
+pmct_cpuset_t* pmct_parse_cpuset(const char* str);
+
+/* Returns a non-zero value if the cpu belongs to the set */
+int pmct_cpuset_isset(pmct_cpuset_t* cpus, unsigned int cpu);
+
+/* Number of CPUs in the set */
+unsigned int pmct_cpuset_count(pmct_cpuset_t* cpus);
+
+/* Max number of CPUs the set can hold (CPU ids go from 0 to that value minus one) */
+unsigned int pmct_cpuset_max_cpus(pmct_cpuset_t* cpus);
+
+/* Returns a non-zero value if both sets have CPUs in common */
+int pmct_cpuset_intersects(pmct_cpuset_t* a, pmct_cpuset_t* b);
+
+/*
+ * Print the CPU set in the CPU list format (e.g., 0-15,64-79) into buf.
+ *
+ * The function returns the number of characters written, or -1
+ * if the buffer is too small.
+ */
+int pmct_cpuset_to_str(pmct_cpuset_t* cpus, char* buf, size_t size);
+
+/*
+ * Bind a process to the CPUs in the set (wrapper for sched_setaffinity())
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_bind_process_cpuset(pid_t pid, pmct_cpuset_t* cpus);
 #endif
@@ -52,6 +52,8 @@
 #include <string.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <linux/types.h>
 #ifndef PAGE_SIZE
@@ -168,6 +170,24 @@ int pmct_check_counter_config(const char* userpmccfg[],unsigned int* nr_counters
 			$ cat /proc/pmc/properties
 			nr_pmcs=4
 		*/
+		pmc_session_config_t cfg;
+
+		/* A session config with no settings just reports the counter usage */
+		memset(&cfg,0,sizeof(pmc_session_config_t));
+
+		if ((fd=open(pmc_monitor_entry, O_RDWR))!=-1) {
+			if (ioctl(fd,PMCTRACK_IOC_CONFIG,&cfg)==0) {
+				(*counter_mask)=cfg.kern_pmcmask;
+				(*nr_counters)=cfg.kern_nr_pmcs;
+				(*ebs)=0;
+				(*nr_experiments)=cfg.kern_nr_experiments;
+				close(fd);
+				return 0;
+			}
+			close(fd);
+		}
+
+		/* Older kernel module: query properties one by one */
 		fd=open(pmc_props_entry, O_RDWR);
 		if(fd == -1) {
 			warnx("Error de apertura de %s\n",pmc_props_entry);
@@ -314,6 +334,178 @@ int pmct_config_timeout(int msecs, int kernel_control)
 	return 0;
 }
 
+/*
+ * Set the level at which the kernel aggregates per-CPU samples
+ * in system-wide mode ("cpu", "core", "llc", "socket" or "node")
+ */
+int pmct_config_syswide_aggregation(const char* level)
+{
+	int len=0;
+	char buf[MAX_CONFIG_STRING_SIZE];
+	int fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=snprintf(buf,sizeof(buf),"syswide_aggr %s\n",level);
+	len=write(fd,buf,len);
+	close(fd);
+
+	if(len <= 0) {
+		if (errno==EINVAL)
+			warnx("Invalid aggregation level: %s (valid levels: cpu, core, llc, socket or node)",level);
+		else
+			warnx("Write error in %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Enable the flight-recorder mode for the buffer of the monitor process.
+ * The kernel keeps the samples gathered in the last window_ms milliseconds
+ * (using a ring buffer of size_bytes bytes if size_bytes>0) and delivers
+ * nothing to the monitor until a dump is triggered.
+ */
+int pmct_config_flight_recorder(unsigned int window_ms, unsigned int size_bytes)
+{
+	int len=0;
+	char buf[MAX_CONFIG_STRING_SIZE];
+	int fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=snprintf(buf,sizeof(buf),"flight_recorder %u %u\n",window_ms,size_bytes);
+	len=write(fd,buf,len);
+	close(fd);
+
+	if(len <= 0) {
+		warnx("Can't enable the flight-recorder mode\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Install a filter that the kernel evaluates on every sample before
+ * pushing it into the buffer of the monitor process
+ */
+int pmct_config_sample_filter(const char* spec)
+{
+	int len=0;
+	char buf[MAX_CONFIG_STRING_SIZE];
+	int fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=snprintf(buf,sizeof(buf),"sample_filter %s\n",spec);
+	len=write(fd,buf,len);
+	close(fd);
+
+	if(len <= 0) {
+		warnx("Invalid sample filter: %s",spec);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Define a metric computed by the kernel for every sample,
+ * which is exported as a virtual counter
+ */
+int pmct_define_metric(const char* spec)
+{
+	int len=0;
+	char buf[MAX_CONFIG_STRING_SIZE];
+	int fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=snprintf(buf,sizeof(buf),"metric %s\n",spec);
+	len=write(fd,buf,len);
+	close(fd);
+
+	if(len <= 0) {
+		warnx("Invalid metric definition: %s",spec);
+		return -1;
+	}
+
+	/* The list of virtual counters has changed */
+	pmct_reload_virtual_counter_info();
+	return 0;
+}
+
+/*
+ * Trigger a dump of the samples kept by the kernel in flight-recorder mode.
+ * The samples can be then retrieved with pmct_read_samples().
+ */
+int pmct_flight_recorder_dump(void)
+{
+	const char* cmd="flight_dump";
+	int ret=0;
+	int fd = open(pmc_monitor_entry, O_WRONLY);
+
+	if(fd == -1) {
+		warnx("can't open %s\n",pmc_monitor_entry);
+		return -1;
+	}
+
+	if(write(fd, cmd, strlen(cmd)+1) < 0)
+		ret=-1;
+
+	close(fd);
+	return ret;
+}
+
+/*
+ * Add a cgroup (path relative to the root of the cgroup v2 hierarchy)
+ * to the set of cgroups to monitor in system-wide mode.
+ * "none" clears the set.
+ */
+int pmct_config_syswide_cgroup(const char* path)
+{
+	int len=0;
+	char buf[PATH_MAX+32];
+	int fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=snprintf(buf,sizeof(buf),"syswide_cgroup %s\n",path);
+
+	if (len>=sizeof(buf)) {
+		warnx("Cgroup path too long: %s",path);
+		close(fd);
+		return -1;
+	}
+
+	len=write(fd,buf,len);
+	close(fd);
+
+	if(len <= 0) {
+		warnx("Can't monitor cgroup %s: %s",path,strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  * Tell PMCTrack's kernel module which PMC events
  * must be monitored.
@@ -359,6 +551,179 @@ int pmct_config_counters(const char* strcfg[], unsigned long flags)
 	return 0;
 }
 
+/*
+ * Replace the PMC events monitored in the current session
+ * (hot reconfiguration). The new event sets take effect at the
+ * next sample boundary of each monitored thread or CPU.
+ */
+int pmct_reconfig_counters(const char* strcfg[])
+{
+	int len=0;
+	char* buf;
+	char* dst;
+	int i=0;
+	int fd;
+
+	if (!strcfg || !strcfg[0]) {
+		warnx("No PMC configuration was specified\n");
+		return -1;
+	}
+
+	buf=malloc(MAX_RAW_COUNTER_CONFIGS_SAFE*(MAX_CONFIG_STRING_SIZE+1)+10);
+
+	if (!buf) {
+		warnx("Can't allocate memory for the PMC configuration\n");
+		return -1;
+	}
+
+	/* Build a single command with all the experiments */
+	dst=buf;
+	dst+=sprintf(dst,"reconfig ");
+	for (i=0; strcfg[i]!=NULL && i<MAX_RAW_COUNTER_CONFIGS_SAFE; i++)
+		dst+=sprintf(dst,"%s%.*s",i?";":"",MAX_CONFIG_STRING_SIZE,strcfg[i]);
+
+	fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		free(buf);
+		return -1;
+	}
+
+	len=write(fd,buf,dst-buf);
+	close(fd);
+	free(buf);
+
+	if(len <= 0) {
+		warnx("Can't reconfigure counters\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Fill in a binary session configuration from the raw PMC and
+ * virtual-counter configuration strings and the remaining settings.
+ * A zero value for msecs or kernel_buffer_size preserves the kernel defaults.
+ */
+int pmct_build_session_config(pmc_session_config_t* cfg,
+                              const char* strcfg[],
+                              const char* virtcfg,
+                              unsigned int msecs,
+                              unsigned int kernel_buffer_size,
+                              unsigned int cfg_flags)
+{
+	int i=0;
+
+	memset(cfg,0,sizeof(pmc_session_config_t));
+
+	for (i=0; strcfg && strcfg[i]!=NULL; i++) {
+		if (i>=PMC_MAX_CONFIG_EXPERIMENTS) {
+			warnx("Too many event sets specified (max=%d)\n",PMC_MAX_CONFIG_EXPERIMENTS);
+			return -1;
+		}
+		if (strlen(strcfg[i])>=PMC_MAX_CONFIG_STRING_LEN) {
+			warnx("PMC configuration string too long: %s\n",strcfg[i]);
+			return -1;
+		}
+		strcpy(cfg->pmc_cfg[i],strcfg[i]);
+	}
+
+	cfg->nr_experiments=i;
+
+	if (virtcfg) {
+		if (strlen(virtcfg)>=PMC_MAX_CONFIG_STRING_LEN) {
+			warnx("Virtual-counter configuration string too long: %s\n",virtcfg);
+			return -1;
+		}
+		strcpy(cfg->virt_cfg,virtcfg);
+	}
+
+	/* Only the virtual counts in use are stored for every sample */
+	cfg->flags=cfg_flags|PMC_CFG_COMPACT_SAMPLES;
+	cfg->timeout_ms=msecs;
+	cfg->kernel_buffer_size=kernel_buffer_size;
+	return 0;
+}
+
+/*
+ * Fallback for pmct_config_session() when the kernel module
+ * does not support the PMCTRACK_IOC_CONFIG ioctl():
+ * apply the settings one by one via /proc/pmc/config
+ */
+static int pmct_config_session_legacy(pmc_session_config_t* cfg)
+{
+	const char* strcfg[PMC_MAX_CONFIG_EXPERIMENTS+1];
+	unsigned long flags=(cfg->flags & PMC_CFG_SYSWIDE)?PMCT_CONFIG_SYSWIDE:0;
+	unsigned int ebs;
+	int i;
+
+	if (cfg->kernel_buffer_size && pmct_set_kernel_buffer_size(cfg->kernel_buffer_size))
+		return -1;
+
+	for (i=0; i<cfg->nr_experiments && i<PMC_MAX_CONFIG_EXPERIMENTS; i++)
+		strcfg[i]=cfg->pmc_cfg[i];
+	strcfg[i]=NULL;
+
+	if (cfg->flags & PMC_CFG_SELF_MONITORING)
+		flags|=PMCT_FLAG_SELF_MONITORING;
+
+	if ((strcfg[0] || (flags & PMCT_FLAG_SELF_MONITORING)) && pmct_config_counters(strcfg,flags))
+		return -1;
+
+	if (cfg->timeout_ms && pmct_config_timeout(cfg->timeout_ms,cfg->flags & PMC_CFG_KERNEL_CONTROL))
+		return -1;
+
+	if (cfg->virt_cfg[0] && pmct_config_virtual_counters(cfg->virt_cfg,flags & PMCT_CONFIG_SYSWIDE))
+		return -1;
+
+	if (cfg->flags & PMC_CFG_START) {
+		if ((cfg->flags & PMC_CFG_SYSWIDE) &&
+		    pmct_syswide_start_counting(cfg->cpu_list[0]?cfg->cpu_list:NULL))
+			return -1;
+		else if (!(cfg->flags & PMC_CFG_SYSWIDE) && pmct_start_counting())
+			return -1;
+	}
+
+	/* Samples are always delivered in full */
+	cfg->kern_sample_size=sizeof(pmc_sample_t);
+
+	return pmct_check_counter_config(NULL,&cfg->kern_nr_pmcs,&cfg->kern_pmcmask,
+	                                 &ebs,&cfg->kern_nr_experiments);
+}
+
+/*
+ * Apply a fully-resolved session configuration in a single
+ * ioctl() on /proc/pmc/monitor.
+ */
+int pmct_config_session(int fd, pmc_session_config_t* cfg)
+{
+	int ret;
+	int fd_monitor=fd;
+
+	if (fd_monitor<0 && (fd_monitor=open(pmc_monitor_entry, O_RDWR))<0) {
+		warnx("Can't open %s\n",pmc_monitor_entry);
+		return -1;
+	}
+
+	ret=ioctl(fd_monitor,PMCTRACK_IOC_CONFIG,cfg);
+
+	if (fd<0)
+		close(fd_monitor);
+
+	/* Older kernel module */
+	if (ret<0 && errno==ENOTTY)
+		return pmct_config_session_legacy(cfg);
+
+	if (ret<0) {
+		warnx("Can't configure monitoring session: %s\n",strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  * Tell PMCTrack's kernel module to start a monitoring session
  * in per-thread mode
@@ -380,20 +745,55 @@ int pmct_start_counting( void )
 	return 0;
 }
 
+/*
+ * Build the command that starts system-wide monitoring
+ * on the CPUs in cpulist (NULL means all CPUs)
+ */
+static int pmct_build_syswide_start_cmd(const char* cpulist, char* cmd, size_t size)
+{
+	pmct_cpuset_t* cpus;
+	int len;
+
+	len=snprintf(cmd,size,"syswide on");
+
+	if (!cpulist)
+		return 0;
+
+	/* The kernel only understands the CPU list format */
+	if ((cpus=pmct_parse_cpuset(cpulist))==NULL)
+		return -1;
+
+	cmd[len++]=' ';
+	if (pmct_cpuset_to_str(cpus,&cmd[len],size-len)<0) {
+		warnx("CPU list too long: %s",cpulist);
+		pmct_free_cpuset(cpus);
+		return -1;
+	}
+
+	pmct_free_cpuset(cpus);
+	return 0;
+}
+
 /*
  * Tell PMCTrack's kernel module to start a monitoring session
  * in system-wide mode
  */
-int pmct_syswide_start_counting( void )
+int pmct_syswide_start_counting(const char* cpulist)
 {
 	int fd;
+	char cmd[MAX_CONFIG_STRING_SIZE];
+
+	if (pmct_build_syswide_start_cmd(cpulist,cmd,sizeof(cmd)))
+		return -1;
+
 	fd = open(pmc_enable_entry, O_WRONLY);
 	if(fd == -1) {
 		warnx("Can't open  %s\n",pmc_enable_entry);
 		return -1;
 	}
-	if(write(fd, "syswide on", 10) < 0) {
-		warnx("Can't write in %s\n",pmc_enable_entry);
+	if(write(fd, cmd, strlen(cmd)) < 0) {
+		warnx("Can't write in %s: %s\n",pmc_enable_entry,strerror(errno));
+		close(fd);
 		return -1;
 	}
 	close(fd);
@@ -411,7 +811,7 @@ void pmct_print_header (FILE* fo, unsigned int nr_experiments,
                         unsigned int virtual_mask,
                         int extended_output,
                         int syswide,
-                        int show_elapsed_time
+                        int time_columns
                         )
 {
 	int i;
@@ -432,9 +832,12 @@ void pmct_print_header (FILE* fo, unsigned int nr_experiments,
 		}
 	}
 
-	if (show_elapsed_time)
+	if (time_columns & PMCT_SHOW_ETIME)
 			fprintf(fo, " %12s","etime_us");
 
+	if (time_columns & PMCT_SHOW_TIMESTAMP)
+		fprintf(fo, " %20s","timestamp_ns");
+
 	for(i=0; (virtual_mask) && (i<MAX_VIRTUAL_COUNTERS); i++) {
 		if(virtual_mask & (0x1<<i)) {
 			fprintf(fo, " %12s%i","virt",i);
@@ -453,12 +856,12 @@ void pmct_print_sample (FILE* fo, unsigned int nr_experiments,
                         unsigned int pmcmask,
                         unsigned int virtual_mask,
                         unsigned int extended_output,
-                        unsigned int show_elapsed_time,
+                        unsigned int time_columns,
                         int nsample,
                         pmc_sample_t* sample)
 {
 
-	char line_out[256]; /* Allocating memory for output */
+	char line_out[512]; /* Allocating memory for output */
 	char* dst=line_out;
 	int j,cnt=0;
 	unsigned int remaining_pmcmask=pmcmask;
@@ -479,7 +882,7 @@ void pmct_print_sample (FILE* fo, unsigned int nr_experiments,
 		}
 	}
 
-	if (show_elapsed_time) {
+	if (time_columns & PMCT_SHOW_ETIME) {
 #if defined(__i386__) || defined(__arm__)
 			dst+=sprintf(dst,"%12llu ",sample->elapsed_time/1000);
 #else
@@ -487,6 +890,14 @@ void pmct_print_sample (FILE* fo, unsigned int nr_experiments,
 #endif					
 	}
 
+	if (time_columns & PMCT_SHOW_TIMESTAMP) {
+#if defined(__i386__) || defined(__arm__)
+		dst+=sprintf(dst,"%20llu ",sample->timestamp);
+#else
+		dst+=sprintf(dst,"%20lu ",sample->timestamp);
+#endif
+	}
+
 	remaining_pmcmask=virtual_mask;
 	cnt=0;
 	for(j=0; (j<MAX_VIRTUAL_COUNTERS) && (remaining_pmcmask) ; j++) {
@@ -510,6 +921,129 @@ void pmct_print_sample (FILE* fo, unsigned int nr_experiments,
 	}
 }
 
+/*
+ * Size of the samples in the kernel buffer associated with fd
+ * (the kernel may store only the virtual counts in use for every sample).
+ */
+int pmct_kernel_sample_size(int fd, unsigned int* sample_size)
+{
+	pmc_session_config_t cfg;
+
+	/* Nothing to configure: the kernel just reports the current state */
+	memset(&cfg,0,sizeof(cfg));
+
+	if (ioctl(fd,PMCTRACK_IOC_CONFIG,&cfg)<0) {
+		/* Older kernel module: samples are always delivered in full */
+		if (errno==ENOTTY) {
+			(*sample_size)=sizeof(pmc_sample_t);
+			return 0;
+		}
+		warnx("Can't retrieve the sample size from %s: %s\n",pmc_monitor_entry,strerror(errno));
+		return -1;
+	}
+
+	if (cfg.kern_sample_size<pmc_sample_size(0) || cfg.kern_sample_size>sizeof(pmc_sample_t)) {
+		warnx("Unsupported sample size reported by the kernel: %u bytes\n",cfg.kern_sample_size);
+		return -1;
+	}
+
+	(*sample_size)=cfg.kern_sample_size;
+	return 0;
+}
+
+/*
+ * Expand nr_samples records of record_size bytes stored
+ * back to back at the beginning of the "samples" array into regular
+ * pmc_sample_t structures. Missing virtual counts are set to zero.
+ */
+static void pmct_unpack_samples(pmc_sample_t* samples, unsigned int nr_samples, size_t record_size)
+{
+	unsigned int max_virt_counts=(record_size-pmc_sample_size(0))/sizeof(uint64_t);
+	int i;
+
+	if (record_size==sizeof(pmc_sample_t))
+		return;
+
+	/* Backwards, so that no record is overwritten before being moved */
+	for (i=nr_samples-1; i>=0; i--) {
+		if (i>0)
+			memmove(&samples[i],(char*)samples+i*record_size,record_size);
+		memset((char*)&samples[i]+record_size,0,sizeof(pmc_sample_t)-record_size);
+
+		if (samples[i].nr_virt_counts>max_virt_counts)
+			samples[i].nr_virt_counts=max_virt_counts;
+	}
+}
+
+/* Name of a sample type */
+const char* pmct_sample_type_str(int type)
+{
+	if (type<0 || type>=PMC_NR_SAMPLE_TYPES)
+		return "unknown";
+	return sample_type_to_str[type];
+}
+
+/* Write the header of a binary stream of samples */
+int pmct_write_stream_header(FILE* fo, unsigned int nr_experiments,
+                             unsigned int pmcmask,
+                             unsigned int virtual_mask,
+                             unsigned int flags)
+{
+	pmct_stream_header_t header;
+
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,PMCT_STREAM_MAGIC,sizeof(header.magic));
+	header.version=PMCT_STREAM_VERSION;
+	header.sample_size=pmc_sample_size(__builtin_popcount(virtual_mask));
+	header.nr_experiments=nr_experiments;
+	header.pmcmask=pmcmask;
+	header.virtual_mask=virtual_mask;
+	header.flags=flags;
+
+	return fwrite(&header,sizeof(header),1,fo)!=1;
+}
+
+/* Append samples to a binary stream (only the virtual counts in use are written) */
+int pmct_write_stream_samples(FILE* fo, unsigned int virtual_mask, pmc_sample_t* samples, unsigned int nr_samples)
+{
+	size_t record_size=pmc_sample_size(__builtin_popcount(virtual_mask));
+	unsigned int i;
+
+	for (i=0; i<nr_samples; i++)
+		if (fwrite(&samples[i],record_size,1,fo)!=1)
+			return 1;
+
+	return 0;
+}
+
+/* Read and validate the header of a binary stream of samples */
+int pmct_read_stream_header(FILE* fi, pmct_stream_header_t* header)
+{
+	if (fread(header,sizeof(pmct_stream_header_t),1,fi)!=1 ||
+	    memcmp(header->magic,PMCT_STREAM_MAGIC,sizeof(header->magic))) {
+		warnx("Not a stream of PMCTrack samples");
+		return 1;
+	}
+
+	if (header->version!=PMCT_STREAM_VERSION ||
+	    header->sample_size<pmc_sample_size(0) || header->sample_size>sizeof(pmc_sample_t)) {
+		warnx("Unsupported stream of samples (version %u, %u-byte samples)",
+		      header->version,header->sample_size);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Read up to max_samples samples from a binary stream */
+int pmct_read_stream_samples(FILE* fi, pmct_stream_header_t* header, pmc_sample_t* samples, unsigned int max_samples)
+{
+	int nr_samples=fread(samples,header->sample_size,max_samples,fi);
+
+	pmct_unpack_samples(samples,nr_samples,header->sample_size);
+	return nr_samples;
+}
+
 /*
  * Accumulate PMC and virtual-counter values from one sample into
  * another sample.
@@ -531,6 +1065,7 @@ void pmct_accumulate_sample (unsigned int nr_experiments,
 		accum->coretype=sample->coretype;
 		accum->exp_idx=sample->exp_idx;
 		accum->pid=sample->pid;
+		accum->target_id=sample->target_id;
 		accum->pmc_mask=sample->pmc_mask;
 		accum->nr_counts=sample->nr_counts;
 		accum->virt_mask=sample->virt_mask;
@@ -558,6 +1093,99 @@ void pmct_accumulate_sample (unsigned int nr_experiments,
 
 }
 
+/*
+ * Restore the heap property in the array of stream indexes
+ * used by pmctrack_merge_samples(), starting from the "root" node.
+ * Streams are ordered by the timestamp of their current sample
+ * (ties are broken by stream index to keep the merge stable).
+ */
+static void pmct_sift_down_streams(unsigned int* heap, unsigned int heap_size,
+                                   unsigned int root,
+                                   pmc_sample_t* streams[],
+                                   unsigned int* cursor)
+{
+	unsigned int child,tmp;
+	pmc_sample_t *a,*b;
+
+	while ((child=2*root+1) < heap_size) {
+		/* Pick the child with the oldest sample */
+		if (child+1 < heap_size) {
+			a=&streams[heap[child+1]][cursor[heap[child+1]]];
+			b=&streams[heap[child]][cursor[heap[child]]];
+			if (a->timestamp < b->timestamp ||
+			    (a->timestamp == b->timestamp && heap[child+1] < heap[child]))
+				child++;
+		}
+
+		a=&streams[heap[child]][cursor[heap[child]]];
+		b=&streams[heap[root]][cursor[heap[root]]];
+
+		if (a->timestamp > b->timestamp ||
+		    (a->timestamp == b->timestamp && heap[child] > heap[root]))
+			break;
+
+		tmp=heap[root];
+		heap[root]=heap[child];
+		heap[child]=tmp;
+		root=child;
+	}
+}
+
+/*
+ * Merge several streams of samples (each of them sorted by timestamp)
+ * into a single time-ordered stream (k-way merge).
+ */
+int pmctrack_merge_samples(pmc_sample_t* streams[],
+                           unsigned int nr_samples[],
+                           unsigned int nr_streams,
+                           pmc_sample_t* dst,
+                           unsigned int max_samples)
+{
+	unsigned int* heap;
+	unsigned int* cursor;
+	unsigned int heap_size=0;
+	unsigned int i;
+	int nr_merged=0;
+	unsigned int idx;
+
+	if (nr_streams==0)
+		return 0;
+
+	heap=malloc(2*nr_streams*sizeof(unsigned int));
+
+	if (!heap) {
+		warnx("Can't allocate memory to merge sample streams");
+		return -1;
+	}
+
+	cursor=heap+nr_streams;
+
+	/* Only non-empty streams take part in the merge */
+	for (i=0; i<nr_streams; i++) {
+		cursor[i]=0;
+		if (streams[i] && nr_samples[i]>0)
+			heap[heap_size++]=i;
+	}
+
+	/* Build the heap */
+	for (i=heap_size/2; i>0; i--)
+		pmct_sift_down_streams(heap,heap_size,i-1,streams,cursor);
+
+	while (heap_size>0 && nr_merged<max_samples) {
+		idx=heap[0];
+		dst[nr_merged++]=streams[idx][cursor[idx]++];
+
+		/* Drop exhausted streams */
+		if (cursor[idx]==nr_samples[idx])
+			heap[0]=heap[--heap_size];
+
+		pmct_sift_down_streams(heap,heap_size,0,streams,cursor);
+	}
+
+	free(heap);
+	return nr_merged;
+}
+
 /*
  * Obtain a file descriptor of the special file exported by
  * PMCTrack's kernel module file to retrieve performance samples
@@ -578,11 +1206,12 @@ int pmct_open_monitor_entry(void)
  * using a special file exported by PMCTrack's kernel module
  *
  * If config_pmcs !=0, the attached process will inherit PMC and
- * virtual counter configuration from the parent process
+ * virtual counter configuration from the parent process, and its
+ * samples will be tagged with target_id
  */
-int pmct_attach_process (pid_t pid, int config_pmcs)
+int pmct_attach_process (pid_t pid, int config_pmcs, int target_id)
 {
-	char str[30];
+	char str[40];
 	int siz;
 
 	int fd = open(pmc_monitor_entry, O_WRONLY);
@@ -591,12 +1220,14 @@ int pmct_attach_process (pid_t pid, int config_pmcs)
 		return -1;
 	}
 	if (config_pmcs)
-		siz=sprintf(str, "pid_attach %d", pid);
+		siz=sprintf(str, "pid_attach %d %d", pid, target_id);
 	else
 		siz=sprintf(str, "pid_monitor %d", pid);
 
-	if(write(fd, str, siz+1) < 0)
+	if(write(fd, str, siz+1) < 0) {
+		close(fd);
 		return -1;
+	}
 
 	close(fd);
 	return 0;
@@ -624,18 +1255,68 @@ int pmct_detach_process (pid_t pid)
 	return 0;
 }
 
+/*
+ * Attach all the threads of the process with PID=pid to the monitor
+ * process in one go. Threads created by the process in the meantime
+ * get attached as well. The attached threads inherit the PMC and virtual
+ * counter configuration from the monitor process, and their samples
+ * are tagged with target_id.
+ */
+int pmct_attach_thread_group (pid_t pid, int target_id)
+{
+	char str[30];
+	int siz;
+	int ret=0;
+
+	int fd = open(pmc_monitor_entry, O_WRONLY);
+	if(fd == -1) {
+		warnx("can't open %s\n",pmc_monitor_entry);
+		return -1;
+	}
+	siz=sprintf(str, "tgid_attach %d %d", pid, target_id);
+
+	if(write(fd, str, siz+1) < 0)
+		ret=-1;
+
+	close(fd);
+	return ret;
+}
+
+/*
+ * Detach all the threads of the process with PID=pid from the monitor
+ */
+int pmct_detach_thread_group (pid_t pid)
+{
+	char str[30];
+	int siz;
+	int ret=0;
+
+	int fd = open(pmc_monitor_entry, O_WRONLY);
+	if(fd == -1) {
+		warnx("can't open %s\n",pmc_monitor_entry);
+		return -1;
+	}
+	siz=sprintf(str, "tgid_detach %d", pid);
+
+	if(write(fd, str, siz+1) < 0)
+		ret=-1;
+
+	close(fd);
+	return ret;
+}
+
 /*
  * Retrieve performance samples from the special file exported by
  * PMCTrack's kernel module
  */
-int pmct_read_samples (int fd, pmc_sample_t* samples, int max_samples)
+int pmct_read_samples (int fd, pmc_sample_t* samples, int max_samples, unsigned int sample_size)
 {
 	int nr_samples = 0;
 	int nbytes = 0;
-	int max_buffer_size=sizeof(pmc_sample_t)*max_samples;
+	int max_buffer_size=sample_size*max_samples;
 
 	if((nbytes = read(fd, samples, max_buffer_size)) < 0) {
-		if (errno!=EINTR)
+		if (errno!=EINTR && errno!=EAGAIN)
 			warnx("Can't read from %s\n",pmc_monitor_entry);
 		return -1;
 	}
@@ -643,7 +1324,8 @@ int pmct_read_samples (int fd, pmc_sample_t* samples, int max_samples)
 	/* Reset read counter */
 	lseek(fd, 0, SEEK_SET);
 
-	nr_samples=nbytes/sizeof(pmc_sample_t);
+	nr_samples=nbytes/sample_size;
+	pmct_unpack_samples(samples,nr_samples,sample_size);
 	return nr_samples;
 }
 
@@ -669,6 +1351,7 @@ pmctrack_desc_t* pmctrack_init(unsigned int max_nr_samples)
 	desc->nr_experiments=0;
 	desc->ebs_on=0;
 	desc->nr_samples=0;
+	desc->kern_sample_size=sizeof(pmc_sample_t);
 	desc->flags=0;
 	memset(desc->event_mapping,0,sizeof(counter_mapping_t)*MAX_PERFORMANCE_COUNTERS);
 	desc->global_pmcmask=0;
@@ -803,40 +1486,42 @@ pmctrack_desc_t* pmctrack_clone_descriptor(pmctrack_desc_t* orig)
 
 static int __pmctrack_config_counters(pmctrack_desc_t* desc, const char* strcfg[], const char* virtcfg, int mux_timeout_ms)
 {
-	unsigned long flags=0;
+	pmc_session_config_t cfg;
+	unsigned int cfg_flags=0;
+
+	/* Nothing to configure (the monitoring mode is left alone too) */
+	if (!(strcfg && strcfg[0]) && !virtcfg)
+		return 0;
 
 	if (mux_timeout_ms==0)
 		mux_timeout_ms=300000;
 
-	/**/
-	if (mux_timeout_ms!=0 && pmct_config_timeout(mux_timeout_ms,desc->kern_pmcmask))
-		return -1;
+	if (desc->kern_pmcmask)
+		cfg_flags|=PMC_CFG_KERNEL_CONTROL;
 
-	if (!(desc->flags & PMCT_FLAG_SELF_MONITORING)) {
-		desc->flags|=PMCT_FLAG_SELF_MONITORING;
-		flags=PMCT_FLAG_SELF_MONITORING;
-	}
+	if (!(desc->flags & PMCT_FLAG_SELF_MONITORING))
+		cfg_flags|=PMC_CFG_SELF_MONITORING;
 
-	/* Configure counters if there is something to configure */
-	if (strcfg && strcfg[0]) {
-		/* Parse counter config */
+	/* Parse counter config */
+	if (strcfg && strcfg[0])
 		pmct_check_counter_config(strcfg,&desc->nr_pmcs,&desc->pmcmask,
 		                          &desc->ebs_on,&desc->nr_experiments);
 
-		/* Tell the kernel what we want to count */
-		if (pmct_config_counters(strcfg,flags))
-			return -1;
-		/* Avoid re-establishing the self-monitoring mode */
-		flags=0;
-	}
-
-	/* Configure virtual counters */
-	if (virtcfg) {
+	if (virtcfg)
 		pmct_check_vcounter_config(virtcfg,&desc->nr_virtual_counters,&desc->virtual_mask);
-		if (pmct_config_virtual_counters(virtcfg,flags))
-			return -1;
-	}
 
+	/* Tell the kernel what we want to count (in a single call) */
+	if (pmct_build_session_config(&cfg,strcfg,virtcfg,mux_timeout_ms,0,cfg_flags))
+		return -1;
+
+	if (pmct_config_session(desc->fd_monitor,&cfg))
+		return -1;
+
+	if (cfg_flags & PMC_CFG_SELF_MONITORING)
+		desc->flags|=PMCT_FLAG_SELF_MONITORING;
+
+	/* The sample size is fixed from now on */
+	desc->kern_sample_size=cfg.kern_sample_size;
 	return 0;
 }
 
@@ -912,12 +1597,14 @@ free_up_strcfg:
 	return ret;
 }
 
-static inline int pmct_start_counters_gen(pmctrack_desc_t* desc,int syswide)
+static inline int pmct_start_counters_gen(pmctrack_desc_t* desc,int syswide, const char* cpulist)
 {
-	char* key[2]= {"ON","syswide on"};
-	int index=syswide?1:0; /* To make sure it is in the allowed range */
+	char cmd[MAX_CONFIG_STRING_SIZE]="ON";
 
-	if(write(desc->fd_monitor,key[index], strlen(key[index])+1) < 0) {
+	if (syswide && pmct_build_syswide_start_cmd(cpulist,cmd,sizeof(cmd)))
+		return -1;
+
+	if(write(desc->fd_monitor,cmd, strlen(cmd)+1) < 0) {
 		warnx("Write error in %s\n",pmc_monitor_entry);
 		return -1;
 	}
@@ -934,6 +1621,7 @@ static inline int pmct_stop_counters_gen(pmctrack_desc_t* desc, int syswide)
 	char* key[2]= {"OFF","syswide off"};
 	int index=syswide?1:0; /* To make sure it is in the allowed range */
 	int nbytes=0;
+	unsigned int sample_size=desc->kern_sample_size;
 
 	/* Disable self monitoring */
 	if(write(desc->fd_monitor,key[index], strlen(key[index])+1) < 0) {
@@ -941,12 +1629,13 @@ static inline int pmct_stop_counters_gen(pmctrack_desc_t* desc, int syswide)
 		return -1;
 	}
 	/* Read stuff */
-	if((nbytes = read(desc->fd_monitor, desc->samples, sizeof(pmc_sample_t)*desc->max_nr_samples)) < 0) {
+	if((nbytes = read(desc->fd_monitor, desc->samples, sample_size*desc->max_nr_samples)) < 0) {
 		perror("Read error in /proc/pmc/monitor\n");
 		return -1;
 	}
 
-	desc->nr_samples=nbytes/sizeof(pmc_sample_t);
+	desc->nr_samples=nbytes/sample_size;
+	pmct_unpack_samples(desc->samples,desc->nr_samples,sample_size);
 
 	return 0;
 }
@@ -958,7 +1647,7 @@ static inline int pmct_stop_counters_gen(pmctrack_desc_t* desc, int syswide)
  */
 int pmctrack_start_counters(pmctrack_desc_t* desc)
 {
-	return pmct_start_counters_gen(desc,0);
+	return pmct_start_counters_gen(desc,0,NULL);
 }
 
 /*
@@ -978,7 +1667,16 @@ int pmctrack_stop_counters(pmctrack_desc_t* desc)
  */
 int pmctrack_start_counters_syswide(pmctrack_desc_t* desc)
 {
-	return pmct_start_counters_gen(desc,1);
+	return pmct_start_counters_gen(desc,1,NULL);
+}
+
+/*
+ * Start a monitoring session in system-wide mode on a subset of CPUs only.
+ * The remaining CPUs are not monitored at all.
+ */
+int pmctrack_start_counters_syswide_cpus(pmctrack_desc_t* desc, const char* cpus)
+{
+	return pmct_start_counters_gen(desc,1,cpus);
 }
 
 /*
@@ -1002,7 +1700,7 @@ void pmctrack_print_counts(pmctrack_desc_t* desc, FILE* fo, int extended_output)
 	int i=0;
 	pmc_sample_t* cur;
 	unsigned int syswide=desc->flags & PMCT_FLAG_SYSWIDE;
-	unsigned int show_elapsed_time=desc->flags & PMCT_FLAG_SHOW_ETIME;
+	unsigned int time_columns=(desc->flags & PMCT_FLAG_SHOW_ETIME)?PMCT_SHOW_ETIME:0;
 
 	// print event-to-counter mappings
 	if (!(desc->flags & PMCT_FLAG_RAW_PMC_CONFIG)) {
@@ -1018,13 +1716,13 @@ void pmctrack_print_counts(pmctrack_desc_t* desc, FILE* fo, int extended_output)
 	}
 
 	// printing header
-	pmct_print_header(fo,desc->nr_experiments,desc->pmcmask,desc->virtual_mask,extended_output,syswide,show_elapsed_time);
+	pmct_print_header(fo,desc->nr_experiments,desc->pmcmask,desc->virtual_mask,extended_output,syswide,time_columns);
 
 	// printing samples
 	for (i=0; i<desc->nr_samples; i++) {
 		cur = &desc->samples[i];
 
-		pmct_print_sample (fo,desc->nr_experiments, desc->pmcmask, desc->virtual_mask, extended_output, show_elapsed_time, i+1, cur);
+		pmct_print_sample (fo,desc->nr_experiments, desc->pmcmask, desc->virtual_mask, extended_output, time_columns, i+1, cur);
 	}
 }
 
@@ -1038,6 +1736,73 @@ pmc_sample_t* pmctrack_get_samples(pmctrack_desc_t* desc,int* nr_samples)
 	return desc->samples;
 }
 
+/*
+ * Retrieve the samples collected so far in an ongoing monitoring session
+ * without stopping it.
+ */
+int pmctrack_read_samples(pmctrack_desc_t* desc, pmc_sample_t* samples, unsigned int max_samples)
+{
+	unsigned int nr_samples=0;
+	unsigned int chunk;
+	int nr_read=0;
+	int fd_flags=-1;
+	int shared=(desc->flags & PMCT_FLAG_SHARED_REGION);
+
+	while (nr_samples<max_samples) {
+		chunk=max_samples-nr_samples;
+
+		if (chunk>PMCT_READ_CHUNK_SAMPLES)
+			chunk=PMCT_READ_CHUNK_SAMPLES;
+
+		/* The kernel ignores the user buffer and fills in the shared region instead */
+		if (shared && chunk>desc->max_nr_samples)
+			chunk=desc->max_nr_samples;
+
+		nr_read=pmct_read_samples(desc->fd_monitor,shared?desc->samples:samples+nr_samples,
+		                          chunk,desc->kern_sample_size);
+
+		/* Error, EOF or no more samples available */
+		if (nr_read<=0)
+			break;
+
+		if (shared)
+			memcpy(samples+nr_samples,desc->samples,nr_read*sizeof(pmc_sample_t));
+
+		nr_samples+=nr_read;
+
+		if (nr_read<chunk)
+			break;
+
+		/* Only the first chunk blocks: drain what is left without waiting */
+		if (fd_flags==-1) {
+			if ((fd_flags=fcntl(desc->fd_monitor,F_GETFL))==-1)
+				break;
+			if (fcntl(desc->fd_monitor,F_SETFL,fd_flags|O_NONBLOCK)==-1)
+				break;
+		}
+	}
+
+	if (fd_flags!=-1)
+		fcntl(desc->fd_monitor,F_SETFL,fd_flags);
+
+	/* Report failures only if nothing could be retrieved */
+	if (nr_samples==0 && nr_read<0)
+		return -1;
+
+	return nr_samples;
+}
+
+/* Retrieve basic information on the current counter configuration */
+void pmctrack_get_counter_config(pmctrack_desc_t* desc,
+                                 unsigned int* nr_experiments,
+                                 unsigned int* pmcmask,
+                                 unsigned int* virtual_mask)
+{
+	(*nr_experiments)=desc->nr_experiments;
+	(*pmcmask)=desc->pmcmask;
+	(*virtual_mask)=desc->virtual_mask;
+}
+
 /*
  * Set up the size of the kernel buffer used to store PMC and virtual
  * counter values
@@ -0,0 +1,296 @@
+/*
+ * cpuset.c
+ *
+ ******************************************************************************
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ *  Dynamically-sized CPU sets, so that CPU binding and CPU filtering
+ *  are not restricted to the first 64 CPUs in the system.
+ */
+#ifndef  _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <err.h>
+#include "pmctrack_internal.h"
+
+/* Set of CPUs of arbitrary size */
+struct pmct_cpuset {
+	cpu_set_t* set;         /* Dynamically allocated glibc CPU set */
+	size_t size;            /* Size in bytes of the set (for the CPU_*_S() macros) */
+	unsigned int nr_cpus;   /* Max number of CPUs the set can hold */
+};
+
+/*
+ * Allocate an empty CPU set that can hold at least nr_cpus CPUs
+ * (or all the CPUs configured in the system, whatever is greater)
+ */
+pmct_cpuset_t* pmct_alloc_cpuset(unsigned int nr_cpus)
+{
+	pmct_cpuset_t* cpus;
+	long nr_conf=sysconf(_SC_NPROCESSORS_CONF);
+
+	if (nr_conf>0 && nr_cpus<nr_conf)
+		nr_cpus=nr_conf;
+
+	if ((cpus=malloc(sizeof(pmct_cpuset_t)))==NULL)
+		return NULL;
+
+	if ((cpus->set=CPU_ALLOC(nr_cpus))==NULL) {
+		free(cpus);
+		return NULL;
+	}
+
+	cpus->nr_cpus=nr_cpus;
+	cpus->size=CPU_ALLOC_SIZE(nr_cpus);
+	CPU_ZERO_S(cpus->size,cpus->set);
+	return cpus;
+}
+
+/* Free up a CPU set */
+void pmct_free_cpuset(pmct_cpuset_t* cpus)
+{
+	if (!cpus)
+		return;
+	CPU_FREE(cpus->set);
+	free(cpus);
+}
+
+/*
+ * Number of CPU ids accepted in CPU lists and masks
+ * (CPUs configured in the system, or CPU_SETSIZE if unknown)
+ */
+static long pmct_cpu_limit(void)
+{
+	long nr_conf=sysconf(_SC_NPROCESSORS_CONF);
+
+	return (nr_conf>0)?nr_conf:CPU_SETSIZE;
+}
+
+/*
+ * Parse a CPU list such as "0-15,64-79" or "3" and add the CPUs found
+ * to the set (if cpus is not NULL). The highest CPU found is stored in max_cpu.
+ * CPU ids must be lower than pmct_cpu_limit().
+ *
+ * The function returns 0 on success, 1 if the list is malformed
+ * and 2 if a CPU is out of range.
+ */
+static int parse_cpu_list(const char* str, pmct_cpuset_t* cpus, int* max_cpu)
+{
+	const char* cur=str;
+	char* end;
+	long first,last,cpu;
+	long limit=pmct_cpu_limit();
+
+	(*max_cpu)=-1;
+
+	while (*cur!='\0') {
+		if (!isdigit(*cur))
+			return 1;
+
+		first=last=strtol(cur,&end,10);
+
+		if (*end=='-') {
+			cur=end+1;
+			if (!isdigit(*cur))
+				return 1;
+			last=strtol(cur,&end,10);
+		}
+
+		if (last<first || (*end!=',' && *end!='\0'))
+			return 1;
+
+		if (last>=limit) {
+			warnx("CPU %ld out of range (the system has %ld CPUs)",last,limit);
+			return 2;
+		}
+
+		if (last>(*max_cpu))
+			(*max_cpu)=last;
+
+		for (cpu=first; cpus && cpu<=last; cpu++)
+			CPU_SET_S(cpu,cpus->size,cpus->set);
+
+		cur=(*end==',')?end+1:end;
+	}
+
+	return ((*max_cpu)==-1)?1:0;
+}
+
+/* Convert an hex digit into its value */
+static inline int hex_value(char c)
+{
+	if (isdigit(c))
+		return c-'0';
+	return tolower(c)-'a'+10;
+}
+
+/*
+ * Build a CPU set from a user-provided string. The following formats are accepted:
+ *  - CPU mask in hex format of arbitrary length (e.g., 0xff00). Bits for CPUs
+ *    beyond the ones configured in the system are ignored (so that all-ones masks work)
+ *  - CPU list with comma-separated CPU numbers and ranges (e.g., 0-15,64-79)
+ *
+ * The function returns NULL on error.
+ */
+pmct_cpuset_t* pmct_parse_cpuset(const char* str)
+{
+	pmct_cpuset_t* cpus;
+	int max_cpu;
+	int len,i,j,ret;
+	int nr_ignored=0;
+	long limit=pmct_cpu_limit();
+	const char* digits;
+
+	if (strncmp(str,"0x",2)==0 || strncmp(str,"0X",2)==0) {
+		digits=str+2;
+		len=strlen(digits);
+
+		if (len==0)
+			goto wrong_format;
+
+		for (i=0; i<len; i++)
+			if (!isxdigit(digits[i]))
+				goto wrong_format;
+
+		if ((cpus=pmct_alloc_cpuset(4L*len<limit?4*len:limit))==NULL)
+			return NULL;
+
+		/* The last digit stands for CPUs 0-3 */
+		for (i=0; i<len; i++) {
+			int val=hex_value(digits[len-1-i]);
+			for (j=0; j<4; j++) {
+				if (!(val & (1<<j)))
+					continue;
+				if (4L*i+j>=limit)
+					nr_ignored++;
+				else
+					CPU_SET_S(4*i+j,cpus->size,cpus->set);
+			}
+		}
+
+		/* Only fail if none of the CPUs in the mask exists */
+		if (nr_ignored && pmct_cpuset_count(cpus)==0) {
+			warnx("No CPU in mask %s exists (the system has %ld CPUs)",str,limit);
+			pmct_free_cpuset(cpus);
+			return NULL;
+		}
+		return cpus;
+	}
+
+	if ((ret=parse_cpu_list(str,NULL,&max_cpu))==1)
+		goto wrong_format;
+	else if (ret)
+		return NULL;
+
+	if ((cpus=pmct_alloc_cpuset(max_cpu+1))==NULL)
+		return NULL;
+
+	parse_cpu_list(str,cpus,&max_cpu);
+	return cpus;
+
+wrong_format:
+	warnx("Wrong format for CPU list or mask: %s",str);
+	return NULL;
+}
+
+/* Returns a non-zero value if the cpu belongs to the set */
+int pmct_cpuset_isset(pmct_cpuset_t* cpus, unsigned int cpu)
+{
+	return cpu<cpus->nr_cpus && CPU_ISSET_S(cpu,cpus->size,cpus->set);
+}
+
+/* Number of CPUs in the set */
+unsigned int pmct_cpuset_count(pmct_cpuset_t* cpus)
+{
+	return CPU_COUNT_S(cpus->size,cpus->set);
+}
+
+/* Max number of CPUs the set can hold (CPU ids go from 0 to that value minus one) */
+unsigned int pmct_cpuset_max_cpus(pmct_cpuset_t* cpus)
+{
+	return cpus->nr_cpus;
+}
+
+/* Returns a non-zero value if both sets have CPUs in common */
+int pmct_cpuset_intersects(pmct_cpuset_t* a, pmct_cpuset_t* b)
+{
+	unsigned int cpu;
+	unsigned int nr_cpus=a->nr_cpus<b->nr_cpus?a->nr_cpus:b->nr_cpus;
+
+	for (cpu=0; cpu<nr_cpus; cpu++)
+		if (CPU_ISSET_S(cpu,a->size,a->set) && CPU_ISSET_S(cpu,b->size,b->set))
+			return 1;
+	return 0;
+}
+
+/*
+ * Print the CPU set in the CPU list format (e.g., 0-15,64-79)
+ * The function returns the number of characters written (-1 if the buffer is too small).
+ */
+int pmct_cpuset_to_str(pmct_cpuset_t* cpus, char* buf, size_t size)
+{
+	unsigned int cpu=0,first;
+	char* dst=buf;
+	int len;
+
+	if (size==0)
+		return -1;
+
+	buf[0]='\0';
+
+	while (cpu<cpus->nr_cpus) {
+		if (!CPU_ISSET_S(cpu,cpus->size,cpus->set)) {
+			cpu++;
+			continue;
+		}
+
+		/* Find end of range */
+		first=cpu;
+		while (cpu+1<cpus->nr_cpus && CPU_ISSET_S(cpu+1,cpus->size,cpus->set))
+			cpu++;
+
+		if (first==cpu)
+			len=snprintf(dst,size,"%s%u",dst==buf?"":",",first);
+		else
+			len=snprintf(dst,size,"%s%u-%u",dst==buf?"":",",first,cpu);
+
+		if (len>=size)
+			return -1;
+
+		dst+=len;
+		size-=len;
+		cpu++;
+	}
+
+	return dst-buf;
+}
+
+/* Wrapper for sched_setaffinity() */
+int pmct_bind_process_cpuset(pid_t pid, pmct_cpuset_t* cpus)
+{
+	return sched_setaffinity(pid,cpus->size,cpus->set);
+}
@@ -0,0 +1,337 @@
+/*
+ * metric.c
+ *
+ ******************************************************************************
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ *  Metric expressions (e.g., "pmc0/pmc1") compiled once into a small
+ *  stack program, which is evaluated over whole columns of values
+ *  (one column per variable) rather than one sample at a time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <err.h>
+#include "pmctrack_internal.h"
+
+#define MAX_METRIC_INSNS 64
+
+/* Operations of the stack program */
+typedef enum {
+	METRIC_OP_VAR,		/* Push a column of values */
+	METRIC_OP_CONST,	/* Push a constant */
+	METRIC_OP_NEG,
+	METRIC_OP_ADD,
+	METRIC_OP_SUB,
+	METRIC_OP_MUL,
+	METRIC_OP_DIV,
+} metric_op_t;
+
+typedef struct {
+	metric_op_t op;
+	int var;		/* Variable index (METRIC_OP_VAR) */
+	double value;		/* Constant (METRIC_OP_CONST) */
+} metric_insn_t;
+
+struct pmct_metric_prog {
+	metric_insn_t insns[MAX_METRIC_INSNS];
+	unsigned int nr_insns;
+	unsigned int max_depth;		/* Max number of items in the stack */
+	unsigned int nr_refs;		/* Number of different variables used */
+	double* scratch;		/* max_depth columns of "capacity" values */
+	unsigned int capacity;
+};
+
+/* State of the recursive-descent parser */
+typedef struct {
+	const char* cur;
+	const char* const* vars;
+	int nr_vars;
+	pmct_metric_prog_t* prog;
+	unsigned int depth;
+	unsigned char* used;	/* Variables referenced so far */
+} metric_parser_t;
+
+static int parse_expr(metric_parser_t* p);
+
+static inline void skip_spaces(metric_parser_t* p)
+{
+	while (isspace(*p->cur))
+		p->cur++;
+}
+
+/* Append an instruction and keep track of the stack depth */
+static int emit(metric_parser_t* p, metric_op_t op, int var, double value)
+{
+	metric_insn_t* insn;
+
+	if (p->prog->nr_insns==MAX_METRIC_INSNS) {
+		warnx("Metric expression is too long");
+		return 1;
+	}
+
+	insn=&p->prog->insns[p->prog->nr_insns++];
+	insn->op=op;
+	insn->var=var;
+	insn->value=value;
+
+	if (op==METRIC_OP_VAR || op==METRIC_OP_CONST) {
+		if (++p->depth>p->prog->max_depth)
+			p->prog->max_depth=p->depth;
+	} else if (op!=METRIC_OP_NEG)
+		p->depth--;
+
+	return 0;
+}
+
+/* factor := number | variable | '(' expr ')' | '-' factor */
+static int parse_factor(metric_parser_t* p)
+{
+	const char* start;
+	char* end;
+	double value;
+	size_t len;
+	int i;
+
+	skip_spaces(p);
+
+	if (*p->cur=='(') {
+		p->cur++;
+		if (parse_expr(p))
+			return 1;
+		skip_spaces(p);
+		if (*p->cur!=')') {
+			warnx("Missing ')' in metric expression");
+			return 1;
+		}
+		p->cur++;
+		return 0;
+	} else if (*p->cur=='-') {
+		p->cur++;
+		return parse_factor(p) || emit(p,METRIC_OP_NEG,0,0);
+	} else if (isdigit(*p->cur) || *p->cur=='.') {
+		value=strtod(p->cur,&end);
+		p->cur=end;
+		return emit(p,METRIC_OP_CONST,0,value);
+	} else if (isalpha(*p->cur) || *p->cur=='_') {
+		start=p->cur;
+		while (isalnum(*p->cur) || *p->cur=='_')
+			p->cur++;
+		len=p->cur-start;
+
+		/* Search backwards so that the last definition of a name wins */
+		for (i=p->nr_vars-1; i>=0; i--)
+			if (strlen(p->vars[i])==len && strncmp(p->vars[i],start,len)==0)
+				break;
+
+		if (i<0) {
+			warnx("Unknown variable in metric expression: %.*s",(int)len,start);
+			return 1;
+		}
+
+		if (!p->used[i]) {
+			p->used[i]=1;
+			p->prog->nr_refs++;
+		}
+		return emit(p,METRIC_OP_VAR,i,0);
+	}
+
+	warnx("Syntax error in metric expression near '%s'",p->cur);
+	return 1;
+}
+
+/* term := factor (('*' | '/') factor)* */
+static int parse_term(metric_parser_t* p)
+{
+	char op;
+
+	if (parse_factor(p))
+		return 1;
+
+	for (;;) {
+		skip_spaces(p);
+		op=*p->cur;
+		if (op!='*' && op!='/')
+			return 0;
+		p->cur++;
+		if (parse_factor(p) || emit(p,op=='*'?METRIC_OP_MUL:METRIC_OP_DIV,0,0))
+			return 1;
+	}
+}
+
+/* expr := term (('+' | '-') term)* */
+static int parse_expr(metric_parser_t* p)
+{
+	char op;
+
+	if (parse_term(p))
+		return 1;
+
+	for (;;) {
+		skip_spaces(p);
+		op=*p->cur;
+		if (op!='+' && op!='-')
+			return 0;
+		p->cur++;
+		if (parse_term(p) || emit(p,op=='+'?METRIC_OP_ADD:METRIC_OP_SUB,0,0))
+			return 1;
+	}
+}
+
+/*
+ * Compile a metric expression, such as "pmc0/pmc1" or "(pmc2+pmc3)*1000/pmc0".
+ * Variable names are resolved into indexes of the "vars" array.
+ */
+pmct_metric_prog_t* pmct_metric_compile(const char* expr, const char* const* vars, int nr_vars)
+{
+	metric_parser_t parser;
+	pmct_metric_prog_t* prog;
+
+	if ((prog=calloc(1,sizeof(pmct_metric_prog_t)))==NULL)
+		return NULL;
+
+	if ((parser.used=calloc(nr_vars>0?nr_vars:1,1))==NULL) {
+		free(prog);
+		return NULL;
+	}
+
+	parser.cur=expr;
+	parser.vars=vars;
+	parser.nr_vars=nr_vars;
+	parser.prog=prog;
+	parser.depth=0;
+
+	if (parse_expr(&parser))
+		goto error;
+
+	skip_spaces(&parser);
+
+	if (*parser.cur!='\0') {
+		warnx("Syntax error in metric expression near '%s'",parser.cur);
+		goto error;
+	}
+
+	free(parser.used);
+	return prog;
+error:
+	free(parser.used);
+	free(prog);
+	return NULL;
+}
+
+/* Free up a compiled metric expression */
+void pmct_metric_free(pmct_metric_prog_t* prog)
+{
+	if (!prog)
+		return;
+	free(prog->scratch);
+	free(prog);
+}
+
+/* Number of different variables referenced in the expression */
+unsigned int pmct_metric_nr_refs(pmct_metric_prog_t* prog)
+{
+	return prog->nr_refs;
+}
+
+/*
+ * Evaluate the expression for n rows. columns[i] holds the n values of the i-th
+ * variable, and the results are stored in out. Divisions by zero yield zero.
+ *
+ * Every instruction is applied to a whole column, so that the inner loops are
+ * simple enough for the compiler to vectorize them.
+ */
+int pmct_metric_eval(pmct_metric_prog_t* prog, double* const* columns, double* out, unsigned int n)
+{
+	const double* stack[MAX_METRIC_INSNS];
+	double* dst;
+	const double* a;
+	const double* b;
+	unsigned int sp=0;
+	unsigned int i,j;
+	metric_insn_t* insn;
+
+	/* Intermediate results go to scratch columns (one per stack slot) */
+	if (n>prog->capacity) {
+		free(prog->scratch);
+		if ((prog->scratch=malloc(sizeof(double)*n*prog->max_depth))==NULL) {
+			prog->capacity=0;
+			return -1;
+		}
+		prog->capacity=n;
+	}
+
+	for (j=0; j<prog->nr_insns; j++) {
+		insn=&prog->insns[j];
+
+		switch (insn->op) {
+		case METRIC_OP_VAR:
+			/* No copy needed */
+			stack[sp++]=columns[insn->var];
+			continue;
+		case METRIC_OP_CONST:
+			dst=&prog->scratch[sp*prog->capacity];
+			for (i=0; i<n; i++)
+				dst[i]=insn->value;
+			stack[sp++]=dst;
+			continue;
+		case METRIC_OP_NEG:
+			a=stack[sp-1];
+			dst=&prog->scratch[(sp-1)*prog->capacity];
+			for (i=0; i<n; i++)
+				dst[i]=-a[i];
+			stack[sp-1]=dst;
+			continue;
+		default:
+			break;
+		}
+
+		/* Binary operators: the result replaces the first operand */
+		a=stack[sp-2];
+		b=stack[sp-1];
+		dst=&prog->scratch[(sp-2)*prog->capacity];
+
+		switch (insn->op) {
+		case METRIC_OP_ADD:
+			for (i=0; i<n; i++)
+				dst[i]=a[i]+b[i];
+			break;
+		case METRIC_OP_SUB:
+			for (i=0; i<n; i++)
+				dst[i]=a[i]-b[i];
+			break;
+		case METRIC_OP_MUL:
+			for (i=0; i<n; i++)
+				dst[i]=a[i]*b[i];
+			break;
+		default:
+			for (i=0; i<n; i++)
+				dst[i]=b[i]!=0.0?a[i]/b[i]:0.0;
+			break;
+		}
+
+		stack[--sp-1]=dst;
+	}
+
+	memcpy(out,stack[0],sizeof(double)*n);
+	return 0;
+}
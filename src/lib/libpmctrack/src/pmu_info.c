@@ -331,6 +331,42 @@ virtual_counter_info_t* pmct_get_virtual_counter_info(void)
 	return virtual_counter_info_gbl;
 }
 
+/*
+ * Read the list of virtual counters again from /proc/pmc/info
+ * (it changes when user-defined metrics are added or removed)
+ */
+void pmct_reload_virtual_counter_info(void)
+{
+	virtual_counter_info_t *vci=virtual_counter_info_gbl;
+	char line[FILE_LINE_SIZE];
+	char str_value[FILE_LINE_SIZE];
+	int int_value;
+	int i;
+	FILE *f;
+
+	/* Nothing to do if it was not loaded yet */
+	if (!vci)
+		return;
+
+	if (!(f=fopen("/proc/pmc/info", "r")))
+		return;
+
+	for (i=0; i<vci->nr_virtual_counters; i++)
+		free(vci->name[i]);
+	vci->nr_virtual_counters=0;
+
+	while(fgets(line, FILE_LINE_SIZE, f)) {
+		if (sscanf(line, "nr_virtual_counters=%d",&int_value) ==1) {
+			vci->nr_virtual_counters=int_value;
+		} else if (sscanf(line, "virt%d=%s", &int_value, str_value) == 2 &&
+		           int_value>=0 && int_value<MAX_VIRTUAL_COUNTERS) {
+			vci->name[int_value]=malloc(strlen(str_value)+1);
+			strcpy(vci->name[int_value],str_value);
+		}
+	}
+	fclose(f);
+}
+
 /*
  * This function takes care of translating a mnemonic-based
  * PMC configuration string into the raw format.
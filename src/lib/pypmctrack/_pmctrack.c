@@ -0,0 +1,560 @@
+/*
+ * _pmctrack.c
+ *
+ ******************************************************************************
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ *  CPython bindings to libpmctrack. Monitoring sessions (pmctrack_desc_t)
+ *  are exposed as Python objects, and samples are never converted to text:
+ *  the kernel copies them straight into writable buffers provided by the
+ *  caller (e.g., NumPy structured arrays), and the samples retrieved when
+ *  a session is stopped are exported via the buffer protocol.
+ *
+ *  The NumPy-specific code lives in the pmctrack package (__init__.py),
+ *  so the extension only depends on libpmctrack and the Python C API.
+ */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stddef.h>
+#include <errno.h>
+#include <pmctrack.h>
+
+/* Session states */
+#define SESSION_IDLE		0
+#define SESSION_PER_THREAD	1
+#define SESSION_SYSWIDE		2
+
+/* Python object wrapping a libpmctrack descriptor */
+typedef struct {
+	PyObject_HEAD
+	pmctrack_desc_t* desc;		/* NULL once the session is closed */
+	pmctrack_desc_t* closed_desc;	/* Descriptor of a closed session whose samples are still referenced */
+	int state;			/* SESSION_IDLE, SESSION_PER_THREAD or SESSION_SYSWIDE */
+	int busy;			/* A read is in progress (with the GIL released) */
+	Py_ssize_t exports;		/* Number of buffer views of the collected samples */
+} SessionObject;
+
+/* Raise an exception if the session cannot be used */
+static int session_check(SessionObject* self)
+{
+	if (!self->desc) {
+		PyErr_SetString(PyExc_ValueError,"Operation on a closed session");
+		return -1;
+	}
+
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError,"A read is in progress on this session");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Raise an exception if the samples stored in the descriptor
+ * are about to be overwritten or freed while views of them exist.
+ */
+static int session_check_exports(SessionObject* self)
+{
+	if (self->exports>0) {
+		PyErr_SetString(PyExc_BufferError,"Collected samples are still referenced (release the arrays or memoryviews first)");
+		return -1;
+	}
+	return 0;
+}
+
+/* Session(max_samples=0) */
+static int Session_init(SessionObject* self, PyObject* args, PyObject* kwds)
+{
+	static char* kwlist[]= {"max_samples",NULL};
+	unsigned int max_samples=0;
+
+	if (!PyArg_ParseTupleAndKeywords(args,kwds,"|I",kwlist,&max_samples))
+		return -1;
+
+	if (self->desc) {
+		PyErr_SetString(PyExc_RuntimeError,"Session already initialized");
+		return -1;
+	}
+
+	if (!(self->desc=pmctrack_init(max_samples))) {
+		PyErr_SetString(PyExc_OSError,"Can't establish a connection with PMCTrack's kernel module");
+		return -1;
+	}
+
+	self->state=SESSION_IDLE;
+	self->busy=0;
+	self->exports=0;
+	return 0;
+}
+
+/* Free up the descriptor */
+static void Session_dealloc(SessionObject* self)
+{
+	if (self->desc)
+		pmctrack_destroy(self->desc);
+	if (self->closed_desc)
+		pmctrack_destroy(self->closed_desc);
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/*
+ * Build a NULL-terminated array of event configurations from a string
+ * or a sequence of strings. The strings remain owned by the "seq" object,
+ * which must be released by the caller.
+ */
+static int build_counter_configs(PyObject* events, const char* strcfg[], PyObject** seq)
+{
+	Py_ssize_t nr_configs,i;
+
+	if (PyUnicode_Check(events)) {
+		if (!(strcfg[0]=PyUnicode_AsUTF8(events)))
+			return -1;
+		strcfg[1]=NULL;
+		(*seq)=NULL;
+		return 0;
+	}
+
+	if (!((*seq)=PySequence_Fast(events,"events must be a string or a sequence of strings")))
+		return -1;
+
+	nr_configs=PySequence_Fast_GET_SIZE(*seq);
+
+	if (nr_configs==0 || nr_configs>MAX_COUNTER_CONFIGS) {
+		PyErr_Format(PyExc_ValueError,"Between 1 and %d event sets must be specified",MAX_COUNTER_CONFIGS);
+		goto error;
+	}
+
+	for (i=0; i<nr_configs; i++) {
+		PyObject* item=PySequence_Fast_GET_ITEM(*seq,i);
+
+		if (!PyUnicode_Check(item)) {
+			PyErr_SetString(PyExc_TypeError,"events must be a string or a sequence of strings");
+			goto error;
+		}
+
+		if (!(strcfg[i]=PyUnicode_AsUTF8(item)))
+			goto error;
+	}
+	strcfg[nr_configs]=NULL;
+	return 0;
+error:
+	Py_CLEAR(*seq);
+	return -1;
+}
+
+/* configure(events, virtual=None, timeout_ms=0, raw=False, pmu=0) */
+static PyObject* Session_configure(SessionObject* self, PyObject* args, PyObject* kwds)
+{
+	static char* kwlist[]= {"events","virtual","timeout_ms","raw","pmu",NULL};
+	PyObject* events=NULL;
+	PyObject* seq=NULL;
+	const char* virtcfg=NULL;
+	const char* strcfg[MAX_COUNTER_CONFIGS+1];
+	int timeout_ms=0;
+	int raw=0;
+	int pmu_id=0;
+	int ret;
+
+	if (!PyArg_ParseTupleAndKeywords(args,kwds,"O|zipi",kwlist,
+	                                 &events,&virtcfg,&timeout_ms,&raw,&pmu_id))
+		return NULL;
+
+	if (session_check(self))
+		return NULL;
+
+	if (build_counter_configs(events,strcfg,&seq))
+		return NULL;
+
+	if (raw)
+		ret=pmctrack_config_counters(self->desc,strcfg,virtcfg,timeout_ms);
+	else
+		ret=pmctrack_config_counters_mnemonic(self->desc,strcfg,virtcfg,timeout_ms,pmu_id);
+
+	Py_XDECREF(seq);
+
+	if (ret) {
+		PyErr_SetString(PyExc_OSError,"Can't configure the performance counters");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+/* start(cpus=None, syswide=False) */
+static PyObject* Session_start(SessionObject* self, PyObject* args, PyObject* kwds)
+{
+	static char* kwlist[]= {"cpus","syswide",NULL};
+	const char* cpus=NULL;
+	int syswide=0;
+	int ret;
+
+	if (!PyArg_ParseTupleAndKeywords(args,kwds,"|zp",kwlist,&cpus,&syswide))
+		return NULL;
+
+	if (session_check(self))
+		return NULL;
+
+	if (self->state!=SESSION_IDLE) {
+		PyErr_SetString(PyExc_RuntimeError,"The session was already started");
+		return NULL;
+	}
+
+	/* A CPU list implies the system-wide mode */
+	if (cpus)
+		ret=pmctrack_start_counters_syswide_cpus(self->desc,cpus);
+	else if (syswide)
+		ret=pmctrack_start_counters_syswide(self->desc);
+	else
+		ret=pmctrack_start_counters(self->desc);
+
+	if (ret) {
+		PyErr_SetString(PyExc_OSError,"Can't start the monitoring session");
+		return NULL;
+	}
+
+	self->state=(cpus || syswide)?SESSION_SYSWIDE:SESSION_PER_THREAD;
+	Py_RETURN_NONE;
+}
+
+/*
+ * stop(): Stop the session and retrieve the remaining samples, which
+ * can be accessed afterwards via the buffer protocol.
+ */
+static PyObject* Session_stop(SessionObject* self, PyObject* unused)
+{
+	int ret;
+
+	if (session_check(self) || session_check_exports(self))
+		return NULL;
+
+	if (self->state==SESSION_IDLE) {
+		PyErr_SetString(PyExc_RuntimeError,"The session was not started");
+		return NULL;
+	}
+
+	if (self->state==SESSION_SYSWIDE)
+		ret=pmctrack_stop_counters_syswide(self->desc);
+	else
+		ret=pmctrack_stop_counters(self->desc);
+
+	self->state=SESSION_IDLE;
+
+	if (ret) {
+		PyErr_SetString(PyExc_OSError,"Can't stop the monitoring session");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+/*
+ * read_into(buffer): Retrieve the samples collected so far in the ongoing session.
+ * The kernel copies the samples straight into "buffer", a writable C-contiguous
+ * buffer whose items are pmc_sample_t structures (e.g., a NumPy array with the
+ * pmctrack.sample_dtype data type). The call blocks until some samples are
+ * available, with the GIL released. It returns the number of samples stored
+ * at the beginning of the buffer (zero if the session is over).
+ */
+static PyObject* Session_read_into(SessionObject* self, PyObject* args)
+{
+	Py_buffer view;
+	Py_ssize_t max_samples;
+	int nr_samples;
+	int saved_errno;
+
+	if (!PyArg_ParseTuple(args,"w*",&view))
+		return NULL;
+
+	if (session_check(self))
+		goto error;
+
+	if (view.itemsize!=sizeof(pmc_sample_t) || !PyBuffer_IsContiguous(&view,'C')) {
+		PyErr_Format(PyExc_ValueError,"A contiguous buffer of %zu-byte samples is required",sizeof(pmc_sample_t));
+		goto error;
+	}
+
+	max_samples=view.len/view.itemsize;
+
+	if (max_samples==0) {
+		PyBuffer_Release(&view);
+		return PyLong_FromLong(0);
+	}
+
+	/* libpmctrack reads the samples in bounded chunks */
+	if (max_samples>UINT_MAX)
+		max_samples=UINT_MAX;
+
+	self->busy=1;
+	Py_BEGIN_ALLOW_THREADS
+	nr_samples=pmctrack_read_samples(self->desc,view.buf,max_samples);
+	saved_errno=errno;
+	Py_END_ALLOW_THREADS
+	self->busy=0;
+
+	PyBuffer_Release(&view);
+
+	if (nr_samples<0) {
+		/* Interrupted by a signal: let the handler run (e.g., KeyboardInterrupt) */
+		if (saved_errno==EINTR) {
+			if (PyErr_CheckSignals())
+				return NULL;
+			return PyLong_FromLong(0);
+		}
+		errno=saved_errno;
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+
+	return PyLong_FromLong(nr_samples);
+error:
+	PyBuffer_Release(&view);
+	return NULL;
+}
+
+/* counter_config(): (nr_experiments, pmcmask, virtual_mask) of the current configuration */
+static PyObject* Session_counter_config(SessionObject* self, PyObject* unused)
+{
+	unsigned int nr_experiments,pmcmask,virtual_mask;
+
+	if (session_check(self))
+		return NULL;
+
+	pmctrack_get_counter_config(self->desc,&nr_experiments,&pmcmask,&virtual_mask);
+	return Py_BuildValue("(III)",nr_experiments,pmcmask,virtual_mask);
+}
+
+/*
+ * close(): Free up the descriptor (idempotent). If views of the collected
+ * samples still exist, the descriptor is freed once the last one is released.
+ */
+static PyObject* Session_close(SessionObject* self, PyObject* unused)
+{
+	if (!self->desc)
+		Py_RETURN_NONE;
+
+	if (session_check(self))
+		return NULL;
+
+	if (self->exports>0)
+		self->closed_desc=self->desc;
+	else
+		pmctrack_destroy(self->desc);
+
+	self->desc=NULL;
+	self->state=SESSION_IDLE;
+	Py_RETURN_NONE;
+}
+
+/* Number of samples retrieved when the session was last stopped */
+static Py_ssize_t Session_length(SessionObject* self)
+{
+	int nr_samples=0;
+
+	if (self->desc)
+		pmctrack_get_samples(self->desc,&nr_samples);
+	return nr_samples;
+}
+
+/*
+ * Export the samples retrieved when the session was last stopped
+ * as a read-only buffer of bytes (no copies involved)
+ */
+static int Session_getbuffer(SessionObject* self, Py_buffer* view, int flags)
+{
+	pmc_sample_t* samples;
+	int nr_samples=0;
+
+	if (session_check(self))
+		return -1;
+
+	samples=pmctrack_get_samples(self->desc,&nr_samples);
+
+	if (PyBuffer_FillInfo(view,(PyObject*)self,samples,
+	                      (Py_ssize_t)nr_samples*sizeof(pmc_sample_t),1,flags))
+		return -1;
+
+	self->exports++;
+	return 0;
+}
+
+static void Session_releasebuffer(SessionObject* self, Py_buffer* view)
+{
+	/* Deferred close */
+	if (--self->exports==0 && self->closed_desc) {
+		pmctrack_destroy(self->closed_desc);
+		self->closed_desc=NULL;
+	}
+}
+
+static PyMethodDef Session_methods[]= {
+	{"configure",(PyCFunction)(void(*)(void))Session_configure,METH_VARARGS|METH_KEYWORDS,
+	 "configure(events, virtual=None, timeout_ms=0, raw=False, pmu=0)\n\n"
+	 "Set the event sets (a string or a sequence of strings) and the virtual counters to monitor.\n"
+	 "Mnemonics are accepted unless raw is true. timeout_ms sets the sampling period."},
+	{"start",(PyCFunction)(void(*)(void))Session_start,METH_VARARGS|METH_KEYWORDS,
+	 "start(cpus=None, syswide=False)\n\n"
+	 "Start monitoring the calling thread, or the whole system if syswide is true\n"
+	 "or a CPU list (e.g., \"0-3,8\") is passed."},
+	{"stop",(PyCFunction)Session_stop,METH_NOARGS,
+	 "stop()\n\nStop the session and retrieve the remaining samples."},
+	{"read_into",(PyCFunction)Session_read_into,METH_VARARGS,
+	 "read_into(buffer) -> int\n\n"
+	 "Store the samples collected so far in a writable buffer of samples, without stopping\n"
+	 "the session. Blocks until samples are available and returns the number of samples read."},
+	{"counter_config",(PyCFunction)Session_counter_config,METH_NOARGS,
+	 "counter_config() -> (nr_experiments, pmcmask, virtual_mask)"},
+	{"close",(PyCFunction)Session_close,METH_NOARGS,
+	 "close()\n\nRelease the connection with the kernel module."},
+	{NULL}
+};
+
+static PySequenceMethods Session_as_sequence= {
+	.sq_length=(lenfunc)Session_length,
+};
+
+static PyBufferProcs Session_as_buffer= {
+	.bf_getbuffer=(getbufferproc)Session_getbuffer,
+	.bf_releasebuffer=(releasebufferproc)Session_releasebuffer,
+};
+
+static PyTypeObject SessionType= {
+	PyVarObject_HEAD_INIT(NULL,0)
+	.tp_name="pmctrack._pmctrack.Session",
+	.tp_doc="PMCTrack monitoring session (see libpmctrack)",
+	.tp_basicsize=sizeof(SessionObject),
+	.tp_flags=Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,
+	.tp_new=PyType_GenericNew,
+	.tp_init=(initproc)Session_init,
+	.tp_dealloc=(destructor)Session_dealloc,
+	.tp_methods=Session_methods,
+	.tp_as_sequence=&Session_as_sequence,
+	.tp_as_buffer=&Session_as_buffer,
+};
+
+/* Layout of a field of pmc_sample_t */
+typedef struct {
+	const char* name;
+	char kind;		/* 'i' (signed) or 'u' (unsigned integer) */
+	size_t elem_size;
+	size_t count;		/* Number of elements (0 for scalar fields) */
+	size_t offset;
+} sample_field_t;
+
+#define SAMPLE_SCALAR(field,kind) \
+	{#field,kind,sizeof(((pmc_sample_t*)0)->field),0,offsetof(pmc_sample_t,field)}
+#define SAMPLE_ARRAY(field,kind) \
+	{#field,kind,sizeof(((pmc_sample_t*)0)->field[0]), \
+	 sizeof(((pmc_sample_t*)0)->field)/sizeof(((pmc_sample_t*)0)->field[0]),offsetof(pmc_sample_t,field)}
+
+static const sample_field_t sample_fields[]= {
+	SAMPLE_SCALAR(type,'i'),
+	SAMPLE_SCALAR(coretype,'i'),
+	SAMPLE_SCALAR(exp_idx,'i'),
+	SAMPLE_SCALAR(config_epoch,'u'),
+	SAMPLE_SCALAR(pid,'i'),
+	SAMPLE_SCALAR(target_id,'i'),
+	SAMPLE_SCALAR(elapsed_time,'u'),
+	SAMPLE_SCALAR(timestamp,'u'),
+	SAMPLE_SCALAR(pmc_mask,'u'),
+	SAMPLE_SCALAR(nr_counts,'u'),
+	SAMPLE_ARRAY(pmc_counts,'u'),
+	SAMPLE_SCALAR(virt_mask,'u'),
+	SAMPLE_SCALAR(nr_virt_counts,'u'),
+	SAMPLE_ARRAY(virtual_counts,'u'),
+};
+
+/*
+ * sample_layout() -> (itemsize, [(name, format, count, offset), ...])
+ * Layout of pmc_sample_t as seen by the compiler (the NumPy data type is built from it)
+ */
+static PyObject* pmctrack_sample_layout(PyObject* self, PyObject* unused)
+{
+	PyObject* fields;
+	int i;
+	int nr_fields=sizeof(sample_fields)/sizeof(sample_field_t);
+
+	if (!(fields=PyList_New(nr_fields)))
+		return NULL;
+
+	for (i=0; i<nr_fields; i++) {
+		const sample_field_t* field=&sample_fields[i];
+		char format[8];
+		PyObject* item;
+
+		/* NumPy-style format (e.g., "u8") */
+		snprintf(format,sizeof(format),"%c%zu",field->kind,field->elem_size);
+
+		if (!(item=Py_BuildValue("(ssnn)",field->name,format,
+		                         (Py_ssize_t)field->count,(Py_ssize_t)field->offset))) {
+			Py_DECREF(fields);
+			return NULL;
+		}
+		PyList_SET_ITEM(fields,i,item);
+	}
+
+	return Py_BuildValue("(nN)",(Py_ssize_t)sizeof(pmc_sample_t),fields);
+}
+
+static PyMethodDef pmctrack_methods[]= {
+	{"sample_layout",pmctrack_sample_layout,METH_NOARGS,
+	 "sample_layout() -> (itemsize, [(name, format, count, offset), ...])"},
+	{NULL}
+};
+
+static struct PyModuleDef pmctrack_module= {
+	PyModuleDef_HEAD_INIT,
+	.m_name="pmctrack._pmctrack",
+	.m_doc="Low-level bindings to libpmctrack (use the pmctrack package instead)",
+	.m_size=-1,
+	.m_methods=pmctrack_methods,
+};
+
+PyMODINIT_FUNC PyInit__pmctrack(void)
+{
+	PyObject* m;
+
+	if (PyType_Ready(&SessionType)<0)
+		return NULL;
+
+	if (!(m=PyModule_Create(&pmctrack_module)))
+		return NULL;
+
+	Py_INCREF(&SessionType);
+	if (PyModule_AddObject(m,"Session",(PyObject*)&SessionType)<0) {
+		Py_DECREF(&SessionType);
+		Py_DECREF(m);
+		return NULL;
+	}
+
+	if (PyModule_AddIntMacro(m,MAX_PERFORMANCE_COUNTERS) ||
+	    PyModule_AddIntMacro(m,MAX_VIRTUAL_COUNTERS) ||
+	    PyModule_AddIntMacro(m,MAX_COUNTER_CONFIGS) ||
+	    PyModule_AddIntMacro(m,PMC_TICK_SAMPLE) ||
+	    PyModule_AddIntMacro(m,PMC_EBS_SAMPLE) ||
+	    PyModule_AddIntMacro(m,PMC_EXIT_SAMPLE) ||
+	    PyModule_AddIntMacro(m,PMC_MIGRATION_SAMPLE) ||
+	    PyModule_AddIntMacro(m,PMC_SELF_SAMPLE)) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
+	return m;
+}
@@ -0,0 +1,203 @@
+# -*- coding: utf-8 -*-
+#
+# pmctrack/__init__.py
+#
+##############################################################################
+#
+# Copyright (c) 2026 agent <agent@local>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+# MA 02110-1301, USA.
+#
+##############################################################################
+#
+#  Python bindings to libpmctrack. Samples are handled as NumPy structured
+#  arrays with the layout of pmc_sample_t (sample_dtype), so they are
+#  never converted to text: the kernel copies them straight into
+#  preallocated arrays (Session.read_into()) and binary streams generated
+#  with "pmctrack -w" are mapped onto arrays as they are read.
+#
+
+import struct
+
+import numpy as np
+
+from . import _pmctrack
+from ._pmctrack import (MAX_PERFORMANCE_COUNTERS, MAX_VIRTUAL_COUNTERS,
+                        MAX_COUNTER_CONFIGS, PMC_TICK_SAMPLE, PMC_EBS_SAMPLE,
+                        PMC_EXIT_SAMPLE, PMC_MIGRATION_SAMPLE, PMC_SELF_SAMPLE)
+
+
+def _build_sample_dtype(nr_virt_counts=MAX_VIRTUAL_COUNTERS, itemsize=None):
+	"""Build the NumPy data type of a sample (optionally with fewer virtual counts)"""
+	sample_size, layout = _pmctrack.sample_layout()
+	names, formats, offsets = [], [], []
+
+	for name, fmt, count, offset in layout:
+		if name == "virtual_counts":
+			count = nr_virt_counts
+		names.append(name)
+		formats.append((fmt, (count,)) if name in ("pmc_counts", "virtual_counts") else fmt)
+		offsets.append(offset)
+
+	return np.dtype({"names": names, "formats": formats, "offsets": offsets,
+	                 "itemsize": itemsize or sample_size})
+
+
+# Data type with the exact layout of pmc_sample_t
+sample_dtype = _build_sample_dtype()
+
+
+def empty_samples(nr_samples):
+	"""Allocate an array for nr_samples samples (to be filled in with Session.read_into())"""
+	return np.zeros(nr_samples, dtype=sample_dtype)
+
+
+class Session(_pmctrack.Session):
+	"""PMCTrack monitoring session (wrapper of a libpmctrack descriptor).
+
+	Session(max_samples=0) connects to PMCTrack's kernel module. If
+	max_samples is zero, samples are exchanged with the kernel through a
+	page-sized shared memory region; otherwise a buffer for max_samples
+	samples is used.
+	"""
+
+	def samples(self):
+		"""Samples retrieved by the last stop() call, as a read-only array.
+
+		The array refers to the session's memory (no copies involved), and
+		must be released before stopping the session again. It remains
+		valid after the session is closed.
+		"""
+		return np.frombuffer(self, dtype=sample_dtype)
+
+	def read(self, out=None, max_samples=1024):
+		"""Samples collected so far in the ongoing session.
+
+		The kernel copies the samples straight into "out" (a preallocated
+		array with the sample_dtype data type), or into a new array of
+		max_samples samples if "out" is not provided. Blocks until samples
+		are available, and returns the part of the array holding the samples
+		retrieved (an empty array once the session is over).
+		"""
+		if out is None:
+			out = empty_samples(max_samples)
+		nr_samples = self.read_into(out)
+		return out[:nr_samples]
+
+	def __enter__(self):
+		return self
+
+	def __exit__(self, exc_type, exc_value, traceback):
+		self.close()
+		return False
+
+
+# Binary streams of samples (see pmct_stream_header_t in pmctrack_internal.h)
+STREAM_MAGIC = b"\x89PMCTRK\n"
+STREAM_VERSION = 1
+STREAM_SYSWIDE = 0x1
+STREAM_MULTI_TARGET = 0x2
+STREAM_EXTENDED = 0x4
+
+_stream_header = struct.Struct("=8s6I")
+
+
+class StreamHeader(object):
+	"""Header of a binary stream of samples"""
+
+	def __init__(self, data):
+		(magic, self.version, self.sample_size, self.nr_experiments,
+		 self.pmcmask, self.virtual_mask, self.flags) = _stream_header.unpack(data)
+
+		if magic != STREAM_MAGIC:
+			raise ValueError("Not a stream of PMCTrack samples")
+
+		min_size = sample_dtype.fields["virtual_counts"][1]
+
+		if (self.version != STREAM_VERSION or self.sample_size < min_size or
+		    self.sample_size > sample_dtype.itemsize or
+		    (self.sample_size - min_size) % 8):
+			raise ValueError("Unsupported stream of samples (version %d, %d-byte samples)" %
+			                 (self.version, self.sample_size))
+
+		# Samples only hold the virtual counts in use
+		self.dtype = _build_sample_dtype((self.sample_size - min_size) // 8, self.sample_size)
+
+
+def _open_stream(source):
+	"""Open a stream given as a path or as a (binary or text) file object"""
+	if isinstance(source, (str, bytes)) or hasattr(source, "__fspath__"):
+		return open(source, "rb"), True
+	# Binary file objects (e.g., sys.stdin.buffer or a pipe)
+	return getattr(source, "buffer", source), False
+
+
+def _read_stream_header(fi):
+	data = fi.read(_stream_header.size)
+	if len(data) != _stream_header.size:
+		raise ValueError("Not a stream of PMCTrack samples")
+	return StreamHeader(data)
+
+
+def iter_stream(source, batch_size=4096):
+	"""Iterate over the samples of a binary stream generated with "pmctrack -w".
+
+	source may be a path or a binary file object, such as the stdout of a
+	running pmctrack process. Yields (header, samples) tuples, where
+	header is the StreamHeader of the stream and samples an array of up
+	to batch_size samples, as soon as they are read, so the stream can be
+	processed while it is being generated. The arrays are built over the
+	data read (no copies involved), with as many virtual counts as the
+	stream holds.
+	"""
+	fi, owned = _open_stream(source)
+	try:
+		header = _read_stream_header(fi)
+		# read1() returns whatever is available (pipes)
+		reader = getattr(fi, "read1", fi.read)
+		pending = b""
+
+		while True:
+			data = reader(batch_size * header.sample_size - len(pending))
+			if not data:
+				break
+			data = pending + data if pending else data
+			nr_samples = len(data) // header.sample_size
+			tail = nr_samples * header.sample_size
+			pending = data[tail:]
+			if nr_samples:
+				yield header, np.frombuffer(data, dtype=header.dtype, count=nr_samples)
+	finally:
+		if owned:
+			fi.close()
+
+
+def read_stream(source):
+	"""Read a whole binary stream generated with "pmctrack -w".
+
+	Returns the stream header and an array with all the samples,
+	built over the data read (no copies involved).
+	"""
+	fi, owned = _open_stream(source)
+	try:
+		header = _read_stream_header(fi)
+		data = fi.read()
+	finally:
+		if owned:
+			fi.close()
+
+	return header, np.frombuffer(data, dtype=header.dtype,
+	                             count=len(data) // header.sample_size)
@@ -178,6 +178,38 @@ void remove_items_cbuffer_t ( cbuffer_t* cbuffer, void* vitems, int nr_items)
 	cbuffer->size-=nr_items;
 }
 
+/* Copy nr_items starting at 'offset' bytes from the head (the items are not removed) */
+void peek_items_cbuffer_t ( cbuffer_t* cbuffer, unsigned int offset, void* vitems, int nr_items)
+{
+	char* items=(char*)vitems;
+	unsigned int pos;
+	int items_copied;
+
+	/* Restriction: the items must be in the buffer (Ignore) */
+	if (offset+nr_items>cbuffer->size)
+		return;
+
+	pos=(cbuffer->head+offset)%cbuffer->max_size;
+
+	/* Check if the items wrap around the end of the buffer */
+	if (pos+nr_items > cbuffer->max_size) {
+		items_copied=cbuffer->max_size-pos;
+		memcpy(items,&cbuffer->data[pos],items_copied);
+		memcpy(items+items_copied,cbuffer->data,nr_items-items_copied);
+	} else
+		memcpy(items,&cbuffer->data[pos],nr_items);
+}
+
+/* Removes nr_items from the beginning of the buffer (without copying them) */
+void discard_items_cbuffer_t ( cbuffer_t* cbuffer, int nr_items)
+{
+	if (nr_items>cbuffer->size)
+		nr_items=cbuffer->size;
+
+	cbuffer->head=(cbuffer->head+nr_items)%cbuffer->max_size;
+	cbuffer->size-=nr_items;
+}
+
 int remove_cbuffer_t_batch(cbuffer_t* cbuffer, void* items, int max_nr_items)
 {
 	/* Check the maximum number of bytes we can actually retrieve */
@@ -58,6 +58,12 @@ char remove_cbuffer_t ( cbuffer_t* cbuffer);
 /* Removes nr_items from the buffer and returns a copy of them */
 void remove_items_cbuffer_t ( cbuffer_t* cbuffer, void* items, int nr_items);
 
+/* Copy nr_items starting at 'offset' bytes from the head (the items are not removed) */
+void peek_items_cbuffer_t ( cbuffer_t* cbuffer, unsigned int offset, void* items, int nr_items);
+
+/* Removes nr_items from the beginning of the buffer (without copying them) */
+void discard_items_cbuffer_t ( cbuffer_t* cbuffer, int nr_items);
+
 /* Empty stuff from the buffer (whatever we've got inside) */
 int remove_cbuffer_t_batch(cbuffer_t* cbuffer, void* items, int max_nr_items);
 
@@ -11,11 +11,24 @@
 #ifndef PHASE_TABLE_H
 #define PHASE_TABLE_H
 
+#include <linux/types.h>
+
+#define PHASE_TABLE_MAX_METRICS 4	/* Max dimensions of the metric vector of an indexed table */
+
 struct phase_table;
 typedef struct phase_table phase_table_t;
 
 /* Create/Destroy a phase table */
 phase_table_t* create_phase_table(unsigned int max_phases, size_t phase_struct_size, int (*compare)(void*,void*,void*));
+
+/*
+ * Create a phase table with an index for nearest-neighbour lookups.
+ * get_metrics() retrieves the metric vector (nr_metrics values) of a phase,
+ * which is quantized using the widths in bucket_width. Only phases less than
+ * half a bucket width away from the key in every dimension are found.
+ */
+phase_table_t* create_indexed_phase_table(unsigned int max_phases, size_t phase_struct_size, int (*compare)(void*,void*,void*),
+        unsigned int nr_metrics, const uint64_t* bucket_width, void (*get_metrics)(void*,uint64_t*));
 void destroy_phase_table(phase_table_t* table);
 
 /* Retrieve the most similar phase in a phase table */
@@ -2,6 +2,7 @@
 #define PMC_INTEL_CMT_H
 
 #include <linux/types.h>
+#include <linux/percpu.h>
 #include <pmc/pmu_config.h> //For cpuid_regs_t
 
 /* API Intel CMT */
@@ -18,6 +19,11 @@
 #define L3_TOTAL_BW_EVENT_ID	0x02
 #define L3_LOCAL_BW_EVENT_ID	0x03
 
+/* Period of the workers that read CMT/MBM counters on each LLC */
+#define CMT_DEFAULT_READOUT_PERIOD_MS	100
+#define CMT_MIN_READOUT_PERIOD_MS	10
+#define CMT_MAX_READOUT_PERIOD_MS	1000
+
 /*
  * We have found empirically that memory bandwith
  * cumulative counters are 24-bit wide !!
@@ -56,10 +62,17 @@ typedef struct {
 typedef struct {
 	unsigned int rmid;
 	uint64_t last_llc_utilization[RMID_MAX_LLCS][CMT_MAX_EVENTS];
-	uint64_t last_cmt_value[RMID_MAX_LLCS][CMT_MAX_EVENTS];
 	unsigned int cos_id;
 } intel_cmt_thread_struct_t;
 
+/* Contents of IA32_PQR_ASSOC currently programmed on a CPU */
+typedef struct {
+	unsigned int rmid;
+	unsigned int cos_id;
+} intel_cmt_pqr_state_t;
+
+DECLARE_PER_CPU(intel_cmt_pqr_state_t, cmt_pqr_state);
+
 /* Supported RMID allocation policies */
 typedef enum {
 	RMID_FIFO,
@@ -71,6 +84,17 @@ rmid_allocation_policy_t;
 
 extern const char* rmid_allocation_policy_str[NR_RMID_ALLOC_POLICIES];
 
+/* Groups of threads that share an RMID */
+typedef enum {
+	RMID_SHARE_THREAD,	/* One RMID per thread */
+	RMID_SHARE_PROCESS,	/* Threads of the same process */
+	RMID_SHARE_CGROUP,	/* Threads in the same cgroup (of the default hierarchy) */
+	NR_RMID_SHARING_POLICIES
+}
+rmid_sharing_policy_t;
+
+extern const char* rmid_sharing_policy_str[NR_RMID_SHARING_POLICIES];
+
 static inline void initialize_cmt_thread_struct(intel_cmt_thread_struct_t* data)
 {
 	int i,j;
@@ -80,7 +104,6 @@ static inline void initialize_cmt_thread_struct(intel_cmt_thread_struct_t* data)
 	for (i=0; i<RMID_MAX_LLCS; i++) {
 		for(j=0; j<CMT_MAX_EVENTS; j++) {
 			data->last_llc_utilization[i][j]=0;
-			data->last_cmt_value[i][j]=0;
 		}
 	}
 
@@ -110,24 +133,39 @@ int intel_mba_set_delay_values(intel_mba_support_t* mba_support, unsigned int id
 void intel_cmt_update_supported_events(intel_cmt_support_t* cmt_support,intel_cmt_thread_struct_t* data, unsigned int llc_id);
 
 
-/* Remove a unused RMID from the free pool and return it. */
-unsigned int get_rmid(void);
+struct task_struct;
+
+/*
+ * Return the RMID shared by the group of threads task "p" belongs to
+ * (based on the sharing policy), and take a reference to it.
+ * RMID 0 is returned if no RMID is available.
+ */
+unsigned int get_rmid(struct task_struct* p);
 
 /*
  * Decrease the reference counter of a given RMID.
- * If the reference counter reaches 0, put the RMID back in
- * the free RMID pool.
+ * If the reference counter reaches 0, the RMID goes into the limbo,
+ * and returns to the free pool once its LLC occupancy drains.
  */
 void put_rmid(uint_t rmid);
 
-/* Increase the reference counter of a given RMID */
-void use_rmid(unsigned int rmid);
-
 
 /* Functions to select/retrieve the current allocation policy for Intel CMT */
 rmid_allocation_policy_t get_cmt_policy(void);
 void set_cmt_policy(rmid_allocation_policy_t new_policy);
 
+/*
+ * Functions to select/retrieve the RMID sharing policy
+ * (threads get an RMID of their own by default)
+ */
+rmid_sharing_policy_t get_rmid_sharing_policy(void);
+int set_rmid_sharing_policy(rmid_sharing_policy_t new_policy);
+
+/* Parameters of the readout workers and the RMID limbo */
+int intel_cmt_set_readout_period(unsigned int period_ms);
+void intel_cmt_set_limbo_threshold(u64 bytes);
+int intel_cmt_print_rmid_pool(char* str);
+
 
 
 /** Low level functions to access CMT/MBM MSRs **/
@@ -143,14 +181,26 @@ static inline u64 __rmid_read(unsigned long rmid, unsigned int event)
 	return val;
 }
 
+/*
+ * Program the RMID and COS of the current CPU. The MSR write
+ * is skipped if IA32_PQR_ASSOC already holds the same values.
+ * (Must be invoked with preemption disabled)
+ */
 static inline void __set_rmid_and_cos(unsigned int rmid, unsigned int cosid)
 {
+	intel_cmt_pqr_state_t* state=this_cpu_ptr(&cmt_pqr_state);
+
+	if (state->rmid==rmid && state->cos_id==cosid)
+		return;
+
 	wrmsr(MSR_IA32_PQR_ASSOC,rmid,cosid);
+	state->rmid=rmid;
+	state->cos_id=cosid;
 }
 
 static inline void __unset_rmid(void)
 {
-	wrmsr(MSR_IA32_PQR_ASSOC,DISABLE_RMID,0);
+	__set_rmid_and_cos(DISABLE_RMID,0);
 }
 
 
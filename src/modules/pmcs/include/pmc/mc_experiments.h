@@ -15,6 +15,13 @@
 #include <sys/types.h>
 #endif
 #include <linux/ktime.h>
+#include <linux/compiler.h>
+
+/* READ_ONCE()/WRITE_ONCE() were introduced in Linux 3.19 */
+#ifndef READ_ONCE
+#define READ_ONCE(x) ACCESS_ONCE(x)
+#define WRITE_ONCE(x,val) (ACCESS_ONCE(x)=(val))
+#endif
 
 
 /* Divide in 32bit mode */
@@ -31,6 +38,7 @@
 CLONE_SIGHAND| CLONE_THREAD )
 #define is_new_thread(flags) ((flags & PMC_NEW_THREAD)==PMC_NEW_THREAD)
 #define TBS_TIMER
+#define MAX_MONITORING_MODULES	8	/* Max number of monitoring modules loaded at once */
 
 #include <linux/proc_fs.h>
 #include <linux/sched.h>
@@ -39,6 +47,9 @@ CLONE_SIGHAND| CLONE_THREAD )
 #include <pmc/pmc_user.h> /*For the data type */
 #include <pmc/data_str/cbuffer.h>
 #include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/list.h>
 #include <linux/timer.h>
 #include <linux/version.h>
 
@@ -125,6 +136,10 @@ typedef enum {
 	EBS_SCHED_MODE		/* Scheduler-driven event-based sampling */
 } pmc_profiling_mode_t;
 
+/* Filter evaluated on the samples before pushing them into the buffer (opaque) */
+struct pmc_sample_filter;
+struct pmc_user_metric_set;
+
 /*
  * SMP-safe data structure to store
  * PMC samples and virtual counter values.
@@ -146,10 +161,56 @@ typedef struct {
 									 * The kernel frees up the memory of the object when
 									 * the ref counter reaches 0.
 									 */
+	unsigned int config_epoch;		/* Incremented every time the monitor publishes a new PMC configuration */
+	core_experiment_set_t pending_cfg[AMP_MAX_CORETYPES]; /* Last PMC configuration published by the monitor
+														   * (threads or CPUs sharing the buffer switch to it
+														   * at their next sample boundary)
+														   */
+	uint64_t flight_window_ns;		/* Flight-recorder mode: keep only the samples gathered in
+									 * the last flight_window_ns nanoseconds (0 if disabled)
+									 */
+	unsigned int flight_dump_bytes;	/* Bytes of a triggered dump not delivered to the monitor yet */
+	int flight_dump_end;			/* Set when a dump is over: the next read fails with EAGAIN
+									 * to mark the end of the dump
+									 */
+	struct list_head flight_links;	/* Links in the list of flight-recorder buffers */
+	struct pmc_sample_filter* filter;	/* Samples that do not pass the filter are not pushed (NULL if none) */
+	struct pmc_user_metric_set __rcu* user_metrics;	/* User-defined metrics in force when the session
+													 * configured its virtual counters (NULL if none)
+													 */
+	unsigned int sample_size;		/* Bytes taken up by every sample in the ring buffer
+									 * (only the virtual counts in use are stored)
+									 */
 } pmc_samples_buffer_t;
 
+/*
+ * Per-thread copy of the event sets published by the monitor for a
+ * given configuration epoch. Copies are built outside the PMI handler,
+ * which only swaps them with the event sets in use (see refresh_pmc_config_epoch()).
+ */
+typedef struct pmc_config_update {
+	unsigned int epoch;
+	core_experiment_set_t sets[AMP_MAX_CORETYPES];
+} pmc_config_update_t;
+
 /* Predeclaration for monitoring_module type */
 struct monitoring_module;
+/* Predeclaration for the set of cgroups monitored in system-wide mode */
+struct syswide_cgroup_set;
+
+#define PMON_MAX_METRIC_KEYS	32	/* Capacity of the per-thread metric snapshot */
+
+/*
+ * High-level metrics of a thread published by the monitoring modules
+ * when a new sample is collected, so that the scheduler can read them
+ * without taking the thread's lock (see mm_publish_metric())
+ */
+typedef struct {
+	seqcount_t seq;							/* Odd while the snapshot is being updated */
+	unsigned long valid_mask;				/* Keys with a published value */
+	unsigned char publisher[PMON_MAX_METRIC_KEYS];	/* ID of the module that published each value */
+	uint64_t values[PMON_MAX_METRIC_KEYS];	/* Values indexed by metric key */
+} pmon_metric_snapshot_t;
 
 /*
  * Per-thread data structure maintained
@@ -178,6 +239,7 @@ typedef struct {
 #endif
 	spinlock_t lock;					/* Lock for PMC experiments */
 	pid_t pid_monitor;					/* PID of the monitor process */
+	int target_id;						/* Target id assigned by the monitor process on attach */
 	pmc_sample_t* pmc_user_samples;			/* Intermediate buffer to transfer data from kernel space
 	 								         * to the virtual address space of the monitor process
 	 								         * (Allocated on first use)
@@ -187,8 +249,14 @@ typedef struct {
 	uint_t nticks_sampling_period;			/* Scheduler-mode tick-based sampling period */
 	uint_t  kernel_buffer_size;				/* Max capacity (in bytes) of the ring buffer in "pmc_samples_buffer" */
 	ktime_t	ref_time;		 			/* To add timestamps to the various samples */
-	struct monitoring_module* task_mod;		/* Pointer to the monitoring module assigned to this task */
-	void* 	monitoring_mod_priv_data;		/* Per-thread private data for current monitoring module */
+	unsigned int config_epoch;			/* Configuration epoch of the event sets in use (see pmc_samples_buffer_t) */
+	pmc_config_update_t* cfg_update;	/* Event sets staged for the next configuration epoch (NULL if none) */
+	pmc_config_update_t* retired_cfg;	/* Event sets replaced by the last switch, waiting to be freed (NULL if none) */
+	pmc_aggr_level_t syswide_aggr;			/* Aggregation level for system-wide mode (inherited by the syswide timer) */
+	struct syswide_cgroup_set* syswide_cgroups; /* Cgroups to monitor in system-wide mode (NULL if none) */
+	unsigned long task_mod_mask;		/* IDs of the monitoring modules that were active when this task was created */
+	void* 	monitoring_mod_priv_data[MAX_MONITORING_MODULES];	/* Per-thread private data of each monitoring module (indexed by module ID) */
+	pmon_metric_snapshot_t metric_snapshot;	/* Metrics published for the scheduler */
 } pmon_prof_t;
 
 /** Various flag values for the "flags" field in pmon_prof_t ***/
@@ -290,8 +358,11 @@ static inline void init_core_experiment_set_t(core_experiment_set_t* cset)
 	cset->cur_exp=0;
 }
 
-/* Copy the configuration of a experiment set into another */
-static inline int clone_core_experiment_set_t(core_experiment_set_t* dst,core_experiment_set_t* src)
+/*
+ * Copy the configuration of a experiment set into another
+ * (gfp_flags are the allocation flags used for the new experiments)
+ */
+static inline int __clone_core_experiment_set_t(core_experiment_set_t* dst,core_experiment_set_t* src, gfp_t gfp_flags)
 {
 	int i=0,j=0;
 	core_experiment_t* exp=NULL;
@@ -301,7 +372,7 @@ static inline int clone_core_experiment_set_t(core_experiment_set_t* dst,core_ex
 
 	for (i=0; i<src->nr_exps; i++) {
 		if (src->exps[i]!=NULL) {
-			exp= (core_experiment_t*) kmalloc(sizeof(core_experiment_t), GFP_KERNEL);
+			exp= (core_experiment_t*) kmalloc(sizeof(core_experiment_t), gfp_flags);
 			if (!exp)
 				goto free_allocated_experiments;
 			memcpy(exp,src->exps[i],sizeof(core_experiment_t));
@@ -323,6 +394,12 @@ free_allocated_experiments:
 	return -ENOMEM;
 }
 
+/* Copy the configuration of a experiment set into another */
+static inline int clone_core_experiment_set_t(core_experiment_set_t* dst,core_experiment_set_t* src)
+{
+	return __clone_core_experiment_set_t(dst,src,GFP_KERNEL);
+}
+
 static inline int clone_core_experiment_set_t_noalloc(core_experiment_set_t* dst,core_experiment_set_t* src)
 {
 	int i=0,j=0;
@@ -353,6 +430,98 @@ static inline int clone_core_experiment_set_t_noalloc(core_experiment_set_t* dst
  */
 pmc_samples_buffer_t* allocate_pmc_samples_buffer(unsigned int size_bytes);
 
+/*
+ * Enable (window_ms>0) or disable (window_ms==0) the flight-recorder mode for a buffer.
+ * In this mode, the buffer keeps only the samples gathered in the last window_ms
+ * milliseconds, and nothing is delivered to the monitor until a dump is triggered.
+ * If size_bytes>0, the ring buffer is replaced with a new one of that capacity.
+ */
+int pmc_samples_buffer_set_flight_recorder(pmc_samples_buffer_t* sbuf, unsigned int window_ms, unsigned int size_bytes);
+/*
+ * Change the size of the samples stored in the buffer (see pmc_sample_size()).
+ * Returns -EBUSY if the buffer holds samples already.
+ */
+int pmc_samples_buffer_set_sample_size(pmc_samples_buffer_t* sbuf, unsigned int sample_size);
+
+/* Remove a buffer from the list of flight-recorder buffers (invoked before freeing it up) */
+void pmc_samples_buffer_unregister_flight_recorder(pmc_samples_buffer_t* sbuf);
+
+/*
+ * Trigger a dump of the samples in a flight-recorder buffer. The samples that are
+ * in the buffer at this point are delivered to the monitor process.
+ */
+int pmc_flight_recorder_trigger(pmc_samples_buffer_t* sbuf);
+
+/* Trigger a dump in every buffer in flight-recorder mode */
+int pmc_flight_recorder_trigger_all(void);
+
+/*
+ * Push a sample into a buffer in flight-recorder mode.
+ *
+ * The function must be invoked with the buffer's lock held.
+ */
+void __push_sample_flight_recorder(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample);
+
+/*
+ * Install a filter for the samples pushed into a buffer. The filter specification
+ * consists of space-separated conditions that must be met by a sample:
+ *  - "cpus=<cpulist>": the sample was gathered on one of these CPUs
+ *    (in system-wide mode, the CPU or domain id stored in the pid field)
+ *  - "<expr>><value>" or "<expr><<value>": a metric computed from the sample
+ *    is above/below a threshold. <expr> is either an event (pmcN or virtN) or
+ *    a relation between two events (e.g., pmc2/pmc0*1000 or pmc0-pmc1).
+ * The "none" specification removes the filter.
+ */
+int pmc_samples_buffer_set_filter(pmc_samples_buffer_t* sbuf, const char* spec);
+
+/* Returns a non-zero value if the sample passes the filter */
+int pmc_sample_filter_match(struct pmc_sample_filter* filter, pmc_sample_t* sample, int cpu);
+
+/*
+ * Define a metric that is computed for every sample and exported as
+ * a virtual counter. The specification has the "<name>=<expr>" format, where
+ * <expr> is an event (pmcN or virtN) or a relation between two events
+ * (e.g., "ipc=pmc0/pmc1*1000"). "<name>=none" removes the metric and
+ * "clear" removes all of them.
+ */
+int pmc_user_metric_define(const char* spec);
+
+/* Number of user-defined metrics available for new sessions */
+unsigned int pmc_user_metrics_nr_defined(void);
+
+/*
+ * Print "virtN=<name>" lines for the user-defined metrics into dst
+ * (first is the virtual-counter ID of the first metric) and return the end of the string.
+ */
+char* pmc_user_metrics_print(char* dst, unsigned int first);
+
+/* Take a reference to the current set of user-defined metrics (NULL if none) */
+struct pmc_user_metric_set* pmc_user_metrics_get(void);
+
+/* Drop a reference obtained with pmc_user_metrics_get() */
+void pmc_user_metrics_put(struct pmc_user_metric_set* set);
+
+/* Number of metrics in a set */
+unsigned int pmc_user_metrics_count(struct pmc_user_metric_set* set);
+
+/*
+ * Make the buffer's session use a given set of user-defined metrics.
+ * The buffer takes over the caller's reference to the set.
+ */
+void pmc_samples_buffer_set_user_metrics(pmc_samples_buffer_t* sbuf, struct pmc_user_metric_set* set);
+
+/*
+ * Compute the user-defined metrics of the buffer's session requested in virt_mask and append the values
+ * to the virtual counts of the sample (first is the virtual-counter ID of the first metric).
+ */
+void pmc_user_metrics_eval(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample, unsigned int virt_mask, unsigned int first);
+
+/* Returns a non-zero value if the buffer is in flight-recorder mode and no dump is pending */
+static inline int flight_recorder_idle(pmc_samples_buffer_t* sbuf)
+{
+	return sbuf->flight_window_ns && !sbuf->flight_dump_bytes;
+}
+
 /* Increment the buffer's reference counter */
 static inline void get_pmc_samples_buffer(pmc_samples_buffer_t* sbuf)
 {
@@ -368,13 +537,37 @@ static inline int get_pmc_samples_buffer_refs(pmc_samples_buffer_t* sbuf)
 /* Decrement the buffer's reference counter */
 static inline void put_pmc_samples_buffer(pmc_samples_buffer_t* sbuf)
 {
+	int i=0;
+
 	if (atomic_dec_and_test(&sbuf->ref_counter)) {
+		if (sbuf->flight_window_ns)
+			pmc_samples_buffer_unregister_flight_recorder(sbuf);
+		if (sbuf->filter)
+			kfree(sbuf->filter);
+		pmc_user_metrics_put(rcu_dereference_protected(sbuf->user_metrics,1));
 		destroy_cbuffer_t(sbuf->pmc_samples);
 		sbuf->pmc_samples=NULL;
+		for (i=0; i<AMP_MAX_CORETYPES; i++)
+			free_experiment_set(&sbuf->pending_cfg[i]);
 		kfree(sbuf);
 	}
 }
 
+/*
+ * Store a sample in the ring buffer, overwriting the oldest samples if
+ * the buffer is full. Only the first sbuf->sample_size bytes of the sample
+ * are stored, and whole samples are dropped so that the remaining ones stay aligned.
+ */
+static inline void __insert_sample_cbuffer(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample)
+{
+	cbuffer_t* cbuf=sbuf->pmc_samples;
+
+	while (nr_gaps_cbuffer_t(cbuf)<sbuf->sample_size && !is_empty_cbuffer_t(cbuf))
+		discard_items_cbuffer_t(cbuf,sbuf->sample_size);
+
+	insert_items_cbuffer_t(cbuf,sample,sbuf->sample_size);
+}
+
 /*
  * Pushes a sample (PMC counts and virtual-counter values) into the buffer and
  * notifies the userspace program if necessary.
@@ -383,8 +576,17 @@ static inline void put_pmc_samples_buffer(pmc_samples_buffer_t* sbuf)
  */
 static inline void __push_sample_cbuffer(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample)
 {
+	/* Discard uninteresting samples */
+	if (sbuf->filter && !pmc_sample_filter_match(sbuf->filter,sample,smp_processor_id()))
+		return;
 
-	insert_items_cbuffer_t (sbuf->pmc_samples, sample, sizeof(pmc_sample_t));
+	/* The monitor is not notified until a dump is triggered */
+	if (unlikely(sbuf->flight_window_ns)) {
+		__push_sample_flight_recorder(sbuf,sample);
+		return;
+	}
+
+	__insert_sample_cbuffer(sbuf,sample);
 
 	if (sbuf->monitor_waiting) {
 		sbuf->monitor_waiting=0;
@@ -394,12 +596,22 @@ static inline void __push_sample_cbuffer(pmc_samples_buffer_t* sbuf, pmc_sample_
 
 /*
  * Pushes a sample (PMC counts and virtual-counter values) into the buffer.
+ * This function is used in system-wide mode, where the pid field of the sample
+ * stores the CPU (or domain id).
  *
  * The function must be invoked with the buffer's lock held.
  */
 static inline void __push_sample_cbuffer_nowakeup(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample)
 {
-	insert_items_cbuffer_t (sbuf->pmc_samples, (const char*) sample, sizeof(pmc_sample_t));
+	if (sbuf->filter && !pmc_sample_filter_match(sbuf->filter,sample,sample->pid))
+		return;
+
+	if (unlikely(sbuf->flight_window_ns)) {
+		__push_sample_flight_recorder(sbuf,sample);
+		return;
+	}
+
+	__insert_sample_cbuffer(sbuf,sample);
 }
 
 /*
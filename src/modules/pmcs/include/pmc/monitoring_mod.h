@@ -16,6 +16,7 @@
 #include <linux/proc_fs.h>
 
 #define MAX_CHARS_EST_MOD 55
+#define MAX_STACKED_MODULES 4	/* Max number of monitoring modules active at once */
 
 
 /* Flags to pass to new_sample() */
@@ -70,8 +71,7 @@ typedef struct monitoring_module {
 													   			*/
 	int		(*on_fork)(unsigned long clone_flags,pmon_prof_t*);	/*	Invoked when a new process/thread is created.
 																	This function takes care of allocating per-thread data
-																	(if needed) and updating the "monitoring_mod_priv_data"
-																	pointer in pmon_prof_t.
+																	(if needed) and storing it with mm_set_priv_data().
 
 																	The function returns 0 on success, and a non-zero value upon failure (such as failing
 																	to allocate memory for the private data per-thread structure) .
@@ -82,6 +82,9 @@ typedef struct monitoring_module {
 	 * The on_new_sample() callback function gets invoked right after a PMC sample is collected
 	 * by PMCTrack's kernel module for a given thread (prof). Note that this function may be invoked in different scenarios:
 	 * TBS mode (on tick/on exit/on migration), scheduler mode or EBS mode.
+	 * Virtual counts must be appended at sample->virtual_counts[sample->nr_virt_counts++],
+	 * and flagged in sample->virt_mask using the indexes of the module's own counters
+	 * (as returned by mm_virt_counter_mask()).
 	 *
 	 * The function returns 0 on success, and a non-zero value upon failure
 	 */
@@ -97,6 +100,10 @@ typedef struct monitoring_module {
 	void	(*on_free_task)(pmon_prof_t* p);	/*	Invoked when the kernel is about to free up a process task structure */
 	void	(*on_switch_in)(pmon_prof_t* p);	/*	Invoked when a context switch in takes place (p is the "incoming" thread ) */
 	void	(*on_switch_out)(pmon_prof_t* p);	/*	Invoked when a context switch out takes place (p is the "outgoing" thread ) */
+	void	(*on_switch_in_unmonitored)(int cpu);	/*	Invoked when a thread not monitored by the module is switched in
+														on the current CPU. Modules that leave per-CPU hardware state
+														programmed on switch out can restore the default state here.
+													*/
 	/*
 	 * get_current_metric_value() gets invoked from the scheduler code when
 	 * a scheduling policy requests the value of a certain performance metric with ID=key.
@@ -120,7 +127,7 @@ typedef struct monitoring_module {
 																					stopping system-wide monitoring mode */
 	void 	(*on_syswide_refresh_monitor)(int cpu, unsigned int virtual_mask);	/* 	Invoked on each CPU to update virtual-counter
 																					counts in system-wide monitoring mode */
-	/* 	Invoked on each CPU to dump virtual-counter values into a pmc_sample_t structure */
+	/* 	Invoked on each CPU to dump virtual-counter values into a pmc_sample_t structure (appended as in on_new_sample()) */
 	void 	(*on_syswide_dump_virtual_counters)(int cpu, unsigned int virtual_mask, pmc_sample_t* sample);
 } monitoring_module_t;
 
@@ -135,8 +142,12 @@ int load_monitoring_module(monitoring_module_t* module);
 int unload_monitoring_module(int module_id);
 /* Get security code associated with current monitoring module */
 int current_monitoring_module_security_id(void);
-/* Get pointer to descriptor to current monitoring module */
+/* Get security code associated with a given monitoring module */
+int monitoring_module_security_id(monitoring_module_t* module);
+/* Get pointer to descriptor to current monitoring module (bottom of the stack) */
 monitoring_module_t* current_monitoring_module(void);
+/* Get bitmask with the IDs of the active monitoring modules */
+unsigned long current_monitoring_module_mask(void);
 /* Wrapper functions for every operation in the monitoring_module_t interface */
 int mm_on_read_config(char* str, unsigned int len);
 int mm_on_write_config(const char *str, unsigned int len);
@@ -149,13 +160,57 @@ void mm_on_exit(pmon_prof_t* prof);
 void mm_on_free_task(pmon_prof_t* prof);
 void mm_on_switch_in(pmon_prof_t* prof);
 void mm_on_switch_out(pmon_prof_t* prof);
+void mm_on_switch_in_unmonitored(pmon_prof_t* prof, int cpu);
 int mm_get_current_metric_value(pmon_prof_t* prof, int key, uint64_t* value);
 void mm_module_counter_usage(monitoring_module_counter_usage_t* usage);
 int mm_on_syswide_start_monitor(int cpu, unsigned int virtual_mask);
 void mm_on_syswide_stop_monitor(int cpu, unsigned int virtual_mask);
 void mm_on_syswide_refresh_monitor(int cpu, unsigned int virtual_mask);
-void mm_on_syswide_dump_virtual_counters(int cpu, unsigned int virtual_mask,pmc_sample_t* sample);
+void mm_on_syswide_dump_virtual_counters(int cpu, unsigned int virtual_mask,pmc_samples_buffer_t* sbuf,pmc_sample_t* sample);
+/* Number of virtual counters provided by the active monitoring modules themselves */
+unsigned int mm_nr_module_virtual_counters(void);
 
+/*
+ * Per-thread private data of a monitoring module.
+ * Every module has its own slot, so that several modules
+ * can be active for the same thread.
+ */
+static inline void* mm_get_priv_data(pmon_prof_t* prof, monitoring_module_t* module)
+{
+	return prof->monitoring_mod_priv_data[module->id];
+}
+
+static inline void mm_set_priv_data(pmon_prof_t* prof, monitoring_module_t* module, void* data)
+{
+	prof->monitoring_mod_priv_data[module->id]=data;
+}
+
+/*
+ * Virtual counters requested for a thread, relative to the slice of
+ * the virtual-counter space assigned to a given monitoring module.
+ * Bit 0 of the result corresponds to the first counter of the module.
+ */
+unsigned int mm_virt_counter_mask(pmon_prof_t* prof, monitoring_module_t* module);
+
+/*
+ * Publish the value of a high-level metric of a thread (key is an mc_metric_key_t
+ * or an mc_metric_extra_key_t value). The value becomes visible to lock-free readers
+ * (mm_get_current_metric_value()) as a whole with the other values published
+ * while processing the same sample, so this function must only be invoked from
+ * the on_new_sample() callback.
+ */
+static inline void mm_publish_metric(pmon_prof_t* prof, monitoring_module_t* module, int key, uint64_t value)
+{
+	pmon_metric_snapshot_t* snapshot=&prof->metric_snapshot;
+
+	/* Nothing to do outside the write section opened by mm_on_new_sample() */
+	if (key<0 || key>=PMON_MAX_METRIC_KEYS || !(raw_read_seqcount(&snapshot->seq) & 1))
+		return;
+
+	snapshot->values[key]=value;
+	snapshot->publisher[key]=module->id;
+	snapshot->valid_mask|=(1UL<<key);
+}
 
 /* Safe and generic open/close operations for /proc entries */
 int proc_generic_open(struct inode *inode, struct file *filp);
@@ -180,6 +235,9 @@ typedef enum {
 	MC_LIGHT_SHARING,
 	MC_PHASE_HIT_RATE,
 	MC_RESET_PHASE_STATISTICS,
+	MC_PHASE_ID,
+	MC_LLC_OCCUPANCY,
+	MC_NR_METRIC_KEYS	/* Must not exceed PMON_MAX_METRIC_KEYS */
 } mc_metric_extra_key_t;
 
 #endif
@@ -10,8 +10,12 @@
 #define PMC_USER_H
 #ifdef __KERNEL__
 #include <linux/types.h>
+#include <linux/ioctl.h>
+#include <linux/stddef.h>
 #else
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <stddef.h>
 #include <stdint.h>
 #endif
 
@@ -19,8 +23,9 @@
 #define MAX_PERFORMANCE_COUNTERS 11
 #endif
 
+/* Must not exceed the number of bits in the virt_mask field of pmc_sample_t */
 #ifndef MAX_VIRTUAL_COUNTERS
-#define MAX_VIRTUAL_COUNTERS 3
+#define MAX_VIRTUAL_COUNTERS 16
 #endif
 
 /* Available sample types */
@@ -38,8 +43,11 @@ typedef struct pmc_sample {
 	sample_type_t type;     /* Sample type */
 	int coretype;           /* Core type where this sample was registered */
 	int exp_idx;            /* Index of the experiment set related to this counter setup */
+	unsigned int config_epoch; /* Configuration epoch (incremented upon every hot reconfiguration of the event sets) */
 	pid_t pid;              /* To store a process id (per-thread mode) or CPU (system-wide mode) */
+	int target_id;          /* Monitored target the thread belongs to (when attaching to several processes) */
 	uint64_t elapsed_time;	/* Reference (from the time the previous sample was gathered) */
+	uint64_t timestamp;	/* Absolute time when the sample was gathered (CLOCK_MONOTONIC, in ns) */
 	unsigned int pmc_mask;  /* PMC mask for this sample */
 	unsigned int nr_counts; /* Number of performance counts associated with this sample */
 	uint64_t pmc_counts[MAX_PERFORMANCE_COUNTERS]; /* Raw PMC counts */
@@ -48,4 +56,63 @@ typedef struct pmc_sample {
 	uint64_t virtual_counts[MAX_VIRTUAL_COUNTERS];	/* Raw virtual-counter values */
 } pmc_sample_t;
 
+/*
+ * Size of a sample whose virtual-counter section holds nr_virt values.
+ * When the PMC_CFG_COMPACT_SAMPLES flag is used, samples are delivered to user space
+ * in this compact form, with as many slots as virtual counters configured for the session
+ * (the actual size is reported in the kern_sample_size field of pmc_session_config_t).
+ */
+#define pmc_sample_size(nr_virt) (offsetof(pmc_sample_t,virtual_counts)+(nr_virt)*sizeof(uint64_t))
+
+/*
+ * Aggregation levels for the system-wide mode. At any level other than
+ * PMC_AGGR_CPU, the kernel sums up per-CPU counts and pushes a single
+ * sample per domain, whose "pid" field stores the domain id
+ * (first CPU in the core or LLC domain, physical package id or NUMA node)
+ */
+typedef enum {
+	PMC_AGGR_CPU=0,
+	PMC_AGGR_CORE,
+	PMC_AGGR_LLC,
+	PMC_AGGR_SOCKET,
+	PMC_AGGR_NODE,
+	PMC_NR_AGGR_LEVELS
+} pmc_aggr_level_t;
+
+/* Max number of cgroups that can be monitored at once in system-wide mode */
+#define PMC_MAX_CGROUPS	64
+
+#define PMC_MAX_CONFIG_EXPERIMENTS	10
+#define PMC_MAX_CONFIG_STRING_LEN	160
+
+/* Flags for the session configuration (pmc_session_config_t) */
+#define PMC_CFG_SYSWIDE			0x1 /* Event sets are meant for system-wide mode */
+#define PMC_CFG_SELF_MONITORING	0x2 /* Enable self-monitoring mode for the calling thread */
+#define PMC_CFG_KERNEL_CONTROL	0x4 /* The timeout sets the sampling period of the monitoring module */
+#define PMC_CFG_START			0x8 /* Start counting once the session is configured */
+#define PMC_CFG_COMPACT_SAMPLES	0x10 /* Deliver samples with a variable-length virtual-counter section */
+
+/*
+ * Fully-resolved configuration of a monitoring session.
+ * Applied in a single call via the PMCTRACK_IOC_CONFIG ioctl()
+ * on /proc/pmc/monitor, rather than with a sequence of writes to /proc/pmc/config
+ */
+typedef struct pmc_session_config {
+	unsigned int flags;                 /* PMC_CFG_* flags */
+	unsigned int nr_experiments;        /* Number of event sets in pmc_cfg */
+	char pmc_cfg[PMC_MAX_CONFIG_EXPERIMENTS][PMC_MAX_CONFIG_STRING_LEN]; /* Raw PMC configuration strings */
+	char virt_cfg[PMC_MAX_CONFIG_STRING_LEN]; /* Raw virtual-counter configuration string ("" if none) */
+	unsigned int timeout_ms;            /* Sampling period in ms (0 to keep the current value) */
+	unsigned int kernel_buffer_size;    /* Size of the kernel buffer in bytes (0 to keep the current value) */
+	char cpu_list[PMC_MAX_CONFIG_STRING_LEN]; /* CPUs to monitor with PMC_CFG_START in system-wide mode ("" for all) */
+	/* Filled in by the kernel: counters in use by the active monitoring module */
+	unsigned int kern_pmcmask;
+	unsigned int kern_nr_pmcs;
+	unsigned int kern_nr_experiments;
+	unsigned int kern_sample_size;      /* Size of the samples delivered by the kernel (in bytes) */
+} pmc_session_config_t;
+
+#define PMCTRACK_IOC_MAGIC	'p'
+#define PMCTRACK_IOC_CONFIG	_IOWR(PMCTRACK_IOC_MAGIC, 1, pmc_session_config_t)
+
 #endif
@@ -10,6 +10,16 @@
 #define SYSWIDE_H
 
 #include <linux/proc_fs.h>
+#include <linux/cpumask.h>
+#include <linux/version.h>
+
+/*
+ * The cgroup-scoped mode relies on the cgroup v2 API
+ * (task_dfl_cgroup() and cgroup_get_from_path() appeared in Linux 4.6)
+ */
+#if defined(CONFIG_CGROUPS) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
+#define PMC_CGROUP_V2
+#endif
 
 /* Global init/cleanup functions */
 int syswide_monitoring_init(void);
@@ -29,10 +39,31 @@ int syswide_monitoring_switch_out(int cpu);
 /* Returns true if "p" is current syswide monitor process */
 int is_syswide_monitor(struct task_struct* p);
 
-/* Start/Stop syswide_monitoring */
-int syswide_monitoring_start(void);
+/* Start/Stop syswide_monitoring (cpus==NULL means all online CPUs) */
+int syswide_monitoring_start(const struct cpumask* cpus);
 int syswide_monitoring_stop(void);
 
+/* Start syswide_monitoring on the CPUs in a list such as "0-7,16" */
+int syswide_monitoring_start_cpulist(const char* cpulist);
+
+
+/*
+ * Translate an aggregation level name ("cpu", "core", "llc", "socket" or "node")
+ * into a pmc_aggr_level_t value. Returns -1 if the name is not valid.
+ */
+int syswide_aggr_level_from_str(const char* str);
+
+/* Set of cgroups monitored in the cgroup-scoped mode */
+struct syswide_cgroup_set;
+
+/*
+ * Add a cgroup (path in the cgroup v2 hierarchy) to a set of cgroups
+ * to be monitored in system-wide mode. The set is allocated on first use.
+ */
+int syswide_cgroup_set_add(struct syswide_cgroup_set** set, const char* path);
+
+/* Drop the references to the cgroups in a set and free it up */
+void syswide_cgroup_set_free(struct syswide_cgroup_set* set);
 
 /* Pause/Resume syswide_monitoring */
 int syswide_monitoring_pause(void);
@@ -1,22 +1,114 @@
 #include <pmc/intel_cmt.h>
 #include <linux/random.h>
 #include <linux/spinlock.h>
-
-/* Basic node of the RMID pool (linked list) */
+#include <linux/smp.h>
+#include <linux/hashtable.h>
+#include <linux/workqueue.h>
+#include <linux/cgroup.h>
+#include <linux/sched.h>
+#include <linux/topology.h>
+#include <linux/version.h>
+#include <linux/atomic.h>
+
+/* Life cycle of an RMID */
+typedef enum {
+	RMID_FREE,		/* In the free pool */
+	RMID_IN_USE,	/* Assigned to a group of threads */
+	RMID_LIMBO		/* Released, but its LLC occupancy has not drained yet */
+} rmid_state_t;
+
+/* Basic node of the RMID pool */
 typedef struct {
 	uint_t rmid;				/* RMID */
-	atomic_t ref_counter;		/* Reference counter for this RMID */
-	unsigned char free_rmid;	/* Is this RMID free? */
-	struct list_head links;		/* prev and next pointers */
+	rmid_state_t state;			/* Current state of the RMID */
+	unsigned int ref_counter;	/* Number of threads using the RMID */
+	rmid_sharing_policy_t sharing;	/* Sharing policy in effect when the RMID was assigned */
+	u64 group_key;				/* Identifier of the group of threads that share the RMID */
+	struct hlist_node hlink;	/* Link for the hash table of groups */
+	unsigned int limbo_epoch;	/* Incremented every time the RMID enters the limbo */
+	unsigned long dirty_llcs;	/* LLCs where the occupancy of a RMID in limbo is still too high */
+	/* Per-LLC counts updated by the readout worker:
+	   occupancy and cumulative bandwidth in bytes */
+	u64 counts[RMID_MAX_LLCS][CMT_MAX_EVENTS];
+	u64 last_raw_bw[RMID_MAX_LLCS][CMT_MAX_EVENTS];	/* Last raw values of MBM counters */
+	unsigned char raw_bw_valid[RMID_MAX_LLCS];	/* Is last_raw_bw meaningful? */
+	/* Bandwidth counts already reported by the threads of the group */
+	atomic64_t reported_bw[RMID_MAX_LLCS][CMT_MAX_EVENTS];
 } rmid_node_t;
 
-static rmid_node_t* node_pool; 			/* Array of RMID nodes */
-static LIST_HEAD(available_rmids);			/* RMID free pool (doubly linked list) */
+/* Readout worker of an LLC */
+typedef struct {
+	struct delayed_work work;
+	int cpu;				/* CPU where the worker runs (-1 if the LLC is not present) */
+	unsigned int llc_id;
+} llc_readout_t;
+
+#define RMID_GROUP_HASH_BITS	7
+
+static rmid_node_t* node_pool; 			/* Array of RMID nodes (node i holds RMID i+1) */
+static uint_t* free_rmids;				/* Free pool (circular buffer) */
+static unsigned int free_head;			/* Index of the first RMID in the free pool */
+static unsigned int nr_free_rmids;
+static unsigned int nr_limbo_rmids;
+static unsigned int nr_rmids;			/* Number of RMIDs available (RMID 0 excluded) */
+static DEFINE_HASHTABLE(rmid_groups,RMID_GROUP_HASH_BITS);	/* RMIDs in use indexed by group */
 static DEFINE_SPINLOCK(rmid_pool_lock);	/* Lock for the RMID pool */
-static int nr_available_rmids;
 static rmid_allocation_policy_t rmid_allocation_policy=RMID_FIFO;
+static rmid_sharing_policy_t rmid_sharing_policy=RMID_SHARE_THREAD;
+
+static intel_cmt_support_t* cmt_info;	/* CMT/MBM parameters of the processor */
+static llc_readout_t llc_readout[RMID_MAX_LLCS];
+static unsigned long present_llcs;		/* Bitmask of LLCs with a readout worker */
+static int readout_enabled=0;
+static unsigned int readout_period_ms=CMT_DEFAULT_READOUT_PERIOD_MS;
+static u64 limbo_threshold;	/* Max occupancy (bytes) of a RMID that can be recycled */
+
+/* Cached copy of IA32_PQR_ASSOC on each CPU */
+DEFINE_PER_CPU(intel_cmt_pqr_state_t, cmt_pqr_state);
 
 const char* rmid_allocation_policy_str[NR_RMID_ALLOC_POLICIES]= {"FIFO","LIFO","RANDOM"};
+const char* rmid_sharing_policy_str[NR_RMID_SHARING_POLICIES]= {"thread","process","cgroup"};
+
+/* Put a RMID back in the free pool (rmid_pool_lock must be held) */
+static void push_free_rmid(rmid_node_t* rmid_node)
+{
+	int i;
+
+	rmid_node->state=RMID_FREE;
+	/* MBM counters may wrap around while the RMID is not in use */
+	for (i=0; i<RMID_MAX_LLCS; i++)
+		rmid_node->raw_bw_valid[i]=0;
+
+	free_rmids[(free_head+nr_free_rmids)%nr_rmids]=rmid_node->rmid;
+	nr_free_rmids++;
+}
+
+/*
+ * Remove a RMID from the free pool based on the allocation policy
+ * (rmid_pool_lock must be held, and the pool must not be empty)
+ */
+static rmid_node_t* pop_free_rmid(void)
+{
+	unsigned int pos;
+	uint_t rmid;
+
+	if (rmid_allocation_policy==RMID_LIFO) {
+		rmid=free_rmids[(free_head+nr_free_rmids-1)%nr_rmids];
+	} else {
+		if (rmid_allocation_policy==RMID_RANDOM)
+			pos=(free_head+get_random_int()%nr_free_rmids)%nr_rmids;
+		else
+			pos=free_head;
+
+		/* Fill the gap with the first item */
+		rmid=free_rmids[pos];
+		free_rmids[pos]=free_rmids[free_head];
+		free_head=(free_head+1)%nr_rmids;
+	}
+
+	nr_free_rmids--;
+	return &node_pool[rmid-1];
+}
 
 /*
  * Initialize a pool with the RMID values
@@ -26,34 +118,33 @@ int initialize_rmid_pool(void)
 {
 	int i=0;
 	unsigned int starting_item;
+
 	/* Bear in mind that RMID 0 is already used (reserved) !! */
-	node_pool= kmalloc(sizeof (rmid_node_t)*(nr_available_rmids-1), GFP_KERNEL);
+	node_pool= kzalloc(sizeof (rmid_node_t)*nr_rmids, GFP_KERNEL);
+	free_rmids= kmalloc(sizeof (uint_t)*nr_rmids, GFP_KERNEL);
 
-	if (node_pool == NULL) {
+	if (node_pool == NULL || free_rmids == NULL) {
 		printk(KERN_INFO "Monitoring module was not able to successfully allocate memory for RMID node pool");
+		kfree(node_pool);
+		kfree(free_rmids);
+		node_pool=NULL;
+		free_rmids=NULL;
 		return -ENOMEM;
 	}
 
-	/* Important to initialize the list every time */
-	INIT_LIST_HEAD(&available_rmids);
+	/* Important to initialize the pool every time */
+	hash_init(rmid_groups);
+	free_head=0;
+	nr_free_rmids=0;
+	nr_limbo_rmids=0;
 
 	/* Generate pseudo-randomly at first */
-	starting_item=(get_random_int()%nr_available_rmids);
-
-	/* Allocate from the beginning */
-	for (i=starting_item; i<nr_available_rmids; i++) {
-		node_pool[i].rmid=i+1;
-		node_pool[i].free_rmid=1;
-		atomic_set(&node_pool[i].ref_counter,0);
-		list_add_tail(&(node_pool[i].links),&available_rmids);
-	}
+	starting_item=(get_random_int()%nr_rmids);
 
-	/* Remaining items... */
-	for (i=0; i<starting_item; i++) {
-		node_pool[i].rmid=i+1;
-		node_pool[i].free_rmid=1;
-		atomic_set(&node_pool[i].ref_counter,0);
-		list_add_tail(&(node_pool[i].links),&available_rmids);
+	for (i=0; i<nr_rmids; i++) {
+		rmid_node_t* rmid_node=&node_pool[(starting_item+i)%nr_rmids];
+		rmid_node->rmid=((starting_item+i)%nr_rmids)+1;
+		push_free_rmid(rmid_node);
 	}
 	return 0;
 }
@@ -62,53 +153,79 @@ int initialize_rmid_pool(void)
 void free_rmid_pool(void)
 {
 	kfree(node_pool);
+	kfree(free_rmids);
+	node_pool=NULL;
+	free_rmids=NULL;
 }
 
-/* Remove a unused RMID from the free pool and return it. */
-uint_t get_rmid(void)
+/*
+ * Identifier of the group task "p" belongs to under a given sharing policy.
+ * Cgroups are identified by their serial number, which (unlike the address
+ * of the cgroup) is never reused, so a new cgroup cannot inherit the RMID
+ * of a cgroup that was removed.
+ */
+static u64 rmid_group_key(struct task_struct* p, rmid_sharing_policy_t policy)
+{
+	u64 key;
+
+	switch (policy) {
+	case RMID_SHARE_THREAD:
+		return p->pid;
+	case RMID_SHARE_CGROUP:
+#if defined(CONFIG_CGROUPS) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
+		rcu_read_lock();
+		key=task_dfl_cgroup(p)->serial_nr;
+		rcu_read_unlock();
+		return key;
+#endif
+		/* Fall back to process-level sharing (no cgroup v2 API, not selectable anyway) */
+	default:
+		key=p->tgid;
+		return key;
+	}
+}
+
+/*
+ * Return the RMID of the group task "p" belongs to, and take a reference to it.
+ * If the group does not have an RMID yet, it gets one from the free pool.
+ * RMID 0 is returned if the pool is empty.
+ */
+uint_t get_rmid(struct task_struct* p)
 {
 	rmid_node_t* rmid_node=NULL;
-	unsigned int random_item;
-	rmid_node_t *aux = NULL;
+	rmid_sharing_policy_t policy=rmid_sharing_policy;
+	u64 key=rmid_group_key(p,policy);
 	uint selected_rmid=0; //None
 	unsigned long flags;
+	int i,j;
 
 	spin_lock_irqsave(&rmid_pool_lock,flags);
 
-	if (list_empty(&available_rmids)) {
-		spin_unlock(&rmid_pool_lock);
-		return 0;
-	}
-
-	switch(rmid_allocation_policy) {
-	case RMID_FIFO:
-		rmid_node=list_first_entry(&available_rmids,rmid_node_t,links);
-		break;
-	case RMID_LIFO:
-		rmid_node=list_entry(available_rmids.prev,rmid_node_t,links); /* list_last_entry */
-		break;
-	case RMID_RANDOM:
-		random_item=(get_random_int()%nr_available_rmids);
-		list_for_each_entry_safe(rmid_node, aux, &available_rmids, links) {
-			if ((random_item--)==0)
-				break;
+	hash_for_each_possible(rmid_groups,rmid_node,hlink,key) {
+		if (rmid_node->group_key==key && rmid_node->sharing==policy) {
+			rmid_node->ref_counter++;
+			selected_rmid=rmid_node->rmid;
+			goto out;
 		}
-		break;
-	default:
-		break;
-	}
-
-	if (rmid_node) {
-		list_del(&rmid_node->links);
-		rmid_node->free_rmid=0;
-		nr_available_rmids--;
-		selected_rmid=rmid_node->rmid;
-		atomic_inc(&rmid_node->ref_counter);
 	}
 
+	if (nr_free_rmids==0)
+		goto out;
+
+	rmid_node=pop_free_rmid();
+	rmid_node->state=RMID_IN_USE;
+	rmid_node->ref_counter=1;
+	rmid_node->sharing=policy;
+	rmid_node->group_key=key;
+	/* The bandwidth consumed by previous owners of the RMID is not reported */
+	for (i=0; i<RMID_MAX_LLCS; i++)
+		for (j=0; j<CMT_MAX_EVENTS; j++)
+			atomic64_set(&rmid_node->reported_bw[i][j],READ_ONCE(rmid_node->counts[i][j]));
+	hash_add(rmid_groups,&rmid_node->hlink,key);
+	selected_rmid=rmid_node->rmid;
+out:
 	spin_unlock_irqrestore(&rmid_pool_lock,flags);
 	return selected_rmid;
-
 }
 
 /* Functions to select/retrieve the current allocation
@@ -123,10 +240,55 @@ void set_cmt_policy(rmid_allocation_policy_t new_policy)
 	rmid_allocation_policy=new_policy;
 }
 
+/*
+ * Functions to select/retrieve the RMID sharing policy.
+ * Groups that already have an RMID keep it until all their threads exit.
+ */
+rmid_sharing_policy_t get_rmid_sharing_policy(void)
+{
+	return rmid_sharing_policy;
+}
+
+/*
+ * Returns a non-zero value if the cgroup v2 hierarchy is in use. On hosts
+ * that only mount cgroup v1 hierarchies, every task belongs to the root of the
+ * default hierarchy, which has no children.
+ */
+static int cgroup_v2_in_use(void)
+{
+#if defined(CONFIG_CGROUPS) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
+	struct cgroup* cgrp;
+	int in_use;
+
+	rcu_read_lock();
+	cgrp=task_dfl_cgroup(current);
+	while (cgroup_parent(cgrp))
+		cgrp=cgroup_parent(cgrp);
+	in_use=!list_empty(&cgrp->self.children);
+	rcu_read_unlock();
+	return in_use;
+#else
+	return 0;
+#endif
+}
+
+int set_rmid_sharing_policy(rmid_sharing_policy_t new_policy)
+{
+	/* All tasks would share the RMID of the root cgroup otherwise */
+	if (new_policy==RMID_SHARE_CGROUP && !cgroup_v2_in_use()) {
+		printk(KERN_INFO "The cgroup RMID sharing policy requires cgroup v2\n");
+		return -ENOTSUPP;
+	}
+
+	rmid_sharing_policy=new_policy;
+	return 0;
+}
+
 /*
  * Decrease the reference counter of a given RMID.
- * If the reference counter reaches 0, put the RMID back in
- * the free RMID pool.
+ * If the reference counter reaches 0, the RMID enters the limbo,
+ * and it will be put back in the free pool by the readout worker
+ * once its LLC occupancy drains.
  */
 void put_rmid(uint_t rmid)
 {
@@ -138,32 +300,188 @@ void put_rmid(uint_t rmid)
 
 	rmid_node=&node_pool[rmid-1];
 
-	if (rmid_node->free_rmid)
-		return;
+	spin_lock_irqsave(&rmid_pool_lock,flags);
+
+	if (rmid_node->state==RMID_IN_USE && --rmid_node->ref_counter==0) {
+		hash_del(&rmid_node->hlink);
+		rmid_node->dirty_llcs=present_llcs;
+		rmid_node->limbo_epoch++;
+		/* Pairs with smp_rmb() in readout_llc_counts() */
+		smp_wmb();
+		rmid_node->state=RMID_LIMBO;
+		nr_limbo_rmids++;
+	}
+
+	spin_unlock_irqrestore(&rmid_pool_lock,flags);
+}
+
+/*
+ * Update the per-LLC counts of a RMID.
+ * (Must be invoked on a CPU of the LLC)
+ */
+static void readout_rmid_counts(rmid_node_t* rmid_node, unsigned int llc_id)
+{
+	static const unsigned int bw_events[]= {L3_TOTAL_BW_EVENT_ID,L3_LOCAL_BW_EVENT_ID};
+	unsigned int supported[]= {cmt_info->event_l3_total_bw,cmt_info->event_l3_local_bw};
+	u64 val;
+	int i,idx;
+
+	if (cmt_info->event_l3_occupancy) {
+		val=__rmid_read(rmid_node->rmid,L3_OCCUPANCY_EVENT_ID);
+
+		if (!(val & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))) {
+			val&=((1ULL<<62ULL)-1); //Mask...
+			rmid_node->counts[llc_id][L3_OCCUPANCY_EVENT_ID-1]=val*cmt_info->upscaling_factor;
+		}
+	}
+
+	for (i=0; i<ARRAY_SIZE(bw_events); i++) {
+		if (!supported[i])
+			continue;
+
+		idx=bw_events[i]-1;
+		val=__rmid_read(rmid_node->rmid,bw_events[i]);
+
+		if (val & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
+			continue;
+
+		val&=MAX_CMT_COUNT;
+
+		/* Extend the 24-bit counter */
+		if (rmid_node->raw_bw_valid[llc_id])
+			rmid_node->counts[llc_id][idx]+=((val-rmid_node->last_raw_bw[llc_id][idx])&MAX_CMT_COUNT)*cmt_info->upscaling_factor;
+		rmid_node->last_raw_bw[llc_id][idx]=val;
+	}
+
+	rmid_node->raw_bw_valid[llc_id]=1;
+}
+
+/*
+ * Periodic worker of an LLC: update the counts of RMIDs in use
+ * and recycle the RMIDs in limbo whose occupancy has drained.
+ */
+static void readout_llc_counts(struct work_struct* work)
+{
+	llc_readout_t* llc=container_of(to_delayed_work(work),llc_readout_t,work);
+	rmid_node_t* rmid_node;
+	rmid_state_t state;
+	unsigned int epoch;
+	unsigned long flags;
+	int i;
+
+	for (i=0; i<nr_rmids; i++) {
+		rmid_node=&node_pool[i];
+		epoch=READ_ONCE(rmid_node->limbo_epoch);
+		smp_rmb();
+		state=READ_ONCE(rmid_node->state);
+
+		if (state==RMID_FREE)
+			continue;
+
+		readout_rmid_counts(rmid_node,llc->llc_id);
+
+		if (state!=RMID_LIMBO ||
+		    rmid_node->counts[llc->llc_id][L3_OCCUPANCY_EVENT_ID-1]>limbo_threshold)
+			continue;
 
-	if (atomic_dec_and_test(&rmid_node->ref_counter)) {
 		spin_lock_irqsave(&rmid_pool_lock,flags);
-		rmid_node->free_rmid=1;
-		list_add_tail(&(rmid_node->links),&available_rmids);
-		nr_available_rmids++;
+
+		/* Make sure the RMID has not been recycled in the meantime */
+		if (rmid_node->state==RMID_LIMBO && rmid_node->limbo_epoch==epoch) {
+			rmid_node->dirty_llcs&=~(1UL<<llc->llc_id);
+
+			if (!rmid_node->dirty_llcs) {
+				nr_limbo_rmids--;
+				push_free_rmid(rmid_node);
+			}
+		}
+
 		spin_unlock_irqrestore(&rmid_pool_lock,flags);
 	}
+
+	if (READ_ONCE(readout_enabled))
+		queue_delayed_work_on(llc->cpu,system_wq,&llc->work,
+		                      msecs_to_jiffies(readout_period_ms));
 }
 
-/* Increase the reference counter of a given RMID */
-void use_rmid(uint_t rmid)
+/* Start up a readout worker on the first online CPU of each LLC */
+static void start_readout_workers(void)
 {
-	rmid_node_t* rmid_node=NULL;
+	int cpu,i;
+	unsigned int llc_id;
 
-	if (rmid==0)
-		return;
+	present_llcs=0;
 
-	rmid_node=&node_pool[rmid-1];
+	for (i=0; i<RMID_MAX_LLCS; i++) {
+		llc_readout[i].cpu=-1;
+		llc_readout[i].llc_id=i;
+		INIT_DELAYED_WORK(&llc_readout[i].work,readout_llc_counts);
+	}
 
-	if (rmid_node->free_rmid)
-		return;
+	for_each_online_cpu(cpu) {
+		llc_id=topology_physical_package_id(cpu);
 
-	atomic_inc(&rmid_node->ref_counter);
+		if (llc_id>=RMID_MAX_LLCS || llc_readout[llc_id].cpu!=-1)
+			continue;
+
+		llc_readout[llc_id].cpu=cpu;
+		present_llcs|=(1UL<<llc_id);
+	}
+
+	readout_enabled=1;
+
+	for (i=0; i<RMID_MAX_LLCS; i++)
+		if (llc_readout[i].cpu!=-1)
+			queue_delayed_work_on(llc_readout[i].cpu,system_wq,&llc_readout[i].work,
+			                      msecs_to_jiffies(readout_period_ms));
+}
+
+static void stop_readout_workers(void)
+{
+	int i;
+
+	WRITE_ONCE(readout_enabled,0);
+
+	for (i=0; i<RMID_MAX_LLCS; i++)
+		if (llc_readout[i].cpu!=-1)
+			cancel_delayed_work_sync(&llc_readout[i].work);
+}
+
+/* Set the period of the readout workers */
+int intel_cmt_set_readout_period(unsigned int period_ms)
+{
+	if (period_ms<CMT_MIN_READOUT_PERIOD_MS || period_ms>CMT_MAX_READOUT_PERIOD_MS)
+		return -EINVAL;
+	readout_period_ms=period_ms;
+	return 0;
+}
+
+/* Set the max occupancy (in bytes) of a RMID that can be recycled */
+void intel_cmt_set_limbo_threshold(u64 bytes)
+{
+	limbo_threshold=bytes;
+}
+
+/* Print the configuration and usage of the RMID pool */
+int intel_cmt_print_rmid_pool(char* str)
+{
+	char* dest=str;
+	unsigned long flags;
+	unsigned int nr_free,nr_limbo;
+
+	spin_lock_irqsave(&rmid_pool_lock,flags);
+	nr_free=nr_free_rmids;
+	nr_limbo=nr_limbo_rmids;
+	spin_unlock_irqrestore(&rmid_pool_lock,flags);
+
+	dest+=sprintf(dest,"rmid_sharing=%d (%s)\n",
+	              rmid_sharing_policy,rmid_sharing_policy_str[rmid_sharing_policy]);
+	dest+=sprintf(dest,"rmid_readout_period_ms=%u\n",readout_period_ms);
+	dest+=sprintf(dest,"rmid_limbo_threshold=%llu\n",limbo_threshold);
+	dest+=sprintf(dest,"rmids_free=%u\n",nr_free);
+	dest+=sprintf(dest,"rmids_in_use=%u\n",nr_rmids-nr_free-nr_limbo);
+	dest+=sprintf(dest,"rmids_in_limbo=%u\n",nr_limbo);
+	return dest-str;
 }
 
 int intel_cmt_probe(void)
@@ -207,6 +525,19 @@ int intel_cmt_probe(void)
 	return 0;
 }
 
+/*
+ * Restore the default RMID and COS on the current CPU,
+ * and make the cached copy of IA32_PQR_ASSOC consistent with it.
+ */
+static void reset_pqr_state_cpu(void* dummy)
+{
+	intel_cmt_pqr_state_t* state=this_cpu_ptr(&cmt_pqr_state);
+
+	wrmsr(MSR_IA32_PQR_ASSOC,DISABLE_RMID,0);
+	state->rmid=DISABLE_RMID;
+	state->cos_id=0;
+}
+
 int intel_cmt_initialize(intel_cmt_support_t* cmt_support)
 {
 	cpuid_regs_t cpuid_regs;
@@ -218,12 +549,12 @@ int intel_cmt_initialize(intel_cmt_support_t* cmt_support)
 	cpuid_regs.ebx=cpuid_regs.edx=0x0;
 	run_cpuid(cpuid_regs);
 	/* Initialize the number of RMIDS (max pool) */
-	cmt_support->total_rmids=nr_available_rmids=cpuid_regs.ecx;
+	cmt_support->total_rmids=nr_rmids=cpuid_regs.ecx;
 	cmt_support->upscaling_factor=cpuid_regs.ebx;
 	supported_events=cpuid_regs.edx & 0x07;
 
 	printk(KERN_INFO "*** Intel CMT Info ***\n");
-	printk(KERN_INFO "Available RMIDs:: %u\n", nr_available_rmids);
+	printk(KERN_INFO "Available RMIDs:: %u\n", nr_rmids);
 	printk(KERN_INFO "Upscaling Factor:: %d\n", cmt_support->upscaling_factor);
 
 	if(supported_events&0x01) {
@@ -242,8 +573,22 @@ int intel_cmt_initialize(intel_cmt_support_t* cmt_support)
 	} else
 		cmt_support->event_l3_local_bw=0;
 
+	if (nr_rmids==0)
+		return -ENOTSUPP;
+
 	if (initialize_rmid_pool())
 		return -ENOMEM;
+
+	/* Default limbo threshold: fair share of the LLC for each RMID */
+	if (boot_cpu_data.x86_cache_size>0)
+		limbo_threshold=((u64)boot_cpu_data.x86_cache_size*1024)/nr_rmids;
+	else
+		limbo_threshold=0;
+	cmt_info=cmt_support;
+
+	/* The MSR may hold anything at this point */
+	on_each_cpu(reset_pqr_state_cpu, NULL, 1);
+	start_readout_workers();
 	return 0;
 }
 
@@ -282,6 +627,9 @@ int intel_cat_initialize(intel_cat_support_t* cat_support)
 
 int intel_cmt_release(intel_cmt_support_t* cmt_support)
 {
+	/* Threads may have left their RMID programmed (lazy unset) */
+	on_each_cpu(reset_pqr_state_cpu, NULL, 1);
+	stop_readout_workers();
 	free_rmid_pool();
 	return 0;
 }
@@ -407,65 +755,40 @@ int intel_mba_set_delay_values(intel_mba_support_t* mba_support, unsigned int id
 }
 
 
+/*
+ * Update the CMT/MBM values of a thread on a given LLC based on the counts
+ * gathered by the readout worker. The LLC occupancy is that of the thread's
+ * RMID. As the RMID may be shared by a group of threads, each thread gets
+ * the bandwidth (bytes) that no other thread of the group reported yet,
+ * so that the bandwidth values of the group add up to that of the RMID.
+ */
 void intel_cmt_update_supported_events(intel_cmt_support_t* cmt_support,intel_cmt_thread_struct_t* tdata, unsigned int llc_id)
 {
-	u64 val=0;
+	rmid_node_t* rmid_node;
+	u64 val,prev,old;
+	int i;
 
-	/* check for l3 occupancy */
-	if(cmt_support->event_l3_occupancy) {
-		val = __rmid_read(tdata->rmid,L3_OCCUPANCY_EVENT_ID);
+	if (tdata->rmid==0 || llc_id>=RMID_MAX_LLCS)
+		return;
 
-		if (val & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
-			trace_printk("Error when reading value");
-		else {
-			val&=((1ULL<<62ULL)-1); //Mask...
-			tdata->last_llc_utilization[llc_id][L3_OCCUPANCY_EVENT_ID-1]=val*cmt_support->upscaling_factor;
-#ifdef DEBUG
-			trace_printk("LLC Usage=%llu bytes\n",tdata->last_llc_utilization[llc_id][L3_OCCUPANCY_EVENT_ID-1]);
-#endif
-		}
-	}
+	rmid_node=&node_pool[tdata->rmid-1];
 
-	/* check for l3 total BW */
-	if(cmt_support->event_l3_total_bw) {
-		val = __rmid_read(tdata->rmid,L3_TOTAL_BW_EVENT_ID);
+	if (cmt_support->event_l3_occupancy)
+		tdata->last_llc_utilization[llc_id][L3_OCCUPANCY_EVENT_ID-1]=READ_ONCE(rmid_node->counts[llc_id][L3_OCCUPANCY_EVENT_ID-1]);
 
-		if (val & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
-			trace_printk(KERN_INFO "Error when reading value");
-		else {
-			val&=MAX_CMT_COUNT;
-			if(tdata->last_cmt_value[llc_id][L3_TOTAL_BW_EVENT_ID-1]>val) {
-				tdata->last_llc_utilization[llc_id][L3_TOTAL_BW_EVENT_ID-1]=(MAX_CMT_COUNT - tdata->last_cmt_value[llc_id][L3_TOTAL_BW_EVENT_ID-1])+val+1;
-			} else {
-				tdata->last_llc_utilization[llc_id][L3_TOTAL_BW_EVENT_ID-1]=val-tdata->last_cmt_value[llc_id][L3_TOTAL_BW_EVENT_ID-1];
-			}
-			tdata->last_llc_utilization[llc_id][L3_TOTAL_BW_EVENT_ID-1]*=cmt_support->upscaling_factor;
-			tdata->last_cmt_value[llc_id][L3_TOTAL_BW_EVENT_ID-1]=val;
-#ifdef DEBUG
-			trace_printk("LLC Total BW=%llu bytes/s\n",tdata->last_llc_utilization[llc_id][L3_TOTAL_BW_EVENT_ID-1]);
-#endif
-		}
-	}
+	for (i=L3_TOTAL_BW_EVENT_ID-1; i<CMT_MAX_EVENTS; i++) {
+		val=READ_ONCE(rmid_node->counts[llc_id][i]);
+		prev=atomic64_read(&rmid_node->reported_bw[llc_id][i]);
 
-	/* check for l3 local BW */
-	if(cmt_support->event_l3_local_bw) {
-		val = __rmid_read(tdata->rmid,L3_LOCAL_BW_EVENT_ID);
+		/* Claim the bytes transferred since the last report (the counts never go back) */
+		while (val>prev && (old=atomic64_cmpxchg(&rmid_node->reported_bw[llc_id][i],prev,val))!=prev)
+			prev=old;
 
-		if (val & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
-			trace_printk(KERN_INFO "Error when reading value");
-		else {
-			val&=MAX_CMT_COUNT;
-			if(tdata->last_cmt_value[llc_id][L3_LOCAL_BW_EVENT_ID-1]>val) {
-				tdata->last_llc_utilization[llc_id][L3_LOCAL_BW_EVENT_ID-1]=(MAX_CMT_COUNT - tdata->last_cmt_value[llc_id][L3_LOCAL_BW_EVENT_ID-1])+val+1;
-			} else {
-				tdata->last_llc_utilization[llc_id][L3_LOCAL_BW_EVENT_ID-1]=val-tdata->last_cmt_value[llc_id][L3_LOCAL_BW_EVENT_ID-1];
-			}
-			tdata->last_llc_utilization[llc_id][L3_LOCAL_BW_EVENT_ID-1]*=cmt_support->upscaling_factor;
-			tdata->last_cmt_value[llc_id][L3_LOCAL_BW_EVENT_ID-1]=val;
+		tdata->last_llc_utilization[llc_id][i]=val>prev?val-prev:0;
+	}
 #ifdef DEBUG
-			trace_printk("LLC Local BW=%llu bytes/s\n",tdata->last_llc_utilization[llc_id][L3_LOCAL_BW_EVENT_ID-1]);
+	trace_printk("RMID=%u LLC Usage=%llu bytes Total BW=%llu bytes Local BW=%llu bytes\n",tdata->rmid,
+	             tdata->last_llc_utilization[llc_id][0],tdata->last_llc_utilization[llc_id][1],
+	             tdata->last_llc_utilization[llc_id][2]);
 #endif
-		}
-	}
-
 }
@@ -19,6 +19,9 @@
 #include <asm/topology.h>
 #include <linux/ftrace.h>
 
+/* Descriptor of this monitoring module (defined at the end of the file) */
+extern monitoring_module_t intel_cmt_mm;
+
 #define INTEL_CMT_MODULE_STR "PMCtrack module that supports Intel CMT"
 
 
@@ -86,6 +89,7 @@ static int intel_cmt_on_read_config(char* str, unsigned int len)
 	dest+=sprintf(dest,"rmid_alloc_policy=%d (%s)\n",
 	              intel_cmt_config.rmid_allocation_policy,
 	              rmid_allocation_policy_str[intel_cmt_config.rmid_allocation_policy]);
+	dest+=intel_cmt_print_rmid_pool(dest);
 	dest+=sprintf(dest,"cat_nr_cos_available=%d\n",
 	              cat_support.cat_nr_cos_available);
 	dest+=sprintf(dest,"cat_cbm_length=%d\n",
@@ -112,20 +116,30 @@ static int intel_cmt_on_write_config(const char *str, unsigned int len)
 	int val;
 	unsigned int uval;
 	unsigned int mask=0;
+	unsigned long long ullval;
 
 	if (sscanf(str,"rmid_alloc_policy %i",&val)==1 && val>=0 && val<NR_RMID_ALLOC_POLICIES) {
 		intel_cmt_config.rmid_allocation_policy=val;
 		set_cmt_policy(intel_cmt_config.rmid_allocation_policy);
+	} else if (sscanf(str,"rmid_sharing %i",&val)==1 && val>=0 && val<NR_RMID_SHARING_POLICIES) {
+		int ret=set_rmid_sharing_policy(val);
+		if (ret)
+			return ret;
+	} else if (sscanf(str,"rmid_readout_period_ms %u",&uval)==1) {
+		if (intel_cmt_set_readout_period(uval))
+			return -EINVAL;
+	} else if (sscanf(str,"rmid_limbo_threshold %llu",&ullval)==1) {
+		intel_cmt_set_limbo_threshold(ullval);
 	} else if (sscanf(str,"cos_id=%i",&val)==1 &&
 	           (val>=0 && val<cat_support.cat_nr_cos_available)) {
 		pmon_prof_t* prof=current->pmc;
 		intel_cmt_thread_data_t*  data;
 
-		if (!prof || !prof->monitoring_mod_priv_data)
+		if (!prof || !mm_get_priv_data(prof,&intel_cmt_mm))
 			return -EINVAL;
 
 		/* Setup cosid !! */
-		data=prof->monitoring_mod_priv_data;
+		data=mm_get_priv_data(prof,&intel_cmt_mm);
 		data->cmt_data.cos_id=val;
 		printk(KERN_ALERT "Setting COSID=%d for process %d\n",data->cmt_data.cos_id,current->tgid);
 	} else if (sscanf(str,"llc_cbm%i 0x%x",&val,&mask)==2) {
@@ -143,7 +157,7 @@ static int intel_cmt_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 {
 	intel_cmt_thread_data_t*  data=NULL;
 
-	if (prof->monitoring_mod_priv_data!=NULL)
+	if (mm_get_priv_data(prof,&intel_cmt_mm)!=NULL)
 		return 0;
 
 	data= kmalloc(sizeof (intel_cmt_thread_data_t), GFP_KERNEL);
@@ -153,20 +167,15 @@ static int intel_cmt_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 
 	initialize_cmt_thread_struct(&data->cmt_data);
 
-	if (is_new_thread(clone_flags) && current->pmc) {
-		pmon_prof_t *pprof= (pmon_prof_t*)current->pmc;
-		intel_cmt_thread_data_t* parent_data=pprof->monitoring_mod_priv_data;
-		data->first_time=0;
-		data->cmt_data.rmid=parent_data->cmt_data.rmid;
-		use_rmid(parent_data->cmt_data.rmid); /* Increase ref counter */
-		trace_printk("Assigned RMID::%u\n",data->cmt_data.rmid);
-	} else {
-		data->first_time=1;
-		data->cmt_data.rmid=0; /* It will be assigned in the first context switch */
-	}
+	/*
+	 * The RMID will be assigned in the first context switch,
+	 * where it may be shared with other threads (see get_rmid())
+	 */
+	data->first_time=1;
+	data->cmt_data.rmid=0;
 
-	data->security_id=current_monitoring_module_security_id();
-	prof->monitoring_mod_priv_data = data;
+	data->security_id=monitoring_module_security_id(&intel_cmt_mm);
+	mm_set_priv_data(prof,&intel_cmt_mm,data);
 	return 0;
 }
 
@@ -174,28 +183,28 @@ static int intel_cmt_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 static void intel_cmt_on_exec(pmon_prof_t* prof) { }
 
 /*
- * Read the LLC occupancy and cumulative memory bandwidth counters
+ * Retrieve the LLC occupancy and memory bandwidth of the thread's RMID
+ * (gathered periodically by the readout workers)
  * and set the associated virtual counts in the PMC sample structure
  */
 static int intel_cmt_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,int flags,void* data)
 {
-	intel_cmt_thread_data_t* tdata=prof->monitoring_mod_priv_data;
+	intel_cmt_thread_data_t* tdata=mm_get_priv_data(prof,&intel_cmt_mm);
 	uint_t llc_id=topology_physical_package_id(cpu),i=0;
-	int cnt_virt=0;
 
 	if (tdata!=NULL) {
 
 		if (!tdata->first_time) {
 
 			intel_cmt_update_supported_events(&cmt_support,&tdata->cmt_data,llc_id);
+			mm_publish_metric(prof,&intel_cmt_mm,MC_LLC_OCCUPANCY,
+			                  tdata->cmt_data.last_llc_utilization[llc_id][L3_OCCUPANCY_EVENT_ID-1]);
 
 			/* Embed virtual counter information so that the user can see what's going on */
 			for(i=0; i<CMT_MAX_EVENTS; i++) {
-				if ((prof->virt_counter_mask & (1<<i) )) {
+				if ((mm_virt_counter_mask(prof,&intel_cmt_mm) & (1<<i) )) {
 					sample->virt_mask|=(1<<i);
-					sample->nr_virt_counts++;
-					sample->virtual_counts[cnt_virt]=tdata->cmt_data.last_llc_utilization[llc_id][i];
-					cnt_virt++;
+					sample->virtual_counts[sample->nr_virt_counts++]=tdata->cmt_data.last_llc_utilization[llc_id][i];
 				}
 			}
 		}
@@ -210,7 +219,7 @@ static void intel_cmt_on_migrate(pmon_prof_t* prof, int prev_cpu, int new_cpu) {
 /* on exit() callback -> return RMID to the pool */
 static void intel_cmt_on_exit(pmon_prof_t* prof)
 {
-	intel_cmt_thread_data_t* data=(intel_cmt_thread_data_t*)prof->monitoring_mod_priv_data;
+	intel_cmt_thread_data_t* data=(intel_cmt_thread_data_t*)mm_get_priv_data(prof,&intel_cmt_mm);
 	if (data)
 		put_rmid(data->cmt_data.rmid);
 
@@ -219,46 +228,49 @@ static void intel_cmt_on_exit(pmon_prof_t* prof)
 /* Free up private data */
 static void intel_cmt_on_free_task(pmon_prof_t* prof)
 {
-	if (prof->monitoring_mod_priv_data)
-		kfree(prof->monitoring_mod_priv_data);
+	if (mm_get_priv_data(prof,&intel_cmt_mm))
+		kfree(mm_get_priv_data(prof,&intel_cmt_mm));
 }
 
 /* on switch_in callback */
 static void intel_cmt_on_switch_in(pmon_prof_t* prof)
 {
-	intel_cmt_thread_data_t* data=(intel_cmt_thread_data_t*)prof->monitoring_mod_priv_data;
-	int was_first_time=0;
+	intel_cmt_thread_data_t* data=(intel_cmt_thread_data_t*)mm_get_priv_data(prof,&intel_cmt_mm);
 
-	if (!data)
+	if (!data) {
+		__unset_rmid();
 		return;
+	}
 
-	if (data->first_time && data->security_id==current_monitoring_module_security_id()) {
+	if (data->first_time && data->security_id==monitoring_module_security_id(&intel_cmt_mm)) {
 		// Assign RMID
-		data->cmt_data.rmid=get_rmid();
+		data->cmt_data.rmid=get_rmid(current);
 		data->first_time=0;
-		was_first_time=0;
 #ifdef DEBUG
 		trace_printk("Assigned RMID::%u\n",data->cmt_data.rmid);
 #endif
 	}
 
 	__set_rmid_and_cos(data->cmt_data.rmid,data->cmt_data.cos_id);
-
-	if (was_first_time) {
-		uint_t llc_id=topology_physical_package_id(smp_processor_id());
-		intel_cmt_update_supported_events(&cmt_support,&data->cmt_data,llc_id);
-	}
-
-
 }
 
-/* on switch_out callback */
-static void intel_cmt_on_switch_out(pmon_prof_t* prof)
+/*
+ * on switch_out callback: the RMID/COS of the outgoing thread stays
+ * programmed, as the incoming thread will either set its own
+ * values or restore the default ones in on_switch_in_unmonitored()
+ */
+static void intel_cmt_on_switch_out(pmon_prof_t* prof) { }
+
+/* A thread not monitored by this module is switched in */
+static void intel_cmt_on_switch_in_unmonitored(int cpu)
 {
 	__unset_rmid();
 }
 
-/* Modify this function if necessary to expose CMT/MBM information to the OS scheduler */
+/*
+ * Modify this function if necessary to expose CMT/MBM information to the OS scheduler.
+ * (The LLC occupancy is published in the thread's metric snapshot)
+ */
 static int intel_cmt_get_current_metric_value(pmon_prof_t* prof, int key, uint64_t* value)
 {
 	return -1;
@@ -283,6 +295,7 @@ monitoring_module_t intel_cmt_mm= {
 	.on_free_task=intel_cmt_on_free_task,
 	.on_switch_in=intel_cmt_on_switch_in,
 	.on_switch_out=intel_cmt_on_switch_out,
+	.on_switch_in_unmonitored=intel_cmt_on_switch_in_unmonitored,
 	.get_current_metric_value=intel_cmt_get_current_metric_value,
 	.module_counter_usage=intel_cmt_module_counter_usage
 };
@@ -17,6 +17,19 @@
 
 #include <linux/random.h>
 #include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/seqlock.h>
+#include <linux/topology.h>
+#include <linux/math64.h>
+#include <linux/cpu.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+#include <linux/cpuhotplug.h>
+#endif
+
+/* Descriptor of this monitoring module (defined at the end of the file) */
+extern monitoring_module_t intel_rapl_mm;
+
 #define INTEL_RAPL_MODULE_STR "PMCtrack module that supports Intel RAPL"
 
 
@@ -26,8 +39,12 @@
 #define MSR_PP0_ENERGY_STATUS_PMCTRACK		0x639
 #define MSR_PP1_ENERGY_STATUS_PMCTRACK		0x641
 #define MSR_DRAM_ENERGY_STATUS_PMCTRACK		0x619
+#define MSR_PKG_POWER_INFO_PMCTRACK		0x614
 
-#define MSR_ENERY_STATUS_BITMASK_PMCTRACK 0xffffffff
+/* Bits in the energy-status MSRs */
+#define RAPL_ENERGY_STATUS_BITS	32
+/* Finest energy unit used by any domain (DRAM on some server processors) */
+#define RAPL_MAX_ENERGY_UNITS	16
 
 /* Possible RAPL domains */
 enum rapl_domains {RAPL_PP0_DOMAIN=0,RAPL_PP1_DOMAIN,RAPL_PKG_DOMAIN,RAPL_DRAM_DOMAIN, RAPL_NR_DOMAINS};
@@ -107,18 +124,90 @@ static char* available_vcounters[]= {"energy_core","energy_pkg","energy_pp1"};
 
 #define CLOSE_CONTEXT_SWITCH 0x1
 
+/* Max number of processor packages in the machine */
+#define RAPL_MAX_PACKAGES	8
+/* Number of points kept in the energy series of each package (must be a power of two) */
+#define RAPL_SERIES_LEN		64
+/* Fractional bits of the energy attributed to threads */
+#define RAPL_SHARE_SHIFT	16
+/* Max number of on-CPU intervals of a thread waiting for the sampler to cover them */
+#define RAPL_MAX_PENDING	8
+
+/* Period of the per-package energy sampler (in ms) */
+static unsigned int rapl_sampler_period_ms=10;
+/* Max sampler period that guarantees no wraparound of the energy-status MSRs is missed */
+static unsigned int rapl_max_sampler_period_ms=1000;
+
+/* A point of the energy series of a package */
+typedef struct {
+	uint64_t timestamp;			/* Time when the point was recorded (ns) */
+	uint64_t energy[RAPL_NR_DOMAINS];	/* Cumulative energy (in RAPL energy units) */
+	uint64_t busy_ns;			/* Cumulative time monitored threads spent on the CPUs of the package */
+} rapl_energy_point_t;
+
+/*
+ * Per-package energy sampler. An hrtimer running on a CPU of the package
+ * reads the energy-status MSRs periodically and appends a point to the series.
+ * Readers never block the sampler: they check afterwards that
+ * the points they used were not overwritten in the meantime.
+ * If the CPU of the sampler goes offline, the sampler moves to another
+ * CPU of the package (the timer must not migrate to a different package).
+ *
+ * The 32-bit energy-status MSRs are extended into 64-bit counters
+ * (energy). The sampler period is bounded so that no wraparound goes
+ * unnoticed between two consecutive readings.
+ */
+typedef struct {
+	int cpu;				/* CPU the sampler runs on (-1 if the package is not present) */
+	struct cpumask cpus;			/* CPUs in the package */
+	struct hrtimer timer;
+	spinlock_t lock;			/* Protects last_raw and energy */
+	uint_t last_raw[RAPL_NR_DOMAINS];	/* Last values read from the energy-status MSRs */
+	uint64_t energy[RAPL_NR_DOMAINS];	/* 64-bit extended energy counters */
+	unsigned long nr_points;		/* Number of points recorded so far */
+	rapl_energy_point_t series[RAPL_SERIES_LEN];
+	int syswide_cpu;			/* CPU reporting the energy of the package in system-wide mode */
+	uint64_t syswide_last[RAPL_NR_DOMAINS];	/* Energy reported in the previous system-wide sample */
+} rapl_package_t;
+
+static rapl_package_t rapl_packages[RAPL_MAX_PACKAGES];
+
+/*
+ * Time monitored threads spent on a CPU. It is updated on context switches
+ * by the CPU itself and read by the sampler of the package.
+ */
+typedef struct {
+	seqcount_t seq;
+	uint64_t busy_ns;		/* Cumulative on-CPU time of monitored threads */
+	uint64_t on_since;		/* Switch-in time of the running monitored thread (0 if none) */
+	uint64_t last_busy_ns;		/* Last value seen by the sampler */
+} rapl_cpu_time_t;
+
+static DEFINE_PER_CPU(rapl_cpu_time_t, rapl_cpu_time);
+
+/* On-CPU interval of a thread */
+typedef struct {
+	uint64_t start;
+	uint64_t end;
+	int package;
+} rapl_interval_t;
+
 /* Per-thread private data for this monitoring module */
 typedef struct {
-	uint_t cur_domain_value[RAPL_NR_DOMAINS];
-	uint64_t acum_power_domain[RAPL_NR_DOMAINS];
+	uint64_t acum_power_domain[RAPL_NR_DOMAINS];	/* Energy attributed to the thread (fixed point, RAPL_SHARE_SHIFT) */
+	uint64_t switch_in_ns;				/* Beginning of the current on-CPU interval (0 if not running) */
+	int package;					/* Package the thread is running on */
+	rapl_interval_t pending[RAPL_MAX_PENDING];	/* Intervals that end after the last point of the series */
+	unsigned int nr_pending;
 	int security_id;
-	int first_time;
 } intel_rapl_thread_data_t;
 
 unsigned int power_units,energy_units,time_units;
 
-/* Initialize resources to support system-wide monitoring with Intel RAPL */
-static int initialize_system_wide_rapl_structures(void);
+/* Start and stop the per-package energy samplers */
+static int rapl_start_samplers(void);
+static void rapl_stop_samplers(void);
+static unsigned int rapl_wraparound_safe_period_ms(void);
 
 /* Return the capabilities/properties of this monitoring module */
 static void intel_rapl_module_counter_usage(monitoring_module_counter_usage_t* usage)
@@ -163,8 +252,12 @@ static int intel_rapl_enable_module(void)
 	energy_units=((result>>8)&0x1f);
 	time_units=((result>>16)&0xf);
 
-	if ((retval=initialize_system_wide_rapl_structures())) {
-		printk(KERN_INFO "Couldn't initialize system-wide RAPL structures");
+	rapl_max_sampler_period_ms=rapl_wraparound_safe_period_ms();
+	if (rapl_sampler_period_ms>rapl_max_sampler_period_ms)
+		rapl_sampler_period_ms=rapl_max_sampler_period_ms;
+
+	if ((retval=rapl_start_samplers())) {
+		printk(KERN_INFO "Couldn't start RAPL energy samplers");
 		return retval;
 	}
 
@@ -174,6 +267,7 @@ static int intel_rapl_enable_module(void)
 /* RAPL MM cleanup function */
 static void intel_rapl_disable_module(void)
 {
+	rapl_stop_samplers();
 	printk(KERN_ALERT "%s monitoring module unloaded!!\n",INTEL_RAPL_MODULE_STR);
 }
 
@@ -186,14 +280,23 @@ static int intel_rapl_on_read_config(char* str, unsigned int len)
 	dst+=sprintf(dst,"Power units = %d\n",power_units);
 	dst+=sprintf(dst,"Energy units = %d\n",energy_units);
 	dst+=sprintf(dst,"Time units = %d\n",time_units);
+	dst+=sprintf(dst,"sampler_period_ms = %u (max %u)\n",rapl_sampler_period_ms,rapl_max_sampler_period_ms);
 
 	return dst - str;
 }
 
-/* This MM does not export configuration parameters */
+/* Change the period of the energy sampler ("sampler_period_ms <ms>") */
 static int intel_rapl_on_write_config(const char *str, unsigned int len)
 {
-	return 0;
+	unsigned int val;
+
+	/* The samplers pick up the new period the next time they fire */
+	if (sscanf(str,"sampler_period_ms %u",&val)==1 && val>0 && val<=rapl_max_sampler_period_ms)
+		rapl_sampler_period_ms=val;
+	else
+		return -EINVAL;
+
+	return len;
 }
 
 /* on fork() callback */
@@ -202,7 +305,7 @@ static int intel_rapl_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 	int i=0;
 	intel_rapl_thread_data_t*  data= NULL;
 
-	if (prof->monitoring_mod_priv_data!=NULL)
+	if (mm_get_priv_data(prof,&intel_rapl_mm)!=NULL)
 		return 0;
 
 
@@ -210,15 +313,15 @@ static int intel_rapl_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 	if (data == NULL)
 		return -ENOMEM;
 
-	for (i=0; i<RAPL_NR_DOMAINS; i++) {
-		data->cur_domain_value[i]=0;
+	for (i=0; i<RAPL_NR_DOMAINS; i++)
 		data->acum_power_domain[i]=0;
-	}
 
-	data->security_id=current_monitoring_module_security_id();
+	data->switch_in_ns=0;
+	data->package=-1;
+	data->nr_pending=0;
+	data->security_id=monitoring_module_security_id(&intel_rapl_mm);
 
-	data->first_time=1;
-	prof->monitoring_mod_priv_data = data;
+	mm_set_priv_data(prof,&intel_rapl_mm,data);
 	return 0;
 }
 
@@ -230,51 +333,454 @@ static void intel_rapl_on_exec(pmon_prof_t* prof)
 #endif
 }
 
+/* Index of the package a CPU belongs to (-1 if not supported) */
+static inline int rapl_cpu_package(int cpu)
+{
+	int pkg=topology_physical_package_id(cpu);
+
+	return (pkg>=0 && pkg<RAPL_MAX_PACKAGES)?pkg:-1;
+}
+
 /*
- * Read RAPL energy registers and update cumulative counters in the
- * private thread structure.
+ * Max sampler period (in ms) that guarantees that the energy-status
+ * MSRs do not wrap around more than once between two readings,
+ * based on the max power of the package (with a 2x safety margin).
  */
-static inline void do_read_energy_msrs(intel_rapl_thread_data_t* tdata, int acum, int remote_core)
+static unsigned int rapl_wraparound_safe_period_ms(void)
 {
-	int i=0;
-	uint_t old_value,foo, delta;
+	uint64_t power_info;
+	uint64_t max_power;
+	uint64_t wrap_joules;
+	unsigned int units=energy_units>RAPL_MAX_ENERGY_UNITS?energy_units:RAPL_MAX_ENERGY_UNITS;
 
-	if (!acum) {
-		/* Read energy count from msrs */
-		for (i=0; i<RAPL_NR_DOMAINS; i++) {
-			if (remote_core && i==RAPL_PP0_DOMAIN)
-				continue;
-			if (available_power_domains_mask & (1<<i)) {
-				rdmsr(rapl_msr_regs_domains[i],tdata->cur_domain_value[i],foo);
-			}
-		}
-	} else {
-		for (i=0; i<RAPL_NR_DOMAINS; i++) {
-			if (remote_core && i==RAPL_PP0_DOMAIN)
-				continue;
-			if (available_power_domains_mask & (1<<i)) {
-				/* Save old value */
-				old_value=tdata->cur_domain_value[i];
+	rdmsrl(MSR_PKG_POWER_INFO_PMCTRACK,power_info);
 
-				/* Read new value */
-				rdmsr(rapl_msr_regs_domains[i],tdata->cur_domain_value[i],foo);
+	/* Max power (or twice the thermal spec power if not reported), in watts */
+	max_power=(power_info>>32) & 0x7fff;
+	if (!max_power)
+		max_power=(power_info & 0x7fff)*2;
+	max_power>>=power_units;
+	if (max_power==0)
+		max_power=1000;	/* Be conservative */
 
-#ifdef DEBUG
-				if (i==0)
-					printk(KERN_ALERT "0x%x \n",tdata->cur_domain_value[i]);
+	/* Energy represented by a full range of the energy-status MSRs */
+	wrap_joules=1ULL<<(RAPL_ENERGY_STATUS_BITS-units);
+
+	return min_t(uint64_t,div64_u64(wrap_joules*1000,max_power*2),60000);
+}
+
+/*
+ * Read the energy-status MSRs of the local package and
+ * update the 64-bit extended energy counters
+ */
+static void rapl_update_package_energy(rapl_package_t* pkg)
+{
+	unsigned long flags;
+	uint_t raw,foo;
+	int i;
+
+	spin_lock_irqsave(&pkg->lock,flags);
+	for (i=0; i<RAPL_NR_DOMAINS; i++) {
+		if (!(available_power_domains_mask & (1<<i)))
+			continue;
+		rdmsr(rapl_msr_regs_domains[i],raw,foo);
+		/* 32-bit wraparound is handled by unsigned arithmetic */
+		pkg->energy[i]+=(uint_t)(raw-pkg->last_raw[i]);
+		pkg->last_raw[i]=raw;
+	}
+	spin_unlock_irqrestore(&pkg->lock,flags);
+}
+
+/*
+ * Time monitored threads spent on a CPU up to "now". The sampler may
+ * interrupt the CPU while it updates the counters, so the number of
+ * retries is bounded and the last value seen is used as a fallback.
+ */
+static uint64_t rapl_cpu_busy_time(int cpu, uint64_t now)
+{
+	rapl_cpu_time_t* ct=&per_cpu(rapl_cpu_time,cpu);
+	uint64_t busy,since;
+	unsigned int seq;
+	int tries;
+
+	for (tries=0; tries<3; tries++) {
+		seq=raw_read_seqcount(&ct->seq);
+		if (seq & 1)
+			continue;
+
+		busy=ct->busy_ns;
+		since=ct->on_since;
+
+		if (read_seqcount_retry(&ct->seq,seq))
+			continue;
+
+		if (since && now>since)
+			busy+=now-since;
+		/* Keep the series monotonic */
+		if (busy>ct->last_busy_ns)
+			ct->last_busy_ns=busy;
+		break;
+	}
+
+	return ct->last_busy_ns;
+}
+
+/* Read the energy-status MSRs of the local package and append a point to the series */
+static void rapl_record_energy_point(rapl_package_t* pkg)
+{
+	rapl_energy_point_t* point=&pkg->series[pkg->nr_points & (RAPL_SERIES_LEN-1)];
+	uint64_t now=raw_ktime(ktime_get());
+	unsigned long flags;
+	int cpu;
+
+	rapl_update_package_energy(pkg);
+
+	point->timestamp=now;
+	spin_lock_irqsave(&pkg->lock,flags);
+	memcpy(point->energy,pkg->energy,sizeof(point->energy));
+	spin_unlock_irqrestore(&pkg->lock,flags);
+	point->busy_ns=0;
+	for_each_cpu(cpu,&pkg->cpus)
+		point->busy_ns+=rapl_cpu_busy_time(cpu,now);
+
+	/* Publish the point */
+	smp_wmb();
+	WRITE_ONCE(pkg->nr_points,pkg->nr_points+1);
+}
+
+/* hrtimer callback of the per-package energy sampler */
+static enum hrtimer_restart rapl_sampler_fire(struct hrtimer* timer)
+{
+	rapl_package_t* pkg=container_of(timer,rapl_package_t,timer);
+
+	rapl_record_energy_point(pkg);
+	hrtimer_forward_now(timer,ms_to_ktime(rapl_sampler_period_ms));
+	return HRTIMER_RESTART;
+}
+
+/* Start the sampler of a package (runs on a CPU of the package) */
+static void rapl_sampler_start_local(void* info)
+{
+	rapl_package_t* pkg=(rapl_package_t*)info;
+	uint_t foo;
+	int i;
+
+	for (i=0; i<RAPL_NR_DOMAINS; i++) {
+		pkg->energy[i]=0;
+		if (available_power_domains_mask & (1<<i))
+			rdmsr(rapl_msr_regs_domains[i],pkg->last_raw[i],foo);
+	}
+
+	rapl_record_energy_point(pkg);
+	hrtimer_start(&pkg->timer,ms_to_ktime(rapl_sampler_period_ms),HRTIMER_MODE_REL_PINNED);
+}
+
+/*
+ * Restart the sampler of a package on another CPU of the package
+ * (the energy counters and the series carry on from where they were)
+ */
+static void rapl_sampler_resume_local(void* info)
+{
+	rapl_package_t* pkg=(rapl_package_t*)info;
+
+	rapl_record_energy_point(pkg);
+	hrtimer_start(&pkg->timer,ms_to_ktime(rapl_sampler_period_ms),HRTIMER_MODE_REL_PINNED);
+}
+
+/* Set once the samplers are up (CPU-hotplug callbacks do nothing otherwise) */
+static int rapl_samplers_ready=0;
+
+/* A CPU came online: start the sampler of its package if it had none */
+static int rapl_cpu_online(unsigned int cpu)
+{
+	rapl_package_t* pkg;
+	int i;
+
+	if (!rapl_samplers_ready || (i=rapl_cpu_package(cpu))<0)
+		return 0;
+
+	pkg=&rapl_packages[i];
+	cpumask_set_cpu(cpu,&pkg->cpus);
+
+	if (pkg->cpu==-1) {
+		pkg->cpu=cpu;
+		smp_call_function_single(cpu,pkg->nr_points?rapl_sampler_resume_local:rapl_sampler_start_local,pkg,1);
+	}
+	return 0;
+}
+
+/* A CPU is going offline: move the sampler of its package elsewhere */
+static int rapl_cpu_down_prep(unsigned int cpu)
+{
+	rapl_package_t* pkg;
+	int i;
+
+	if (!rapl_samplers_ready || (i=rapl_cpu_package(cpu))<0)
+		return 0;
+
+	pkg=&rapl_packages[i];
+	cpumask_clear_cpu(cpu,&pkg->cpus);
+
+	if (pkg->cpu!=cpu)
+		return 0;
+
+	hrtimer_cancel(&pkg->timer);
+
+	if ((pkg->cpu=cpumask_any_and(&pkg->cpus,cpu_online_mask))>=nr_cpu_ids)
+		pkg->cpu=-1;	/* The package is gone */
+	else
+		smp_call_function_single(pkg->cpu,rapl_sampler_resume_local,pkg,1);
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+static int rapl_cpu_notifier(struct notifier_block *b, unsigned long action, void *data)
+{
+	unsigned int cpu=(unsigned long)data;
+
+	switch (action & ~CPU_TASKS_FROZEN) {
+	case CPU_DOWN_FAILED:
+	case CPU_ONLINE:
+		rapl_cpu_online(cpu);
+		break;
+	case CPU_DOWN_PREPARE:
+		rapl_cpu_down_prep(cpu);
+		break;
+	}
+	return NOTIFY_OK;
+}
+
+static struct notifier_block rapl_cpu_nb = {
+	.notifier_call = rapl_cpu_notifier,
+};
+#else
+static enum cpuhp_state rapl_cpuhp_state;
 #endif
-				/* Check Overflow */
-				if (tdata->cur_domain_value[i] < old_value) {
-					printk(KERN_ALERT "Overflow detected ...\n");
-					delta=MSR_ENERY_STATUS_BITMASK_PMCTRACK-old_value;
-					delta+=tdata->cur_domain_value[i]+1;
-				} else
-					delta=tdata->cur_domain_value[i]-old_value;
-
-				tdata->acum_power_domain[i]+=delta;
-			}
-		}
+
+/* Set up and start one energy sampler per package */
+static int rapl_start_samplers(void)
+{
+	rapl_package_t* pkg;
+	rapl_cpu_time_t* ct;
+	int cpu,i;
+
+	for (i=0; i<RAPL_MAX_PACKAGES; i++) {
+		rapl_packages[i].cpu=-1;
+		rapl_packages[i].syswide_cpu=-1;
+		rapl_packages[i].nr_points=0;
+		cpumask_clear(&rapl_packages[i].cpus);
+		spin_lock_init(&rapl_packages[i].lock);
+		hrtimer_init(&rapl_packages[i].timer,CLOCK_MONOTONIC,HRTIMER_MODE_REL);
+		rapl_packages[i].timer.function=rapl_sampler_fire;
+	}
+
+	for_each_possible_cpu(cpu) {
+		ct=&per_cpu(rapl_cpu_time,cpu);
+		seqcount_init(&ct->seq);
+		ct->busy_ns=ct->on_since=ct->last_busy_ns=0;
+	}
+
+	/* The callbacks do nothing until the samplers are up */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+	register_cpu_notifier(&rapl_cpu_nb);
+#else
+	if ((i=cpuhp_setup_state_nocalls(CPUHP_AP_ONLINE_DYN,"pmctrack/rapl:online",
+	                                 rapl_cpu_online,rapl_cpu_down_prep))<0)
+		return i;
+	rapl_cpuhp_state=i;
+#endif
+
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		if ((i=rapl_cpu_package(cpu))<0)
+			continue;
+		pkg=&rapl_packages[i];
+		if (pkg->cpu==-1)
+			pkg->cpu=cpu;
+		cpumask_set_cpu(cpu,&pkg->cpus);
+	}
+
+	for (i=0; i<RAPL_MAX_PACKAGES; i++) {
+		pkg=&rapl_packages[i];
+		if (pkg->cpu!=-1)
+			smp_call_function_single(pkg->cpu,rapl_sampler_start_local,pkg,1);
+	}
+	rapl_samplers_ready=1;
+	put_online_cpus();
+
+	return 0;
+}
+
+/* Stop the energy samplers */
+static void rapl_stop_samplers(void)
+{
+	int i;
+
+	get_online_cpus();
+	rapl_samplers_ready=0;
+	for (i=0; i<RAPL_MAX_PACKAGES; i++)
+		hrtimer_cancel(&rapl_packages[i].timer);
+	put_online_cpus();
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+	unregister_cpu_notifier(&rapl_cpu_nb);
+#else
+	cpuhp_remove_state_nocalls(rapl_cpuhp_state);
+#endif
+}
+
+/*
+ * Value of the energy series at time t, obtained by linear interpolation of
+ * the points in the [first,nr) range (or by extrapolation from
+ * the last segment, if t is past the latest point).
+ */
+static void rapl_series_value(rapl_package_t* pkg, unsigned long first, unsigned long nr,
+                              uint64_t t, rapl_energy_point_t* value)
+{
+	rapl_energy_point_t* p0;
+	rapl_energy_point_t* p1;
+	unsigned long idx=nr-1;
+	uint64_t frac;
+	int i;
+
+	/* Search backwards (t is usually recent) */
+	while (idx>first && pkg->series[idx & (RAPL_SERIES_LEN-1)].timestamp>t)
+		idx--;
+
+	if (idx==nr-1)
+		idx--;
+
+	p0=&pkg->series[idx & (RAPL_SERIES_LEN-1)];
+	p1=&pkg->series[(idx+1) & (RAPL_SERIES_LEN-1)];
+
+	if (t<p0->timestamp)
+		t=p0->timestamp;
+
+	/* Fraction of the segment (fixed point), capped when extrapolating */
+	frac=div64_u64((t-p0->timestamp)<<RAPL_SHARE_SHIFT,p1->timestamp-p0->timestamp);
+	if (frac>(2ULL<<RAPL_SHARE_SHIFT))
+		frac=2ULL<<RAPL_SHARE_SHIFT;
+
+	value->timestamp=t;
+	for (i=0; i<RAPL_NR_DOMAINS; i++)
+		value->energy[i]=p0->energy[i]+(((p1->energy[i]-p0->energy[i])*frac)>>RAPL_SHARE_SHIFT);
+	value->busy_ns=p0->busy_ns+(((p1->busy_ns-p0->busy_ns)*frac)>>RAPL_SHARE_SHIFT);
+}
+
+/*
+ * Energy consumed by a package and time spent by monitored threads
+ * on its CPUs in the [a,b] interval. Returns a non-zero value if the
+ * series is not available.
+ */
+static int rapl_series_delta(rapl_package_t* pkg, uint64_t a, uint64_t b, rapl_energy_point_t* delta)
+{
+	rapl_energy_point_t va,vb;
+	unsigned long nr,first;
+	int tries,i;
+
+	for (tries=0; tries<3; tries++) {
+		nr=READ_ONCE(pkg->nr_points);
+		smp_rmb();
+
+		if (nr<2)
+			return 1;
+
+		first=(nr>RAPL_SERIES_LEN-1)?nr-(RAPL_SERIES_LEN-1):0;
+		rapl_series_value(pkg,first,nr,a,&va);
+		rapl_series_value(pkg,first,nr,b,&vb);
+
+		/* Make sure the sampler did not overwrite the points used */
+		smp_rmb();
+		if (READ_ONCE(pkg->nr_points)>first+RAPL_SERIES_LEN)
+			continue;
+
+		for (i=0; i<RAPL_NR_DOMAINS; i++)
+			delta->energy[i]=(vb.energy[i]>va.energy[i])?vb.energy[i]-va.energy[i]:0;
+		delta->busy_ns=(vb.busy_ns>va.busy_ns)?vb.busy_ns-va.busy_ns:0;
+		return 0;
 	}
+
+	return 1;
+}
+
+/*
+ * Attribute to a thread the energy consumed by its package while the thread
+ * was running in an interval, in proportion to the time it spent on
+ * the CPU relative to the other monitored threads running on the same package.
+ */
+static void rapl_attribute_interval(intel_rapl_thread_data_t* tdata, rapl_interval_t* interval)
+{
+	rapl_energy_point_t delta;
+	uint64_t dt=interval->end-interval->start;
+	uint64_t share;
+	int i;
+
+	if (rapl_series_delta(&rapl_packages[interval->package],interval->start,interval->end,&delta))
+		return;
+
+	if (delta.busy_ns<dt)
+		delta.busy_ns=dt;
+
+	share=div64_u64(dt<<RAPL_SHARE_SHIFT,delta.busy_ns);
+
+	for (i=0; i<RAPL_NR_DOMAINS; i++)
+		if (available_power_domains_mask & (1<<i))
+			tdata->acum_power_domain[i]+=delta.energy[i]*share;
+}
+
+/* Timestamp of the latest point in the energy series of a package (0 if none) */
+static inline uint64_t rapl_series_last_timestamp(rapl_package_t* pkg)
+{
+	unsigned long nr=READ_ONCE(pkg->nr_points);
+
+	smp_rmb();
+	return nr?pkg->series[(nr-1) & (RAPL_SERIES_LEN-1)].timestamp:0;
+}
+
+/*
+ * Attribute the energy of the thread's pending intervals the series already
+ * covers (i.e., that end before the latest point of the series), so that
+ * the energy is interpolated rather than extrapolated. The remaining intervals
+ * are kept for later, unless force is set (e.g., the thread is exiting).
+ */
+static void rapl_settle_intervals(intel_rapl_thread_data_t* tdata, int force)
+{
+	rapl_interval_t* interval;
+	unsigned int i,nr_left=0;
+
+	for (i=0; i<tdata->nr_pending; i++) {
+		interval=&tdata->pending[i];
+
+		if (force || interval->end<=rapl_series_last_timestamp(&rapl_packages[interval->package]))
+			rapl_attribute_interval(tdata,interval);
+		else
+			tdata->pending[nr_left++]=(*interval);
+	}
+
+	tdata->nr_pending=nr_left;
+}
+
+/* Record an on-CPU interval of the thread, to be attributed once the series covers it */
+static void rapl_queue_interval(intel_rapl_thread_data_t* tdata, uint64_t a, uint64_t b)
+{
+	unsigned int i;
+
+	if (tdata->package<0 || b<=a)
+		return;
+
+	/* No room left: settle the oldest interval with the points available */
+	if (tdata->nr_pending==RAPL_MAX_PENDING) {
+		rapl_attribute_interval(tdata,&tdata->pending[0]);
+		for (i=1; i<RAPL_MAX_PENDING; i++)
+			tdata->pending[i-1]=tdata->pending[i];
+		tdata->nr_pending--;
+	}
+
+	tdata->pending[tdata->nr_pending].start=a;
+	tdata->pending[tdata->nr_pending].end=b;
+	tdata->pending[tdata->nr_pending].package=tdata->package;
+	tdata->nr_pending++;
 }
 
 /*
@@ -283,28 +789,35 @@ static inline void do_read_energy_msrs(intel_rapl_thread_data_t* tdata, int acum
  */
 static int intel_rapl_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,int flags,void* data)
 {
-	intel_rapl_thread_data_t* tdata=prof->monitoring_mod_priv_data;
+	intel_rapl_thread_data_t* tdata=mm_get_priv_data(prof,&intel_rapl_mm);
 	int i=0;
-	int cnt_virt=0;
 	int active_domains=0;
+	uint64_t now,units;
 
-	if (tdata!=NULL && prof->virt_counter_mask) {
+	if (tdata!=NULL && mm_virt_counter_mask(prof,&intel_rapl_mm)) {
+
+		/* Account for the current on-CPU interval up to now */
+		if (!(flags & MM_NO_CUR_CPU) && tdata->switch_in_ns) {
+			now=raw_ktime(ktime_get());
+			rapl_queue_interval(tdata,tdata->switch_in_ns,now);
+			tdata->switch_in_ns=now;
+		}
 
-		do_read_energy_msrs(tdata,1,flags & MM_NO_CUR_CPU);
+		/* Energy of the intervals not covered by the series yet goes to later samples */
+		rapl_settle_intervals(tdata,flags & MM_EXIT);
 
 		/* Embed virtual counter information so that the user can see what's going on */
 
 		for (i=0; i<RAPL_NR_DOMAINS; i++) {
 			if (available_power_domains_mask & (1<<i)) {
-				if ((prof->virt_counter_mask & (1<<active_domains)) ) { // Just one virtual counter
+				units=tdata->acum_power_domain[i]>>RAPL_SHARE_SHIFT;
+				if ((mm_virt_counter_mask(prof,&intel_rapl_mm) & (1<<active_domains)) ) { // Just one virtual counter
 					sample->virt_mask|=(1<<active_domains);
-					sample->nr_virt_counts++;
-					sample->virtual_counts[cnt_virt]=(tdata->acum_power_domain[i]*1000000)>>energy_units;
-					cnt_virt++;
+					sample->virtual_counts[sample->nr_virt_counts++]=(units*1000000)>>energy_units;
 				}
 				active_domains++;
-				/* Reset no matter what */
-				tdata->acum_power_domain[i]=0;
+				/* Reset no matter what (the fraction of an energy unit is carried over) */
+				tdata->acum_power_domain[i]&=(1ULL<<RAPL_SHARE_SHIFT)-1;
 			}
 		}
 	}
@@ -315,36 +828,62 @@ static int intel_rapl_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* samp
 /* Free up private data */
 static void intel_rapl_on_free_task(pmon_prof_t* prof)
 {
-	if (prof->monitoring_mod_priv_data)
-		kfree(prof->monitoring_mod_priv_data);
+	if (mm_get_priv_data(prof,&intel_rapl_mm))
+		kfree(mm_get_priv_data(prof,&intel_rapl_mm));
 }
 
-/* on switch_in callback */
+/*
+ * on switch_in callback: no MSRs are read on context switches,
+ * just the beginning of the on-CPU interval is recorded
+ */
 void intel_rapl_on_switch_in(pmon_prof_t* prof)
 {
-	intel_rapl_thread_data_t* data=(intel_rapl_thread_data_t*)prof->monitoring_mod_priv_data;
+	intel_rapl_thread_data_t* data=(intel_rapl_thread_data_t*)mm_get_priv_data(prof,&intel_rapl_mm);
+	rapl_cpu_time_t* ct;
+	uint64_t now;
 
-	if (!data || data->security_id!=current_monitoring_module_security_id() )
+	if (!data || data->security_id!=monitoring_module_security_id(&intel_rapl_mm) )
 		return;
 
-	/* Update prev counts */
-	do_read_energy_msrs(data,0,0);
+	now=raw_ktime(ktime_get());
+	ct=this_cpu_ptr(&rapl_cpu_time);
 
-	if (data->first_time)
-		data->first_time=0;
+	write_seqcount_begin(&ct->seq);
+	ct->on_since=now;
+	write_seqcount_end(&ct->seq);
+
+	data->switch_in_ns=now;
+	data->package=rapl_cpu_package(smp_processor_id());
 }
 
-/* on switch_out callback */
+/*
+ * on switch_out callback: the energy for the on-CPU interval is taken
+ * from the energy series of the package
+ */
 void intel_rapl_on_switch_out(pmon_prof_t* prof)
 {
-	intel_rapl_thread_data_t* data=(intel_rapl_thread_data_t*)prof->monitoring_mod_priv_data;
+	intel_rapl_thread_data_t* data=(intel_rapl_thread_data_t*)mm_get_priv_data(prof,&intel_rapl_mm);
+	rapl_cpu_time_t* ct;
+	uint64_t now;
 
-	if (!data || data->security_id!=current_monitoring_module_security_id())
+	if (!data || data->security_id!=monitoring_module_security_id(&intel_rapl_mm))
 		return;
 
+	now=raw_ktime(ktime_get());
+	ct=this_cpu_ptr(&rapl_cpu_time);
+
+	write_seqcount_begin(&ct->seq);
+	if (ct->on_since && now>ct->on_since)
+		ct->busy_ns+=now-ct->on_since;
+	ct->on_since=0;
+	write_seqcount_end(&ct->seq);
+
 	/* Accumulate energy readings */
-	if (!data->first_time)
-		do_read_energy_msrs(data,1,0);
+	if (data->switch_in_ns) {
+		rapl_queue_interval(data,data->switch_in_ns,now);
+		data->switch_in_ns=0;
+	}
+	rapl_settle_intervals(data,0);
 }
 
 /* Modify this function if necessary to expose energy readings to the OS scheduler */
@@ -353,38 +892,29 @@ static int intel_rapl_get_current_metric_value(pmon_prof_t* prof, int key, uint6
 	return -1;
 }
 
-/* Support for system-wide power measurement (Reuse per-thread info as is) */
-static DEFINE_PER_CPU(intel_rapl_thread_data_t, cpu_syswide);
+/*
+ * Support for system-wide power measurement: the energy of each package is
+ * reported by a single CPU (the lowest-numbered monitored CPU in the package).
+ * The remaining CPUs report zero, so that adding up the values of all CPUs
+ * yields the energy of the whole system.
+ */
 
-/* Initialize resources to support system-wide monitoring with Intel RAPL */
-static int initialize_system_wide_rapl_structures(void)
+/* Package whose energy is reported by a CPU in system-wide mode (NULL if none) */
+static inline rapl_package_t* rapl_syswide_package(int cpu)
 {
-	int cpu,i;
-	intel_rapl_thread_data_t* data;
-
-	for_each_possible_cpu(cpu) {
-		data=&per_cpu(cpu_syswide, cpu);
-
-		for (i=0; i<RAPL_NR_DOMAINS; i++) {
-			data->cur_domain_value[i]=0;
-			data->acum_power_domain[i]=0;
-		}
+	int pkg=rapl_cpu_package(cpu);
 
-		/* These two fields are not used by the system-wide monitor
-			Nevertheless we initialize them both just in case...
-		*/
-		data->security_id=current_monitoring_module_security_id();
-		data->first_time=1;
-	}
-
-	return 0;
+	if (pkg<0 || rapl_packages[pkg].syswide_cpu!=cpu)
+		return NULL;
+	return &rapl_packages[pkg];
 }
 
 /*	Invoked on each CPU when starting up system-wide monitoring mode */
 static int intel_rapl_on_syswide_start_monitor(int cpu, unsigned int virtual_mask)
 {
-	intel_rapl_thread_data_t* data;
-	int i=0;
+	rapl_package_t* pkg;
+	unsigned long flags;
+	int pkg_id,old;
 
 	/* Probe only */
 	if (cpu==-1) {
@@ -398,51 +928,77 @@ static int intel_rapl_on_syswide_start_monitor(int cpu, unsigned int virtual_mas
 			return 0;
 	}
 
-	data=&per_cpu(cpu_syswide, cpu);
+	if ((pkg_id=rapl_cpu_package(cpu))<0)
+		return 0;
 
-	for (i=0; i<RAPL_NR_DOMAINS; i++) {
-		data->cur_domain_value[i]=0;
-		data->acum_power_domain[i]=0;
-	}
+	pkg=&rapl_packages[pkg_id];
+
+	/* CPUs start up in parallel: the lowest-numbered one reports the package energy */
+	do {
+		old=pkg->syswide_cpu;
+		if (old!=-1 && old<cpu)
+			return 0;
+	} while (cmpxchg(&pkg->syswide_cpu,old,cpu)!=old);
 
 	/* Update prev counts */
-	do_read_energy_msrs(data,0,0);
+	rapl_update_package_energy(pkg);
+	spin_lock_irqsave(&pkg->lock,flags);
+	memcpy(pkg->syswide_last,pkg->energy,sizeof(pkg->syswide_last));
+	spin_unlock_irqrestore(&pkg->lock,flags);
 
 	return 0;
 }
 
 /*	Invoked on each CPU when stopping system-wide monitoring mode */
+static void intel_rapl_on_syswide_stop_monitor(int cpu, unsigned int virtual_mask)
+{
+	rapl_package_t* pkg=rapl_syswide_package(cpu);
+
+	if (pkg)
+		pkg->syswide_cpu=-1;
+}
+
+/*	Invoked on each CPU to refresh its counts in system-wide mode */
 static void intel_rapl_on_syswide_refresh_monitor(int cpu, unsigned int virtual_mask)
 {
-	intel_rapl_thread_data_t* data=&per_cpu(cpu_syswide, cpu);
+	rapl_package_t* pkg=rapl_syswide_package(cpu);
 
-	/* Accumulate energy readings */
-	do_read_energy_msrs(data,1,0);
+	/* Only the reporting CPU of the package reads the MSRs */
+	if (pkg)
+		rapl_update_package_energy(pkg);
 }
 
 /* 	Dump virtual-counter values for this CPU */
 static void intel_rapl_on_syswide_dump_virtual_counters(int cpu, unsigned int virtual_mask,pmc_sample_t* sample)
 {
-	intel_rapl_thread_data_t* data=&per_cpu(cpu_syswide, cpu);
+	rapl_package_t* pkg=rapl_syswide_package(cpu);
+	uint64_t delta[RAPL_NR_DOMAINS];
+	unsigned long flags;
 	int i=0;
-	int cnt_virt=0;
 	int active_domains=0;
 
 	if (!virtual_mask)
 		return;
 
+	memset(delta,0,sizeof(delta));
+
+	if (pkg) {
+		spin_lock_irqsave(&pkg->lock,flags);
+		for (i=0; i<RAPL_NR_DOMAINS; i++) {
+			delta[i]=pkg->energy[i]-pkg->syswide_last[i];
+			pkg->syswide_last[i]=pkg->energy[i];
+		}
+		spin_unlock_irqrestore(&pkg->lock,flags);
+	}
+
 	/* Embed virtual counter information so that the user can see what's going on */
 	for (i=0; i<RAPL_NR_DOMAINS; i++) {
 		if (available_power_domains_mask & (1<<i)) {
 			if ((virtual_mask & (1<<active_domains)) ) {
 				sample->virt_mask|=(1<<active_domains);
-				sample->nr_virt_counts++;
-				sample->virtual_counts[cnt_virt]=(data->acum_power_domain[i]*1000000)>>energy_units; /* Just PP0 for now */
-				cnt_virt++;
+				sample->virtual_counts[sample->nr_virt_counts++]=(delta[i]*1000000)>>energy_units;
 			}
 			active_domains++;
-			// Reset no matter what
-			data->acum_power_domain[i]=0;
 		}
 	}
 }
@@ -465,6 +1021,7 @@ monitoring_module_t intel_rapl_mm= {
 	.get_current_metric_value=intel_rapl_get_current_metric_value,
 	.module_counter_usage=intel_rapl_module_counter_usage,
 	.on_syswide_start_monitor=intel_rapl_on_syswide_start_monitor,
+	.on_syswide_stop_monitor=intel_rapl_on_syswide_stop_monitor,
 	.on_syswide_refresh_monitor=intel_rapl_on_syswide_refresh_monitor,
 	.on_syswide_dump_virtual_counters=intel_rapl_on_syswide_dump_virtual_counters
 };
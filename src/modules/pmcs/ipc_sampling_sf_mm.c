@@ -29,6 +29,9 @@
 
 #define IPC_MODEL_STRING "IPC sampling SF estimation module"
 
+/* Descriptor of this monitoring module (defined at the end of the file) */
+extern monitoring_module_t ipc_sampling_sf_mm;
+
 /* Global PMC configuration for both core types */
 core_experiment_set_t ipc_sampling_pmc_configuration[AMP_CORE_TYPES];
 
@@ -182,7 +185,7 @@ static int ipc_sampling_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 	int i=0;
 	ipc_sampling_thread_data_t*  data=NULL;
 
-	if (prof->monitoring_mod_priv_data!=NULL)
+	if (mm_get_priv_data(prof,&ipc_sampling_sf_mm)!=NULL)
 		return 0;
 
 	if (!prof->pmcs_config) {
@@ -209,7 +212,7 @@ static int ipc_sampling_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 
 	data->warming_up=1;
 	data->cur_speedup_factor=ipc_sampling_sfmodel_config.sfmodel_initial_ratio*100; /* 2.5 x (default) */
-	prof->monitoring_mod_priv_data = data;
+	mm_set_priv_data(prof,&ipc_sampling_sf_mm,data);
 	return 0;
 }
 
@@ -229,7 +232,7 @@ static int ipc_sampling_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sa
 {
 	int cur_coretype=get_coretype_cpu(cpu);
 	//core_experiment_t *cur_exp=prof->pmcs_config;
-	ipc_sampling_thread_data_t* sfdata=prof->monitoring_mod_priv_data;
+	ipc_sampling_thread_data_t* sfdata=mm_get_priv_data(prof,&ipc_sampling_sf_mm);
 	int ipc=0;
 
 	if (sfdata!=NULL) {
@@ -243,6 +246,7 @@ static int ipc_sampling_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sa
 		/* Update running average */
 		pmon_update_running_average(ipc_history,ipc,
 		                            ipc_sampling_sfmodel_config.sfmodel_running_average_factor,12,1);
+		mm_publish_metric(prof,&ipc_sampling_sf_mm,MC_INSTR_PER_CYCLE,ipc_history->running_average);
 
 
 		sfdata->ipc_samples_cnt[cur_coretype]++;
@@ -273,11 +277,13 @@ static int ipc_sampling_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sa
 			else
 				sfdata->cur_speedup_factor=speedup_estimate;
 
+			mm_publish_metric(prof,&ipc_sampling_sf_mm,MC_SPEEDUP_FACTOR,
+			                  normalize_speedup_factor(sfdata->cur_speedup_factor));
+
 			/* Embed virtual counter information so that the user can see what's going on */
-			if ((prof->virt_counter_mask & 0x1) ) {
+			if ((mm_virt_counter_mask(prof,&ipc_sampling_sf_mm) & 0x1) ) {
 				sample->virt_mask|=0x1;
-				sample->nr_virt_counts++;
-				sample->virtual_counts[0]=sfdata->cur_speedup_factor;
+				sample->virtual_counts[sample->nr_virt_counts++]=sfdata->cur_speedup_factor;
 			}
 
 #ifdef DEBUG
@@ -308,7 +314,7 @@ static void ipc_sampling_on_migrate(pmon_prof_t* prof, int prev_cpu, int new_cpu
 /* Free up private data */
 static void ipc_sampling_on_free_task(pmon_prof_t* prof)
 {
-	ipc_sampling_thread_data_t* data=(ipc_sampling_thread_data_t*)prof->monitoring_mod_priv_data;
+	ipc_sampling_thread_data_t* data=(ipc_sampling_thread_data_t*)mm_get_priv_data(prof,&ipc_sampling_sf_mm);
 	if (data)
 		kfree(data);
 }
@@ -316,7 +322,7 @@ static void ipc_sampling_on_free_task(pmon_prof_t* prof)
 /* Return current SF value for this thread */
 static int ipc_sampling_get_current_metric_value(pmon_prof_t* prof, int key, uint64_t* value)
 {
-	ipc_sampling_thread_data_t* sfdata=prof->monitoring_mod_priv_data;
+	ipc_sampling_thread_data_t* sfdata=mm_get_priv_data(prof,&ipc_sampling_sf_mm);
 
 	/* Detect null data before accessing the samples buffer*/
 	if (sfdata==NULL)
@@ -21,6 +21,11 @@
 #endif /* __LINUX__ && _DEBUG_USER_MODE */
 #if defined(__LINUX__)
 #include <linux/kernel.h>
+#include <linux/cpumask.h>
+#include <linux/ctype.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/kref.h>
 #include <asm/div64.h>          /* For do_div(). */
 #else	/* Solaris kernel */
 /* Nothing at all */
@@ -164,10 +169,10 @@ void compute_value(pmc_metric_t* metric, uint64_t* hw_events, pmc_metric_t* metr
 		break;
 	case op_substract:
 		get_operands(metric, hw_events, metric_vector, operands, 2);
-		if(operands[0].value >= operands[1].value ) {
+		if(operands[0].value >= operands[1].value )
 			metric->count = operands[0].value-operands[1].value;
-		}
-		metric->count=0;
+		else
+			metric->count=0;
 		break;
 	case op_rate:
 		get_operands(metric, hw_events, metric_vector, operands, 2);
@@ -316,6 +321,7 @@ int get_any_cpu_coretype(int coretype)
 pmc_samples_buffer_t* allocate_pmc_samples_buffer(unsigned int size_bytes)
 {
 	pmc_samples_buffer_t* pmc_samples_buf=NULL;
+	int i=0;
 
 	pmc_samples_buf=kmalloc(sizeof(pmc_samples_buffer_t),GFP_KERNEL);
 
@@ -334,10 +340,179 @@ pmc_samples_buffer_t* allocate_pmc_samples_buffer(unsigned int size_bytes)
 	atomic_set(&pmc_samples_buf->ref_counter,1);
 
 	pmc_samples_buf->monitor_waiting=0;
+	pmc_samples_buf->config_epoch=0;
+	pmc_samples_buf->flight_window_ns=0;
+	pmc_samples_buf->flight_dump_bytes=0;
+	pmc_samples_buf->flight_dump_end=0;
+	INIT_LIST_HEAD(&pmc_samples_buf->flight_links);
+	pmc_samples_buf->filter=NULL;
+	RCU_INIT_POINTER(pmc_samples_buf->user_metrics,NULL);
+	pmc_samples_buf->sample_size=sizeof(pmc_sample_t);
+
+	for (i=0; i<AMP_MAX_CORETYPES; i++)
+		init_core_experiment_set_t(&pmc_samples_buf->pending_cfg[i]);
 
 	return pmc_samples_buf;
 }
 
+int pmc_samples_buffer_set_sample_size(pmc_samples_buffer_t* sbuf, unsigned int sample_size)
+{
+	unsigned long flags;
+	int ret=0;
+
+	if (sample_size<pmc_sample_size(0) || sample_size>sizeof(pmc_sample_t))
+		return -EINVAL;
+
+	spin_lock_irqsave(&sbuf->lock,flags);
+	if (sample_size!=sbuf->sample_size) {
+		if (is_empty_cbuffer_t(sbuf->pmc_samples))
+			sbuf->sample_size=sample_size;
+		else
+			ret=-EBUSY;
+	}
+	spin_unlock_irqrestore(&sbuf->lock,flags);
+	return ret;
+}
+
+/* Buffers in flight-recorder mode (to support global triggers) */
+static LIST_HEAD(flight_recorder_list);
+static DEFINE_SPINLOCK(flight_recorder_lock);
+
+int pmc_samples_buffer_set_flight_recorder(pmc_samples_buffer_t* sbuf, unsigned int window_ms, unsigned int size_bytes)
+{
+	cbuffer_t* new_ring=NULL;
+	cbuffer_t* old_ring=NULL;
+	unsigned long flags;
+
+	size_bytes=(size_bytes/sbuf->sample_size)*sbuf->sample_size;
+
+	if (size_bytes && (new_ring=create_cbuffer_t(size_bytes))==NULL)
+		return -ENOMEM;
+
+	if (window_ms)
+		pmc_samples_buffer_unregister_flight_recorder(sbuf);
+
+	spin_lock_irqsave(&sbuf->lock,flags);
+	if (new_ring) {
+		old_ring=sbuf->pmc_samples;
+		sbuf->pmc_samples=new_ring;
+	}
+	sbuf->flight_window_ns=(uint64_t)window_ms*NSEC_PER_MSEC;
+	sbuf->flight_dump_bytes=0;
+	sbuf->flight_dump_end=0;
+	spin_unlock_irqrestore(&sbuf->lock,flags);
+
+	if (window_ms) {
+		spin_lock_irqsave(&flight_recorder_lock,flags);
+		list_add_tail(&sbuf->flight_links,&flight_recorder_list);
+		spin_unlock_irqrestore(&flight_recorder_lock,flags);
+	} else
+		pmc_samples_buffer_unregister_flight_recorder(sbuf);
+
+	if (old_ring)
+		destroy_cbuffer_t(old_ring);
+
+	return 0;
+}
+
+void pmc_samples_buffer_unregister_flight_recorder(pmc_samples_buffer_t* sbuf)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&flight_recorder_lock,flags);
+	list_del_init(&sbuf->flight_links);
+	spin_unlock_irqrestore(&flight_recorder_lock,flags);
+}
+
+/* Must be invoked with the buffer's lock held */
+static void __flight_recorder_trigger(pmc_samples_buffer_t* sbuf)
+{
+	/* Deliver whatever is in the buffer right now */
+	sbuf->flight_dump_bytes=size_cbuffer_t(sbuf->pmc_samples);
+
+	if (sbuf->flight_dump_bytes && sbuf->monitor_waiting) {
+		sbuf->monitor_waiting=0;
+		up(&sbuf->sem_queue);
+	}
+}
+
+int pmc_flight_recorder_trigger(pmc_samples_buffer_t* sbuf)
+{
+	unsigned long flags;
+
+	if (!sbuf->flight_window_ns)
+		return -EINVAL;
+
+	spin_lock_irqsave(&sbuf->lock,flags);
+	/* Do nothing if the previous dump is still in progress */
+	if (!sbuf->flight_dump_bytes)
+		__flight_recorder_trigger(sbuf);
+	spin_unlock_irqrestore(&sbuf->lock,flags);
+	return 0;
+}
+
+int pmc_flight_recorder_trigger_all(void)
+{
+	pmc_samples_buffer_t* sbuf;
+	unsigned long flags,sbuf_flags;
+	int nr_buffers=0;
+
+	spin_lock_irqsave(&flight_recorder_lock,flags);
+	list_for_each_entry(sbuf,&flight_recorder_list,flight_links) {
+		spin_lock_irqsave(&sbuf->lock,sbuf_flags);
+		if (!sbuf->flight_dump_bytes)
+			__flight_recorder_trigger(sbuf);
+		spin_unlock_irqrestore(&sbuf->lock,sbuf_flags);
+		nr_buffers++;
+	}
+	spin_unlock_irqrestore(&flight_recorder_lock,flags);
+
+	return nr_buffers?0:-ENOENT;
+}
+
+/* Discard the oldest sample in a flight-recorder buffer */
+static inline void __flight_recorder_discard_oldest(pmc_samples_buffer_t* sbuf)
+{
+	discard_items_cbuffer_t(sbuf->pmc_samples,sbuf->sample_size);
+
+	/* The sample may belong to a dump in progress */
+	if (!sbuf->flight_dump_bytes)
+		return;
+
+	if (sbuf->flight_dump_bytes>sbuf->sample_size)
+		sbuf->flight_dump_bytes-=sbuf->sample_size;
+	else {
+		sbuf->flight_dump_bytes=0;
+		sbuf->flight_dump_end=1;
+	}
+}
+
+void __push_sample_flight_recorder(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample)
+{
+	cbuffer_t* cbuf=sbuf->pmc_samples;
+	uint64_t oldest_timestamp;
+
+	/* Overwrite the oldest samples when the buffer is full */
+	while (nr_gaps_cbuffer_t(cbuf)<sbuf->sample_size && !is_empty_cbuffer_t(cbuf))
+		__flight_recorder_discard_oldest(sbuf);
+
+	insert_items_cbuffer_t(cbuf,sample,sbuf->sample_size);
+
+	/* Do not drop samples that are being delivered to the monitor */
+	if (sbuf->flight_dump_bytes)
+		return;
+
+	/* Drop samples that fall out of the time window */
+	while (size_cbuffer_t(cbuf)>sbuf->sample_size) {
+		peek_items_cbuffer_t(cbuf,offsetof(pmc_sample_t,timestamp),&oldest_timestamp,sizeof(uint64_t));
+
+		if (sample->timestamp-oldest_timestamp<=sbuf->flight_window_ns)
+			break;
+
+		__flight_recorder_discard_oldest(sbuf);
+	}
+}
+
 
 int estimate_sf_additive(uint64_t* metrics,int* adregression_spec,int correction_factor)
 {
@@ -420,87 +595,248 @@ void fill_in_sf_metric_vector(metric_experiment_set_t* metric_set, uint64_t* sf_
 
 /********* Implementation of operations on the phase table ************/
 #include <linux/list.h>
+#include <linux/mm.h>
 #include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 
 /* Generic nodes for the doubly linked list used in the table  */
 typedef struct {
 	struct list_head links; 	/* for the linked list */
 	int idx;					/* Index for the allocator */
+	int in_use;					/* Is the entry occupied? */
 	void* data; 				/* Phase object */
+	struct hlist_node hlink;	/* for the index (indexed tables only) */
+	uint64_t cell[PHASE_TABLE_MAX_METRICS];	/* Quantized metric vector (indexed tables only) */
 } phase_node_t;
 
+/*
+ * Index of a phase table: phases are hashed by their quantized metric vector,
+ * so that similar phases are found in the same cell or in an adjacent one.
+ */
+typedef struct {
+	unsigned int nr_metrics;	/* Dimensions of the metric vector */
+	uint64_t bucket_width[PHASE_TABLE_MAX_METRICS];	/* Width of a cell in each dimension */
+	void (*get_metrics)(void*,uint64_t*);	/* Retrieve the metric vector of a phase */
+	unsigned int hash_bits;
+	struct hlist_head* buckets;
+} phase_table_index_t;
+
 struct phase_table {
 	struct list_head phases;	/* List of phases */
+	struct list_head free_phases;	/* List of unused entries */
 	int nr_phases;				/* Current number of phases */
 	int max_phases;				/* Max phases to be stored on the list */
 	size_t phase_struct_size;	/* Size of the phase structure */
 	void* phase_pool;			/* Memory pool (pre-allocated table entries) */
 	phase_node_t* node_pool;	/* Memory pool (pre-allocated table entries) */
-	unsigned long bitmap;		/* bitmask to keep track of free and occupied entries (1 means free, 0 -> occupied) */
 	int (*compare)(void*,void*,void*); /* Comparison operation (returns 0 if equals or Manhatan distance) */
+	phase_table_index_t* index;	/* NULL for tables without an index */
 };
 
-/* Create a phase table */
-phase_table_t* create_phase_table(unsigned int max_phases, size_t phase_struct_size, int (*compare)(void*,void*,void*))
+/*
+ * Allocate a phase table along with its memory pools (and index if nr_buckets>0)
+ * in a single block. Tables are created for every monitored thread,
+ * so small ones (the common case) are obtained with kmalloc().
+ */
+static phase_table_t* alloc_phase_table(unsigned int max_phases, size_t phase_struct_size,
+                                        int (*compare)(void*,void*,void*), unsigned int nr_buckets)
 {
 	phase_table_t* table=NULL;
-	const unsigned int max_bits=sizeof(unsigned long)*8;
-	void* phase_pool=NULL;
-	void* node_pool=NULL;
+	char* block;
+	size_t index_offset,node_offset,bucket_offset,phase_offset,size;
 	int i=0;
 
-	/* Make sure we can keep track of everything on the bitmap */
-	if (max_phases>max_bits)
+	if (max_phases==0)
 		return NULL;
 
-	/* Allocate memory */
-	if ((phase_pool=vmalloc(phase_struct_size*max_phases))==NULL)
-		goto free_up_resources;
+	/* Layout: table, index, node pool, index buckets and phase pool */
+	index_offset=ALIGN(sizeof(phase_table_t),sizeof(uint64_t));
+	node_offset=index_offset+(nr_buckets?ALIGN(sizeof(phase_table_index_t),sizeof(uint64_t)):0);
+	bucket_offset=node_offset+ALIGN(sizeof(phase_node_t)*max_phases,sizeof(uint64_t));
+	phase_offset=bucket_offset+ALIGN(sizeof(struct hlist_head)*nr_buckets,sizeof(uint64_t));
+	size=phase_offset+phase_struct_size*max_phases;
 
-	if ((node_pool=vmalloc(sizeof(phase_node_t)*max_phases))==NULL)
-		goto free_up_resources;
+	if (size<=(PAGE_SIZE<<PAGE_ALLOC_COSTLY_ORDER))
+		block=kmalloc(size,GFP_KERNEL);
+	else
+		block=vmalloc(size);
 
-	if ((table=vmalloc(sizeof(phase_table_t)))==NULL)
-		goto free_up_resources;
+	if (!block)
+		return NULL;
+
+	table=(phase_table_t*)block;
 
 	/* Initialize phase table */
 	INIT_LIST_HEAD(&table->phases);
+	INIT_LIST_HEAD(&table->free_phases);
 	table->nr_phases=0;
 	table->max_phases=max_phases;
 	table->phase_struct_size=phase_struct_size;
-	table->phase_pool=phase_pool;
-	table->node_pool=node_pool;
-	if (max_phases==max_bits)
-		table->bitmap=~(0); /* All 1s */
-	else
-		table->bitmap=(1<<max_phases)-1; /* 2^max_phases -1 */
+	table->phase_pool=block+phase_offset;
+	table->node_pool=(phase_node_t*)(block+node_offset);
 	table->compare=compare;
+	table->index=NULL;
+
+	if (nr_buckets) {
+		table->index=(phase_table_index_t*)(block+index_offset);
+		table->index->buckets=(struct hlist_head*)(block+bucket_offset);
+		for (i=0; i<nr_buckets; i++)
+			INIT_HLIST_HEAD(&table->index->buckets[i]);
+	}
 
 	/* Prepare pointers (Dark pointer arithmetic operation */
 	for (i=0; i<max_phases; i++) {
-		table->node_pool[i].data=(((char*)phase_pool) + i*phase_struct_size);
+		table->node_pool[i].data=(((char*)table->phase_pool) + i*phase_struct_size);
 		table->node_pool[i].idx=i;
+		table->node_pool[i].in_use=0;
+		INIT_HLIST_NODE(&table->node_pool[i].hlink);
+		list_add_tail(&table->node_pool[i].links,&table->free_phases);
 	}
 
 	return table;
-free_up_resources:
-	if (node_pool)
-		vfree(node_pool);
-	if (phase_pool)
-		vfree(phase_pool);
-	if (table)
-		vfree(table);
-	return NULL;
 }
 
-/* Free up resources associated with a phase table */
+/* Create a phase table */
+phase_table_t* create_phase_table(unsigned int max_phases, size_t phase_struct_size, int (*compare)(void*,void*,void*))
+{
+	return alloc_phase_table(max_phases,phase_struct_size,compare,0);
+}
+
+/*
+ * Create a phase table indexed by the metric vector of phases.
+ * Lookups only consider phases whose metrics are less than half
+ * a bucket width apart from those of the key in every dimension,
+ * so bucket widths should be at least twice the similarity threshold
+ * used by the caller.
+ */
+phase_table_t* create_indexed_phase_table(unsigned int max_phases, size_t phase_struct_size, int (*compare)(void*,void*,void*),
+        unsigned int nr_metrics, const uint64_t* bucket_width, void (*get_metrics)(void*,uint64_t*))
+{
+	phase_table_t* table=NULL;
+	phase_table_index_t* index=NULL;
+	unsigned int nr_buckets;
+	int i=0;
+
+	if (max_phases==0 || nr_metrics==0 || nr_metrics>PHASE_TABLE_MAX_METRICS || !get_metrics)
+		return NULL;
+
+	for (i=0; i<nr_metrics; i++)
+		if (bucket_width[i]==0)
+			return NULL;
+
+	/* As many buckets as entries */
+	nr_buckets=roundup_pow_of_two(max_phases);
+
+	if ((table=alloc_phase_table(max_phases,phase_struct_size,compare,nr_buckets))==NULL)
+		return NULL;
+
+	index=table->index;
+	index->hash_bits=ilog2(nr_buckets);
+	index->nr_metrics=nr_metrics;
+	index->get_metrics=get_metrics;
+
+	for (i=0; i<nr_metrics; i++)
+		index->bucket_width[i]=bucket_width[i];
+
+	return table;
+}
+
+/* Free up resources associated with a phase table (pools and index included) */
 void destroy_phase_table(phase_table_t* table)
 {
-	if (table->node_pool)
-		vfree(table->node_pool);
-	if (table->phase_pool)
-		vfree(table->phase_pool);
-	vfree(table);
+	if (is_vmalloc_addr(table))
+		vfree(table);
+	else
+		kfree(table);
+}
+
+/* Bucket of the index that stores the phases of a given cell */
+static inline struct hlist_head* phase_index_bucket(phase_table_index_t* index, uint64_t* cell)
+{
+	u32 hash=jhash(cell,sizeof(uint64_t)*index->nr_metrics,0);
+	return &index->buckets[hash & ((1U<<index->hash_bits)-1)];
+}
+
+/*
+ * Quantize the metric vector of a phase. For each dimension, the function
+ * also reports whether the phase lies in the lower half of its cell.
+ */
+static void phase_index_quantize(phase_table_index_t* index, void* phase, uint64_t* cell, unsigned int* lower_half)
+{
+	uint64_t metrics[PHASE_TABLE_MAX_METRICS];
+	u64 rem;
+	int i;
+
+	index->get_metrics(phase,metrics);
+	(*lower_half)=0;
+
+	for (i=0; i<index->nr_metrics; i++) {
+		cell[i]=div64_u64_rem(metrics[i],index->bucket_width[i],&rem);
+		if (rem<index->bucket_width[i]/2)
+			(*lower_half)|=(1<<i);
+	}
+}
+
+/*
+ * Retrieve the most similar phase using the index. Phases close enough
+ * to the key are in its cell or in the adjacent cells on the side of the key,
+ * so 2^nr_metrics cells are probed at most.
+ */
+static phase_node_t* get_phase_from_index(phase_table_t* table, void* key_phase, void* priv_data, int* sim_min)
+{
+	phase_table_index_t* index=table->index;
+	uint64_t key_cell[PHASE_TABLE_MAX_METRICS];
+	uint64_t cell[PHASE_TABLE_MAX_METRICS];
+	unsigned int lower_half;
+	unsigned int neighbour;
+	phase_node_t* cur_phase;
+	phase_node_t* selected_phase=NULL;
+	int sim_test=0;
+	int i;
+
+	phase_index_quantize(index,key_phase,key_cell,&lower_half);
+
+	for (neighbour=0; neighbour<(1<<index->nr_metrics); neighbour++) {
+		/* Bit i set in neighbour: move to the adjacent cell in dimension i */
+		for (i=0; i<index->nr_metrics; i++) {
+			cell[i]=key_cell[i];
+
+			if (!(neighbour & (1<<i)))
+				continue;
+
+			if (!(lower_half & (1<<i)))
+				cell[i]++;
+			else if (cell[i]>0)
+				cell[i]--;
+			else
+				break;
+		}
+
+		/* No such cell */
+		if (i<index->nr_metrics)
+			continue;
+
+		hlist_for_each_entry(cur_phase,phase_index_bucket(index,cell),hlink) {
+			if (memcmp(cur_phase->cell,cell,sizeof(uint64_t)*index->nr_metrics))
+				continue;
+
+			/* Invoke comparator function */
+			sim_test=table->compare(cur_phase->data,key_phase,priv_data);
+
+			if (sim_test<(*sim_min)) {
+				(*sim_min)=sim_test;
+				selected_phase=cur_phase;
+
+				/* Exact match found */
+				if (sim_test==0)
+					return selected_phase;
+			}
+		}
+	}
+
+	return selected_phase;
 }
 
 /* Retrieve the most similar phase in a phase table */
@@ -513,19 +849,23 @@ void* get_phase_from_table(phase_table_t* table, void* key_phase, void* priv_dat
 	int sim_test=0;
 	int sim_min=INT_MAX;
 
-	list_for_each(p,&table->phases) {
-		cur_phase=list_entry(p,phase_node_t,links);
+	if (table->index) {
+		selected_phase=get_phase_from_index(table,key_phase,priv_data,&sim_min);
+	} else {
+		list_for_each(p,&table->phases) {
+			cur_phase=list_entry(p,phase_node_t,links);
 
-		/* Invoke comparator function */
-		sim_test=table->compare(cur_phase->data,key_phase,priv_data);
+			/* Invoke comparator function */
+			sim_test=table->compare(cur_phase->data,key_phase,priv_data);
 
-		if (sim_test<sim_min) {
-			sim_min=sim_test;
-			selected_phase=cur_phase;
+			if (sim_test<sim_min) {
+				sim_min=sim_test;
+				selected_phase=cur_phase;
 
-			/* Exact match found */
-			if (sim_test==0)
-				break;
+				/* Exact match found */
+				if (sim_test==0)
+					break;
+			}
 		}
 	}
 
@@ -544,7 +884,7 @@ int promote_table_entry(phase_table_t* table, int index)
 	struct list_head* node;
 
 	/* Check if index is valid and corresponds to a valid entry */
-	if ((index<0) || (index>=table->max_phases) || ((1<<index) & table->bitmap))
+	if ((index<0) || (index>=table->max_phases) || !table->node_pool[index].in_use)
 		return -ENOENT;
 
 	/* Point to the phase's node by accessing the node pool */
@@ -559,36 +899,23 @@ int promote_table_entry(phase_table_t* table, int index)
 	return 0;
 }
 
-/* Find a free entry in the phase table */
-static phase_node_t* get_free_phase_loc(phase_table_t* table)
-{
-	int i=0;
-
-	if (table->bitmap==0)
-		return NULL;
-
-	/* Locate first 1 in here */
-	for (i=0; i<table->max_phases && !((1<<i) & table->bitmap); i++ ) {}
-
-	if (i==table->max_phases)
-		return NULL;
-	else
-		return &table->node_pool[i];
-}
-
 /* Insert a new phase into the phase table */
 void* insert_phase_in_table(phase_table_t* table, void* phase)
 {
 	phase_node_t* free_phase_loc;
-
-	/* Get free location */
-	free_phase_loc=get_free_phase_loc(table);
+	unsigned int lower_half;
 
 	/* If it is full -> reuse tail (oldest phase is evicted) */
-	if (free_phase_loc==NULL) {
+	if (list_empty(&table->free_phases)) {
 		free_phase_loc=list_entry(table->phases.prev,phase_node_t,links);
+		if (table->index)
+			hlist_del(&free_phase_loc->hlink);
+		/* The new phase becomes the most recent one */
+		list_move(&free_phase_loc->links,&table->phases);
 	} else {
-		table->bitmap&=~(1<<free_phase_loc->idx); /* Clear bit */
+		free_phase_loc=list_first_entry(&table->free_phases,phase_node_t,links);
+		list_del(&free_phase_loc->links);
+		free_phase_loc->in_use=1;
 		table->nr_phases++;
 		/* Newer phases inserted at the beginning */
 		list_add(&free_phase_loc->links,&table->phases);
@@ -596,5 +923,462 @@ void* insert_phase_in_table(phase_table_t* table, void* phase)
 
 	/* Copy data */
 	memcpy(free_phase_loc->data,phase,table->phase_struct_size);
+
+	if (table->index) {
+		phase_index_quantize(table->index,free_phase_loc->data,free_phase_loc->cell,&lower_half);
+		hlist_add_head(&free_phase_loc->hlink,phase_index_bucket(table->index,free_phase_loc->cell));
+	}
+
 	return free_phase_loc->data;
-}
\ No newline at end of file
+}
+
+/*
+ * Sample filters: the events of a sample are expanded into
+ * an array of values indexed by PMC number (virtual counters go next)
+ * so that conditions can be evaluated with compute_value().
+ */
+#define PMC_FILTER_VIRT_IDX(n)	(MAX_PERFORMANCE_COUNTERS+(n))
+#define PMC_FILTER_ZERO_IDX	(MAX_PERFORMANCE_COUNTERS+MAX_VIRTUAL_COUNTERS)
+#define PMC_FILTER_NR_VALUES	(PMC_FILTER_ZERO_IDX+1)
+#define PMC_MAX_FILTER_CONDS	4
+
+/* Threshold condition on a metric */
+typedef struct {
+	pmc_metric_t metric;		/* Metric computed from the events of the sample */
+	unsigned int pmc_mask;		/* PMCs the metric depends on */
+	unsigned int virt_mask;		/* Virtual counters the metric depends on */
+	int greater;			/* Emit if the value is above (1) or below (0) the threshold */
+	uint64_t threshold;
+} pmc_filter_cond_t;
+
+struct pmc_sample_filter {
+	int restrict_cpus;		/* Whether the "cpus" field is used or not */
+	cpumask_t cpus;			/* CPUs whose samples are emitted */
+	unsigned int nr_conds;
+	pmc_filter_cond_t conds[PMC_MAX_FILTER_CONDS];
+};
+
+/* Parse an event name (pmcN or virtN) and return its index in the array of values */
+static int parse_filter_operand(const char* str, pmc_arg_t* arg, pmc_filter_cond_t* cond)
+{
+	unsigned int n;
+
+	if (sscanf(str,"pmc%u",&n)==1 && n<MAX_PERFORMANCE_COUNTERS) {
+		cond->pmc_mask|=(1<<n);
+		arg->index=n;
+	} else if (sscanf(str,"virt%u",&n)==1 && n<MAX_VIRTUAL_COUNTERS) {
+		cond->virt_mask|=(1<<n);
+		arg->index=PMC_FILTER_VIRT_IDX(n);
+	} else
+		return -EINVAL;
+
+	arg->type=hw_event_arg;
+	return 0;
+}
+
+/*
+ * Parse a metric expression, such as "pmc2/pmc0*1000" or "pmc0-pmc1"
+ * (the optional scale factor is only allowed for divisions)
+ */
+static int parse_metric_expr(char* str, const char* name, pmc_filter_cond_t* cond)
+{
+	char* op;
+	char* scale;
+	pmc_arg_t args[2];
+	pmc_relation_mode_t mode=op_sum;
+	unsigned long scale_factor=1;
+
+	cond->pmc_mask=cond->virt_mask=0;
+
+	/* Single event by default (added to a zero value) */
+	args[1].type=hw_event_arg;
+	args[1].index=PMC_FILTER_ZERO_IDX;
+
+	if ((op=strpbrk(str,"/*+-"))) {
+		switch (*op) {
+		case '/':
+			mode=op_rate;
+			break;
+		case '*':
+			mode=op_multiplication;
+			break;
+		case '+':
+			mode=op_sum;
+			break;
+		default:
+			mode=op_substract;
+			break;
+		}
+		*op='\0';
+
+		/* Scale factor for rates (e.g., "per kilo-instruction") */
+		if (mode==op_rate && (scale=strchr(op+1,'*'))) {
+			*scale='\0';
+			if (kstrtoul(scale+1,0,&scale_factor) || scale_factor==0)
+				return -EINVAL;
+		}
+
+		if (parse_filter_operand(op+1,&args[1],cond))
+			return -EINVAL;
+	}
+
+	if (parse_filter_operand(str,&args[0],cond))
+		return -EINVAL;
+
+	init_pmc_metric(&cond->metric,name,mode,args,scale_factor);
+	return 0;
+}
+
+/* Parse a threshold condition, such as "pmc2/pmc0*1000>5" */
+static int parse_filter_cond(char* str, pmc_filter_cond_t* cond)
+{
+	char* cmp=strpbrk(str,"<>");
+
+	if (!cmp || cmp==str)
+		return -EINVAL;
+
+	cond->greater=(*cmp=='>');
+	*cmp='\0';
+
+	if (kstrtoull(cmp+1,0,&cond->threshold))
+		return -EINVAL;
+
+	return parse_metric_expr(str,"filter",cond);
+}
+
+int pmc_samples_buffer_set_filter(pmc_samples_buffer_t* sbuf, const char* spec)
+{
+	struct pmc_sample_filter* filter=NULL;
+	struct pmc_sample_filter* old_filter;
+	char* copy=NULL;
+	char* cur;
+	char* token;
+	unsigned long flags;
+	int ret=0;
+
+	if (strcmp(spec,"none")!=0) {
+		if ((filter=kzalloc(sizeof(struct pmc_sample_filter),GFP_KERNEL))==NULL)
+			return -ENOMEM;
+
+		if ((copy=kstrdup(spec,GFP_KERNEL))==NULL) {
+			kfree(filter);
+			return -ENOMEM;
+		}
+
+		cur=copy;
+		while ((token=strsep(&cur," \t\n"))!=NULL && !ret) {
+			if (*token=='\0')
+				continue;
+
+			if (strncmp(token,"cpus=",5)==0) {
+				filter->restrict_cpus=1;
+				ret=cpulist_parse(token+5,&filter->cpus);
+			} else if (filter->nr_conds<PMC_MAX_FILTER_CONDS) {
+				ret=parse_filter_cond(token,&filter->conds[filter->nr_conds++]);
+			} else
+				ret=-E2BIG;
+		}
+
+		kfree(copy);
+
+		if (ret || (!filter->restrict_cpus && filter->nr_conds==0)) {
+			kfree(filter);
+			return ret?ret:-EINVAL;
+		}
+	}
+
+	spin_lock_irqsave(&sbuf->lock,flags);
+	old_filter=sbuf->filter;
+	sbuf->filter=filter;
+	spin_unlock_irqrestore(&sbuf->lock,flags);
+
+	if (old_filter)
+		kfree(old_filter);
+
+	return 0;
+}
+
+/* Expand the event counts in the sample into an array indexed by event number */
+static void expand_sample_values(pmc_sample_t* sample, uint64_t* values)
+{
+	int i,cnt;
+
+	for (i=0,cnt=0; i<MAX_PERFORMANCE_COUNTERS; i++)
+		values[i]=(sample->pmc_mask & (1<<i))?sample->pmc_counts[cnt++]:0;
+
+	for (i=0,cnt=0; i<MAX_VIRTUAL_COUNTERS; i++)
+		values[PMC_FILTER_VIRT_IDX(i)]=(sample->virt_mask & (1<<i))?sample->virtual_counts[cnt++]:0;
+
+	values[PMC_FILTER_ZERO_IDX]=0;
+}
+
+int pmc_sample_filter_match(struct pmc_sample_filter* filter, pmc_sample_t* sample, int cpu)
+{
+	uint64_t values[PMC_FILTER_NR_VALUES];
+	pmc_filter_cond_t* cond;
+	pmc_metric_t metric;
+	int i;
+
+	/* Only regular samples are filtered (e.g., exit samples always go through) */
+	if (sample->type!=PMC_TICK_SAMPLE && sample->type!=PMC_EBS_SAMPLE)
+		return 1;
+
+	if (filter->restrict_cpus && (cpu<0 || cpu>=nr_cpu_ids || !cpumask_test_cpu(cpu,&filter->cpus)))
+		return 0;
+
+	if (!filter->nr_conds)
+		return 1;
+
+	expand_sample_values(sample,values);
+
+	for (i=0; i<filter->nr_conds; i++) {
+		cond=&filter->conds[i];
+
+		/* The condition does not apply to samples of other event sets */
+		if ((cond->pmc_mask & ~sample->pmc_mask) || (cond->virt_mask & ~sample->virt_mask))
+			continue;
+
+		/* The filter is shared by all CPUs: compute the metric on a private copy */
+		metric=cond->metric;
+		compute_value(&metric,values,NULL);
+
+		if (cond->greater?(metric.count<=cond->threshold):(metric.count>=cond->threshold))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * User-defined metrics: relations between events defined via /proc/pmc/config,
+ * which are evaluated for every sample and exported as virtual counters
+ * (right after the ones provided by the active monitoring module).
+ *
+ * Sets of definitions are never modified once published. Every session takes
+ * a reference to the set in force when it configures its virtual counters,
+ * so later definitions, redefinitions or removals do not change the meaning
+ * of the virtual counters of the sessions that are already running.
+ */
+struct pmc_user_metric_set {
+	unsigned int nr_metrics;
+	pmc_filter_cond_t metrics[MAX_VIRTUAL_COUNTERS];	/* The metric ID is the user-provided name */
+	struct kref ref;
+	struct rcu_head rcu;
+};
+
+/* Set for new sessions; updates are serialized with the mutex */
+static struct pmc_user_metric_set __rcu* user_metrics=NULL;
+static DEFINE_MUTEX(user_metrics_mutex);
+
+static void pmc_user_metrics_release(struct kref* ref)
+{
+	struct pmc_user_metric_set* set=container_of(ref,struct pmc_user_metric_set,ref);
+
+	/* The sampling path may still be evaluating the set */
+	kfree_rcu(set,rcu);
+}
+
+void pmc_user_metrics_put(struct pmc_user_metric_set* set)
+{
+	if (set)
+		kref_put(&set->ref,pmc_user_metrics_release);
+}
+
+struct pmc_user_metric_set* pmc_user_metrics_get(void)
+{
+	struct pmc_user_metric_set* set;
+
+	mutex_lock(&user_metrics_mutex);
+	set=rcu_dereference_protected(user_metrics,lockdep_is_held(&user_metrics_mutex));
+	if (set)
+		kref_get(&set->ref);
+	mutex_unlock(&user_metrics_mutex);
+
+	return set;
+}
+
+unsigned int pmc_user_metrics_count(struct pmc_user_metric_set* set)
+{
+	return set?set->nr_metrics:0;
+}
+
+int pmc_user_metric_define(const char* spec)
+{
+	struct pmc_user_metric_set* set;
+	struct pmc_user_metric_set* old_set;
+	char* copy;
+	char* expr;
+	char* c;
+	int i,idx;
+	int ret=0;
+
+	if ((set=kzalloc(sizeof(struct pmc_user_metric_set),GFP_KERNEL))==NULL)
+		return -ENOMEM;
+
+	if ((copy=kstrdup(spec,GFP_KERNEL))==NULL) {
+		kfree(set);
+		return -ENOMEM;
+	}
+
+	kref_init(&set->ref);
+
+	mutex_lock(&user_metrics_mutex);
+
+	old_set=rcu_dereference_protected(user_metrics,lockdep_is_held(&user_metrics_mutex));
+
+	/* Start off with a copy of the current definitions */
+	if (old_set) {
+		set->nr_metrics=old_set->nr_metrics;
+		memcpy(set->metrics,old_set->metrics,sizeof(set->metrics));
+	}
+
+	if (strcmp(copy,"clear")==0) {
+		set->nr_metrics=0;
+		goto publish;
+	}
+
+	if ((expr=strchr(copy,'='))==NULL || expr==copy) {
+		ret=-EINVAL;
+		goto out_err;
+	}
+
+	*expr++='\0';
+
+	if (strlen(copy)>=MAX_EXP_ID) {
+		ret=-ENAMETOOLONG;
+		goto out_err;
+	}
+
+	for (c=copy; *c; c++) {
+		if (!isalnum(*c) && *c!='_') {
+			ret=-EINVAL;
+			goto out_err;
+		}
+	}
+
+	/* Look for a metric with the same name */
+	for (idx=0; idx<set->nr_metrics && strcmp(set->metrics[idx].metric.id,copy); idx++) {}
+
+	if (strcmp(expr,"none")==0) {
+		if (idx==set->nr_metrics) {
+			ret=-ENOENT;
+			goto out_err;
+		}
+		/* The metrics that go next shift one virtual counter down (for new sessions only) */
+		set->nr_metrics--;
+		for (i=idx; i<set->nr_metrics; i++)
+			set->metrics[i]=set->metrics[i+1];
+	} else {
+		if (idx==set->nr_metrics) {
+			if (idx==MAX_VIRTUAL_COUNTERS) {
+				ret=-ENOSPC;
+				goto out_err;
+			}
+			set->nr_metrics++;
+		}
+
+		if ((ret=parse_metric_expr(expr,copy,&set->metrics[idx])))
+			goto out_err;
+	}
+
+publish:
+	if (set->nr_metrics==0) {
+		kfree(set);
+		set=NULL;
+	}
+
+	rcu_assign_pointer(user_metrics,set);
+
+	mutex_unlock(&user_metrics_mutex);
+
+	/* Sessions using the old set keep their own reference */
+	pmc_user_metrics_put(old_set);
+	kfree(copy);
+	return 0;
+out_err:
+	mutex_unlock(&user_metrics_mutex);
+	kfree(set);
+	kfree(copy);
+	return ret;
+}
+
+unsigned int pmc_user_metrics_nr_defined(void)
+{
+	struct pmc_user_metric_set* set;
+	unsigned int nr_metrics;
+
+	mutex_lock(&user_metrics_mutex);
+	set=rcu_dereference_protected(user_metrics,lockdep_is_held(&user_metrics_mutex));
+	nr_metrics=pmc_user_metrics_count(set);
+	mutex_unlock(&user_metrics_mutex);
+
+	return nr_metrics;
+}
+
+char* pmc_user_metrics_print(char* dst, unsigned int first)
+{
+	struct pmc_user_metric_set* set;
+	unsigned int i;
+
+	mutex_lock(&user_metrics_mutex);
+	set=rcu_dereference_protected(user_metrics,lockdep_is_held(&user_metrics_mutex));
+
+	for (i=0; set && i<set->nr_metrics && first+i<MAX_VIRTUAL_COUNTERS; i++)
+		dst+=sprintf(dst,"virt%u=%s\n",first+i,set->metrics[i].metric.id);
+
+	mutex_unlock(&user_metrics_mutex);
+	return dst;
+}
+
+void pmc_samples_buffer_set_user_metrics(pmc_samples_buffer_t* sbuf, struct pmc_user_metric_set* set)
+{
+	struct pmc_user_metric_set* old_set;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sbuf->lock,flags);
+	old_set=rcu_dereference_protected(sbuf->user_metrics,lockdep_is_held(&sbuf->lock));
+	rcu_assign_pointer(sbuf->user_metrics,set);
+	spin_unlock_irqrestore(&sbuf->lock,flags);
+
+	pmc_user_metrics_put(old_set);
+}
+
+void pmc_user_metrics_eval(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample, unsigned int virt_mask, unsigned int first)
+{
+	struct pmc_user_metric_set* set;
+	uint64_t values[PMC_FILTER_NR_VALUES];
+	pmc_filter_cond_t* expr;
+	pmc_metric_t metric;
+	unsigned int idx;
+	int i;
+
+	if (first>=MAX_VIRTUAL_COUNTERS || !(virt_mask>>first))
+		return;
+
+	rcu_read_lock();
+	set=rcu_dereference(sbuf->user_metrics);
+
+	if (set) {
+		expand_sample_values(sample,values);
+
+		for (i=0; i<set->nr_metrics && (idx=first+i)<MAX_VIRTUAL_COUNTERS; i++) {
+			expr=&set->metrics[i];
+
+			/* Not requested, or the events are not in this sample (multiplexing) */
+			if (!(virt_mask & (1<<idx)) ||
+			    (expr->pmc_mask & ~sample->pmc_mask) || (expr->virt_mask & ~sample->virt_mask))
+				continue;
+
+			/* The set is shared by all CPUs: compute the metric on a private copy */
+			metric=expr->metric;
+			compute_value(&metric,values,NULL);
+
+			/* Metrics may refer to the ones defined before */
+			values[PMC_FILTER_VIRT_IDX(idx)]=metric.count;
+			sample->virt_mask|=(1<<idx);
+			sample->virtual_counts[sample->nr_virt_counts++]=metric.count;
+		}
+	}
+
+	rcu_read_unlock();
+}
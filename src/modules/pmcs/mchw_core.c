@@ -20,12 +20,15 @@
 #include <linux/proc_fs.h>
 #include <linux/cpumask.h>
 #include <linux/slab.h>
+#include <linux/ctype.h>
 
 #include <linux/smp.h>
 #include <linux/cpu.h>
 #include <linux/kdebug.h>
 #include <linux/notifier.h>
 #include <linux/semaphore.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
 #include <pmc/pmu_config.h>
 #include <linux/pmctrack.h>
 #include <linux/vmalloc.h>
@@ -42,12 +45,19 @@
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
 #include <linux/sched/task.h> /* for get_task_struct()/put_task_struct() */
+#include <linux/sched/signal.h> /* for for_each_thread() */
 #endif
 
 
 
 
 #define BUF_LEN_PMC_SAMPLES_EBS_KERNEL (((PAGE_SIZE)/sizeof(pmc_sample_t))*sizeof(pmc_sample_t))
+/*
+ * Maximum number of bytes returned by a single read() on /proc/pmc/monitor
+ * when no shared memory region is in use (the size of the intermediate buffer).
+ * Bigger requests (e.g., flight-recorder dumps) are served with several reads.
+ */
+#define MAX_LEN_PMC_SAMPLES_READ (256*1024)
 
 /*
  * Different scenarios where performance samples
@@ -152,11 +162,13 @@ static const struct file_operations proc_pmc_info_fops = {
 static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf, size_t len, loff_t *off);
 static ssize_t proc_monitor_pmcs_read (struct file *filp, char __user *buf, size_t len, loff_t *off);
 static int proc_monitor_pmcs_mmap(struct file *filp, struct vm_area_struct *vma);
+static long proc_monitor_pmcs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 
 static const struct file_operations proc_monitor_pmcs_fops = {
 	.read = proc_monitor_pmcs_read,
 	.write = proc_monitor_pmcs_write,
 	.mmap=proc_monitor_pmcs_mmap,
+	.unlocked_ioctl = proc_monitor_pmcs_ioctl,
 	.open = proc_generic_open,
 	.release = proc_generic_close,
 };
@@ -174,6 +186,15 @@ static int configure_performance_counters_thread(const char *buf,struct task_str
  */
 static int configure_virtual_counters_thread(const char *buf,struct task_struct* p, int system_wide);
 
+/*
+ * Publish a new set of PMC experiments for all the threads (or CPUs in system-wide mode)
+ * that share the buffer of the monitor process
+ */
+static int reconfigure_performance_counters(char *buf);
+
+/* Enable PMC monitoring for the current thread */
+static int start_self_counting(pmon_prof_t* prof);
+
 /* Initialization of platform-independent per-CPU structures */
 static void init_percpu_structures(void);
 
@@ -278,6 +299,80 @@ pmc_ops_t pmc_mc_prog = {
 	mod_get_current_metric_value
 };
 
+/*
+ * Thread groups that are being attached to a monitor process
+ * via the "tgid_attach" command (see pmctrack_tgid_attach()).
+ * While the attach operation is in progress, threads created by
+ * not-yet-attached threads of the group are attached in the fork path.
+ */
+struct group_attach {
+	pid_t tgid;			/* Thread group being attached */
+	pmon_prof_t* monitor;		/* Monitor process */
+	int target_id;			/* Target id for the threads in the group */
+	struct list_head links;
+};
+
+static LIST_HEAD(group_attach_list);
+static DEFINE_MUTEX(group_attach_mutex);
+static atomic_t nr_group_attach=ATOMIC_INIT(0);
+
+/*
+ * Attach a thread that has been just created to the same monitor
+ * as the rest of the thread group, if the group is being attached.
+ * The function is invoked in the context of the parent thread.
+ */
+static void attach_group_clone(pmon_prof_t* prof, struct task_struct* p)
+{
+	struct group_attach* ga;
+	pmon_prof_t* monitor=NULL;
+	int target_id=0;
+	int i,j;
+
+	mutex_lock(&group_attach_mutex);
+
+	list_for_each_entry(ga,&group_attach_list,links) {
+		if (ga->tgid==current->tgid) {
+			monitor=ga->monitor;
+			target_id=ga->target_id;
+			break;
+		}
+	}
+
+	/* The monitor does not go away while the group is in the list */
+	if (!monitor)
+		goto out_unlock;
+
+	for(i=0; i<AMP_MAX_CORETYPES; i++) {
+		if (clone_core_experiment_set_t(&prof->pmcs_multiplex_cfg[i],&monitor->pmcs_multiplex_cfg[i])) {
+			for (j=0; j<i; j++) {
+				free_experiment_set(&prof->pmcs_multiplex_cfg[j]);
+				init_core_experiment_set_t(&prof->pmcs_multiplex_cfg[j]);
+			}
+			goto out_unlock;
+		}
+	}
+	prof->pmcs_config=get_cur_experiment_in_set(&prof->pmcs_multiplex_cfg[0]);
+
+	prof->profiling_mode=monitor->profiling_mode;
+	if (monitor->pmc_samples_buffer) {
+		get_pmc_samples_buffer(monitor->pmc_samples_buffer);
+		prof->pmc_samples_buffer=monitor->pmc_samples_buffer;
+	}
+	prof->virt_counter_mask=monitor->virt_counter_mask;
+	prof->pmc_jiffies_interval=monitor->pmc_jiffies_interval;
+	prof->nticks_sampling_period=monitor->nticks_sampling_period;
+	prof->pmc_jiffies_timeout=jiffies+prof->pmc_jiffies_interval;
+	prof->pid_monitor=monitor->this_tsk->pid;
+	prof->target_id=target_id;
+	p->prof_enabled=1;
+#ifdef TBS_TIMER
+	if (prof->profiling_mode==TBS_USER_MODE)
+		mod_timer( &prof->timer, prof->pmc_jiffies_timeout);
+#endif
+out_unlock:
+	mutex_unlock(&group_attach_mutex);
+}
+
 /* Invoked when forking a process/thread */
 static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_struct* p)
 {
@@ -298,6 +393,9 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 
 	prof->pmc_jiffies_interval=-1;	/* TBS disabled */
 
+	prof->syswide_aggr=PMC_AGGR_CPU;
+	prof->syswide_cgroups=NULL;
+
 	prof->pmc_jiffies_timeout=jiffies+3000*250;	/* Just in case: make sure it doesn't expire soon */
 
 	prof->this_tsk=p;
@@ -335,10 +433,19 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 
 	spin_lock_init(&prof->lock);
 
+	seqcount_init(&prof->metric_snapshot.seq);
+	prof->metric_snapshot.valid_mask=0;
+
 	prof->pid_monitor=-1;
 
+	prof->target_id=0;
+
 	prof->ref_time=ktime_get();
 
+	prof->config_epoch=0;
+	prof->cfg_update=NULL;
+	prof->retired_cfg=NULL;
+
 #ifdef TBS_TIMER
 	/* Timer initialization (but timer is not added!!) */
 	init_timer(&prof->timer);
@@ -347,11 +454,11 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 	prof->timer.expires=prof->pmc_jiffies_timeout;  /* It does not matter for now */
 #endif
 
-	/* Associate this task to the current monitoring module */
-	prof->task_mod=current_monitoring_module();
+	/* Associate this task to the active monitoring modules */
+	prof->task_mod_mask=current_monitoring_module_mask();
 
 	/* No per-thread private data by default */
-	prof->monitoring_mod_priv_data = NULL;
+	memset(prof->monitoring_mod_priv_data,0,sizeof(prof->monitoring_mod_priv_data));
 
 	if (is_new_thread(clone_flags) && current->prof_enabled && current->pmc) {
 		pmon_prof_t* par_prof = (pmon_prof_t*)current->pmc;
@@ -370,6 +477,7 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 				/* For now start with slow core events */
 				prof->pmcs_config=get_cur_experiment_in_set(&prof->pmcs_multiplex_cfg[0]);
 			}
+			prof->config_epoch=par_prof->config_epoch;
 
 			prof->virt_counter_mask=par_prof->virt_counter_mask;
 
@@ -379,6 +487,7 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 			prof->pmc_jiffies_timeout=jiffies+prof->pmc_jiffies_interval;
 			/* Inherit monitor from the "parent thread" as well */
 			prof->pid_monitor=par_prof->pid_monitor;
+			prof->target_id=par_prof->target_id;
 			p->prof_enabled=1;
 #ifdef TBS_TIMER
 			if (prof->profiling_mode==TBS_USER_MODE)
@@ -389,6 +498,9 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 			prof->kernel_buffer_size=par_prof->kernel_buffer_size;
 		}
 
+	} else if (unlikely(atomic_read(&nr_group_attach)) && is_new_thread(clone_flags)) {
+		/* The parent thread belongs to a group that is being attached */
+		attach_group_clone(prof,p);
 	}
 
 	if ((ret=mm_on_fork(clone_flags,prof))) {
@@ -400,6 +512,135 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 	return 0;
 }
 
+/* Free up a per-thread copy of event sets */
+static void free_pmc_config_update(pmc_config_update_t* update)
+{
+	int i;
+
+	if (!update)
+		return;
+
+	for (i=0; i<AMP_MAX_CORETYPES; i++)
+		free_experiment_set(&update->sets[i]);
+	kfree(update);
+}
+
+/*
+ * Free up the event sets replaced by the last configuration switch and,
+ * if the monitor published a new configuration epoch, build a copy of the
+ * new event sets for the thread. The copy is then picked up by
+ * refresh_pmc_config_epoch() at the next sample boundary.
+ *
+ * This function allocates and frees memory, so it must not be invoked from
+ * the PMI handler (NMI context on x86). It is invoked from the tick and
+ * context-switch paths with the thread's lock held.
+ */
+static void stage_pmc_config_epoch(pmon_prof_t* prof, int alloc)
+{
+	pmc_samples_buffer_t* sbuf=prof->pmc_samples_buffer;
+	pmc_config_update_t* update;
+	unsigned long flags;
+	int i=0;
+
+	/* The PMI handler only fills in this field when it is NULL */
+	free_pmc_config_update(xchg(&prof->retired_cfg,NULL));
+
+	if (!alloc || !sbuf || likely(prof->config_epoch==READ_ONCE(sbuf->config_epoch)))
+		return;
+
+	/* Already staged */
+	update=READ_ONCE(prof->cfg_update);
+	if (update && update->epoch==READ_ONCE(sbuf->config_epoch))
+		return;
+
+	if (!(update=kmalloc(sizeof(pmc_config_update_t),GFP_ATOMIC)))
+		return; /* Give it another try on the next tick */
+
+	for (i=0; i<AMP_MAX_CORETYPES; i++)
+		init_core_experiment_set_t(&update->sets[i]);
+
+	spin_lock_irqsave(&sbuf->lock,flags);
+	update->epoch=sbuf->config_epoch;
+
+	for (i=0; i<AMP_MAX_CORETYPES; i++) {
+		if (__clone_core_experiment_set_t(&update->sets[i],&sbuf->pending_cfg[i],GFP_ATOMIC)) {
+			spin_unlock_irqrestore(&sbuf->lock,flags);
+			free_pmc_config_update(update);
+			return;
+		}
+	}
+
+	spin_unlock_irqrestore(&sbuf->lock,flags);
+
+	/* Replace a copy staged for an older epoch (if any) */
+	free_pmc_config_update(xchg(&prof->cfg_update,update));
+}
+
+/*
+ * Switch to the PMC configuration most recently published by
+ * the monitor process via the "reconfig" command (if any).
+ * The function must be invoked at a sample boundary with the
+ * thread's lock held. If the switch cannot take place on the current CPU
+ * (cur_cpu==0), the counters are reprogrammed on the next tick.
+ *
+ * The new event sets must have been staged beforehand with stage_pmc_config_epoch().
+ * This function neither allocates/frees memory nor takes any lock, so that it can be
+ * safely invoked from the PMI handler: it just swaps the event sets in use with
+ * the staged ones. The replaced event sets are freed later on the tick or
+ * context-switch path.
+ *
+ * The function returns a non-zero value if the event sets were replaced.
+ */
+static int refresh_pmc_config_epoch(pmon_prof_t* prof, int cur_coretype, int cur_cpu)
+{
+	pmc_config_update_t* update;
+	core_experiment_set_t old_set;
+	core_experiment_t* exp;
+	int i=0;
+
+	/* Nothing staged, or the previous event sets have not been freed yet */
+	if (likely(!READ_ONCE(prof->cfg_update)) || READ_ONCE(prof->retired_cfg))
+		return 0;
+
+	if (!(update=xchg(&prof->cfg_update,NULL)))
+		return 0;
+
+	prof->config_epoch=update->epoch;
+	exp=get_cur_experiment_in_set(&update->sets[cur_coretype]);
+
+	/*
+	 * Keep the old configuration if there are no events for this core type
+	 * (the monitor rejects configurations that do not match the sampling mode,
+	 * so the second check is just a safety net)
+	 */
+	if (!exp || (exp->ebs_idx!=-1)!=(prof->profiling_mode==EBS_MODE)) {
+		WRITE_ONCE(prof->retired_cfg,update);
+		return 0;
+	}
+
+	/* Swap event sets (the old ones are freed outside the PMI handler) */
+	for (i=0; i<AMP_MAX_CORETYPES; i++) {
+		old_set=prof->pmcs_multiplex_cfg[i];
+		prof->pmcs_multiplex_cfg[i]=update->sets[i];
+		update->sets[i]=old_set;
+	}
+
+	WRITE_ONCE(prof->retired_cfg,update);
+
+	prof->pmcs_config=exp;
+
+	if (cur_cpu) {
+		/* Clear all counters in the platform */
+		mc_clear_all_platform_counters(get_pmu_props_coretype(cur_coretype));
+		/* reconfigure counters as if it were the first time*/
+		mc_restart_all_counters(prof->pmcs_config);
+	} else {
+		prof->flags|=PMC_PREPARE_MULTIPLEXING;
+	}
+
+	return 1;
+}
+
 /*
  * This function is invoked from the tick processing
  * function and context-switch related callbacks
@@ -470,12 +711,15 @@ static inline void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t
 
 		sample.coretype=cur_coretype;
 		sample.exp_idx=core_exp->exp_idx;
+		sample.config_epoch=prof->config_epoch;
 		sample.pmc_mask=core_exp->used_pmcs;
 		sample.nr_counts=core_exp->size;
 		sample.virt_mask=0;
 		sample.nr_virt_counts=0;
 		sample.pid=prof->this_tsk->pid;
+		sample.target_id=prof->target_id;
 		sample.elapsed_time=raw_ktime(ktime_sub(now,prof->ref_time));
+		sample.timestamp=raw_ktime(now);
 		prof->ref_time=now;
 
 		/* This is to handle migration samples correctly !! */
@@ -504,6 +748,10 @@ static inline void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t
 		if (event==PMC_SAVE_EVT)
 			mc_stop_all_counters(core_exp);
 
+		/* Switch to a new event set if the monitor published one */
+		if (refresh_pmc_config_epoch(prof,cur_coretype,!(callback_flags & MM_NO_CUR_CPU)))
+			return;
+
 		/* Engage multiplexation */
 		next=get_next_experiment_in_set(&prof->pmcs_multiplex_cfg[cur_coretype]);
 
@@ -554,12 +802,15 @@ static inline void sample_counters_sched_tbs(pmon_prof_t* prof, core_experiment_
 			sample.type=PMC_TICK_SAMPLE;
 			sample.coretype=cur_coretype;
 			sample.exp_idx=core_exp->exp_idx;
+			sample.config_epoch=prof->config_epoch;
 			sample.pmc_mask=core_exp->used_pmcs;
 			sample.nr_counts=core_exp->size;
 			sample.virt_mask=0;
 			sample.nr_virt_counts=0;
 			sample.pid=prof->this_tsk->pid;
+			sample.target_id=prof->target_id;
 			sample.elapsed_time=raw_ktime(ktime_sub(now,prof->ref_time));
+			sample.timestamp=raw_ktime(now);
 			prof->ref_time=now;
 
 			/* Copy and clear samples in prof */
@@ -573,6 +824,9 @@ static inline void sample_counters_sched_tbs(pmon_prof_t* prof, core_experiment_
 
 			/* Push sample if it's due time */
 			push_sample_cbuffer(prof,&sample);
+
+			/* Switch to a new event set if the monitor published one */
+			refresh_pmc_config_epoch(prof,cur_coretype,1);
 		} else {
 			/*Performance tool sampling interval control sample is incremented*/
 			prof->pmc_ticks_counter++;
@@ -583,11 +837,14 @@ static inline void sample_counters_sched_tbs(pmon_prof_t* prof, core_experiment_
 		sample.type=PMC_MIGRATION_SAMPLE;
 		sample.coretype=cur_coretype;
 		sample.exp_idx=core_exp->exp_idx;
+		sample.config_epoch=prof->config_epoch;
 		sample.pmc_mask=core_exp->used_pmcs;
 		sample.nr_counts=core_exp->size;
 		sample.virt_mask=0;
 		sample.nr_virt_counts=0;
 		sample.pid=prof->this_tsk->pid;
+		sample.target_id=prof->target_id;
+		sample.timestamp=raw_ktime(ktime_get());
 		ebs_idx=core_exp->ebs_idx;
 
 		/* This is to handle migration samples correctly !! */
@@ -659,6 +916,9 @@ static void mod_save_callback_gen(void* v_prof, int cpu, int lock)
 
 	mm_on_switch_out(prof);
 
+	/* Free up replaced event sets (no allocations here: the runqueue lock is held) */
+	stage_pmc_config_epoch(prof,0);
+
 	/* Update last CPU if it's not the first time */
 	if (prof->last_cpu!=-1)
 		prof->last_cpu=cpu;
@@ -687,8 +947,10 @@ static inline void mod_restore_callback_gen(void* v_prof, int cpu, int lock)
 	if (syswide_monitoring_enabled() && !syswide_monitoring_switch_in(cpu))
 		return;
 
-	if (!prof || !prof->this_tsk->prof_enabled)
+	if (!prof || !prof->this_tsk->prof_enabled) {
+		mm_on_switch_in_unmonitored(NULL,cpu);
 		return;
+	}
 
 	if (lock) {
 		spin_lock_irqsave(&prof->lock,flags);
@@ -700,6 +962,7 @@ static inline void mod_restore_callback_gen(void* v_prof, int cpu, int lock)
 	core_exp = prof->pmcs_config?prof->pmcs_config:&per_cpu(cpu_exp, cpu);
 
 	mm_on_switch_in(prof);
+	mm_on_switch_in_unmonitored(prof,cpu);
 
 	/* Update prev and cur coretype in the event of a migration */
 	if (prof->last_cpu!=cpu) {
@@ -970,6 +1233,9 @@ static void mod_tbs_tick(void* v_prof, int cpu)
 	if (unlikely(!prof->this_tsk->prof_enabled))
 		goto unlock;
 
+	/* Prepare the switch to a new configuration epoch (if any) */
+	stage_pmc_config_epoch(prof,1);
+
 	mm_on_tick(prof,cpu);
 
 	switch(prof->profiling_mode) {
@@ -1043,11 +1309,14 @@ static void mod_exit_thread(struct task_struct* tsk)
 		sample.type=PMC_EXIT_SAMPLE;
 		sample.coretype=cur_coretype;
 		sample.exp_idx=core_exp->exp_idx;
+		sample.config_epoch=prof->config_epoch;
 		sample.pmc_mask=core_exp->used_pmcs;
 		sample.nr_counts=core_exp->size;
 		sample.virt_mask=0;
 		sample.nr_virt_counts=0;
 		sample.pid=prof->this_tsk->pid;
+		sample.target_id=prof->target_id;
+		sample.timestamp=raw_ktime(ktime_get());
 
 		/* Copy and clear samples in prof */
 		for(i=0; i<MAX_LL_EXPS; i++) {
@@ -1128,9 +1397,18 @@ static void mod_free_per_thread_data(struct task_struct* tsk)
 	/* Notify the monitoring module */
 	mm_on_free_task(prof);
 
+	if (prof->syswide_cgroups) {
+		syswide_cgroup_set_free(prof->syswide_cgroups);
+		prof->syswide_cgroups=NULL;
+	}
+
 	/* Disable profiling no matter what */
 	tsk->prof_enabled = 0;
 
+	free_pmc_config_update(prof->cfg_update);
+	free_pmc_config_update(prof->retired_cfg);
+	prof->cfg_update=prof->retired_cfg=NULL;
+
 	/* Deallocate memory from thread-specific PMC data if any */
 	if (prof->pmcs_config) {
 		for (i=0; i<AMP_MAX_CORETYPES; i++)
@@ -1139,7 +1417,7 @@ static void mod_free_per_thread_data(struct task_struct* tsk)
 	}
 
 	if (prof->pmc_user_samples) {
-		kfree(prof->pmc_user_samples);
+		vfree(prof->pmc_user_samples);
 		prof->pmc_user_samples=NULL;
 	}
 
@@ -1179,11 +1457,15 @@ static ssize_t proc_pmc_config_write(struct file *filp, const char __user *buff,
 	if(sscanf(kbuf,"sched_sampling_period %i",&val)==1 && val>0) {
 		pmcs_pmon_config.pmon_nticks = msecs_to_jiffies(val);
 	} else if(sscanf(kbuf,"kernel_buffer_size %i",&val)==1 && val>0) {
-		unsigned int new_size=(val/sizeof(pmc_sample_t))*sizeof(pmc_sample_t);
-		if (new_size == 0)
+		/*
+		 * No rounding: the ring buffer wraps around at byte granularity,
+		 * and the size of the samples is only known once it is allocated.
+		 * It must hold at least one sample, though.
+		 */
+		if (val<sizeof(pmc_sample_t))
 			ret=-EINVAL;
 		else
-			pmcs_pmon_config.pmon_kernel_buffer_size=new_size;
+			pmcs_pmon_config.pmon_kernel_buffer_size=val;
 	} else if (strncmp(kbuf, "selfcfg pmc",11)==0) {
 		/* For now configure for all cpus*/
 		val=configure_performance_counters_thread(kbuf+8,current,0);
@@ -1233,12 +1515,57 @@ static ssize_t proc_pmc_config_write(struct file *filp, const char __user *buff,
 		pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
 
 		if (prof) {
-			unsigned int new_size=(val/sizeof(pmc_sample_t))*sizeof(pmc_sample_t);
-			if (new_size == 0)
+			/* Not rounded (see kernel_buffer_size) */
+			if (val<sizeof(pmc_sample_t))
 				ret=-EINVAL;
 			else
-				prof->kernel_buffer_size=new_size;
+				prof->kernel_buffer_size=val;
 		}
+	} else if (strncmp(kbuf,"metric ",7)==0) {
+		/* System-wide definition of a metric exported as a virtual counter */
+		ret=pmc_user_metric_define(strim(kbuf+7));
+	} else if (strncmp(kbuf,"sample_filter ",14)==0) {
+		pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
+
+		/* Filter for the samples pushed into the buffer of the monitor */
+		if (!prof || !prof->pmc_samples_buffer)
+			ret=-EINVAL;
+		else
+			ret=pmc_samples_buffer_set_filter(prof->pmc_samples_buffer,strim(kbuf+14));
+	} else if (sscanf(kbuf,"flight_recorder %i",&val)==1 && val>=0) {
+		pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
+		int size_bytes=0;
+
+		/* An optional buffer capacity (in bytes) may follow the time window (in ms) */
+		sscanf(kbuf,"flight_recorder %i %i",&val,&size_bytes);
+
+		if (!prof || !prof->pmc_samples_buffer || size_bytes<0)
+			ret=-EINVAL;
+		else
+			ret=pmc_samples_buffer_set_flight_recorder(prof->pmc_samples_buffer,val,size_bytes);
+	} else if (strncmp(kbuf,"syswide_aggr ",13)==0) {
+		pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
+		int level=syswide_aggr_level_from_str(strim(kbuf+13));
+
+		if (!prof || level<0)
+			ret=-EINVAL;
+		else
+			prof->syswide_aggr=level;
+	} else if (strncmp(kbuf,"syswide_cgroup ",15)==0) {
+		pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
+		char* path=strim(kbuf+15);
+
+		if (!prof)
+			ret=-EINVAL;
+		else if (strcmp(path,"none")==0) {
+			syswide_cgroup_set_free(prof->syswide_cgroups);
+			prof->syswide_cgroups=NULL;
+		} else if ((val=syswide_cgroup_set_add(&prof->syswide_cgroups,path)))
+			ret=val;
+	} else if (strncmp(kbuf,"reconfig ",9)==0) {
+		val=reconfigure_performance_counters(kbuf+9);
+		if (val!=0)
+			ret=val;
 	} else if ((val=mm_on_write_config(kbuf,len))!=0) {
 		ret=val;
 	} else
@@ -1297,13 +1624,16 @@ err_config_read:
 	return err;
 }
 
-#define MAX_STR_CONFIG_LEN 100
+/* Max length of commands for /proc/pmc/enable and /proc/pmc/monitor
+   (large enough for "syswide on <cpu list>") */
+#define MAX_STR_CONFIG_LEN 256
 
 
 struct attach_arg {
 	pmon_prof_t* monitor;
 	pmon_prof_t* monitored;
 	core_experiment_set_t* exp_set[AMP_MAX_CORETYPES];
+	int target_id;
 };
 
 
@@ -1338,6 +1668,10 @@ static int set_up_monitoring_task(void *data)
 	/* For now start with slow core events */
 	target->pmcs_config=get_cur_experiment_in_set(&target->pmcs_multiplex_cfg[0]);
 
+	/* Pick up any event set published by the monitor at the next sample boundary */
+	target->config_epoch=0;
+	free_pmc_config_update(xchg(&target->cfg_update,NULL));
+
 	/* Inherit virtual counters */
 	target->virt_counter_mask=monitor->virt_counter_mask;
 
@@ -1353,6 +1687,7 @@ static int set_up_monitoring_task(void *data)
 	p->prof_enabled=1;
 	/* Set itself as the monitor */
 	target->pid_monitor=monitor->this_tsk->pid;
+	target->target_id=arg->target_id;
 
 	if (current==p)
 		mod_restore_callback_gen(target,cpu,0);
@@ -1363,10 +1698,15 @@ static int set_up_monitoring_task(void *data)
 
 static noinline int pmctrack_task_detach_force(struct task_struct* target, pid_t monitor_pid);
 
-static int pmctrack_pid_attach(pid_t pid)
+/*
+ * Attach a task to the current (monitor) process. Samples collected
+ * for the task are tagged with target_id.
+ * The function must be invoked with the reference counter
+ * of the target task !=0
+ */
+static int pmctrack_task_attach(struct task_struct* target, int target_id)
 {
 	struct task_struct* cur=current;
-	struct task_struct* target=NULL;
 	pmon_prof_t* monitor;
 	pmon_prof_t* monitored;
 	struct attach_arg arg;
@@ -1381,25 +1721,19 @@ static int pmctrack_pid_attach(pid_t pid)
 	int nr_tries=0;
 	int ret=-EAGAIN;
 
-	if (pid<0 || !cur->pmc)
+	if (!cur->pmc || !target->pmc)
 		return -EINVAL;
 
-	rcu_read_lock();
-	target = find_process_by_pid(pid);
-	if(!target || !target->pmc) {
-		rcu_read_unlock();
-		return -ESRCH;
-	}
-	/* Prevent target from going away */
-	get_task_struct(target);
-	rcu_read_unlock();
-
 	monitor= (pmon_prof_t*)current->pmc;
 	monitored = (pmon_prof_t*)target->pmc;
 
 	/* Phase one: set up monitor */
 	spin_lock_irqsave(&monitored->lock,flags);
-	if (!target->pmc || target->prof_enabled || monitored->pid_monitor!=-1 || monitored->pmc_samples_buffer) {
+	if (target->prof_enabled && monitored->pid_monitor==cur->pid) {
+		/* Already attached to this monitor (e.g., by the fork path) */
+		spin_unlock_irqrestore(&monitored->lock,flags);
+		return 0;
+	} else if (!target->pmc || target->prof_enabled || monitored->pid_monitor!=-1 || monitored->pmc_samples_buffer) {
 		attachable=0;
 		try_force_detach=(target->pmc && target->prof_enabled && monitored->pid_monitor!=-1 &&  monitored->pmc_samples_buffer);
 	} else
@@ -1434,6 +1768,7 @@ static int pmctrack_pid_attach(pid_t pid)
 	/* Phase 3: prepare xcall */
 	arg.monitor=monitor;
 	arg.monitored=monitored;
+	arg.target_id=target_id;
 	for(i=0; i<AMP_MAX_CORETYPES; i++)
 		arg.exp_set[i]=&set[i];
 
@@ -1464,6 +1799,28 @@ static int pmctrack_pid_attach(pid_t pid)
 		for(i=0; i<AMP_MAX_CORETYPES; i++)
 			free_experiment_set(&set[i]);
 out_err:
+	return retval;
+}
+
+static int pmctrack_pid_attach(pid_t pid, int target_id)
+{
+	struct task_struct* target=NULL;
+	int retval;
+
+	if (pid<0 || !current->pmc)
+		return -EINVAL;
+
+	rcu_read_lock();
+	target = find_process_by_pid(pid);
+	if(!target || !target->pmc) {
+		rcu_read_unlock();
+		return -ESRCH;
+	}
+	/* Prevent target from going away */
+	get_task_struct(target);
+	rcu_read_unlock();
+
+	retval=pmctrack_task_attach(target,target_id);
 	put_task_struct(target);
 	return retval;
 }
@@ -1505,10 +1862,14 @@ static int disable_monitoring_task(void *data)
 }
 
 
-static noinline int pmctrack_pid_detach(pid_t pid)
+/*
+ * Detach a task from the current (monitor) process.
+ * The function must be invoked with the reference counter
+ * of the target task !=0
+ */
+static noinline int pmctrack_task_detach(struct task_struct* target)
 {
 	struct task_struct* cur=current;
-	struct task_struct* target=NULL;
 	pmon_prof_t* monitor;
 	pmon_prof_t* monitored;
 	struct attach_arg arg;
@@ -1520,19 +1881,9 @@ static noinline int pmctrack_pid_detach(pid_t pid)
 	int nr_tries=0;
 	int ret=-EAGAIN;
 
-	if (pid<0)
+	if (!target->pmc)
 		return -EINVAL;
 
-	rcu_read_lock();
-	target = find_process_by_pid(pid);
-	if(!target || !target->pmc) {
-		rcu_read_unlock();
-		return -ESRCH;
-	}
-	/* Prevent target from going away */
-	get_task_struct(target);
-	rcu_read_unlock();
-
 	monitor= (pmon_prof_t*)current->pmc;
 	monitored = (pmon_prof_t*)target->pmc;
 
@@ -1582,10 +1933,256 @@ static noinline int pmctrack_pid_detach(pid_t pid)
 		del_timer_sync(&monitored->timer);
 #endif
 out_err:
+	return retval;
+}
+
+static noinline int pmctrack_pid_detach(pid_t pid)
+{
+	struct task_struct* target=NULL;
+	int retval;
+
+	if (pid<0)
+		return -EINVAL;
+
+	rcu_read_lock();
+	target = find_process_by_pid(pid);
+	if(!target || !target->pmc) {
+		rcu_read_unlock();
+		return -ESRCH;
+	}
+	/* Prevent target from going away */
+	get_task_struct(target);
+	rcu_read_unlock();
+
+	retval=pmctrack_task_detach(target);
 	put_task_struct(target);
 	return retval;
 }
 
+/*
+ * Take a reference to every thread in the thread group of the leader task.
+ * The array of threads is allocated by this function and must be released
+ * with put_thread_group_snapshot().
+ *
+ * The function returns the number of threads in the snapshot, or a negative
+ * value on error.
+ */
+static int get_thread_group_snapshot(struct task_struct* leader, struct task_struct*** threads)
+{
+	struct task_struct* t;
+	struct task_struct** vector;
+	int capacity;
+	int nr_threads;
+	int i;
+
+	for (;;) {
+		/* Leave some room for threads created in the meantime */
+		capacity=get_nr_threads(leader)+16;
+
+		if ((vector=vmalloc(sizeof(struct task_struct*)*capacity))==NULL)
+			return -ENOMEM;
+
+		nr_threads=0;
+		rcu_read_lock();
+		for_each_thread(leader,t) {
+			if (nr_threads<capacity) {
+				get_task_struct(t);
+				vector[nr_threads]=t;
+			}
+			nr_threads++;
+		}
+		rcu_read_unlock();
+
+		if (nr_threads<=capacity) {
+			(*threads)=vector;
+			return nr_threads;
+		}
+
+		/* The thread group grew too much. Try again */
+		for (i=0; i<capacity; i++)
+			put_task_struct(vector[i]);
+		vfree(vector);
+	}
+}
+
+/* Release the references taken by get_thread_group_snapshot() */
+static void put_thread_group_snapshot(struct task_struct** threads, int nr_threads)
+{
+	int i;
+
+	for (i=0; i<nr_threads; i++)
+		put_task_struct(threads[i]);
+	vfree(threads);
+}
+
+/*
+ * Obtain a reference to the leader of the thread group
+ * the task with the specified PID belongs to.
+ */
+static struct task_struct* get_thread_group_leader(pid_t pid)
+{
+	struct task_struct* target;
+
+	rcu_read_lock();
+	target = find_process_by_pid(pid);
+	if (target) {
+		target=target->group_leader;
+		/* Prevent leader from going away */
+		get_task_struct(target);
+	}
+	rcu_read_unlock();
+	return target;
+}
+
+/*
+ * Attach all the threads in a thread group to the current (monitor) process.
+ * Samples collected for the threads in the group are tagged with target_id,
+ * so that a monitor process can track several applications at once.
+ * The thread group is registered in group_attach_list before the threads
+ * are collected, so that threads created during the operation are attached
+ * in the fork path. Threads whose creation was already under way when the group
+ * was registered may show up in the group after it is traversed, so the group
+ * is traversed again until no thread is newly attached. Once every thread
+ * in the group has been attached, new threads inherit monitoring from their
+ * creator, as usual.
+ *
+ * The function returns 0 if at least one thread could be attached.
+ */
+static int pmctrack_tgid_attach(pid_t tgid, int target_id)
+{
+	struct task_struct* leader;
+	struct task_struct** threads=NULL;
+	struct group_attach ga;
+	pmon_prof_t* prof;
+	int nr_threads;
+	int nr_attached=0;
+	int nr_new;
+	int retval=0;
+	int ret;
+	int i;
+	const int max_nr_passes=4;
+	int nr_passes=0;
+
+	if (tgid<=0 || !current->pmc)
+		return -EINVAL;
+
+	if ((leader=get_thread_group_leader(tgid))==NULL)
+		return -ESRCH;
+
+	/* A monitor process cannot attach to its own thread group */
+	if (leader->tgid==current->tgid) {
+		retval=-EINVAL;
+		goto out_put_leader;
+	}
+
+	/* Register the group */
+	ga.tgid=leader->tgid;
+	ga.monitor=(pmon_prof_t*)current->pmc;
+	ga.target_id=target_id;
+	mutex_lock(&group_attach_mutex);
+	list_add(&ga.links,&group_attach_list);
+	atomic_inc(&nr_group_attach);
+	mutex_unlock(&group_attach_mutex);
+
+	do {
+		if ((nr_threads=get_thread_group_snapshot(leader,&threads))<0) {
+			if (!nr_attached)
+				retval=nr_threads;
+			break;
+		}
+
+		nr_new=0;
+
+		for (i=0; i<nr_threads; i++) {
+			prof=(pmon_prof_t*)threads[i]->pmc;
+
+			/* Skip threads attached in a previous pass or in the fork path */
+			if (prof && threads[i]->prof_enabled && prof->pid_monitor==current->pid) {
+				if (nr_passes==0)
+					nr_attached++;
+				continue;
+			}
+
+			ret=pmctrack_task_attach(threads[i],target_id);
+
+			if (ret==0) {
+				nr_attached++;
+				nr_new++;
+			} else if (retval==0)
+				retval=ret;	/* Keep track of the first error */
+		}
+
+		put_thread_group_snapshot(threads,nr_threads);
+		nr_passes++;
+	} while (nr_new && nr_passes<max_nr_passes);
+
+	/* Threads that exited in the meantime do not count as an error */
+	if (nr_attached)
+		retval=0;
+
+	mutex_lock(&group_attach_mutex);
+	list_del(&ga.links);
+	atomic_dec(&nr_group_attach);
+	mutex_unlock(&group_attach_mutex);
+out_put_leader:
+	put_task_struct(leader);
+	return retval;
+}
+
+/*
+ * Detach all the threads in a thread group from the current (monitor) process.
+ * Threads created while the group is being detached inherit monitoring from
+ * a thread that was not detached yet, so the thread group is traversed again
+ * until no attached thread is found.
+ */
+static int pmctrack_tgid_detach(pid_t tgid)
+{
+	struct task_struct* leader;
+	struct task_struct** threads=NULL;
+	pmon_prof_t* prof;
+	int nr_threads;
+	int nr_detached;
+	int retval=-EINVAL;
+	int i;
+	const int max_nr_passes=4;
+	int nr_passes=0;
+
+	if (tgid<=0)
+		return -EINVAL;
+
+	if ((leader=get_thread_group_leader(tgid))==NULL)
+		return -ESRCH;
+
+	do {
+		if ((nr_threads=get_thread_group_snapshot(leader,&threads))<0) {
+			retval=nr_threads;
+			break;
+		}
+
+		nr_detached=0;
+
+		for (i=0; i<nr_threads; i++) {
+			prof=(pmon_prof_t*)threads[i]->pmc;
+
+			/* Skip threads that are not monitored by the current process */
+			if (!prof || !threads[i]->prof_enabled || prof->pid_monitor!=current->pid)
+				continue;
+
+			if (pmctrack_task_detach(threads[i])==0)
+				nr_detached++;
+		}
+
+		put_thread_group_snapshot(threads,nr_threads);
+
+		if (nr_detached)
+			retval=0;
+		nr_passes++;
+	} while (nr_detached && nr_passes<max_nr_passes);
+
+	put_task_struct(leader);
+	return retval;
+}
+
 /* Function invoked with the reference counter of the monitored task !=0 */
 static noinline int pmctrack_task_detach_force(struct task_struct* target, pid_t monitor_pid)
 {
@@ -1649,6 +2246,7 @@ static noinline int pmctrack_task_detach_force(struct task_struct* target, pid_t
 static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf, size_t len, loff_t *off)
 {
 	int val;
+	int target_id=0;
 	pid_t pid;
 	struct task_struct* tsM;
 	pmon_prof_t* monitor;
@@ -1685,17 +2283,32 @@ static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf
 			put_task_struct(tsM);
 			return -ESRCH;
 		} else {
+			/* The monitor may be reused to track several processes in a row */
+			pmc_buf=monitor->pmc_samples_buffer;
 			monitor->pmc_samples_buffer=monitored->pmc_samples_buffer;
 			/* Increase ref count */
 			get_pmc_samples_buffer(monitor->pmc_samples_buffer);
+			/* Drop the reference to the buffer of the previous process */
+			if (pmc_buf)
+				put_pmc_samples_buffer(pmc_buf);
 			/* Set monitor */
 			monitored->pid_monitor=current->pid;
 			put_task_struct(tsM);
 		}
-	} else if (sscanf(kbuf,"pid_attach %i", &val)==1 && val>0) {
-		return pmctrack_pid_attach(val);
+	} else if (sscanf(kbuf,"pid_attach %i %i", &val, &target_id)>=1 && val>0) {
+		return pmctrack_pid_attach(val,target_id);
 	} else if (sscanf(kbuf,"pid_detach %i", &val)==1 && val>0) {
 		return pmctrack_pid_detach(val);
+	} else if (sscanf(kbuf,"tgid_attach %i %i", &val, &target_id)>=1 && val>0) {
+		return pmctrack_tgid_attach(val,target_id);
+	} else if (sscanf(kbuf,"tgid_detach %i", &val)==1 && val>0) {
+		return pmctrack_tgid_detach(val);
+	} else if (strncmp(kbuf,"flight_dump",11)==0) {
+		/* Dump the samples kept in the buffer of the monitor */
+		prof= (pmon_prof_t*)current->pmc;
+		if (!prof || !prof->pmc_samples_buffer)
+			return -EINVAL;
+		return pmc_flight_recorder_trigger(prof->pmc_samples_buffer);
 	} else if (strncmp(kbuf,"ON",2)==0) {
 		prof= (pmon_prof_t*)current->pmc;
 		if (!prof)
@@ -1755,8 +2368,9 @@ static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf
 	}
 	/* Syswide monitoring can be started/stopped using this /proc entry as well
 		 to simplify libpmctrack implementation */
-	else if (strcmp(kbuf,"syswide on")==0) {
-		if ((val=syswide_monitoring_start()))
+	else if (strncmp(kbuf,"syswide on",10)==0 && (kbuf[10]=='\0' || isspace(kbuf[10]))) {
+		/* An optional CPU list may follow (e.g. "syswide on 0-7") */
+		if ((val=syswide_monitoring_start_cpulist(strim(&kbuf[10]))))
 			return val;
 	} else if (strcmp(kbuf,"syswide off")==0) {
 		if ((val=syswide_monitoring_stop()))
@@ -1775,7 +2389,7 @@ static ssize_t proc_monitor_pmcs_read (struct file *filp, char __user *buf, size
 	unsigned long flags;
 	pmc_samples_buffer_t* pmcbuf;
 	pmc_sample_t* dst_buffer=NULL;
-	unsigned int dst_buffer_size=len;
+	size_t dst_buffer_size=MAX_LEN_PMC_SAMPLES_READ;
 	int retval;
 
 	lentotal=0;
@@ -1794,21 +2408,23 @@ static ssize_t proc_monitor_pmcs_read (struct file *filp, char __user *buf, size
 	if (prof_mon->pmc_kernel_samples) {
 		dst_buffer=prof_mon->pmc_kernel_samples;
 		dst_buffer_size=PAGE_SIZE; /* This buffer is as big as a page */
-	}
-	/* Allocate memory the first time (if no dst_buffer available) */
-	if (!dst_buffer || !prof_mon->pmc_user_samples) {
-		prof_mon->pmc_user_samples=kmalloc(len,GFP_KERNEL);
-		if (!prof_mon->pmc_user_samples)
-			return -ENOMEM;
-	}
-
-	if (!dst_buffer)
+	} else {
+		/* Allocate the intermediate buffer the first time (reused afterwards) */
+		if (!prof_mon->pmc_user_samples) {
+			prof_mon->pmc_user_samples=vmalloc(MAX_LEN_PMC_SAMPLES_READ);
+			if (!prof_mon->pmc_user_samples)
+				return -ENOMEM;
+		}
 		dst_buffer=prof_mon->pmc_user_samples;
+	}
 
 	/* Restrict max size */
 	if (dst_buffer_size>len)
 		dst_buffer_size=len;
 
+	/* Copy whole samples only */
+	dst_buffer_size-=dst_buffer_size%pmcbuf->sample_size;
+
 	/* Prevent the perf interrupt to kick in when trying to do this */
 	spin_lock_irqsave(&pmcbuf->lock,flags);
 
@@ -1817,13 +2433,30 @@ static ssize_t proc_monitor_pmcs_read (struct file *filp, char __user *buf, size
 		goto read_buffer_now;
 	}
 
-	/* EOF if all threads actually finished */
-	if (get_pmc_samples_buffer_refs(pmcbuf)<=1 && is_empty_cbuffer_t(pmcbuf->pmc_samples)) {
+	/* The last dump was delivered completely: let the monitor know */
+	if (pmcbuf->flight_dump_end) {
+		pmcbuf->flight_dump_end=0;
+		spin_unlock_irqrestore(&pmcbuf->lock,flags);
+		return -EAGAIN;
+	}
+
+	/*
+	 * EOF if all threads actually finished
+	 * (in flight-recorder mode, samples that were not dumped are discarded)
+	 */
+	if (get_pmc_samples_buffer_refs(pmcbuf)<=1 && (is_empty_cbuffer_t(pmcbuf->pmc_samples) || flight_recorder_idle(pmcbuf))) {
 		spin_unlock_irqrestore(&pmcbuf->lock,flags);
 		return 0;
 	}
 
-	while (is_empty_cbuffer_t(pmcbuf->pmc_samples)) {
+	/* In flight-recorder mode, block until a dump is triggered */
+	while (is_empty_cbuffer_t(pmcbuf->pmc_samples) || flight_recorder_idle(pmcbuf)) {
+		/* Readers that drain the buffer in chunks must not block */
+		if (filp->f_flags & O_NONBLOCK) {
+			spin_unlock_irqrestore(&pmcbuf->lock,flags);
+			return -EAGAIN;
+		}
+
 		pmcbuf->monitor_waiting=1;
 
 		spin_unlock_irqrestore(&pmcbuf->lock,flags);
@@ -1837,16 +2470,26 @@ static ssize_t proc_monitor_pmcs_read (struct file *filp, char __user *buf, size
 		spin_lock_irqsave(&pmcbuf->lock,flags);
 
 		/* EOF if all threads actually finished */
-		if (get_pmc_samples_buffer_refs(pmcbuf)<=1 && is_empty_cbuffer_t(pmcbuf->pmc_samples)) {
+		if (get_pmc_samples_buffer_refs(pmcbuf)<=1 && (is_empty_cbuffer_t(pmcbuf->pmc_samples) || flight_recorder_idle(pmcbuf))) {
 			spin_unlock_irqrestore(&pmcbuf->lock,flags);
 			return 0;
 		}
 	}
 
 read_buffer_now:
+	/* Deliver only the samples that belong to the dump in flight-recorder mode */
+	if (pmcbuf->flight_window_ns && dst_buffer_size>pmcbuf->flight_dump_bytes)
+		dst_buffer_size=pmcbuf->flight_dump_bytes;
+
 	/* Bytes to be copied to the user buffer */
 	lentotal=remove_cbuffer_t_batch(pmcbuf->pmc_samples,dst_buffer,dst_buffer_size);
 
+	if (pmcbuf->flight_window_ns && lentotal) {
+		pmcbuf->flight_dump_bytes-=lentotal;
+		if (!pmcbuf->flight_dump_bytes)
+			pmcbuf->flight_dump_end=1;
+	}
+
 	spin_unlock_irqrestore(&pmcbuf->lock,flags);
 
 	/* Invoke copy to user if necessary */
@@ -1855,13 +2498,13 @@ read_buffer_now:
 	}
 #ifdef DEBUG
 	{
-		int n=lentotal/sizeof(pmc_sample_t);
-		pmc_sample_t* cur=prof_mon->pmc_user_samples;
+		int n=lentotal/pmcbuf->sample_size;
+		char* cur=dst_buffer;
 
 		printk (KERN_INFO "Samples read: %d\n",n);
 		while(n--) {
-			printk (KERN_INFO "IDX: %d\n",cur->exp_idx);
-			cur++;
+			printk (KERN_INFO "IDX: %d\n",((pmc_sample_t*)cur)->exp_idx);
+			cur+=pmcbuf->sample_size;
 		}
 	}
 #endif
@@ -1952,55 +2595,212 @@ static int proc_monitor_pmcs_mmap(struct file *filp, struct vm_area_struct *vma)
 	return 0;
 }
 
-/* Write callback for /proc/pmc/enable */
-static ssize_t proc_pmc_enable_write(struct file *filp, const char __user *buff, size_t len, loff_t *off)
+/*
+ * Apply a fully-resolved session configuration (pmc_session_config_t)
+ * for the current thread in a single call. This is equivalent to the sequence
+ * of writes to /proc/pmc/config issued by libpmctrack
+ * ("kernel_buffer_size_t", "selfcfg pmc...", "timeout", "selfcfg virt...", "selfmon"),
+ * optionally followed by "ON" on /proc/pmc/enable. Upon return, the structure also
+ * holds the PMC usage of the active monitoring module, so that no
+ * extra queries to /proc/pmc/properties are necessary.
+ *
+ * With PMC_CFG_COMPACT_SAMPLES, the samples pushed into the buffer only hold
+ * as many virtual counts as virtual counters are enabled for the thread,
+ * and the resulting sample size is reported in kern_sample_size.
+ */
+static int apply_session_config(pmc_session_config_t* cfg)
 {
 	pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
-	char kbuf[MAX_STR_CONFIG_LEN];
+	monitoring_module_counter_usage_t usage;
+	int system_wide=(cfg->flags & PMC_CFG_SYSWIDE)?1:0;
 	pmc_samples_buffer_t* pmc_buf=NULL;
 	unsigned long flags=0;
-	int error=0;
+	unsigned int tmp_mask;
+	int i,error=0;
 
-	if (len>=MAX_STR_CONFIG_LEN || copy_from_user(kbuf,buff,len))
-		return -EFAULT;
+	if (cfg->nr_experiments>PMC_MAX_CONFIG_EXPERIMENTS)
+		return -EINVAL;
 
-	kbuf[len]='\0';
+	/* Make sure strings are NULL-terminated */
+	for (i=0; i<PMC_MAX_CONFIG_EXPERIMENTS; i++)
+		cfg->pmc_cfg[i][PMC_MAX_CONFIG_STRING_LEN-1]='\0';
+	cfg->virt_cfg[PMC_MAX_CONFIG_STRING_LEN-1]='\0';
+	cfg->cpu_list[PMC_MAX_CONFIG_STRING_LEN-1]='\0';
 
-	if (strcmp(kbuf,"ON")==0 && prof!=NULL) {
+	/* Nothing to configure: just report counter usage */
+	if (cfg->nr_experiments==0 && cfg->virt_cfg[0]=='\0' && !cfg->timeout_ms
+	    && !cfg->kernel_buffer_size && !(cfg->flags & (PMC_CFG_SELF_MONITORING|PMC_CFG_START)))
+		goto report_usage;
+
+	if (!prof)
+		return -EINVAL;
+
+	/* Kernel buffer size (must be set before the buffer gets allocated) */
+	if (cfg->kernel_buffer_size) {
+		/* Not rounded, as the sample size is negotiated later on */
+		if (cfg->kernel_buffer_size<sizeof(pmc_sample_t))
+			return -EINVAL;
+		prof->kernel_buffer_size=cfg->kernel_buffer_size;
+	}
 
-		/* Allocate memory for the buffer sample if necessary */
+	for (i=0; i<cfg->nr_experiments; i++)
+		if ((error=configure_performance_counters_thread(cfg->pmc_cfg[i],current,system_wide)))
+			return error;
+
+	if (cfg->timeout_ms) {
+		if (cfg->flags & PMC_CFG_KERNEL_CONTROL)
+			prof->nticks_sampling_period=msecs_to_jiffies(cfg->timeout_ms);
+		else
+			prof->pmc_jiffies_interval=msecs_to_jiffies(cfg->timeout_ms);
+	}
+
+	if (cfg->virt_cfg[0]!='\0' &&
+	    (error=configure_virtual_counters_thread(cfg->virt_cfg,current,system_wide)))
+		return error;
+
+	/*
+	 * Compact samples (per-thread mode only). The buffer is allocated here
+	 * so that its sample size is known before any sample gets pushed.
+	 */
+	if ((cfg->flags & PMC_CFG_COMPACT_SAMPLES) && !system_wide) {
 		if (!prof->pmc_samples_buffer) {
 			pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size);
-			if (pmc_buf == NULL) {
-				printk(KERN_INFO "Can't allocate memory to store buffer samples\n");
-				return -1;
+			if (pmc_buf == NULL)
+				return -ENOMEM;
+
+			spin_lock_irqsave(&prof->lock,flags);
+			if (!prof->pmc_samples_buffer) {
+				prof->pmc_samples_buffer=pmc_buf;
+				pmc_buf=NULL;
 			}
+			spin_unlock_irqrestore(&prof->lock,flags);
+
+			if (pmc_buf)
+				put_pmc_samples_buffer(pmc_buf);
 		}
 
-		/* Prevent the perf interrupt to kick in when trying to do this */
-		spin_lock_irqsave(&prof->lock,flags);
+		if ((error=pmc_samples_buffer_set_sample_size(prof->pmc_samples_buffer,
+		           pmc_sample_size(hweight32(prof->virt_counter_mask)))))
+			return error;
+	}
 
-		/* Assign newly created data */
-		if (!prof->pmc_samples_buffer)
-			prof->pmc_samples_buffer=pmc_buf;
+	if (cfg->flags & PMC_CFG_SELF_MONITORING)
+		prof->flags|=PMC_SELF_MONITORING;
 
-		/* Set up jiffies interval if it wasn't set previously */
-		if (prof->pmc_jiffies_interval<0)
-			prof->pmc_jiffies_interval=HZ; /* One second (for now) */
+	if (cfg->flags & PMC_CFG_START) {
+		if (system_wide)
+			error=syswide_monitoring_start_cpulist(strim(cfg->cpu_list));
+		else
+			error=start_self_counting(prof);
+		if (error)
+			return error;
+	}
 
-		prof->pmc_jiffies_timeout=jiffies+prof->pmc_jiffies_interval;
+report_usage:
+	mm_module_counter_usage(&usage);
+	cfg->kern_pmcmask=usage.hwpmc_mask;
+	cfg->kern_nr_experiments=usage.nr_experiments;
+	cfg->kern_nr_pmcs=0;
+	for (tmp_mask=usage.hwpmc_mask; tmp_mask; tmp_mask>>=1)
+		if (tmp_mask & 0x1)
+			cfg->kern_nr_pmcs++;
+
+	if (prof && prof->pmc_samples_buffer)
+		cfg->kern_sample_size=prof->pmc_samples_buffer->sample_size;
+	else
+		cfg->kern_sample_size=sizeof(pmc_sample_t);
+	return 0;
+}
 
-		prof->ref_time=ktime_get();
+/* ioctl() callback for /proc/pmc/monitor */
+static long proc_monitor_pmcs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	pmc_session_config_t* cfg;
+	long ret=0;
+
+	if (cmd!=PMCTRACK_IOC_CONFIG)
+		return -ENOTTY;
+
+	/* Too big for the stack */
+	if ((cfg=kmalloc(sizeof(pmc_session_config_t),GFP_KERNEL))==NULL)
+		return -ENOMEM;
+
+	if (copy_from_user(cfg,(void __user *)arg,sizeof(pmc_session_config_t))) {
+		ret=-EFAULT;
+		goto free_cfg;
+	}
+
+	if ((ret=apply_session_config(cfg)))
+		goto free_cfg;
+
+	if (copy_to_user((void __user *)arg,cfg,sizeof(pmc_session_config_t)))
+		ret=-EFAULT;
+free_cfg:
+	kfree(cfg);
+	return ret;
+}
+
+/*
+ * Enable PMC monitoring for the current thread
+ * (allocates the samples buffer if necessary and starts the sampling period)
+ */
+static int start_self_counting(pmon_prof_t* prof)
+{
+	pmc_samples_buffer_t* pmc_buf=NULL;
+	unsigned long flags=0;
+
+	/* Allocate memory for the buffer sample if necessary */
+	if (!prof->pmc_samples_buffer) {
+		pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size);
+		if (pmc_buf == NULL) {
+			printk(KERN_INFO "Can't allocate memory to store buffer samples\n");
+			return -1;
+		}
+	}
+
+	/* Prevent the perf interrupt to kick in when trying to do this */
+	spin_lock_irqsave(&prof->lock,flags);
+
+	/* Assign newly created data */
+	if (!prof->pmc_samples_buffer)
+		prof->pmc_samples_buffer=pmc_buf;
+
+	/* Set up jiffies interval if it wasn't set previously */
+	if (prof->pmc_jiffies_interval<0)
+		prof->pmc_jiffies_interval=HZ; /* One second (for now) */
+
+	prof->pmc_jiffies_timeout=jiffies+prof->pmc_jiffies_interval;
+
+	prof->ref_time=ktime_get();
 
 #ifdef TBS_TIMER
-		if (prof->profiling_mode==TBS_USER_MODE)
-			mod_timer( &prof->timer, prof->pmc_jiffies_timeout);
+	if (prof->profiling_mode==TBS_USER_MODE)
+		mod_timer( &prof->timer, prof->pmc_jiffies_timeout);
 #endif
-		current->prof_enabled=1;
+	current->prof_enabled=1;
 
-		mod_restore_callback_gen(prof,smp_processor_id(),0);
+	mod_restore_callback_gen(prof,smp_processor_id(),0);
 
-		spin_unlock_irqrestore(&prof->lock,flags);
+	spin_unlock_irqrestore(&prof->lock,flags);
+	return 0;
+}
+
+/* Write callback for /proc/pmc/enable */
+static ssize_t proc_pmc_enable_write(struct file *filp, const char __user *buff, size_t len, loff_t *off)
+{
+	pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
+	char kbuf[MAX_STR_CONFIG_LEN];
+	unsigned long flags=0;
+	int error=0;
+
+	if (len>=MAX_STR_CONFIG_LEN || copy_from_user(kbuf,buff,len))
+		return -EFAULT;
+
+	kbuf[len]='\0';
+
+	if (strcmp(kbuf,"ON")==0 && prof!=NULL) {
+		if ((error=start_self_counting(prof)))
+			return error;
 	} else if (strcmp(kbuf,"OFF")==0 && prof!=NULL) {
 		if (!prof)
 			return -EINVAL;
@@ -2018,8 +2818,9 @@ static ssize_t proc_pmc_enable_write(struct file *filp, const char __user *buff,
 		mod_save_callback_gen(prof,smp_processor_id(),0);
 
 		spin_unlock_irqrestore(&prof->lock,flags);
-	} else if (strcmp(kbuf,"syswide on")==0) {
-		if ((error=syswide_monitoring_start()))
+	} else if (strncmp(kbuf,"syswide on",10)==0 && (kbuf[10]=='\0' || isspace(kbuf[10]))) {
+		/* An optional CPU list may follow (e.g. "syswide on 0-7") */
+		if ((error=syswide_monitoring_start_cpulist(strim(&kbuf[10]))))
 			return error;
 	} else if (strcmp(kbuf,"syswide off")==0) {
 		if ((error=syswide_monitoring_stop()))
@@ -2030,6 +2831,10 @@ static ssize_t proc_pmc_enable_write(struct file *filp, const char __user *buff,
 	} else if (strcmp(kbuf,"syswide resume")==0) {
 		if ((error=syswide_monitoring_resume()))
 			return error;
+	} else if (strcmp(kbuf,"flight_dump")==0) {
+		/* Trigger a dump in all the buffers in flight-recorder mode */
+		if ((error=pmc_flight_recorder_trigger_all()))
+			return error;
 	}
 #ifdef SCHED_AMP
 	else if (strcmp(kbuf,"ON_SF")==0 && prof!=NULL) {
@@ -2135,6 +2940,8 @@ static int configure_virtual_counters_thread(const char *buf,struct task_struct*
 	unsigned long flags=0;
 	unsigned int highest_virt_pmc=0;
 	monitoring_module_counter_usage_t usage;
+	struct pmc_user_metric_set* user_metrics;
+	pmc_samples_buffer_t* sbuf;
 
 	/* Make sure prof structure exists for this thread */
 	if(prof == NULL)
@@ -2150,21 +2957,30 @@ static int configure_virtual_counters_thread(const char *buf,struct task_struct*
 	/* Figure out virtual counters available */
 	mm_module_counter_usage(&usage);
 
+	/*
+	 * The session keeps using the user-defined metrics in force now,
+	 * even if they are redefined or removed later on
+	 */
+	user_metrics=pmc_user_metrics_get();
+
 	/* No such virtual counter */
-	if (highest_virt_pmc>=usage.nr_virtual_counters) {
+	if (highest_virt_pmc>=mm_nr_module_virtual_counters()+pmc_user_metrics_count(user_metrics)) {
 		printk("No such virtual counter: %u",highest_virt_pmc);
+		pmc_user_metrics_put(user_metrics);
 		return -1;
 	}
 
 	/* Allocate memory for the buffer sample if necessary */
 	if (!prof->pmc_samples_buffer) {
 
+		/* System-wide samples are never compact (one per possible CPU) */
 		if (system_wide)
-			prof->kernel_buffer_size=sizeof(pmc_sample_t)*nr_cpu_ids; /* Number of possible CPUs */
+			prof->kernel_buffer_size=sizeof(pmc_sample_t)*nr_cpu_ids;
 
 		pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size);
 		if (pmc_buf == NULL) {
 			printk(KERN_INFO "Can't allocate memory to store buffer samples\n");
+			pmc_user_metrics_put(user_metrics);
 			return -1;
 		}
 	}
@@ -2184,9 +3000,13 @@ static int configure_virtual_counters_thread(const char *buf,struct task_struct*
 		prof->pmc_samples_buffer=pmc_buf;
 
 	prof->virt_counter_mask=used_virt;
+	sbuf=prof->pmc_samples_buffer;
 
 	spin_unlock_irqrestore(&prof->lock,flags);
 
+	/* The buffer takes over the reference */
+	pmc_samples_buffer_set_user_metrics(sbuf,user_metrics);
+
 	return 0;
 }
 
@@ -2439,6 +3259,96 @@ int configure_performance_counters_set(const char* strconfig[], core_experiment_
 }
 
 
+/*
+ * This function accepts a list of raw-formatted PMC configuration strings
+ * separated by semicolons (one per multiplexing experiment), and publishes
+ * the associated event sets through the buffer of the monitor process.
+ * The monitored threads (or CPUs in system-wide mode) switch to the new
+ * configuration at their next sample boundary. Samples gathered with the new
+ * event sets carry the updated config_epoch value.
+ */
+static int reconfigure_performance_counters(char *buf)
+{
+	pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
+	pmc_samples_buffer_t* sbuf;
+	const char* strconfig[AMP_MAX_EXP_CORETYPE+1];
+	core_experiment_set_t new_set[AMP_MAX_CORETYPES];
+	core_experiment_set_t old_set[AMP_MAX_CORETYPES];
+	core_experiment_t* exp;
+	char* cfg;
+	int nr_experiments=0;
+	unsigned long flags;
+	int i=0;
+	int error=0;
+
+	if (!prof || !prof->pmc_samples_buffer)
+		return -EINVAL;
+
+	sbuf=prof->pmc_samples_buffer;
+
+	while ((cfg=strsep(&buf,";"))!=NULL) {
+		cfg=strim(cfg);
+
+		if (*cfg=='\0')
+			continue;
+
+		if (nr_experiments==AMP_MAX_EXP_CORETYPE)
+			return -E2BIG;
+
+		strconfig[nr_experiments++]=cfg;
+	}
+
+	if (nr_experiments==0)
+		return -EINVAL;
+
+	strconfig[nr_experiments]=NULL;
+
+	if ((error=configure_performance_counters_set(strconfig,new_set,AMP_MAX_CORETYPES)))
+		return error<0?error:-EINVAL;
+
+	/*
+	 * Make sure ebs is not enabled in system-wide mode, and that
+	 * the new event sets match the sampling mode of the session
+	 * (the monitored threads cannot switch from TBS to EBS or vice versa)
+	 */
+	for (i=0; i<AMP_MAX_CORETYPES && !error; i++) {
+		exp=get_cur_experiment_in_set(&new_set[i]);
+
+		if (!exp)
+			continue;
+
+		if (exp->ebs_idx!=-1 && is_syswide_monitor(current)) {
+			printk(KERN_INFO "EBS can't be used in system-wide mode\n");
+			error=-EINVAL;
+		} else if (!is_syswide_monitor(current) &&
+		           (exp->ebs_idx!=-1)!=(prof->profiling_mode==EBS_MODE)) {
+			printk(KERN_INFO "The new event sets do not match the sampling mode (%s) of the session\n",
+			       prof->profiling_mode==EBS_MODE?"EBS":"TBS");
+			error=-EINVAL;
+		}
+	}
+
+	if (error) {
+		for (i=0; i<AMP_MAX_CORETYPES; i++)
+			free_experiment_set(&new_set[i]);
+		return error;
+	}
+
+	/* Replace the pending configuration and start a new epoch */
+	spin_lock_irqsave(&sbuf->lock,flags);
+	for (i=0; i<AMP_MAX_CORETYPES; i++) {
+		old_set[i]=sbuf->pending_cfg[i];
+		sbuf->pending_cfg[i]=new_set[i];
+	}
+	sbuf->config_epoch++;
+	spin_unlock_irqrestore(&sbuf->lock,flags);
+
+	for (i=0; i<AMP_MAX_CORETYPES; i++)
+		free_experiment_set(&old_set[i]);
+
+	return 0;
+}
+
 /* Initialize global parameters of the kernel module */
 void init_pmon_config_t(void)
 {
@@ -2541,7 +3451,7 @@ static ssize_t proc_pmc_info_read(struct file *filp, char __user *buf, size_t le
 	int nbytes=0;
 	char* dst;
 	int i=0;
-#define MAX_INFO_STRING 1024
+#define MAX_INFO_STRING 2048
 
 	if (*off>0)
 		return 0;
@@ -2594,8 +3504,10 @@ static ssize_t proc_pmc_info_read(struct file *filp, char __user *buf, size_t le
 
 	if (usage.nr_virtual_counters) {
 		dst+=sprintf(dst,"*** Virtual counters ***\n");
-		for (i = 0; i < usage.nr_virtual_counters; i++)
+		for (i = 0; i < usage.nr_virtual_counters && i < mm_nr_module_virtual_counters(); i++)
 			dst+=sprintf(dst,"virt%d=%s\n",i,usage.vcounter_desc[i]==NULL?"unknown":usage.vcounter_desc[i]);
+		/* Names of user-defined metrics are read with their lock held */
+		dst=pmc_user_metrics_print(dst,i);
 	}
 	dst+=sprintf(dst,"***************\n");
 
@@ -2773,12 +3685,15 @@ void do_count_on_overflow(struct pt_regs *regs, unsigned int overflow_mask)
 		sample.type=PMC_EBS_SAMPLE;
 		sample.coretype=cur_coretype;
 		sample.exp_idx=core_exp->exp_idx;
+		sample.config_epoch=prof->config_epoch;
 		sample.pmc_mask=core_exp->used_pmcs;
 		sample.nr_counts=core_exp->size;
 		sample.virt_mask=0;
 		sample.nr_virt_counts=0;
 		sample.pid=p->pid;
+		sample.target_id=prof->target_id;
 		sample.elapsed_time=raw_ktime(ktime_sub(now,prof->ref_time));
+		sample.timestamp=raw_ktime(now);
 		prof->ref_time=now;
 
 		/* Read counters !! */
@@ -2803,7 +3718,7 @@ void do_count_on_overflow(struct pt_regs *regs, unsigned int overflow_mask)
 			__push_sample_cbuffer(prof->pmc_samples_buffer,&sample);
 			spin_unlock(&prof->pmc_samples_buffer->lock);
 
-			if (prof->profiling_mode==EBS_MODE) {
+			if (prof->profiling_mode==EBS_MODE && !refresh_pmc_config_epoch(prof,cur_coretype,1)) {
 				/* Engage multiplexation */
 				next=get_next_experiment_in_set(&prof->pmcs_multiplex_cfg[cur_coretype]);
 
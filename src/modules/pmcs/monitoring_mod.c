@@ -16,6 +16,10 @@
 #include <linux/module.h>
 #include <pmc/smart_power.h>
 #include <linux/uaccess.h>
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
+#include <linux/percpu.h>
+#include <linux/version.h>
 
 #ifdef DEBUG
 static const char* sample_type_to_str[PMC_NR_SAMPLE_TYPES]= {"tick","ebs","exit","migration"};
@@ -220,21 +224,120 @@ static monitoring_module_t dummy_mm= {
  ********** IMPLEMENTATION OF THE MONITORING MODULE MANAGER ******************
  *****************************************************************************/
 
+/*
+ * Compact array with the non-null implementations of a given
+ * callback among the active monitoring modules (in stack order)
+ */
+#define MM_CALLBACK_ARRAY(op) \
+	struct { \
+		typeof(((monitoring_module_t*)0)->op) fn; \
+		monitoring_module_t* module; \
+	} op[MAX_STACKED_MODULES]; \
+	int nr_##op
+
+/* Table used to dispatch every operation to the active monitoring modules */
+typedef struct {
+	MM_CALLBACK_ARRAY(on_read_config);
+	MM_CALLBACK_ARRAY(on_write_config);
+	MM_CALLBACK_ARRAY(on_fork);
+	MM_CALLBACK_ARRAY(on_exec);
+	MM_CALLBACK_ARRAY(on_new_sample);
+	MM_CALLBACK_ARRAY(on_migrate);
+	MM_CALLBACK_ARRAY(on_exit);
+	MM_CALLBACK_ARRAY(on_switch_in);
+	MM_CALLBACK_ARRAY(on_switch_out);
+	MM_CALLBACK_ARRAY(on_switch_in_unmonitored);
+	MM_CALLBACK_ARRAY(get_current_metric_value);
+	MM_CALLBACK_ARRAY(on_tick);
+	MM_CALLBACK_ARRAY(on_syswide_start_monitor);
+	MM_CALLBACK_ARRAY(on_syswide_stop_monitor);
+	MM_CALLBACK_ARRAY(on_syswide_refresh_monitor);
+	MM_CALLBACK_ARRAY(on_syswide_dump_virtual_counters);
+	/*
+	 * Slice of the virtual-counter space assigned to each active module
+	 * (indexed by module ID). Kept in the table so that the slices
+	 * change along with the stack, and never under the feet of a reader.
+	 */
+	struct {
+		unsigned int base;	/* First virtual counter of the slice */
+		unsigned int nr;	/* Number of virtual counters in the slice */
+	} slices[MAX_MONITORING_MODULES];
+	unsigned int nr_virt_counters;	/* Virtual counters exported by the active modules */
+} mm_dispatch_table_t;
+
+/* Append a module's callback to the table (only if implemented) */
+#define mm_add_callback(table,mod,op) \
+	do { \
+		if ((mod)->op) { \
+			(table)->op[(table)->nr_##op].fn=(mod)->op; \
+			(table)->op[(table)->nr_##op++].module=(mod); \
+		} \
+	} while (0)
+
 /*
  * Monitoring module manager
  */
 static struct {
 	struct list_head modules;
-	monitoring_module_t* cur_module;
+	monitoring_module_t* by_id[MAX_MONITORING_MODULES];	/* Loaded modules indexed by ID */
+	monitoring_module_t* stack[MAX_STACKED_MODULES];	/* Active modules (bottom of the stack first) */
+	int nr_active;
+	unsigned long active_mask;		/* IDs of the active modules */
+	mm_dispatch_table_t tables[2];	/* Dispatch tables (double buffered) */
+	mm_dispatch_table_t* dispatch;	/* Dispatch table in use */
 	int nr_modules;
 	int nr_ids;
 	struct proc_dir_entry *proc_entry;
 	struct semaphore sem;
 } mm_manager;
 
+/*
+ * Readers of the dispatch table. The operations that may sleep (fork, exec,
+ * exit and /proc/pmc/config accesses) walk the table in an SRCU read-side
+ * critical section. The remaining ones are invoked from atomic context
+ * (tick, scheduler, PMI handler or IPIs) and walk it with preemption disabled.
+ * mm_rebuild_dispatch_table() waits for both kinds of readers.
+ */
+static struct srcu_struct mm_dispatch_srcu;
+
+static inline mm_dispatch_table_t* mm_dispatch_sleepable_begin(int* idx)
+{
+	(*idx)=srcu_read_lock(&mm_dispatch_srcu);
+	return srcu_dereference(mm_manager.dispatch,&mm_dispatch_srcu);
+}
+
+static inline void mm_dispatch_sleepable_end(int idx)
+{
+	srcu_read_unlock(&mm_dispatch_srcu,idx);
+}
+
+static inline mm_dispatch_table_t* mm_dispatch_atomic_begin(void)
+{
+	rcu_read_lock_sched();
+	return rcu_dereference_sched(mm_manager.dispatch);
+}
+
+static inline void mm_dispatch_atomic_end(void)
+{
+	rcu_read_unlock_sched();
+}
+
+/*
+ * Dispatch table used by the invocation of on_new_sample() in progress
+ * on each CPU, so that mm_virt_counter_mask() sees the same slices as
+ * the caller even if the table is replaced in the meantime.
+ */
+static DEFINE_PER_CPU(mm_dispatch_table_t*, mm_sample_table);
+
 
 /* Make a given monitoring module the default one */
 int activate_monitoring_module(int module_id);
+/* Push a monitoring module on top of the stack of active modules */
+int push_monitoring_module(int module_id);
+/* Remove the monitoring module on top of the stack of active modules */
+int pop_monitoring_module(void);
+/* Replace the stack of active modules */
+static int mm_set_stack(monitoring_module_t** stack, int nr_active);
 /*
  * Reload a monitoring module.
  * This function may be necessary in the event the
@@ -264,12 +367,15 @@ static const struct file_operations proc_mm_manager_fops = {
 /** @@ Architecture-specific monitoring modules @@ **/
 #if defined(CONFIG_PMC_CORE_2_DUO) || defined(CONFIG_PMC_AMD)
 extern monitoring_module_t ipc_sampling_sf_mm;
+extern monitoring_module_t phase_detection_mm;
 #elif defined(CONFIG_PMC_CORE_I7)
 extern monitoring_module_t ipc_sampling_sf_mm;
 extern monitoring_module_t intel_cmt_mm;
 extern monitoring_module_t intel_rapl_mm;
+extern monitoring_module_t phase_detection_mm;
 #elif defined(CONFIG_PMC_ARM) || defined(CONFIG_PMC_ARM64)
 extern monitoring_module_t ipc_sampling_sf_mm;
+extern monitoring_module_t phase_detection_mm;
 #ifndef ODROID
 extern monitoring_module_t vexpress_sensors_mm;
 #endif
@@ -282,18 +388,29 @@ extern monitoring_module_t spower_mm;
 int init_mm_manager(struct proc_dir_entry* pmc_dir)
 {
 	int ret=0;
+
+	/* Every metric key must fit in the per-thread snapshot */
+	BUILD_BUG_ON(MC_NR_METRIC_KEYS>PMON_MAX_METRIC_KEYS);
+	BUILD_BUG_ON(MAX_MONITORING_MODULES>256);	/* IDs stored as unsigned char */
+
 	/* Init fields */
 	mm_manager.nr_modules=0;
-	mm_manager.cur_module=NULL;
+	mm_manager.nr_active=0;
+	mm_manager.active_mask=0;
+	mm_manager.dispatch=&mm_manager.tables[0];
 	mm_manager.nr_ids=0;
 	INIT_LIST_HEAD(&mm_manager.modules);
 	sema_init(&mm_manager.sem,1);
 
+	if ((ret=init_srcu_struct(&mm_dispatch_srcu)))
+		return ret;
+
 	/* Create /proc/em_manager entry */
 	mm_manager.proc_entry = proc_create_data( "mm_manager", 0666, pmc_dir, &proc_mm_manager_fops, NULL );
 
 	if(mm_manager.proc_entry  == NULL) {
 		printk(KERN_INFO "Couldn't create 'mm_manager' proc entry\n");
+		cleanup_srcu_struct(&mm_dispatch_srcu);
 		return -ENOMEM;
 	}
 
@@ -302,6 +419,7 @@ int init_mm_manager(struct proc_dir_entry* pmc_dir)
 
 	if ((ret=activate_monitoring_module(0))) {
 		remove_proc_entry("mm_manager", pmc_dir);
+		cleanup_srcu_struct(&mm_dispatch_srcu);
 		printk(KERN_INFO "Couldn't activate dummy monitoring module\n");
 		return ret;
 	}
@@ -323,12 +441,15 @@ int init_mm_manager(struct proc_dir_entry* pmc_dir)
 	/** @@ Architecture-specific monitoring modules @@ **/
 #if defined(CONFIG_PMC_CORE_2_DUO) || defined(CONFIG_PMC_AMD)
 	load_monitoring_module(&ipc_sampling_sf_mm);
+	load_monitoring_module(&phase_detection_mm);
 #elif defined(CONFIG_PMC_CORE_I7)
 	load_monitoring_module(&ipc_sampling_sf_mm);
 	load_monitoring_module(&intel_cmt_mm);
 	load_monitoring_module(&intel_rapl_mm);
+	load_monitoring_module(&phase_detection_mm);
 #elif defined(CONFIG_PMC_ARM) || defined(CONFIG_PMC_ARM64)
 	load_monitoring_module(&ipc_sampling_sf_mm);
+	load_monitoring_module(&phase_detection_mm);
 #ifndef ODROID
 	load_monitoring_module(&vexpress_sensors_mm);
 #endif
@@ -348,14 +469,12 @@ int init_mm_manager(struct proc_dir_entry* pmc_dir)
 void destroy_mm_manager(struct proc_dir_entry* pmc_dir)
 {
 	/* Disable current modules */
-	if (mm_manager.cur_module) {
-		mm_manager.cur_module->disable_module();
-		mm_manager.cur_module=NULL;
-	}
+	mm_set_stack(NULL,0);
 #ifdef CONFIG_SMART_POWER
 	spower_unregister_driver();
 #endif
 	remove_proc_entry("mm_manager", pmc_dir);
+	cleanup_srcu_struct(&mm_dispatch_srcu);
 }
 
 /* /proc/pmc/mm_manager read callback */
@@ -368,6 +487,7 @@ static ssize_t proc_mm_manager_read(struct file *filp, char __user *buf, size_t
 	struct list_head* mylist=&mm_manager.modules;
 	struct list_head *cur_node= mylist->next;
 	ssize_t nbytes=0;
+	int i;
 
 	if (*off>0)
 		return 0;
@@ -387,13 +507,21 @@ static ssize_t proc_mm_manager_read(struct file *filp, char __user *buf, size_t
 		cur_entry = list_entry(cur_node, monitoring_module_t, links);
 		cur_node=cur_node->next;
 
-		if (cur_entry==mm_manager.cur_module) {
+		if (mm_manager.active_mask & (1UL<<cur_entry->id)) {
 			dest+=sprintf(dest,"[*] %d - %s\n",cur_entry->id,cur_entry->info);
 		} else {
 			dest+=sprintf(dest,"[ ] %d - %s\n",cur_entry->id,cur_entry->info);
 		}
 	}
 
+	/* Show the order of the active modules only if there are several */
+	if (mm_manager.nr_active>1) {
+		dest+=sprintf(dest,"stack:");
+		for (i=0; i<mm_manager.nr_active; i++)
+			dest+=sprintf(dest," %d",mm_manager.stack[i]->id);
+		dest+=sprintf(dest,"\n");
+	}
+
 	up(&mm_manager.sem);
 
 	nbytes=dest-kbuf;
@@ -436,6 +564,18 @@ static ssize_t proc_mm_manager_write(struct file *filp, const char __user *buff,
 			ret=retval;
 			goto up_semaphore;
 		}
+	} else if (sscanf(line,"push %i",&val)==1) {
+		if ((retval=push_monitoring_module(val))<0) {
+			printk(KERN_ALERT "Unable to push the desired module");
+			ret=retval;
+			goto up_semaphore;
+		}
+	} else if (strncmp(line,"pop",3)==0) {
+		if ((retval=pop_monitoring_module())<0) {
+			printk(KERN_ALERT "Unable to pop the module on top of the stack");
+			ret=retval;
+			goto up_semaphore;
+		}
 	} else if (strncmp(line,"deactivate",10)==0) {
 		if ((retval=activate_monitoring_module(-1))<0) {
 			printk(KERN_ALERT "Unable to deactivate the desired module");
@@ -455,110 +595,298 @@ up_semaphore:
 	return ret;
 }
 
+/* Find a loaded monitoring module by ID */
+static inline monitoring_module_t* mm_find_module(int module_id)
+{
+	if (module_id<0 || module_id>=MAX_MONITORING_MODULES)
+		return NULL;
+	return mm_manager.by_id[module_id];
+}
+
+/*
+ * Aggregate the counter usage of a stack of modules.
+ * If a dispatch table is provided, each module is assigned there the slice
+ * of the virtual-counter space that follows those of the modules below it.
+ * Returns -EBUSY if two modules claim the same PMCs, and -ENOSPC
+ * if the modules export more virtual counters than a sample can hold.
+ */
+static int mm_stack_counter_usage(monitoring_module_t** stack, int nr_active,
+                                  monitoring_module_counter_usage_t* usage, mm_dispatch_table_t* table)
+{
+	monitoring_module_counter_usage_t mod_usage;
+	monitoring_module_t* module;
+	int i,j;
+	int ret=0;
+
+	usage->hwpmc_mask=0;
+	usage->nr_virtual_counters=0;
+	usage->nr_experiments=0; /* No event multiplexing either */
+
+	for (i=0; i<nr_active; i++) {
+		module=stack[i];
+
+		mod_usage.hwpmc_mask=0;
+		mod_usage.nr_virtual_counters=0;
+		mod_usage.nr_experiments=0;
+
+		if (module->module_counter_usage)
+			module->module_counter_usage(&mod_usage);
+
+		if (usage->hwpmc_mask & mod_usage.hwpmc_mask)
+			ret=-EBUSY;
+
+		usage->hwpmc_mask|=mod_usage.hwpmc_mask;
+
+		if (mod_usage.nr_experiments>usage->nr_experiments)
+			usage->nr_experiments=mod_usage.nr_experiments;
+
+		if (usage->nr_virtual_counters+mod_usage.nr_virtual_counters>MAX_VIRTUAL_COUNTERS) {
+			mod_usage.nr_virtual_counters=MAX_VIRTUAL_COUNTERS-usage->nr_virtual_counters;
+			ret=-ENOSPC;
+		}
+
+		if (table) {
+			table->slices[module->id].base=usage->nr_virtual_counters;
+			table->slices[module->id].nr=mod_usage.nr_virtual_counters;
+		}
+
+		for (j=0; j<mod_usage.nr_virtual_counters; j++)
+			usage->vcounter_desc[usage->nr_virtual_counters++]=mod_usage.vcounter_desc[j];
+	}
+
+	if (table)
+		table->nr_virt_counters=usage->nr_virtual_counters;
+
+	return ret;
+}
+
+/*
+ * Rebuild the dispatch table after a change in the stack of active modules.
+ * The new table is built on the spare buffer and then published, so
+ * that concurrent callers see either the old table or the new one.
+ */
+static void mm_rebuild_dispatch_table(void)
+{
+	mm_dispatch_table_t* table;
+	monitoring_module_t* module;
+	monitoring_module_counter_usage_t usage;
+	int i;
+
+	if (mm_manager.dispatch==&mm_manager.tables[0])
+		table=&mm_manager.tables[1];
+	else
+		table=&mm_manager.tables[0];
+
+	memset(table,0,sizeof(mm_dispatch_table_t));
+
+	/* The number of virtual counters of a module may change when it is reinitialized */
+	mm_stack_counter_usage(mm_manager.stack,mm_manager.nr_active,&usage,table);
+
+	for (i=0; i<mm_manager.nr_active; i++) {
+		module=mm_manager.stack[i];
+		mm_add_callback(table,module,on_read_config);
+		mm_add_callback(table,module,on_write_config);
+		mm_add_callback(table,module,on_fork);
+		mm_add_callback(table,module,on_exec);
+		mm_add_callback(table,module,on_new_sample);
+		mm_add_callback(table,module,on_migrate);
+		mm_add_callback(table,module,on_exit);
+		mm_add_callback(table,module,on_switch_in);
+		mm_add_callback(table,module,on_switch_out);
+		mm_add_callback(table,module,on_switch_in_unmonitored);
+		mm_add_callback(table,module,get_current_metric_value);
+		mm_add_callback(table,module,on_tick);
+		mm_add_callback(table,module,on_syswide_start_monitor);
+		mm_add_callback(table,module,on_syswide_stop_monitor);
+		mm_add_callback(table,module,on_syswide_refresh_monitor);
+		mm_add_callback(table,module,on_syswide_dump_virtual_counters);
+	}
+
+	rcu_assign_pointer(mm_manager.dispatch,table);
+
+	/*
+	 * Wait for callers still using the old table, which is
+	 * overwritten the next time the stack changes
+	 */
+	synchronize_srcu(&mm_dispatch_srcu);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	synchronize_rcu();
+#else
+	synchronize_sched();
+#endif
+}
+
+/*
+ * Replace the stack of active modules with a new one (bottom first).
+ * Modules joining the stack are enabled before disabling those leaving it,
+ * so that the stack remains untouched if something goes wrong.
+ */
+static int mm_set_stack(monitoring_module_t** stack, int nr_active)
+{
+	monitoring_module_t* old_stack[MAX_STACKED_MODULES];
+	int old_nr_active=mm_manager.nr_active;
+	monitoring_module_counter_usage_t usage;
+	unsigned long new_mask=0;
+	int i,j;
+	int error=0;
+
+	for (i=0; i<nr_active; i++) {
+		/* A module cannot be stacked twice */
+		if (new_mask & (1UL<<stack[i]->id))
+			return -EEXIST;
+		new_mask|=(1UL<<stack[i]->id);
+	}
+
+	/* Make sure the modules can coexist */
+	if ((error=mm_stack_counter_usage(stack,nr_active,&usage,NULL)))
+		return error;
+
+	/* Enable the modules that join the stack */
+	for (i=0; i<nr_active; i++) {
+		if (mm_manager.active_mask & (1UL<<stack[i]->id))
+			continue;
+
+		if ((error=stack[i]->enable_module())) {
+			for (j=0; j<i; j++)
+				if (!(mm_manager.active_mask & (1UL<<stack[j]->id)))
+					stack[j]->disable_module();
+			return error;
+		}
+	}
+
+	memcpy(old_stack,mm_manager.stack,sizeof(old_stack));
+
+	for (i=0; i<nr_active; i++)
+		mm_manager.stack[i]=stack[i];
+
+	mm_manager.nr_active=nr_active;
+	mm_manager.active_mask=new_mask;
+	mm_rebuild_dispatch_table();
+
+	/* Disable the modules that left the stack */
+	for (i=old_nr_active-1; i>=0; i--)
+		if (!(new_mask & (1UL<<old_stack[i]->id)))
+			old_stack[i]->disable_module();
+
+	return 0;
+}
+
 /* Make a given monitoring module the default one */
 int activate_monitoring_module(int module_id)
 {
-	monitoring_module_t* cur_entry=NULL;
-	struct list_head *cur_node;
-	struct list_head* mylist=&mm_manager.modules;
+	monitoring_module_t* module;
 	int old_module_id=0;
 	int error=0;
 
 	/* All disabled so far */
 	if (module_id < 0) {
-		if (mm_manager.cur_module==NULL) {
+		if (mm_manager.nr_active==0) {
 			return -1;
 		} else {
-			old_module_id=mm_manager.cur_module->id;
-			mm_manager.cur_module=NULL;
+			old_module_id=mm_manager.stack[0]->id;
+			mm_set_stack(NULL,0);
 			return old_module_id;
 		}
-	} else if ((mm_manager.cur_module !=NULL) && (mm_manager.cur_module->id==module_id)) {
+	} else if (mm_manager.nr_active==1 && mm_manager.stack[0]->id==module_id) {
 		/* Already enabled */
 		return module_id;
-	} else {
-
-		cur_node = mylist->next; /* Retrieve first element */
-
-		while (cur_node!= mylist) {
-			/* cur_entry points to the structure in which the list is embedded */
-			cur_entry = list_entry(cur_node, monitoring_module_t, links);
-			cur_node=cur_node->next; /* Keep track of it before anything else */
-
-			if (cur_entry->id==module_id) {
-				/* Try to enable the new module
-				  right before disabling the old one
-				  and return an error if something went wrong
-				  */
-				if ((error=cur_entry->enable_module()))
-					return error; //
-				/* Disable curmodule if not null */
-				if (mm_manager.cur_module)
-					mm_manager.cur_module->disable_module();
-				/* Update the pointer with the new module !! */
-				mm_manager.cur_module=cur_entry;
-				return module_id;
-			}
-		}
-
+	} else if ((module=mm_find_module(module_id))==NULL) {
 		/* Not possible */
 		return -1;
 	}
 
+	/* The module replaces the whole stack */
+	if ((error=mm_set_stack(&module,1)))
+		return error;
+
+	return module_id;
 }
 
-/* This is necessary to upgrade the configuration after a change in the system topology, and core type ... */
-int reinitialize_monitoring_module(int module_id)
+/* Push a monitoring module on top of the stack of active modules */
+int push_monitoring_module(int module_id)
 {
-	monitoring_module_t* cur_entry=NULL;
-	struct list_head *cur_node;
-	struct list_head* mylist=&mm_manager.modules;
-
+	monitoring_module_t* stack[MAX_STACKED_MODULES];
+	monitoring_module_t* module;
+	int i;
+	int error=0;
 
-	/* All disabled so far */
-	if (module_id < 0) {
+	if ((module=mm_find_module(module_id))==NULL)
 		return -1;
-	} else if ((mm_manager.cur_module !=NULL) && (mm_manager.cur_module->id==module_id)) {
-		/* Already enabled */
-		mm_manager.cur_module->enable_module();
-		return module_id;
-	} else {
 
-		cur_node = mylist->next; /* First item of the list */
+	if (mm_manager.nr_active==MAX_STACKED_MODULES)
+		return -ENOSPC;
 
-		while (cur_node!= mylist) {
-			/* cur_entry points to the structure in which the list is embedded */
-			cur_entry = list_entry(cur_node, monitoring_module_t, links);
-			cur_node=cur_node->next; /* Keep track of it before anything else */
+	for (i=0; i<mm_manager.nr_active; i++)
+		stack[i]=mm_manager.stack[i];
 
-			if (cur_entry->id==module_id) {
-				/* Call enable, but it means it must reinitialize */
-				cur_entry->enable_module();
-				return module_id;
-			}
-		}
+	stack[i]=module;
+
+	if ((error=mm_set_stack(stack,mm_manager.nr_active+1)))
+		return error;
 
-		/* Not found */
+	return module_id;
+}
+
+/* Remove the monitoring module on top of the stack of active modules */
+int pop_monitoring_module(void)
+{
+	int module_id;
+
+	if (mm_manager.nr_active==0)
 		return -1;
-	}
+
+	module_id=mm_manager.stack[mm_manager.nr_active-1]->id;
+	mm_set_stack(mm_manager.stack,mm_manager.nr_active-1);
+	return module_id;
+}
+
+/* This is necessary to upgrade the configuration after a change in the system topology, and core type ... */
+int reinitialize_monitoring_module(int module_id)
+{
+	monitoring_module_t* module=mm_find_module(module_id);
+
+	/* Not found */
+	if (!module)
+		return -1;
+
+	/* Call enable, but it means it must reinitialize */
+	module->enable_module();
+
+	/* The number of virtual counters may have changed */
+	if (mm_manager.active_mask & (1UL<<module_id))
+		mm_rebuild_dispatch_table();
+
+	return module_id;
 }
 
 /* Arbitrary offset value */
 #define SECURITY_IDS_OFFSET 999
 
+/* Get security code associated with a given monitoring module */
+int monitoring_module_security_id(monitoring_module_t* module)
+{
+	return SECURITY_IDS_OFFSET+module->id;
+}
+
 /* Get security code associated with current monitoring module */
 int current_monitoring_module_security_id(void)
 {
-	if (mm_manager.cur_module ==NULL)
+	if (mm_manager.nr_active==0)
 		return -1;
 	else
-		return SECURITY_IDS_OFFSET+mm_manager.cur_module->id;
+		return monitoring_module_security_id(mm_manager.stack[0]);
 }
 
-/* Get pointer to descriptor to current monitoring module */
+/* Get pointer to descriptor to current monitoring module (bottom of the stack) */
 monitoring_module_t* current_monitoring_module(void)
 {
-	return mm_manager.cur_module;
+	return mm_manager.nr_active?mm_manager.stack[0]:NULL;
+}
+
+/* Get bitmask with the IDs of the active monitoring modules */
+unsigned long current_monitoring_module_mask(void)
+{
+	return mm_manager.active_mask;
 }
 
 /* Load a specific monitoring module */
@@ -567,11 +895,17 @@ int load_monitoring_module(monitoring_module_t* module)
 	int ret=-EINVAL;
 
 	/* Check possible errors */
-	if (module==NULL ||  module->id>0 ||
-	    (module->probe_module && (ret=module->probe_module())) )
+	if (module==NULL ||  module->id>0)
+		return ret;
+
+	if (mm_manager.nr_ids==MAX_MONITORING_MODULES)
+		return -ENOSPC;
+
+	if (module->probe_module && (ret=module->probe_module()))
 		return ret;
 
 	module->id=mm_manager.nr_ids++;
+	mm_manager.by_id[module->id]=module;
 	list_add_tail(&module->links,&mm_manager.modules);
 	mm_manager.nr_modules++;
 	return module->id;
@@ -580,54 +914,62 @@ int load_monitoring_module(monitoring_module_t* module)
 /* Unload the monitoring module with associated ID */
 int unload_monitoring_module(int module_id)
 {
-	monitoring_module_t* cur_entry=NULL;
-	struct list_head *cur_node;
-	struct list_head* mylist=&mm_manager.modules;
+	monitoring_module_t* module=mm_find_module(module_id);
 
-	/* Can't unload the module we're currently using */
-	if ((module_id < 0) ||
-	    ((mm_manager.cur_module !=NULL) && (mm_manager.cur_module->id==module_id))
-	   ) {
+	/* Can't unload a module we're currently using */
+	if (!module || (mm_manager.active_mask & (1UL<<module_id)))
 		return -1;
-	} else {
 
-		cur_node = mylist->next; /* First item of the list */
+	list_del(&module->links);
+	mm_manager.by_id[module_id]=NULL;
+	mm_manager.nr_modules--;
+	return module_id;
+}
 
-		while (cur_node!= mylist) {
-			/* cur_entry points to the structure in which the list is embedded */
-			cur_entry = list_entry(cur_node, monitoring_module_t, links);
+/* Was the module active when the task was created? */
+static inline int mod_task_is_curr(pmon_prof_t* prof, monitoring_module_t* module)
+{
+	return prof->task_mod_mask & (1UL<<module->id);
+}
 
-			if (cur_entry->id==module_id) {
-				list_del(cur_node);
-				mm_manager.nr_modules--;
-				return module_id;
-			}
-			cur_node=cur_node->next;
-		}
+/* Virtual counters in the slice of a given module (relative to the first one) */
+static inline unsigned int mm_slice_mask(mm_dispatch_table_t* table, monitoring_module_t* module, unsigned int virtual_mask)
+{
+	return (virtual_mask>>table->slices[module->id].base) & ((1U<<table->slices[module->id].nr)-1);
+}
 
-		/* Not possible */
-		return -1;
-	}
+/*
+ * Modules append their virtual counts to the sample, and flag them in virt_mask
+ * using the indexes of their own slice. virt_mask is cleared before invoking
+ * a module, and the bits it sets are then moved to the module's slice.
+ */
+static inline unsigned int mm_begin_virtual_counts(pmc_sample_t* sample)
+{
+	unsigned int virt_mask=sample->virt_mask;
+
+	sample->virt_mask=0;
+	return virt_mask;
 }
 
-static inline int mod_task_is_curr(pmon_prof_t* prof)
+static inline void mm_end_virtual_counts(mm_dispatch_table_t* table, pmc_sample_t* sample,
+        monitoring_module_t* module, unsigned int virt_mask)
 {
-	return prof->task_mod!=NULL && mm_manager.cur_module==prof->task_mod;
+	sample->virt_mask=virt_mask|((sample->virt_mask & ((1U<<table->slices[module->id].nr)-1))<<table->slices[module->id].base);
 }
 
-static inline int is_valid_monitoring_module(monitoring_module_t* module)
+unsigned int mm_virt_counter_mask(pmon_prof_t* prof, monitoring_module_t* module)
 {
-	monitoring_module_t* cur_entry=NULL;
+	mm_dispatch_table_t* table;
+	unsigned int mask;
 
-	if (!module)
-		return 0;
+	rcu_read_lock_sched();
 
-	list_for_each_entry(cur_entry, &mm_manager.modules, links) {
-		if (cur_entry==module)
-			return 1;
-	}
+	if (!(table=this_cpu_read(mm_sample_table)))
+		table=rcu_dereference_sched(mm_manager.dispatch);
 
-	return 0;
+	mask=mm_slice_mask(table,module,prof->virt_counter_mask);
+	rcu_read_unlock_sched();
+	return mask;
 }
 
 /**
@@ -637,132 +979,404 @@ static inline int is_valid_monitoring_module(monitoring_module_t* module)
 
 int mm_on_read_config(char* str, unsigned int len)
 {
-	if (mm_manager.cur_module && mm_manager.cur_module->on_read_config)
-		return mm_manager.cur_module->on_read_config(str,len);
-	return 0;
-}
+	int idx;
+	mm_dispatch_table_t* table=mm_dispatch_sleepable_begin(&idx);
+	int i,ret;
+	int nbytes=0;
+
+	for (i=0; i<table->nr_on_read_config; i++) {
+		if ((ret=table->on_read_config[i].fn(str+nbytes,len-nbytes))<0) {
+			nbytes=ret;
+			break;
+		}
+		nbytes+=ret;
+	}
 
+	mm_dispatch_sleepable_end(idx);
+	return nbytes;
+}
 
+/*
+ * Every active module gets to see the string. The result of the first module
+ * that took care of it (or reported an error) is returned.
+ */
 int mm_on_write_config(const char *str, unsigned int len)
 {
-	if (mm_manager.cur_module && mm_manager.cur_module->on_write_config)
-		return mm_manager.cur_module->on_write_config(str,len);
-	return 0;
+	int idx;
+	mm_dispatch_table_t* table=mm_dispatch_sleepable_begin(&idx);
+	int i,val;
+	int ret=0;
+
+	for (i=0; i<table->nr_on_write_config; i++) {
+		val=table->on_write_config[i].fn(str,len);
+		if (ret==0 || (ret<0 && val>0))
+			ret=val;
+	}
+
+	mm_dispatch_sleepable_end(idx);
+	return ret;
 }
 
 int mm_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 {
-	if (mm_manager.cur_module && mm_manager.cur_module->on_fork)
-		return mm_manager.cur_module->on_fork(clone_flags, prof);
-	return 0;
+	int idx;
+	mm_dispatch_table_t* table=mm_dispatch_sleepable_begin(&idx);
+	int i;
+	int ret=0;
+
+	for (i=0; i<table->nr_on_fork && !ret; i++)
+		ret=table->on_fork[i].fn(clone_flags, prof);
+
+	mm_dispatch_sleepable_end(idx);
+	return ret;
 }
 
 void mm_on_exec(pmon_prof_t* prof)
 {
-	if ( mod_task_is_curr(prof) && mm_manager.cur_module->on_exec)
-		mm_manager.cur_module->on_exec(prof);
+	int idx;
+	mm_dispatch_table_t* table=mm_dispatch_sleepable_begin(&idx);
+	int i;
+
+	for (i=0; i<table->nr_on_exec; i++)
+		if (mod_task_is_curr(prof,table->on_exec[i].module))
+			table->on_exec[i].fn(prof);
+
+	mm_dispatch_sleepable_end(idx);
+}
+
+/* Number of virtual counters provided by the active monitoring modules themselves */
+unsigned int mm_nr_module_virtual_counters(void)
+{
+	unsigned int nr_virt_counters=mm_dispatch_atomic_begin()->nr_virt_counters;
+
+	mm_dispatch_atomic_end();
+	return nr_virt_counters;
 }
 
 int mm_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,int flags,void* data)
 {
-	if ( mod_task_is_curr(prof) && mm_manager.cur_module->on_new_sample)
-		return mm_manager.cur_module->on_new_sample(prof,cpu,sample,flags,data);
-	return 0;
+	mm_dispatch_table_t* table=mm_dispatch_atomic_begin();
+	mm_dispatch_table_t* prev_table;
+	monitoring_module_t* module;
+	pmon_metric_snapshot_t* snapshot=&prof->metric_snapshot;
+	unsigned int virt_mask;
+	int i,val;
+	int ret=0;
+	/*
+	 * Writers of the metric snapshot are serialized by the thread's lock,
+	 * but a sample may be collected from an NMI while a write section is open.
+	 * The nested invocation then publishes its values in that same section.
+	 */
+	int publish=!(raw_read_seqcount(&snapshot->seq) & 1);
+
+	if (publish)
+		write_seqcount_begin(&snapshot->seq);
+
+	/* Restored on the way out, as a sample may be collected from an NMI in the meantime */
+	prev_table=this_cpu_read(mm_sample_table);
+	this_cpu_write(mm_sample_table,table);
+
+	for (i=0; i<table->nr_on_new_sample; i++) {
+		module=table->on_new_sample[i].module;
+
+		if (!mod_task_is_curr(prof,module))
+			continue;
+
+		virt_mask=mm_begin_virtual_counts(sample);
+		val=table->on_new_sample[i].fn(prof,cpu,sample,flags,data);
+		mm_end_virtual_counts(table,sample,module,virt_mask);
+
+		if (val && !ret)
+			ret=val;
+	}
+
+	this_cpu_write(mm_sample_table,prev_table);
+	mm_dispatch_atomic_end();
+
+	if (publish)
+		write_seqcount_end(&snapshot->seq);
+
+	/* User-defined metrics go after the modules' virtual counters */
+	if (prof->virt_counter_mask && prof->pmc_samples_buffer)
+		pmc_user_metrics_eval(prof->pmc_samples_buffer,sample,prof->virt_counter_mask,mm_nr_module_virtual_counters());
+	return ret;
 }
 
 void mm_on_tick(pmon_prof_t* prof,int cpu)
 {
-	if ( mod_task_is_curr(prof) && mm_manager.cur_module->on_tick)
-		mm_manager.cur_module->on_tick(prof,cpu);
+	mm_dispatch_table_t* table=mm_dispatch_atomic_begin();
+	int i;
+
+	for (i=0; i<table->nr_on_tick; i++)
+		if (mod_task_is_curr(prof,table->on_tick[i].module))
+			table->on_tick[i].fn(prof,cpu);
+
+	mm_dispatch_atomic_end();
 }
 
 void mm_on_migrate(pmon_prof_t* prof, int prev_cpu, int new_cpu)
 {
-	if ( mod_task_is_curr(prof) && mm_manager.cur_module->on_migrate)
-		mm_manager.cur_module->on_migrate(prof,prev_cpu,new_cpu);
+	mm_dispatch_table_t* table=mm_dispatch_atomic_begin();
+	int i;
+
+	for (i=0; i<table->nr_on_migrate; i++)
+		if (mod_task_is_curr(prof,table->on_migrate[i].module))
+			table->on_migrate[i].fn(prof,prev_cpu,new_cpu);
+
+	mm_dispatch_atomic_end();
 }
 
 void mm_on_exit(pmon_prof_t* prof)
 {
-	if ( mod_task_is_curr(prof) && mm_manager.cur_module->on_exit)
-		return mm_manager.cur_module->on_exit(prof);
+	int idx;
+	mm_dispatch_table_t* table=mm_dispatch_sleepable_begin(&idx);
+	int i;
+
+	for (i=0; i<table->nr_on_exit; i++)
+		if (mod_task_is_curr(prof,table->on_exit[i].module))
+			table->on_exit[i].fn(prof);
+
+	mm_dispatch_sleepable_end(idx);
 }
 
 void mm_on_free_task(pmon_prof_t* prof)
 {
-	if ( mod_task_is_curr(prof) && mm_manager.cur_module->on_free_task)
-		mm_manager.cur_module->on_free_task(prof);
-	else if (prof && prof->monitoring_mod_priv_data)	{
-		/* Free up memory if the monitoring module
-			was changed in between */
-		monitoring_module_t* task_mod=prof->task_mod;
-		if (is_valid_monitoring_module(task_mod) && task_mod->on_free_task)
-			task_mod->on_free_task(prof);
+	monitoring_module_t* module;
+	int id;
+
+	if (!prof)
+		return;
+
+	for (id=0; id<mm_manager.nr_ids; id++) {
+		module=mm_manager.by_id[id];
+
+		if (!module || !module->on_free_task)
+			continue;
+
+		/* Free up memory even if the module was deactivated in between */
+		if ((mod_task_is_curr(prof,module) && (mm_manager.active_mask & (1UL<<id))) ||
+		    mm_get_priv_data(prof,module))
+			module->on_free_task(prof);
 	}
 }
 
 void mm_on_switch_in(pmon_prof_t* prof)
 {
-	if ( mod_task_is_curr(prof) && mm_manager.cur_module->on_switch_in)
-		mm_manager.cur_module->on_switch_in(prof);
+	mm_dispatch_table_t* table=mm_dispatch_atomic_begin();
+	int i;
+
+	for (i=0; i<table->nr_on_switch_in; i++)
+		if (mod_task_is_curr(prof,table->on_switch_in[i].module))
+			table->on_switch_in[i].fn(prof);
+
+	mm_dispatch_atomic_end();
 }
 
 void mm_on_switch_out(pmon_prof_t* prof)
 {
-	if ( mod_task_is_curr(prof) && mm_manager.cur_module->on_switch_out)
-		mm_manager.cur_module->on_switch_out(prof);
+	mm_dispatch_table_t* table=mm_dispatch_atomic_begin();
+	int i;
+
+	for (i=0; i<table->nr_on_switch_out; i++)
+		if (mod_task_is_curr(prof,table->on_switch_out[i].module))
+			table->on_switch_out[i].fn(prof);
+
+	mm_dispatch_atomic_end();
+}
+
+/*
+ * Notify the modules that do not monitor the incoming thread
+ * (all of them if prof is NULL)
+ */
+void mm_on_switch_in_unmonitored(pmon_prof_t* prof, int cpu)
+{
+	mm_dispatch_table_t* table=mm_dispatch_atomic_begin();
+	int i;
+
+	for (i=0; i<table->nr_on_switch_in_unmonitored; i++)
+		if (!prof || !mod_task_is_curr(prof,table->on_switch_in_unmonitored[i].module))
+			table->on_switch_in_unmonitored[i].fn(cpu);
+
+	mm_dispatch_atomic_end();
+}
+
+/*
+ * Retrieve a metric from the thread's snapshot without taking any lock.
+ * Return 0 if a module that is still active published the metric.
+ */
+static int mm_read_metric_snapshot(pmon_prof_t* prof, int key, uint64_t* value)
+{
+	pmon_metric_snapshot_t* snapshot=&prof->metric_snapshot;
+	unsigned int seq;
+	int valid;
+	int publisher;
+	uint64_t val;
+
+	if (key<0 || key>=PMON_MAX_METRIC_KEYS)
+		return -1;
+
+	do {
+		seq=read_seqcount_begin(&snapshot->seq);
+		valid=(snapshot->valid_mask>>key) & 1;
+		publisher=snapshot->publisher[key];
+		val=snapshot->values[key];
+	} while (read_seqcount_retry(&snapshot->seq,seq));
+
+	if (!valid || !(mm_manager.active_mask & (1UL<<publisher)))
+		return -1;
+
+	(*value)=val;
+	return 0;
 }
 
+/*
+ * Metrics published by the modules are read from the thread's snapshot.
+ * Otherwise the first module that exports the metric provides its value.
+ */
 int mm_get_current_metric_value(pmon_prof_t* prof, int key, uint64_t* value)
 {
-	int ret=0;
-	if ( mod_task_is_curr(prof) && mm_manager.cur_module->get_current_metric_value) {
-		ret=mm_manager.cur_module->get_current_metric_value(prof,key,value);
+	mm_dispatch_table_t* table;
+	int i;
+	int ret=-1;
+
+	if (mm_read_metric_snapshot(prof,key,value)==0)
+		return 0;
+
+	table=mm_dispatch_atomic_begin();
+
+	for (i=0; i<table->nr_get_current_metric_value; i++) {
+		if (!mod_task_is_curr(prof,table->get_current_metric_value[i].module))
+			continue;
+
+		ret=table->get_current_metric_value[i].fn(prof,key,value);
 #ifdef DEBUG
 		if (key>7)
 			trace_printk("Requested key %d -> value=%llu ,status=%d\n",key,*value,ret);
 #endif
-		return ret;
-	} else
-		return -1;
+		if (ret==0)
+			break;
+	}
+
+	mm_dispatch_atomic_end();
+	return ret;
 }
 
 void mm_module_counter_usage(monitoring_module_counter_usage_t* usage)
 {
-	if (mm_manager.cur_module && mm_manager.cur_module->module_counter_usage)
-		return mm_manager.cur_module->module_counter_usage(usage);
-	else {
-		/* Return default info (no counter is used) */
-		usage->hwpmc_mask=0;
-		usage->nr_virtual_counters=0;
-		usage->nr_experiments=0; /* No event multiplexing either */
-	}
+	/*
+	 * Returns default info (no counter is used) if no module is active.
+	 * The slices of the virtual-counter space are only (re)assigned
+	 * when the dispatch table is rebuilt, so they are left alone here.
+	 */
+	mm_stack_counter_usage(mm_manager.stack,mm_manager.nr_active,usage,NULL);
+
+	/*
+	 * User-defined metrics are exported as additional virtual counters
+	 * (their names are not stable, so they are not described here)
+	 */
+	usage->nr_virtual_counters+=pmc_user_metrics_nr_defined();
+	if (usage->nr_virtual_counters>MAX_VIRTUAL_COUNTERS)
+		usage->nr_virtual_counters=MAX_VIRTUAL_COUNTERS;
 }
 
 int mm_on_syswide_start_monitor(int cpu, unsigned int virtual_mask)
 {
-	if (mm_manager.cur_module && mm_manager.cur_module->on_syswide_start_monitor)
-		return mm_manager.cur_module->on_syswide_start_monitor(cpu,virtual_mask);
-	else
+	mm_dispatch_table_t* table;
+	monitoring_module_t* module;
+	unsigned int covered_mask=0;
+	unsigned int module_mask;
+	int i,j;
+	int ret=0;
+
+	table=mm_dispatch_atomic_begin();
+
+	/* Only user-defined metrics were requested */
+	if (!(virtual_mask&=((1U<<table->nr_virt_counters)-1))) {
+		mm_dispatch_atomic_end();
+		return 0;
+	}
+
+	for (i=0; i<table->nr_on_syswide_start_monitor; i++) {
+		module=table->on_syswide_start_monitor[i].module;
+		covered_mask|=(((1U<<table->slices[module->id].nr)-1)<<table->slices[module->id].base);
+	}
+
+	/* Some of the requested counters are not available in system-wide mode */
+	if (virtual_mask & ~covered_mask) {
+		mm_dispatch_atomic_end();
 		return -ENOSYS;
+	}
+
+	for (i=0; i<table->nr_on_syswide_start_monitor; i++) {
+		module=table->on_syswide_start_monitor[i].module;
+
+		if (!(module_mask=mm_slice_mask(table,module,virtual_mask)))
+			continue;
+
+		if ((ret=table->on_syswide_start_monitor[i].fn(cpu,module_mask))) {
+			/* Stop the modules started so far (not needed when probing) */
+			for (j=0; cpu!=-1 && j<i; j++) {
+				module=table->on_syswide_start_monitor[j].module;
+				if (module->on_syswide_stop_monitor && (module_mask=mm_slice_mask(table,module,virtual_mask)))
+					module->on_syswide_stop_monitor(cpu,module_mask);
+			}
+			break;
+		}
+	}
+
+	mm_dispatch_atomic_end();
+	return ret;
 }
 
 void mm_on_syswide_stop_monitor(int cpu, unsigned int virtual_mask)
 {
-	if (mm_manager.cur_module && mm_manager.cur_module->on_syswide_stop_monitor)
-		mm_manager.cur_module->on_syswide_stop_monitor(cpu,virtual_mask);
+	mm_dispatch_table_t* table=mm_dispatch_atomic_begin();
+	unsigned int module_mask;
+	int i;
+
+	for (i=0; i<table->nr_on_syswide_stop_monitor; i++)
+		if ((module_mask=mm_slice_mask(table,table->on_syswide_stop_monitor[i].module,virtual_mask)))
+			table->on_syswide_stop_monitor[i].fn(cpu,module_mask);
+
+	mm_dispatch_atomic_end();
 }
 
 void mm_on_syswide_refresh_monitor(int cpu, unsigned int virtual_mask)
 {
-	if (mm_manager.cur_module && mm_manager.cur_module->on_syswide_refresh_monitor)
-		mm_manager.cur_module->on_syswide_refresh_monitor(cpu,virtual_mask);
+	mm_dispatch_table_t* table=mm_dispatch_atomic_begin();
+	unsigned int module_mask;
+	int i;
+
+	for (i=0; i<table->nr_on_syswide_refresh_monitor; i++)
+		if ((module_mask=mm_slice_mask(table,table->on_syswide_refresh_monitor[i].module,virtual_mask)))
+			table->on_syswide_refresh_monitor[i].fn(cpu,module_mask);
+
+	mm_dispatch_atomic_end();
 }
 
-void mm_on_syswide_dump_virtual_counters(int cpu, unsigned int virtual_mask,pmc_sample_t* sample)
+void mm_on_syswide_dump_virtual_counters(int cpu, unsigned int virtual_mask,pmc_samples_buffer_t* sbuf,pmc_sample_t* sample)
 {
-	if (mm_manager.cur_module && mm_manager.cur_module->on_syswide_dump_virtual_counters)
-		mm_manager.cur_module->on_syswide_dump_virtual_counters(cpu,virtual_mask,sample);
+	mm_dispatch_table_t* table=mm_dispatch_atomic_begin();
+	monitoring_module_t* module;
+	unsigned int module_mask,virt_mask;
+	unsigned int nr_virt_counters=table->nr_virt_counters;
+	int i;
+
+	for (i=0; i<table->nr_on_syswide_dump_virtual_counters; i++) {
+		module=table->on_syswide_dump_virtual_counters[i].module;
+
+		if (!(module_mask=mm_slice_mask(table,module,virtual_mask)))
+			continue;
+
+		virt_mask=mm_begin_virtual_counts(sample);
+		table->on_syswide_dump_virtual_counters[i].fn(cpu,module_mask,sample);
+		mm_end_virtual_counts(table,sample,module,virt_mask);
+	}
+
+	mm_dispatch_atomic_end();
+
+	if (sbuf)
+		pmc_user_metrics_eval(sbuf,sample,virtual_mask,nr_virt_counters);
 }
 
 
@@ -0,0 +1,408 @@
+/*
+ *  phase_detection_mm.c
+ *
+ *	Online detection of program phases based on
+ *	the IPC and the LLC miss rate of threads
+ *
+ *  Copyright (c) 2026 agent <agent@local>
+ *
+ *  This code is licensed under the GNU GPL v2.
+ */
+
+#include <pmc/hl_events.h>
+#include <pmc/mc_experiments.h>
+#include <pmc/monitoring_mod.h>
+#include <pmc/data_str/phase_table.h>
+
+#define PHASE_DETECTION_STRING "Online phase detection module"
+
+/* Descriptor of this monitoring module (defined at the end of the file) */
+extern monitoring_module_t phase_detection_mm;
+
+#define PHASE_NR_METRICS	2	/* IPC and LLC misses per kilo-instruction */
+#define PHASE_MAX_ENTRIES	1024	/* Max value for the max_phases parameter */
+
+/* Virtual counters exported by this module */
+#define PHASE_VCOUNTER_ID			0
+#define PHASE_VCOUNTER_TRANSITION	1
+#define PHASE_VCOUNTER_LENGTH		2
+#define PHASE_NR_VCOUNTERS			3
+
+/* Global PMC configuration for all core types */
+static core_experiment_set_t phase_detection_pmc_configuration[AMP_MAX_CORETYPES];
+
+/* Descriptors for the various performance metrics */
+static metric_experiment_set_t phase_detection_metric_set;
+
+/* Entry of the phase table */
+typedef struct {
+	uint_t id;								/* Phase ID */
+	uint64_t metrics[PHASE_NR_METRICS];		/* Metric vector of the first interval in the phase */
+} phase_entry_t;
+
+/* Per-thread private data for this monitoring module */
+typedef struct {
+	metric_experiment_set_t metric_set;				/* Performance-metric descriptors */
+	pmon_change_history_t history[PHASE_NR_METRICS];	/* Running averages of the metrics */
+	phase_table_t* phase_table;						/* Phases observed so far */
+	uint_t similarity_threshold;					/* Max distance to a phase in the table */
+	uint_t next_phase_id;							/* ID for the next phase discovered */
+	uint_t cur_phase_id;							/* Phase of the last interval (0 if none) */
+	uint_t cur_phase_length;						/* Number of consecutive intervals in that phase */
+	uint_t nr_lookups;								/* Lookups in the phase table */
+	uint_t nr_hits;									/* Lookups that found a known phase */
+	int reset_requested;							/* Reset the statistics on the next sample */
+} phase_detection_thread_data_t;
+
+/* MM configuration parameters */
+static struct {
+	uint_t running_average_factor;	/* Percentage of the previous running average employed to compute
+									   the current one [0..100] */
+	uint_t similarity_threshold;	/* Max Manhattan distance between the metric vectors
+									   of an interval and a known phase */
+	uint_t max_phases;				/* Capacity of the per-thread phase table */
+}
+phase_detection_config= {35,250,64};
+
+/* RAW PMC configuration strings (instructions, cycles and LLC misses) */
+static const char* phase_detection_pmcstr_cfg[]= {
+#if defined(CONFIG_PMC_CORE_2_DUO) || defined(CONFIG_PMC_CORE_I7)
+	"pmc0,pmc1,pmc3=0x2e,umask3=0x41",
+#elif defined(CONFIG_PMC_AMD)
+	"pmc0=0xc0,pmc1=0x76,pmc2=0x7e,umask2=0x3",
+#else  /* ARM */
+	"pmc1=0x8,pmc2=0x11,pmc3=0x17",
+#endif
+	NULL
+};
+
+/* Return the capabilities/properties of this monitoring module */
+static void phase_detection_module_counter_usage(monitoring_module_counter_usage_t* usage)
+{
+#if defined(CONFIG_PMC_ARM) || defined(CONFIG_PMC_ARM64)
+	usage->hwpmc_mask= (1<<1) | (1<<2) | (1<<3);
+#elif defined(CONFIG_PMC_AMD)
+	usage->hwpmc_mask=0x7;
+#else
+	usage->hwpmc_mask=0xb;
+#endif
+	usage->nr_virtual_counters=PHASE_NR_VCOUNTERS;
+	usage->nr_experiments=1;
+	usage->vcounter_desc[PHASE_VCOUNTER_ID]="phase_id";
+	usage->vcounter_desc[PHASE_VCOUNTER_TRANSITION]="phase_transition";
+	usage->vcounter_desc[PHASE_VCOUNTER_LENGTH]="phase_length";
+}
+
+/* Create the set of performance metric descriptors (IPC and LLC MPKI) */
+static void init_phase_metrics(metric_experiment_set_t* metric_set)
+{
+	pmc_metric_t* metric=NULL;
+	metric_experiment_t* metricExp;
+	pmc_arg_t arguments[2];
+	init_metric_experiment_set_t(metric_set);
+
+	metricExp=&metric_set->exps[metric_set->nr_exps++];
+
+	/* IPC */
+	metric=&metricExp->metrics[metricExp->size++];
+	arguments[0].index=0;
+	arguments[0].type=hw_event_arg;
+	arguments[1].index=1;
+	arguments[1].type=hw_event_arg;
+	init_pmc_metric(metric,"IPC",op_rate,arguments,1000);
+
+	/* LLC misses per kilo-instruction */
+	metric=&metricExp->metrics[metricExp->size++];
+	arguments[0].index=2;
+	arguments[0].type=hw_event_arg;
+	arguments[1].index=0;
+	arguments[1].type=hw_event_arg;
+	init_pmc_metric(metric,"LLC_MPKI",op_rate,arguments,1000000);
+}
+
+/* Manhattan distance between the metric vectors of two phases */
+static int phase_detection_compare(void* a, void* b, void* priv_data)
+{
+	phase_entry_t* pa=(phase_entry_t*)a;
+	phase_entry_t* pb=(phase_entry_t*)b;
+	uint64_t distance=0;
+	int i;
+
+	for (i=0; i<PHASE_NR_METRICS; i++) {
+		if (pa->metrics[i]>pb->metrics[i])
+			distance+=pa->metrics[i]-pb->metrics[i];
+		else
+			distance+=pb->metrics[i]-pa->metrics[i];
+	}
+
+	return distance>INT_MAX?INT_MAX:(int)distance;
+}
+
+/* Metric vector of a phase (used by the index of the phase table) */
+static void phase_detection_get_metrics(void* phase, uint64_t* metrics)
+{
+	phase_entry_t* entry=(phase_entry_t*)phase;
+	int i;
+
+	for (i=0; i<PHASE_NR_METRICS; i++)
+		metrics[i]=entry->metrics[i];
+}
+
+/* MM initialization function */
+static int phase_detection_enable_module(void)
+{
+	if (configure_performance_counters_set(phase_detection_pmcstr_cfg, phase_detection_pmc_configuration, get_nr_coretypes())) {
+		printk("Can't configure global performance counters. This is too bad ... ");
+		return -EINVAL;
+	}
+
+	init_phase_metrics(&phase_detection_metric_set);
+
+	printk(KERN_ALERT "%s has been loaded successfuly\n",PHASE_DETECTION_STRING);
+	return 0;
+}
+
+/* MM cleanup function */
+static void phase_detection_disable_module(void)
+{
+	int i=0;
+	for (i=0; i<get_nr_coretypes(); i++)
+		free_experiment_set(&phase_detection_pmc_configuration[i]);
+
+	printk(KERN_ALERT "%s monitoring module unloaded!!\n",PHASE_DETECTION_STRING);
+}
+
+/* Print the values for the different configuration parameters */
+static int phase_detection_on_read_config(char* str, unsigned int len)
+{
+	char* dest=str;
+
+	dest+=sprintf(dest,"running_average_factor=%u\n",phase_detection_config.running_average_factor);
+	dest+=sprintf(dest,"similarity_threshold=%u\n",phase_detection_config.similarity_threshold);
+	dest+=sprintf(dest,"max_phases=%u\n",phase_detection_config.max_phases);
+
+	return dest-str;
+}
+
+/*
+ * Parse a param_name=value string and change param_name's value accordingly.
+ * The similarity threshold and the table capacity only apply to threads created afterwards.
+ */
+static int phase_detection_on_write_config(const char *str, unsigned int len)
+{
+	unsigned int val;
+
+	if (sscanf(str,"running_average_factor %u",&val)==1 && val<=100) {
+		phase_detection_config.running_average_factor=val;
+	} else if (sscanf(str,"similarity_threshold %u",&val)==1 && val>0) {
+		phase_detection_config.similarity_threshold=val;
+	} else if (sscanf(str,"max_phases %u",&val)==1 && val>0 && val<=PHASE_MAX_ENTRIES) {
+		phase_detection_config.max_phases=val;
+	} else {
+		return -EINVAL;
+	}
+	return len;
+}
+
+/* on fork() callback */
+static int phase_detection_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
+{
+	int i=0;
+	phase_detection_thread_data_t*  data=NULL;
+	uint64_t bucket_width[PHASE_NR_METRICS];
+
+	if (mm_get_priv_data(prof,&phase_detection_mm)!=NULL)
+		return 0;
+
+	data= kmalloc(sizeof (phase_detection_thread_data_t), GFP_KERNEL);
+	if (data == NULL)
+		return -ENOMEM;
+
+	/*
+	 * The index finds every phase less than half a bucket width away
+	 * in each dimension, which covers the similarity threshold
+	 */
+	data->similarity_threshold=phase_detection_config.similarity_threshold;
+	for (i=0; i<PHASE_NR_METRICS; i++)
+		bucket_width[i]=2*data->similarity_threshold;
+
+	data->phase_table=create_indexed_phase_table(phase_detection_config.max_phases,sizeof(phase_entry_t),
+	                  phase_detection_compare,PHASE_NR_METRICS,bucket_width,phase_detection_get_metrics);
+
+	if (data->phase_table == NULL) {
+		kfree(data);
+		return -ENOMEM;
+	}
+
+	if (!prof->pmcs_config) {
+		for(i=0; i<get_nr_coretypes(); i++)
+			clone_core_experiment_set_t(&prof->pmcs_multiplex_cfg[i],&phase_detection_pmc_configuration[i]);
+
+		prof->pmcs_config=get_cur_experiment_in_set(&prof->pmcs_multiplex_cfg[0]);
+	}
+
+	/* Clone metric metainfo */
+	memcpy(&data->metric_set,&phase_detection_metric_set,sizeof(metric_experiment_set_t));
+
+	for(i=0; i<PHASE_NR_METRICS; i++)
+		init_pmon_change_history(&data->history[i]);
+
+	data->next_phase_id=1;
+	data->cur_phase_id=0;
+	data->cur_phase_length=0;
+	data->nr_lookups=0;
+	data->nr_hits=0;
+	data->reset_requested=0;
+	mm_set_priv_data(prof,&phase_detection_mm,data);
+	return 0;
+}
+
+/* on exec() callback */
+static void phase_detection_on_exec(pmon_prof_t* prof) { }
+
+/*
+ * Classify the last interval of the thread: the smoothed metric vector
+ * is looked up in the thread's phase table, and a new phase is created
+ * if no known phase is similar enough. The phase ID, whether a phase
+ * transition took place, and the number of consecutive intervals in
+ * the current phase are exported as virtual counts.
+ */
+static int phase_detection_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,int flags,void* data)
+{
+	phase_detection_thread_data_t* pdata=mm_get_priv_data(prof,&phase_detection_mm);
+	metric_experiment_t* metric_exp;
+	phase_entry_t key;
+	phase_entry_t* phase;
+	unsigned int virtual_mask;
+	int similarity=0,index=0;
+	int transition=0;
+	int i;
+	uint_t nr_lookups;
+
+	if (pdata==NULL || sample->exp_idx!=0)
+		return 0;
+
+	/* Statistics are only modified here (resets are deferred until the next sample) */
+	if (READ_ONCE(pdata->reset_requested)) {
+		WRITE_ONCE(pdata->reset_requested,0);
+		pdata->nr_lookups=pdata->nr_hits=0;
+	}
+
+	metric_exp=&pdata->metric_set.exps[0];
+	compute_performance_metrics(sample->pmc_counts,metric_exp);
+
+	/* Smooth out the metrics */
+	for (i=0; i<PHASE_NR_METRICS; i++) {
+		pmon_update_running_average(&pdata->history[i],metric_exp->metrics[i].count,
+		                            phase_detection_config.running_average_factor,12,1);
+		key.metrics[i]=pdata->history[i].running_average;
+	}
+
+	nr_lookups=++pdata->nr_lookups;
+	phase=get_phase_from_table(pdata->phase_table,&key,NULL,&similarity,&index);
+
+	if (phase && similarity<=(int)pdata->similarity_threshold) {
+		pdata->nr_hits++;
+		promote_table_entry(pdata->phase_table,index);
+	} else {
+		/* New phase (the least recently seen one is evicted if the table is full) */
+		key.id=pdata->next_phase_id++;
+		phase=insert_phase_in_table(pdata->phase_table,&key);
+	}
+
+	if (phase->id!=pdata->cur_phase_id) {
+		transition=1;
+		pdata->cur_phase_id=phase->id;
+		pdata->cur_phase_length=1;
+	} else {
+		pdata->cur_phase_length++;
+	}
+
+	mm_publish_metric(prof,&phase_detection_mm,MC_PHASE_ID,pdata->cur_phase_id);
+	mm_publish_metric(prof,&phase_detection_mm,MC_PHASE_HIT_RATE,(pdata->nr_hits*100)/nr_lookups);
+
+	/* Embed virtual counter information so that the user can see what's going on */
+	virtual_mask=mm_virt_counter_mask(prof,&phase_detection_mm);
+
+	for (i=0; i<PHASE_NR_VCOUNTERS; i++) {
+		if (!(virtual_mask & (1<<i)))
+			continue;
+
+		sample->virt_mask|=(1<<i);
+
+		switch (i) {
+		case PHASE_VCOUNTER_ID:
+			sample->virtual_counts[sample->nr_virt_counts++]=pdata->cur_phase_id;
+			break;
+		case PHASE_VCOUNTER_TRANSITION:
+			sample->virtual_counts[sample->nr_virt_counts++]=transition;
+			break;
+		default:
+			sample->virtual_counts[sample->nr_virt_counts++]=pdata->cur_phase_length;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static void phase_detection_on_migrate(pmon_prof_t* prof, int prev_cpu, int new_cpu) { }
+
+/* Free up private data */
+static void phase_detection_on_free_task(pmon_prof_t* prof)
+{
+	phase_detection_thread_data_t* data=mm_get_priv_data(prof,&phase_detection_mm);
+
+	if (data) {
+		destroy_phase_table(data->phase_table);
+		kfree(data);
+	}
+}
+
+/*
+ * Return the current phase of the thread or the phase hit rate
+ * (both are usually read from the thread's metric snapshot)
+ */
+static int phase_detection_get_current_metric_value(pmon_prof_t* prof, int key, uint64_t* value)
+{
+	phase_detection_thread_data_t* pdata=mm_get_priv_data(prof,&phase_detection_mm);
+	uint_t nr_lookups;
+
+	if (pdata==NULL)
+		return -1;
+
+	switch (key) {
+	case MC_PHASE_ID:
+		(*value)=pdata->cur_phase_id;
+		return 0;
+	case MC_PHASE_HIT_RATE:
+		/* Percentage of intervals that belong to a known phase */
+		nr_lookups=READ_ONCE(pdata->nr_lookups);
+		(*value)=nr_lookups?(READ_ONCE(pdata->nr_hits)*100)/nr_lookups:0;
+		return 0;
+	case MC_RESET_PHASE_STATISTICS:
+		/* May run on another CPU: the sample path does the actual reset */
+		WRITE_ONCE(pdata->reset_requested,1);
+		(*value)=0;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* Implementation of the monitoring_module_t interface */
+monitoring_module_t phase_detection_mm= {
+	.info=PHASE_DETECTION_STRING,
+	.id=-1,
+	.enable_module=phase_detection_enable_module,
+	.disable_module=phase_detection_disable_module,
+	.on_read_config=phase_detection_on_read_config,
+	.on_write_config=phase_detection_on_write_config,
+	.on_fork=phase_detection_on_fork,
+	.on_exec=phase_detection_on_exec,
+	.on_new_sample=phase_detection_on_new_sample,
+	.on_migrate=phase_detection_on_migrate,
+	.on_free_task=phase_detection_on_free_task,
+	.get_current_metric_value=phase_detection_get_current_metric_value,
+	.module_counter_usage=phase_detection_module_counter_usage
+};
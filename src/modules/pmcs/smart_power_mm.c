@@ -14,6 +14,9 @@
 #include <pmc/monitoring_mod.h>
 #include <pmc/smart_power.h>
 
+/* Descriptor of this monitoring module (defined at the end of the file) */
+extern monitoring_module_t spower_mm;
+
 #define SPOWER_MODULE_STR "Odroid Smart Power"
 
 /* Per-thread private data for this monitoring module */
@@ -95,7 +98,7 @@ static int spower_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 {
 	spower_thread_data_t*  data= NULL;
 
-	if (prof->monitoring_mod_priv_data!=NULL)
+	if (mm_get_priv_data(prof,&spower_mm)!=NULL)
 		return 0;
 
 
@@ -105,8 +108,8 @@ static int spower_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 
 	memset(&data->last_sample,0,sizeof(struct spower_sample));
 	data->time_last_sample=jiffies;
-	data->security_id=current_monitoring_module_security_id();
-	prof->monitoring_mod_priv_data = data;
+	data->security_id=monitoring_module_security_id(&spower_mm);
+	mm_set_priv_data(prof,&spower_mm,data);
 	return 0;
 }
 
@@ -116,11 +119,10 @@ static int spower_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
  */
 static int spower_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,int flags,void* data)
 {
-	spower_thread_data_t* tdata=prof->monitoring_mod_priv_data;
+	spower_thread_data_t* tdata=mm_get_priv_data(prof,&spower_mm);
 	int i=0;
-	int cnt_virt=0;
 
-	if (tdata==NULL || prof->virt_counter_mask==0)
+	if (tdata==NULL || mm_virt_counter_mask(prof,&spower_mm)==0)
 		return 0;
 
 	/* dump data if we got something */
@@ -131,23 +133,22 @@ static int spower_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,i
 
 	/* Embed virtual counter information so that the user can see what's going on */
 	for (i=0; i<SPOWER_NR_MEASUREMENTS; i++) {
-		if ((prof->virt_counter_mask & (1<<i)) ) {
+		if ((mm_virt_counter_mask(prof,&spower_mm) & (1<<i)) ) {
 			switch (i) {
 			case SPOWER_POWER:
-				sample->virtual_counts[cnt_virt++]=tdata->last_sample.m_watt;
+				sample->virtual_counts[sample->nr_virt_counts++]=tdata->last_sample.m_watt;
 				break;
 			case SPOWER_CURRENT:
-				sample->virtual_counts[cnt_virt++]=tdata->last_sample.m_ampere;
+				sample->virtual_counts[sample->nr_virt_counts++]=tdata->last_sample.m_ampere;
 				break;
 			case SPOWER_ENERGY:
-				sample->virtual_counts[cnt_virt++]=tdata->last_sample.m_ujoules;
+				sample->virtual_counts[sample->nr_virt_counts++]=tdata->last_sample.m_ujoules;
 				break;
 			default:
 				continue;
 			}
 
 			sample->virt_mask|=(1<<i);
-			sample->nr_virt_counts++;
 		}
 	}
 
@@ -157,8 +158,8 @@ static int spower_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,i
 /* Free up private data */
 static void spower_on_free_task(pmon_prof_t* prof)
 {
-	if (prof->monitoring_mod_priv_data)
-		kfree(prof->monitoring_mod_priv_data);
+	if (mm_get_priv_data(prof,&spower_mm))
+		kfree(mm_get_priv_data(prof,&spower_mm));
 }
 
 /* Support for system-wide power measurement (Reuse per-thread info as is) */
@@ -179,7 +180,7 @@ static int initialize_system_wide_spower_structures(void)
 		/* These fields are not used by the system-wide monitor
 			Nevertheless we initialize them both just in case...
 		*/
-		data->security_id=current_monitoring_module_security_id();
+		data->security_id=monitoring_module_security_id(&spower_mm);
 	}
 
 	return 0;
@@ -221,7 +222,6 @@ static void spower_on_syswide_dump_virtual_counters(int cpu, unsigned int virtua
 {
 	spower_thread_data_t* data=&per_cpu(cpu_syswide, cpu);
 	int i=0;
-	int cnt_virt=0;
 
 	if (!virtual_mask)
 		return;
@@ -237,20 +237,19 @@ static void spower_on_syswide_dump_virtual_counters(int cpu, unsigned int virtua
 		if ((virtual_mask & (1<<i)) ) {
 			switch (i) {
 			case SPOWER_POWER:
-				sample->virtual_counts[cnt_virt++]=data->last_sample.m_watt;
+				sample->virtual_counts[sample->nr_virt_counts++]=data->last_sample.m_watt;
 				break;
 			case SPOWER_CURRENT:
-				sample->virtual_counts[cnt_virt++]=data->last_sample.m_ampere;
+				sample->virtual_counts[sample->nr_virt_counts++]=data->last_sample.m_ampere;
 				break;
 			case SPOWER_ENERGY:
-				sample->virtual_counts[cnt_virt++]=data->last_sample.m_ujoules;
+				sample->virtual_counts[sample->nr_virt_counts++]=data->last_sample.m_ujoules;
 				break;
 			default:
 				continue;
 			}
 
 			sample->virt_mask|=(1<<i);
-			sample->nr_virt_counts++;
 		}
 	}
 }
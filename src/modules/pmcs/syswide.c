@@ -11,6 +11,14 @@
 #include <linux/timer.h>
 #include <linux/smp.h>
 #include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/vmalloc.h>
+#ifdef PMC_CGROUP_V2
+#include <linux/cgroup.h>
+#include <linux/hash.h>
+#endif
 #include <pmc/pmu_config.h>
 #include <linux/mm.h>  /* mmap related stuff */
 #include <asm/uaccess.h>
@@ -21,6 +29,31 @@
 #define SYSWIDE_MONITORING_STOPPING -2
 #define SYSWIDE_MONITORING_STARTING -1
 
+/* Set of cgroups monitored in the cgroup-scoped mode */
+struct syswide_cgroup_set {
+	struct cgroup* cgroups[PMC_MAX_CGROUPS];
+	int nr_cgroups;
+};
+
+/* Per-CPU counts for a monitored cgroup */
+typedef struct {
+	uint64_t pmc_values[MAX_LL_EXPS];
+	pmc_sample_t sample;	/* Partial sample for the cgroup on this CPU */
+	int aggr_idx;	/* Index of the cgroup in syswide_ctl.aggr_samples */
+} cpu_cgroup_counts_t;
+
+/*
+ * Per-CPU cache that maps the cgroups of the tasks seen on a CPU to
+ * the index of the monitored cgroup they belong to (cgroup-scoped mode),
+ * so that the hierarchy is walked only the first time a cgroup shows up.
+ */
+#define SYSWIDE_CGROUP_CACHE_BITS	4
+
+typedef struct {
+	struct cgroup* cgrp;
+	u64 serial_nr;	/* Cgroup's serial number (unlike addresses, never reused) */
+	int idx;	/* Index of the monitored cgroup (-1 if none) */
+} cgroup_cache_entry_t;
 
 /*
  * Per-CPU structure to hold the necessary
@@ -33,6 +66,13 @@ typedef struct {
 	uint_t virt_counter_mask;
 	uint64_t pmc_values[MAX_LL_EXPS];
 	pmc_sample_t last_sample;
+	unsigned int config_epoch;	/* Configuration epoch of pmc_config_set */
+	int aggr_idx;	/* Index of the CPU's domain in syswide_ctl.aggr_samples */
+	cpu_cgroup_counts_t* cgroup_counts;	/* Per-cgroup counts (cgroup-scoped mode only) */
+	int cur_cgroup;	/* Monitored cgroup of the task running on the CPU (-1 if none).
+					 * In the cgroup-scoped mode, PMCs only count while it is not -1
+					 */
+	cgroup_cache_entry_t cgroup_cache[1<<SYSWIDE_CGROUP_CACHE_BITS];
 	spinlock_t lock;
 } cpu_syswide_t;
 
@@ -50,6 +90,17 @@ typedef struct {
 	*/
 	unsigned long syswide_timer_period; /* Inherit from monitor thread */
 	unsigned int pause_syswide_monitor; /* Global pause flag */
+	cpumask_t cpus;	/* CPUs being monitored (the remaining ones are left alone) */
+	cpumask_t sampled_cpus;	/* CPUs sampled in the current timer round */
+	cpumask_t cgroup_active_cpus;	/* CPUs that ran tasks of monitored cgroups since their last sample
+									 * (cgroup-scoped mode only). The other CPUs are not sampled
+									 */
+	pmc_aggr_level_t aggr_level;	/* Inherit from monitor thread */
+	pmc_sample_t* aggr_samples;	/* One sample per domain (NULL if aggr_level==PMC_AGGR_CPU) */
+	unsigned int nr_aggr_samples;
+	/* Cgroups being monitored (NULL if not in the cgroup-scoped mode) */
+	struct syswide_cgroup_set* cgroups;
+	cpu_cgroup_counts_t* cgroup_counts;	/* Per-CPU counts for all cgroups */
 	spinlock_t lock;
 } syswide_ctl_t;
 
@@ -61,6 +112,115 @@ typedef struct {
 syswide_ctl_t syswide_ctl= {.syswide_monitor=SYSWIDE_MONITORING_DISABLED};
 static DEFINE_PER_CPU(cpu_syswide_t, cpu_syswide);
 
+static const char* aggr_level_names[PMC_NR_AGGR_LEVELS]= {"cpu","core","llc","socket","node"};
+
+/* Return the id of the domain the CPU belongs to for a given aggregation level */
+static int get_cpu_domain_id(int cpu, pmc_aggr_level_t level)
+{
+	switch (level) {
+	case PMC_AGGR_CORE:
+		return cpumask_first(topology_sibling_cpumask(cpu));
+	case PMC_AGGR_LLC:
+#ifdef CONFIG_SCHED_MC
+		return cpumask_first(cpu_coregroup_mask(cpu));
+#else
+		/* Assume the LLC is shared by the whole package */
+		return cpumask_first(topology_core_cpumask(cpu));
+#endif
+	case PMC_AGGR_SOCKET:
+		return topology_physical_package_id(cpu);
+	case PMC_AGGR_NODE:
+		return cpu_to_node(cpu);
+	default:
+		return cpu;
+	}
+}
+
+/* Return the index of the aggregated sample for a domain (allocate it if not found) */
+static int get_aggr_sample_idx(int domain, int coretype)
+{
+	pmc_sample_t* aggr;
+	int i;
+
+	for (i=0; i<syswide_ctl.nr_aggr_samples; i++) {
+		aggr=&syswide_ctl.aggr_samples[i];
+		if (aggr->pid==domain && aggr->coretype==coretype)
+			return i;
+	}
+
+	/* New domain */
+	aggr=&syswide_ctl.aggr_samples[i];
+	memset(aggr,0,sizeof(pmc_sample_t));
+	aggr->pid=domain;
+	aggr->coretype=coretype;
+	syswide_ctl.nr_aggr_samples++;
+	return i;
+}
+
+/*
+ * Assign each monitored CPU to the aggregated sample of its domain
+ * (or of each cgroup in the cgroup-scoped mode).
+ * CPUs of different types are never aggregated together, as they
+ * may be counting different events.
+ */
+static void setup_syswide_aggregation(void)
+{
+	int cpu,i,coretype;
+	cpu_syswide_t* cur;
+
+	syswide_ctl.nr_aggr_samples=0;
+
+	for_each_cpu(cpu, &syswide_ctl.cpus) {
+		coretype=get_coretype_cpu(cpu);
+		cur=&per_cpu(cpu_syswide, cpu);
+
+		if (cur->cgroup_counts) {
+			for (i=0; i<syswide_ctl.cgroups->nr_cgroups; i++)
+				cur->cgroup_counts[i].aggr_idx=get_aggr_sample_idx(i,coretype);
+		} else
+			cur->aggr_idx=get_aggr_sample_idx(get_cpu_domain_id(cpu,syswide_ctl.aggr_level),coretype);
+	}
+}
+
+/*
+ * Add up the counts of a CPU sample to the sample of its domain.
+ * The first CPU in the domain to contribute in a round provides the
+ * metadata and the virtual counts (these usually measure resources
+ * shared by the whole domain, such as the package energy).
+ */
+static void add_to_aggr_sample(pmc_sample_t* aggr, pmc_sample_t* sample)
+{
+	pid_t domain=aggr->pid;
+	int i;
+
+	if (aggr->exp_idx<0) {
+		(*aggr)=(*sample);
+		aggr->pid=domain;
+		return;
+	}
+
+	/* Skip CPUs still counting other events (e.g., right after a reconfig) */
+	if (aggr->exp_idx!=sample->exp_idx || aggr->config_epoch!=sample->config_epoch)
+		return;
+
+	for (i=0; i<sample->nr_counts; i++)
+		aggr->pmc_counts[i]+=sample->pmc_counts[i];
+}
+
+/*
+ * Translate an aggregation level name ("cpu", "core", "llc", "socket" or "node")
+ * into a pmc_aggr_level_t value. Returns -1 if the name is not valid.
+ */
+int syswide_aggr_level_from_str(const char* str)
+{
+	int i;
+
+	for (i=0; i<PMC_NR_AGGR_LEVELS; i++)
+		if (strcmp(str,aggr_level_names[i])==0)
+			return i;
+	return -1;
+}
+
 
 /*
  * Read performance counters and update statistics
@@ -113,6 +273,117 @@ static int refresh_counts_cpu(cpu_syswide_t* cpudata)
 }
 
 
+/*
+ * Switch to the PMC configuration most recently published by the
+ * monitor process via the "reconfig" command (if any).
+ * The function must be invoked at a sample boundary with the
+ * CPU's lock held.
+ *
+ * It returns a non-zero value if the event set was replaced.
+ */
+static int refresh_syswide_config_epoch(cpu_syswide_t* cpudata, int cur_coretype)
+{
+	pmc_samples_buffer_t* sbuf=syswide_ctl.pmc_samples_buffer;
+	core_experiment_set_t new_set;
+	unsigned int epoch;
+
+	if (!sbuf || likely(cpudata->config_epoch==sbuf->config_epoch))
+		return 0;
+
+	init_core_experiment_set_t(&new_set);
+
+	spin_lock(&sbuf->lock);
+	epoch=sbuf->config_epoch;
+	if (__clone_core_experiment_set_t(&new_set,&sbuf->pending_cfg[cur_coretype],GFP_ATOMIC)) {
+		spin_unlock(&sbuf->lock);
+		/* Give it another try at the next sample boundary */
+		return 0;
+	}
+	spin_unlock(&sbuf->lock);
+
+	cpudata->config_epoch=epoch;
+
+	/* No events for this core type -> keep the old configuration */
+	if (new_set.nr_exps==0)
+		return 0;
+
+	/* Clear all counters in the platform */
+	mc_clear_all_platform_counters(get_pmu_props_coretype(cur_coretype));
+
+	free_experiment_set(&cpudata->pmc_config_set);
+	cpudata->pmc_config_set=new_set;
+	cpudata->cur_config=get_cur_experiment_in_set(&cpudata->pmc_config_set);
+
+	/* Reconfigure counters as if it were the first time*/
+	mc_restart_all_counters(cpudata->cur_config);
+
+	return 1;
+}
+
+#ifdef PMC_CGROUP_V2
+/*
+ * Return the index of the monitored cgroup task "p" belongs to (-1 if none).
+ * Must be invoked with the CPU's lock held.
+ */
+static int get_task_cgroup_idx(cpu_syswide_t* cpudata, struct task_struct* p)
+{
+	struct syswide_cgroup_set* set=syswide_ctl.cgroups;
+	struct cgroup* cgrp;
+	cgroup_cache_entry_t* entry;
+	int i,idx=-1;
+
+	rcu_read_lock();
+	cgrp=task_dfl_cgroup(p);
+	entry=&cpudata->cgroup_cache[hash_ptr(cgrp,SYSWIDE_CGROUP_CACHE_BITS)];
+
+	if (entry->cgrp==cgrp && entry->serial_nr==cgrp->serial_nr) {
+		idx=entry->idx;
+	} else {
+		for (i=0; i<set->nr_cgroups; i++) {
+			if (cgroup_is_descendant(cgrp,set->cgroups[i])) {
+				idx=i;
+				break;
+			}
+		}
+		entry->cgrp=cgrp;
+		entry->serial_nr=cgrp->serial_nr;
+		entry->idx=idx;
+	}
+	rcu_read_unlock();
+	return idx;
+}
+#else
+static inline int get_task_cgroup_idx(cpu_syswide_t* cpudata, struct task_struct* p)
+{
+	return -1;
+}
+#endif
+
+/*
+ * Read the PMCs on the current CPU and charge the counts to the
+ * cgroup whose task is running. PMCs keep counting only if keep_counting
+ * is set; nothing is read if no task of a monitored cgroup is running,
+ * as PMCs are stopped in the meantime.
+ * Must be invoked with the CPU's lock held.
+ */
+static void __fold_cgroup_counts_cpu(cpu_syswide_t* cpudata, int keep_counting)
+{
+	int i;
+
+	if (cpudata->cur_cgroup<0)
+		return;
+
+	__refresh_counts_cpu(cpudata);
+
+	if (!keep_counting && cpudata->cur_config)
+		mc_stop_all_counters(cpudata->cur_config);
+
+	for (i=0; i<MAX_LL_EXPS; i++) {
+		cpudata->cgroup_counts[cpudata->cur_cgroup].pmc_values[i]+=cpudata->pmc_values[i];
+		cpudata->pmc_values[i]=0;
+	}
+}
+
 /*
  * Gather PMC and virtual-counter samples
  * on the current CPU
@@ -132,7 +403,10 @@ static void syswide_monitoring_sample_cpu(void* dummy)
 	/* Grab the spinlock to avoid races when updating "pmc_values" */
 	spin_lock_irqsave(&cur->lock,flags);
 
-	__refresh_counts_cpu(cur);
+	if (cur->cgroup_counts)
+		__fold_cgroup_counts_cpu(cur,1);
+	else
+		__refresh_counts_cpu(cur);
 
 	if (core_exp) {
 		/* Copy and clear samples in prof */
@@ -150,11 +424,32 @@ static void syswide_monitoring_sample_cpu(void* dummy)
 	sample->virt_mask=0;
 	sample->nr_virt_counts=0;
 	sample->pid=cpu; /* In syswide mode -> this field is reused to store the CPU */
+	sample->target_id=0;
+	sample->timestamp=raw_ktime(ktime_get());
+	sample->config_epoch=cur->config_epoch;
 
 
 	/* Call the estimation module if the user requested virtual counters */
 	if (cur->virt_counter_mask)
-		mm_on_syswide_dump_virtual_counters(cpu,cur->virt_counter_mask,sample);
+		mm_on_syswide_dump_virtual_counters(cpu,cur->virt_counter_mask,syswide_ctl.pmc_samples_buffer,sample);
+
+	/* Cgroup-scoped mode: generate a partial sample per cgroup */
+	if (cur->cgroup_counts) {
+		for (i=0; i<syswide_ctl.cgroups->nr_cgroups; i++) {
+			cpu_cgroup_counts_t* cg=&cur->cgroup_counts[i];
+			int j;
+
+			cg->sample=(*sample);
+			for (j=0; j<MAX_LL_EXPS; j++) {
+				cg->sample.pmc_counts[j]=cg->pmc_values[j];
+				cg->pmc_values[j]=0;
+			}
+		}
+	}
+
+	/* Switch to a new event set if the monitor published one */
+	if (refresh_syswide_config_epoch(cur,cur_coretype))
+		goto out_unlock;
 
 	/* Engage multiplexation */
 	next=get_next_experiment_in_set(&cur->pmc_config_set);
@@ -169,22 +464,58 @@ static void syswide_monitoring_sample_cpu(void* dummy)
 		mc_restart_all_counters(cur->cur_config);
 	}
 
-
+out_unlock:
+	/*
+	 * Cgroup-scoped mode: PMCs stay idle (and the CPU is no longer sampled)
+	 * until a task of a monitored cgroup shows up
+	 */
+	if (cur->cgroup_counts && cur->cur_cgroup<0) {
+		if (cur->cur_config)
+			mc_stop_all_counters(cur->cur_config);
+		cpumask_clear_cpu(cpu,&syswide_ctl.cgroup_active_cpus);
+	}
 	spin_unlock_irqrestore(&cur->lock,flags);
 }
 
+/*
+ * CPU where the timer is armed: one of the monitored CPUs (the current one
+ * if possible), so as not to disturb the other ones.
+ */
+static int syswide_timer_cpu(void)
+{
+	int cpu=smp_processor_id();
+
+	if (cpumask_test_cpu(cpu,&syswide_ctl.cpus) && cpu_online(cpu))
+		return cpu;
+
+	cpu=cpumask_any_and(&syswide_ctl.cpus,cpu_online_mask);
+
+	return (cpu<nr_cpu_ids)?cpu:smp_processor_id();
+}
+
 /* Main timer function for the syswide-monitoring mode */
 static void fire_syswide_timer(unsigned long data)
 {
 	cpu_syswide_t* cur=NULL;
 	unsigned long flags;
 	int cpu=0;
+	int i;
 
 	if (!syswide_monitoring_enabled())
 		return;
 
+	/*
+	 * In the cgroup-scoped mode, only the CPUs that ran tasks of
+	 * the monitored cgroups since the last round are sampled
+	 */
+	if (syswide_ctl.cgroups)
+		cpumask_and(&syswide_ctl.sampled_cpus,&syswide_ctl.cpus,&syswide_ctl.cgroup_active_cpus);
+	else
+		cpumask_copy(&syswide_ctl.sampled_cpus,&syswide_ctl.cpus);
+
 	/* Generate per-cpu samples in a distributed way */
-	on_each_cpu(syswide_monitoring_sample_cpu, NULL, 1);
+	if (!cpumask_empty(&syswide_ctl.sampled_cpus))
+		on_each_cpu_mask(&syswide_ctl.sampled_cpus,syswide_monitoring_sample_cpu, NULL, 1);
 
 	/* Grab the global lock */
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
@@ -192,18 +523,44 @@ static void fire_syswide_timer(unsigned long data)
 	if (!syswide_ctl.pause_syswide_monitor && syswide_monitoring_enabled() &&  syswide_ctl.pmc_samples_buffer) {
 		spin_lock(&syswide_ctl.pmc_samples_buffer->lock);
 
-		/* Dump the various samples */
-		for_each_online_cpu(cpu) {
-			cur=&per_cpu(cpu_syswide, cpu);
-			__push_sample_cbuffer_nowakeup(syswide_ctl.pmc_samples_buffer,&cur->last_sample);
+		if (syswide_ctl.aggr_samples) {
+			/* Sum up per-CPU counts and dump one sample per domain */
+			for (i=0; i<syswide_ctl.nr_aggr_samples; i++)
+				syswide_ctl.aggr_samples[i].exp_idx=-1;
+
+			for_each_cpu_and(cpu, &syswide_ctl.sampled_cpus, cpu_online_mask) {
+				cur=&per_cpu(cpu_syswide, cpu);
+
+				if (!cur->cgroup_counts) {
+					add_to_aggr_sample(&syswide_ctl.aggr_samples[cur->aggr_idx],&cur->last_sample);
+					continue;
+				}
+
+				for (i=0; i<syswide_ctl.cgroups->nr_cgroups; i++)
+					add_to_aggr_sample(&syswide_ctl.aggr_samples[cur->cgroup_counts[i].aggr_idx],
+					                   &cur->cgroup_counts[i].sample);
+			}
+
+			for (i=0; i<syswide_ctl.nr_aggr_samples; i++)
+				if (syswide_ctl.aggr_samples[i].exp_idx>=0)
+					__push_sample_cbuffer_nowakeup(syswide_ctl.pmc_samples_buffer,&syswide_ctl.aggr_samples[i]);
+		} else {
+			/* Dump the various samples */
+			for_each_cpu_and(cpu, &syswide_ctl.sampled_cpus, cpu_online_mask) {
+				cur=&per_cpu(cpu_syswide, cpu);
+				__push_sample_cbuffer_nowakeup(syswide_ctl.pmc_samples_buffer,&cur->last_sample);
+			}
 		}
 		/* Wake up monitor ... */
 		__wake_up_monitor_program(syswide_ctl.pmc_samples_buffer);
 		spin_unlock(&syswide_ctl.pmc_samples_buffer->lock);
 	}
 
-	if (syswide_monitoring_enabled())
-		mod_timer( &syswide_ctl.syswide_timer, jiffies + syswide_ctl.syswide_timer_period);
+	/* mod_timer() may move the timer to a CPU that is not monitored */
+	if (syswide_monitoring_enabled()) {
+		syswide_ctl.syswide_timer.expires=jiffies+syswide_ctl.syswide_timer_period;
+		add_timer_on(&syswide_ctl.syswide_timer,syswide_timer_cpu());
+	}
 
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
 }
@@ -226,8 +583,11 @@ static inline void reset_cpu_syswide_data(cpu_syswide_t* data, int init)
 	else
 		free_experiment_set(&data->pmc_config_set);
 
-	if (init)
+	if (init) {
 		spin_lock_init(&data->lock);
+		data->cgroup_counts=NULL;
+		data->cur_cgroup=-1;
+	}
 
 	for(i=0; i<MAX_LL_EXPS; i++)
 		data->pmc_values[i]=0;
@@ -237,6 +597,8 @@ static inline void reset_cpu_syswide_data(cpu_syswide_t* data, int init)
 
 	data->virt_counter_mask=0;	// No virtual counters selected so far
 
+	data->config_epoch=0;
+
 	/* Clear sample */
 	memset(&data->last_sample,0,sizeof(pmc_sample_t));
 }
@@ -282,6 +644,14 @@ int syswide_monitoring_init(void)
 	syswide_ctl.syswide_timer.function=fire_syswide_timer;
 	syswide_ctl.syswide_timer_period=HZ;
 	syswide_ctl.pause_syswide_monitor=0; /* Enabled by default */
+	cpumask_clear(&syswide_ctl.cpus);
+	cpumask_clear(&syswide_ctl.sampled_cpus);
+	cpumask_clear(&syswide_ctl.cgroup_active_cpus);
+	syswide_ctl.aggr_level=PMC_AGGR_CPU;
+	syswide_ctl.aggr_samples=NULL;
+	syswide_ctl.nr_aggr_samples=0;
+	syswide_ctl.cgroups=NULL;
+	syswide_ctl.cgroup_counts=NULL;
 
 	for_each_possible_cpu(cpu) {
 		cur=&per_cpu(cpu_syswide, cpu);
@@ -318,7 +688,30 @@ int syswide_monitoring_enabled(void)
  */
 int syswide_monitoring_switch_in(int cpu)
 {
-	/* Do nothing on switch in for now */
+	cpu_syswide_t* cur=&per_cpu(cpu_syswide, cpu);
+	unsigned long flags;
+
+	if (!cpumask_test_cpu(cpu,&syswide_ctl.cpus))
+		return 1;
+
+	/* Only the cgroup-scoped mode cares about the incoming task */
+	if (!syswide_ctl.cgroups)
+		return 0;
+
+	spin_lock_irqsave(&cur->lock,flags);
+
+	/*
+	 * PMCs were stopped on the switch out: count only if the incoming
+	 * task belongs to a monitored cgroup, and get this CPU sampled
+	 */
+	if (cur->cgroup_counts && (cur->cur_cgroup=get_task_cgroup_idx(cur,current))>=0) {
+		if (cur->cur_config)
+			mc_restart_all_counters(cur->cur_config);
+		if (!cpumask_test_cpu(cpu,&syswide_ctl.cgroup_active_cpus))
+			cpumask_set_cpu(cpu,&syswide_ctl.cgroup_active_cpus);
+	}
+
+	spin_unlock_irqrestore(&cur->lock,flags);
 	return 0;
 }
 
@@ -334,11 +727,28 @@ int syswide_monitoring_switch_in(int cpu)
 int syswide_monitoring_switch_out(int cpu)
 {
 	cpu_syswide_t* cur=&per_cpu(cpu_syswide, cpu);
+	unsigned long flags;
+	int retval;
 
-	if (!syswide_monitoring_enabled())
+	if (!syswide_monitoring_enabled() || !cpumask_test_cpu(cpu,&syswide_ctl.cpus))
 		return 1;
 
-	return refresh_counts_cpu(cur);
+	if (!syswide_ctl.cgroups)
+		return refresh_counts_cpu(cur);
+
+	/* Cgroup-scoped mode: nothing to do if no task of the monitored cgroups was running */
+	if (READ_ONCE(cur->cur_cgroup)<0)
+		return !cur->cur_config;
+
+	/* Charge the counts to the outgoing task's cgroup and stop counting */
+	spin_lock_irqsave(&cur->lock,flags);
+	if (cur->cgroup_counts) {
+		__fold_cgroup_counts_cpu(cur,0);
+		cur->cur_cgroup=-1;
+	}
+	retval=!cur->cur_config;
+	spin_unlock_irqrestore(&cur->lock,flags);
+	return retval;
 }
 
 /* Returns true if "p" is current syswide monitor process */
@@ -360,6 +770,17 @@ static void syswide_monitoring_start_cpu(void* dummy)
 		mc_restart_all_counters(cur->cur_config);
 	}
 
+	/* Cgroup-scoped mode: count only if a task of a monitored cgroup is running */
+	if (cur->cgroup_counts) {
+		spin_lock(&cur->lock);
+		cur->cur_cgroup=get_task_cgroup_idx(cur,current);
+		if (cur->cur_cgroup>=0)
+			cpumask_set_cpu(cpu,&syswide_ctl.cgroup_active_cpus);
+		else if (cur->cur_config)
+			mc_stop_all_counters(cur->cur_config);
+		spin_unlock(&cur->lock);
+	}
+
 	/* Tell the monitoring module to start syswide monitoring */
 	if (cur->virt_counter_mask)
 		mm_on_syswide_start_monitor(cpu, cur->virt_counter_mask);
@@ -381,8 +802,11 @@ static void syswide_monitoring_stop_cpu(void* dummy)
 		mm_on_syswide_stop_monitor(cpu, cur->virt_counter_mask);
 }
 
-/* Start syswide_monitoring */
-int syswide_monitoring_start(void)
+/*
+ * Start syswide_monitoring on the specified CPUs
+ * (cpus==NULL means all online CPUs)
+ */
+int syswide_monitoring_start(const struct cpumask* cpus)
 {
 	int retval=0;
 	unsigned long flags=0;
@@ -392,10 +816,39 @@ int syswide_monitoring_start(void)
 	pmon_prof_t* prof=(pmon_prof_t*)p->pmc;
 	cpu_syswide_t* cur;
 	core_experiment_t* experiment=NULL;
+	pmc_sample_t* aggr_samples=NULL;
+	struct syswide_cgroup_set* cgroups;
+	cpu_cgroup_counts_t* cgroup_counts=NULL;
+	unsigned int nr_aggr=0;
 
 	if (!prof)
 		return -EPERM;
 
+	cgroups=prof->syswide_cgroups;
+
+	if (cgroups) {
+		/* Virtual counters are gathered per CPU, not per task */
+		if (prof->virt_counter_mask) {
+			printk(KERN_INFO "Virtual counters can't be used in the cgroup-scoped mode\n");
+			return -EINVAL;
+		}
+
+		nr_aggr=cgroups->nr_cgroups*AMP_MAX_CORETYPES;
+		cgroup_counts=vzalloc(sizeof(cpu_cgroup_counts_t)*cgroups->nr_cgroups*nr_cpu_ids);
+
+		if (!cgroup_counts)
+			return -ENOMEM;
+	} else if (prof->syswide_aggr!=PMC_AGGR_CPU) {
+		/* There cannot be more domains than CPUs */
+		nr_aggr=nr_cpu_ids;
+	}
+
+	if (nr_aggr && (aggr_samples=kmalloc(sizeof(pmc_sample_t)*nr_aggr,GFP_KERNEL))==NULL) {
+		if (cgroup_counts)
+			vfree(cgroup_counts);
+		return -ENOMEM;
+	}
+
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
 
 	/* Make sure system wide is not already in use */
@@ -405,6 +858,15 @@ int syswide_monitoring_start(void)
 		goto exit_unlock;
 	}
 
+	/* Only online CPUs can be monitored */
+	cpumask_and(&syswide_ctl.cpus, cpus?cpus:cpu_online_mask, cpu_online_mask);
+
+	if (cpumask_empty(&syswide_ctl.cpus)) {
+		retval=-EINVAL;
+		printk(KERN_INFO "No online CPUs selected for system-wide mode\n");
+		goto exit_unlock;
+	}
+
 	/* Inherit fields from monitor process */
 	syswide_ctl.syswide_timer_period=prof->pmc_jiffies_interval;
 	syswide_ctl.syswide_monitor=SYSWIDE_MONITORING_STARTING;
@@ -417,8 +879,8 @@ int syswide_monitoring_start(void)
 		printk(KERN_INFO "Virtual counters not available in system-wide mode\n");
 		goto exit_unlock;
 	}
-	/* Propagate values on each CPU ... */
-	for_each_possible_cpu(cpu) {
+	/* Propagate values on each monitored CPU ... */
+	for_each_cpu(cpu, &syswide_ctl.cpus) {
 
 		coretype=get_coretype_cpu(cpu);
 		cur=&per_cpu(cpu_syswide, cpu);
@@ -446,6 +908,30 @@ int syswide_monitoring_start(void)
 		}
 	}
 
+	/* Cgroup-scoped mode: the session owns the cgroups from now on */
+	if (cgroups) {
+		syswide_ctl.cgroups=cgroups;
+		syswide_ctl.cgroup_counts=cgroup_counts;
+		prof->syswide_cgroups=NULL;
+		cpumask_clear(&syswide_ctl.cgroup_active_cpus);
+
+		for_each_cpu(cpu, &syswide_ctl.cpus) {
+			cur=&per_cpu(cpu_syswide, cpu);
+			spin_lock(&cur->lock);
+			cur->cgroup_counts=&cgroup_counts[cpu*cgroups->nr_cgroups];
+			cur->cur_cgroup=-1;
+			/* Indexes refer to the previous set of cgroups */
+			memset(cur->cgroup_cache,0,sizeof(cur->cgroup_cache));
+			spin_unlock(&cur->lock);
+		}
+	}
+
+	/* Set up in-kernel aggregation of per-CPU samples */
+	syswide_ctl.aggr_level=prof->syswide_aggr;
+	syswide_ctl.aggr_samples=aggr_samples;
+	if (aggr_samples)
+		setup_syswide_aggregation();
+
 	/* Share buffer ... */
 	syswide_ctl.pmc_samples_buffer=prof->pmc_samples_buffer;
 	/* Increase ref count */
@@ -454,19 +940,24 @@ int syswide_monitoring_start(void)
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
 
 	/* Initialize counters on each CPU with interrupts enabled */
-	on_each_cpu(syswide_monitoring_start_cpu, NULL, 1);
+	on_each_cpu_mask(&syswide_ctl.cpus, syswide_monitoring_start_cpu, NULL, 1);
 
-	/* Enable system-wide monitoring and start up timer */
+	/* Enable system-wide monitoring and start up timer
+	   (on a monitored CPU, so as not to disturb the other ones) */
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
 	syswide_ctl.syswide_monitor=p->pid;
 	syswide_ctl.syswide_timer.expires=jiffies+syswide_ctl.syswide_timer_period;
 	syswide_ctl.pause_syswide_monitor=0; /* Enabled by default */
-	add_timer(&syswide_ctl.syswide_timer);
+	add_timer_on(&syswide_ctl.syswide_timer,syswide_timer_cpu());
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
 
 	return 0;
 exit_unlock:
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
+	if (aggr_samples)
+		kfree(aggr_samples);
+	if (cgroup_counts)
+		vfree(cgroup_counts);
 	return retval; /* TODO */
 }
 
@@ -476,6 +967,11 @@ int syswide_monitoring_stop(void)
 	int retval=0;
 	unsigned long flags=0;
 	struct task_struct* p=current;
+	pmc_sample_t* aggr_samples;
+	struct syswide_cgroup_set* cgroups;
+	cpu_cgroup_counts_t* cgroup_counts;
+	cpu_syswide_t* cur;
+	int cpu;
 
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
 
@@ -493,7 +989,18 @@ int syswide_monitoring_stop(void)
 	/* Cancel timer (Blocking function)*/
 	del_timer_sync(&syswide_ctl.syswide_timer);
 	/* Stop counters across CPUs */
-	on_each_cpu(syswide_monitoring_stop_cpu, NULL, 1);
+	on_each_cpu_mask(&syswide_ctl.cpus, syswide_monitoring_stop_cpu, NULL, 1);
+
+	/* Detach per-cgroup counts (context-switch hooks may still be running) */
+	if (syswide_ctl.cgroups) {
+		for_each_possible_cpu(cpu) {
+			cur=&per_cpu(cpu_syswide, cpu);
+			spin_lock_irqsave(&cur->lock,flags);
+			cur->cgroup_counts=NULL;
+			cur->cur_cgroup=-1;
+			spin_unlock_irqrestore(&cur->lock,flags);
+		}
+	}
 
 	/* Update global status */
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
@@ -502,8 +1009,21 @@ int syswide_monitoring_stop(void)
 	/* Decrease ref count for the shared buffer and forget it ever existed */
 	put_pmc_samples_buffer(syswide_ctl.pmc_samples_buffer);
 	syswide_ctl.pmc_samples_buffer=NULL;
+	aggr_samples=syswide_ctl.aggr_samples;
+	syswide_ctl.aggr_samples=NULL;
+	syswide_ctl.nr_aggr_samples=0;
+	cgroups=syswide_ctl.cgroups;
+	cgroup_counts=syswide_ctl.cgroup_counts;
+	syswide_ctl.cgroups=NULL;
+	syswide_ctl.cgroup_counts=NULL;
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
 
+	if (aggr_samples)
+		kfree(aggr_samples);
+	if (cgroup_counts)
+		vfree(cgroup_counts);
+	syswide_cgroup_set_free(cgroups);
+
 	return 0;
 exit_unlock_stop:
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
@@ -511,6 +1031,72 @@ exit_unlock_stop:
 }
 
 
+/*
+ * Start syswide_monitoring on the CPUs found in a CPU list
+ * such as "0-7,16" (NULL or empty string means all online CPUs)
+ */
+int syswide_monitoring_start_cpulist(const char* cpulist)
+{
+	cpumask_var_t cpus;
+	int retval;
+
+	if (!cpulist || cpulist[0]=='\0')
+		return syswide_monitoring_start(NULL);
+
+	if (!alloc_cpumask_var(&cpus,GFP_KERNEL))
+		return -ENOMEM;
+
+	if ((retval=cpulist_parse(cpulist,cpus))==0)
+		retval=syswide_monitoring_start(cpus);
+
+	free_cpumask_var(cpus);
+	return retval;
+}
+
+/*
+ * Add a cgroup (path in the cgroup v2 hierarchy) to a set of cgroups
+ * to be monitored in system-wide mode. The set is allocated on first use.
+ */
+int syswide_cgroup_set_add(struct syswide_cgroup_set** set, const char* path)
+{
+#ifdef PMC_CGROUP_V2
+	struct cgroup* cgrp;
+
+	if (!(*set) && ((*set)=kzalloc(sizeof(struct syswide_cgroup_set),GFP_KERNEL))==NULL)
+		return -ENOMEM;
+
+	if ((*set)->nr_cgroups>=PMC_MAX_CGROUPS)
+		return -ENOSPC;
+
+	cgrp=cgroup_get_from_path(path);
+
+	if (IS_ERR(cgrp))
+		return PTR_ERR(cgrp);
+
+	(*set)->cgroups[(*set)->nr_cgroups++]=cgrp;
+	return 0;
+#else
+	return -ENOSYS;
+#endif
+}
+
+/* Drop the references to the cgroups in a set and free it up */
+void syswide_cgroup_set_free(struct syswide_cgroup_set* set)
+{
+#ifdef PMC_CGROUP_V2
+	int i;
+#endif
+
+	if (!set)
+		return;
+
+#ifdef PMC_CGROUP_V2
+	for (i=0; i<set->nr_cgroups; i++)
+		cgroup_put(set->cgroups[i]);
+#endif
+	kfree(set);
+}
+
 /* Pause syswide_monitoring */
 int syswide_monitoring_pause(void)
 {
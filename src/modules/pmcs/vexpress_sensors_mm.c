@@ -15,6 +15,9 @@
 #include <pmc/monitoring_mod.h>
 #include <pmc/vexpress_sensors.h>
 
+/* Descriptor of this monitoring module (defined at the end of the file) */
+extern monitoring_module_t vexpress_sensors_mm;
+
 #define ARM_VERSATILE_SENSORS_STR "ARM vexpress sensors"
 
 
@@ -135,20 +138,20 @@ static int vexpress_sensors_on_fork(unsigned long clone_flags, pmon_prof_t* prof
 	int i=0;
 	vexpress_sensors_thread_data_t* data=NULL;
 
-	if (prof->monitoring_mod_priv_data!=NULL)
+	if (mm_get_priv_data(prof,&vexpress_sensors_mm)!=NULL)
 		return 0;
 
 	data= kmalloc(sizeof (vexpress_sensors_thread_data_t), GFP_KERNEL);
 	if (data == NULL)
 		return -ENOMEM;
 
-	data->security_id=current_monitoring_module_security_id();
+	data->security_id=monitoring_module_security_id(&vexpress_sensors_mm);
 	data->first_time=1;
 	data->timestamp=jiffies;
 	for (i=0; i<nr_sensors_available; i++)
 		initialize_vexpress_sensors_count(&data->sensor_counts[i]);
 
-	prof->monitoring_mod_priv_data = data;
+	mm_set_priv_data(prof,&vexpress_sensors_mm,data);
 	return 0;
 }
 
@@ -177,9 +180,8 @@ static inline void do_read_sensors(vexpress_sensors_thread_data_t* tdata, int ac
  */
 static int vexpress_sensors_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,int flags,void* data)
 {
-	vexpress_sensors_thread_data_t* tdata=prof->monitoring_mod_priv_data;
+	vexpress_sensors_thread_data_t* tdata=mm_get_priv_data(prof,&vexpress_sensors_mm);
 	int i=0;
-	int cnt_virt=0;
 
 	if (tdata!=NULL) {
 
@@ -188,11 +190,9 @@ static int vexpress_sensors_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t
 		/* Embed virtual counter information so that the user can see what's going on */
 
 		for (i=0; i<nr_sensors_available; i++) {
-			if ((prof->virt_counter_mask & (1<<i)) ) {
+			if ((mm_virt_counter_mask(prof,&vexpress_sensors_mm) & (1<<i)) ) {
 				sample->virt_mask|=(1<<i);
-				sample->nr_virt_counts++;
-				sample->virtual_counts[cnt_virt]=tdata->sensor_counts[i].acum;
-				cnt_virt++;
+				sample->virtual_counts[sample->nr_virt_counts++]=tdata->sensor_counts[i].acum;
 			}
 			/* Reset no matter what */
 			tdata->sensor_counts[i].acum=0;
@@ -205,16 +205,16 @@ static int vexpress_sensors_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t
 /* Free up private data */
 static void vexpress_sensors_on_free_task(pmon_prof_t* prof)
 {
-	if (prof->monitoring_mod_priv_data)
-		kfree(prof->monitoring_mod_priv_data);
+	if (mm_get_priv_data(prof,&vexpress_sensors_mm))
+		kfree(mm_get_priv_data(prof,&vexpress_sensors_mm));
 }
 
 /* on switch_in callback */
 void vexpress_sensors_on_switch_in(pmon_prof_t* prof)
 {
-	vexpress_sensors_thread_data_t* data=(vexpress_sensors_thread_data_t*)prof->monitoring_mod_priv_data;
+	vexpress_sensors_thread_data_t* data=(vexpress_sensors_thread_data_t*)mm_get_priv_data(prof,&vexpress_sensors_mm);
 
-	if (!data || data->security_id!=current_monitoring_module_security_id() )
+	if (!data || data->security_id!=monitoring_module_security_id(&vexpress_sensors_mm) )
 		return;
 
 #ifdef CONFIG_PMC_ARM64
@@ -228,9 +228,9 @@ void vexpress_sensors_on_switch_in(pmon_prof_t* prof)
 /* on switch_out callback */
 void vexpress_sensors_on_switch_out(pmon_prof_t* prof)
 {
-	vexpress_sensors_thread_data_t* data=(vexpress_sensors_thread_data_t*)prof->monitoring_mod_priv_data;
+	vexpress_sensors_thread_data_t* data=(vexpress_sensors_thread_data_t*)mm_get_priv_data(prof,&vexpress_sensors_mm);
 
-	if (!data || data->security_id!=current_monitoring_module_security_id())
+	if (!data || data->security_id!=monitoring_module_security_id(&vexpress_sensors_mm))
 		return;
 
 #ifdef CONFIG_PMC_ARM64
@@ -265,7 +265,7 @@ static int initialize_system_wide_sensor_structures(void)
 		/* These two fields are not used by the system-wide monitor
 			Nevertheless we initialize them both just in case...
 		*/
-		data->security_id=current_monitoring_module_security_id();
+		data->security_id=monitoring_module_security_id(&vexpress_sensors_mm);
 		data->first_time=1;
 	}
 
@@ -315,15 +315,12 @@ static void vexpress_sensors_on_syswide_dump_virtual_counters(int cpu, unsigned
 {
 	vexpress_sensors_thread_data_t* data=&per_cpu(cpu_syswide, cpu);
 	int i=0;
-	int cnt_virt=0;
 
 	/* Embed virtual counter information so that the user can see what's going on */
 	for (i=0; i<nr_sensors_available; i++) {
 		if ((virtual_mask & (1<<i)) ) {
 			sample->virt_mask|=(1<<i);
-			sample->nr_virt_counts++;
-			sample->virtual_counts[cnt_virt]=data->sensor_counts[i].acum;
-			cnt_virt++;
+			sample->virtual_counts[sample->nr_virt_counts++]=data->sensor_counts[i].acum;
 		}
 		/* Reset no matter what */
 		data->sensor_counts[i].acum=0;
@@ -0,0 +1,3 @@
+#!/bin/bash
+LD_LIBRARY_PATH=../../../src/lib/libpmctrack ./test-merge
+
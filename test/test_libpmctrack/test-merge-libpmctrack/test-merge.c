@@ -0,0 +1,106 @@
+/*
+ * test-merge.c
+ *
+ ******************************************************************************
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pmctrack.h>
+
+#define NR_STREAMS 4
+#define MAX_SAMPLES 16
+
+/*
+ * Timestamps of the samples in each stream (one per CPU, for instance).
+ * Stream 2 is empty, and some timestamps show up in several streams
+ * (ties must be broken by stream index).
+ */
+static const uint64_t stream_ts[NR_STREAMS][MAX_SAMPLES]= {
+	{ 10, 40, 50, 90 },
+	{ 20, 40, 60 },
+	{ 0 },
+	{ 5, 10, 70, 80, 100 }
+};
+static unsigned int stream_len[NR_STREAMS]= {4,3,0,5};
+
+/* Check the merge of the streams into an array of max_samples samples */
+static int check_merge(pmc_sample_t* streams[], unsigned int max_samples)
+{
+	pmc_sample_t merged[NR_STREAMS*MAX_SAMPLES];
+	unsigned int expected=0;
+	int nr_merged;
+	int i;
+
+	for (i=0; i<NR_STREAMS; i++)
+		expected+=stream_len[i];
+
+	if (expected>max_samples)
+		expected=max_samples;
+
+	nr_merged=pmctrack_merge_samples(streams,stream_len,NR_STREAMS,merged,max_samples);
+
+	if (nr_merged!=expected) {
+		fprintf(stderr,"Merged %d samples (%u expected)\n",nr_merged,expected);
+		return 1;
+	}
+
+	for (i=1; i<nr_merged; i++) {
+		/* The pid field holds the stream index */
+		if (merged[i].timestamp<merged[i-1].timestamp ||
+		    (merged[i].timestamp==merged[i-1].timestamp && merged[i].pid<merged[i-1].pid)) {
+			fprintf(stderr,"Sample %d out of order (timestamp=%llu, stream=%d)\n",
+			        i,(unsigned long long)merged[i].timestamp,merged[i].pid);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* MAIN */
+int main(int argc, char *argv[])
+{
+	pmc_sample_t samples[NR_STREAMS][MAX_SAMPLES];
+	pmc_sample_t* streams[NR_STREAMS];
+	int i,j;
+
+	memset(samples,0,sizeof(samples));
+
+	for (i=0; i<NR_STREAMS; i++) {
+		for (j=0; j<stream_len[i]; j++) {
+			samples[i][j].timestamp=stream_ts[i][j];
+			samples[i][j].pid=i;
+		}
+		streams[i]=samples[i];
+	}
+
+	/* Whole merge, and a merge truncated to the capacity of the destination */
+	if (check_merge(streams,NR_STREAMS*MAX_SAMPLES) || check_merge(streams,5)) {
+		fprintf(stderr,"Test failed\n");
+		exit(1);
+	}
+
+	printf("Test passed\n");
+	return 0;
+}